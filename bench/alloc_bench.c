@@ -0,0 +1,190 @@
+// Allocator microbenchmark for TécnicoFS.
+//
+// Compares the allocators of a table with many entries (1M data blocks, by
+// default), partly filled beforehand:
+//   - scan: the old allocation table, scanned linearly under a mutex for the
+//     first free entry (as data_block_alloc used to do);
+//   - bitmap: the allocator's bitmap alone (no per-thread caches);
+//   - cached: the allocator with per-thread caches, as used for data blocks.
+// Each thread repeatedly allocates a batch of entries and frees them, so the
+// fill stays the same throughout.
+//
+// Usage: alloc_bench [entries] [max_threads] [seconds] [fill_percent]
+
+#include "allocator.h"
+#include "state.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BATCH 64
+#define CACHE_CAPACITY 64
+
+typedef enum { MODE_SCAN, MODE_BITMAP, MODE_CACHED } bench_mode;
+
+static char const *const mode_names[] = {"scan", "bitmap", "cached"};
+
+static bench_mode mode;
+static size_t entries = 1 << 20;
+static double seconds = 1.0;
+
+static allocation_state_t *scan_table;
+static pthread_mutex_t scan_lock = PTHREAD_MUTEX_INITIALIZER;
+static allocator_t allocator;
+
+static atomic_bool stop;
+static atomic_size_t total_ops;
+
+static int scan_alloc(void) {
+  pthread_mutex_lock(&scan_lock);
+  for (size_t i = 0; i < entries; i++) {
+    if (scan_table[i] == FREE) {
+      scan_table[i] = TAKEN;
+      pthread_mutex_unlock(&scan_lock);
+      return (int)i;
+    }
+  }
+  pthread_mutex_unlock(&scan_lock);
+  return -1;
+}
+
+static void scan_free(int entry) {
+  pthread_mutex_lock(&scan_lock);
+  scan_table[entry] = FREE;
+  pthread_mutex_unlock(&scan_lock);
+}
+
+static int bench_alloc(void) {
+  return mode == MODE_SCAN ? scan_alloc() : allocator_alloc(&allocator);
+}
+
+static void bench_free(int entry) {
+  if (mode == MODE_SCAN) {
+    scan_free(entry);
+  } else {
+    allocator_free(&allocator, entry);
+  }
+}
+
+static void *bench_thread(void *arg) {
+  (void)arg;
+  int batch[BATCH];
+  size_t ops = 0;
+  while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+    size_t taken = 0;
+    while (taken < BATCH && (batch[taken] = bench_alloc()) != -1) {
+      taken++;
+    }
+    for (size_t i = 0; i < taken; i++) {
+      bench_free(batch[i]);
+    }
+    ops += taken * 2;
+  }
+  atomic_fetch_add(&total_ops, ops);
+  return NULL;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// sets up the table for the current mode, with the first fill_percent% of
+// its entries taken (the worst case for the scan, and a realistic one for a
+// file system that only ever grew)
+static int setup(size_t fill_percent, uint64_t **words) {
+  size_t filled = entries / 100 * fill_percent;
+  if (mode == MODE_SCAN) {
+    scan_table = calloc(entries, sizeof(allocation_state_t));
+    if (scan_table == NULL) {
+      return -1;
+    }
+    for (size_t i = 0; i < filled; i++) {
+      scan_table[i] = TAKEN;
+    }
+    return 0;
+  }
+
+  *words = calloc(ALLOCATOR_WORDS(entries), sizeof(uint64_t));
+  if (*words == NULL) {
+    return -1;
+  }
+  for (size_t i = 0; i < filled; i++) {
+    (*words)[i / 64] |= 1ULL << (i % 64);
+  }
+  return allocator_init(&allocator, *words, entries,
+                        mode == MODE_CACHED ? CACHE_CAPACITY : 0);
+}
+
+static void teardown(uint64_t *words) {
+  if (mode == MODE_SCAN) {
+    free(scan_table);
+    scan_table = NULL;
+  } else {
+    allocator_destroy(&allocator);
+    free(words);
+  }
+}
+
+int main(int argc, char **argv) {
+  size_t max_threads = 4;
+  size_t fill_percent = 90;
+  if (argc > 1) {
+    entries = strtoul(argv[1], NULL, 10);
+  }
+  if (argc > 2) {
+    max_threads = strtoul(argv[2], NULL, 10);
+  }
+  if (argc > 3) {
+    seconds = strtod(argv[3], NULL);
+  }
+  if (argc > 4) {
+    fill_percent = strtoul(argv[4], NULL, 10);
+  }
+  if (entries == 0 || entries > INT32_MAX || fill_percent > 100) {
+    fprintf(stderr, "alloc_bench: invalid arguments\n");
+    return EXIT_FAILURE;
+  }
+
+  printf("mode,entries,threads,fill,ops_per_sec,ns_per_op\n");
+  for (bench_mode m = MODE_SCAN; m <= MODE_CACHED; m++) {
+    mode = m;
+    for (size_t n = 1; n <= max_threads; n *= 2) {
+      uint64_t *words = NULL;
+      if (setup(fill_percent, &words) == -1) {
+        fprintf(stderr, "alloc_bench: failed to set up the table\n");
+        return EXIT_FAILURE;
+      }
+      atomic_store(&stop, false);
+      atomic_store(&total_ops, 0);
+
+      pthread_t threads[n];
+      double start = now();
+      for (size_t i = 0; i < n; i++) {
+        pthread_create(&threads[i], NULL, bench_thread, NULL);
+      }
+      struct timespec period = {
+          .tv_sec = (time_t)seconds,
+          .tv_nsec = (long)((seconds - (double)(time_t)seconds) * 1e9),
+      };
+      nanosleep(&period, NULL);
+      atomic_store(&stop, true);
+      for (size_t i = 0; i < n; i++) {
+        pthread_join(threads[i], NULL);
+      }
+      double elapsed = now() - start;
+
+      size_t ops = atomic_load(&total_ops);
+      printf("%s,%zu,%zu,%zu,%.0f,%.1f\n", mode_names[mode], entries, n,
+             fill_percent, (double)ops / elapsed,
+             ops > 0 ? elapsed * 1e9 * (double)n / (double)ops : 0.0);
+      teardown(words);
+    }
+  }
+  return 0;
+}
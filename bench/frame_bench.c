@@ -0,0 +1,161 @@
+// Wire format microbenchmark.
+//
+// Sends messages of several payload sizes through a pipe, from one thread to
+// another, and compares the throughput (messages per second) of:
+//
+// - fixed: the old fixed-size records (a code and a zero padded
+//   MESSAGE_SIZE buffer), one write per message;
+// - framed: one frame per message, one write per message (like publishers);
+// - packed: frames packed together, one write per PIPE_BUF bytes (like the
+//   broker writing to subscribers).
+//
+// Usage: frame_bench [messages]
+
+#include "extras.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
+
+typedef enum { FORMAT_FIXED, FORMAT_FRAMED, FORMAT_PACKED } format_t;
+
+static char const *format_names[] = {"fixed", "framed", "packed"};
+
+// record sent by the old protocol
+typedef struct {
+  uint8_t code;
+  char message[MESSAGE_SIZE];
+} fixed_msg;
+
+typedef struct {
+  format_t format;
+  int fd;
+  size_t messages;
+  size_t payload;
+} side_args;
+
+static void write_all(int fd, void const *buffer, size_t size) {
+  if (write(fd, buffer, size) != (ssize_t)size) {
+    perror("frame_bench: write");
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void *writer(void *arg) {
+  side_args *args = (side_args *)arg;
+  char message[MESSAGE_SIZE];
+  memset(message, 'x', sizeof(message));
+
+  if (args->format == FORMAT_FIXED) {
+    fixed_msg msg;
+    msg.code = 10;
+    for (size_t i = 0; i < args->messages; i++) {
+      memset(msg.message, '\0', MESSAGE_SIZE);
+      memcpy(msg.message, message, args->payload);
+      write_all(args->fd, &msg, sizeof(msg));
+    }
+  } else if (args->format == FORMAT_FRAMED) {
+    for (size_t i = 0; i < args->messages; i++) {
+      if (frame_write(args->fd, 10, message, args->payload) == -1) {
+        perror("frame_bench: frame_write");
+        exit(EXIT_FAILURE);
+      }
+    }
+  } else {
+    char buffer[FRAME_MAX_SIZE];
+    size_t size = 0;
+    for (size_t i = 0; i < args->messages; i++) {
+      if (FRAME_MAX_SIZE - size < sizeof(frame_header) + args->payload) {
+        write_all(args->fd, buffer, size);
+        size = 0;
+      }
+      size += frame_pack(buffer + size, 10, message, args->payload);
+    }
+    write_all(args->fd, buffer, size);
+  }
+  close(args->fd);
+  return NULL;
+}
+
+static size_t read_fixed(int fd) {
+  fixed_msg msg;
+  size_t received = 0, filled = 0;
+  ssize_t n;
+  while ((n = read(fd, (char *)&msg + filled, sizeof(msg) - filled)) > 0) {
+    filled += (size_t)n;
+    if (filled == sizeof(msg)) {
+      if (msg.code != 10 || strlen(msg.message) == 0)
+        return 0;
+      received++;
+      filled = 0;
+    }
+  }
+  return received;
+}
+
+static size_t read_frames(int fd) {
+  frame_reader reader;
+  frame_header header;
+  char const *payload;
+  size_t received = 0;
+  int found;
+  frame_reader_init(&reader, fd);
+  while (frame_reader_fill(&reader) > 0) {
+    while ((found = frame_next(&reader, &header, &payload)) == 1) {
+      if (header.code != 10 || header.length == 0)
+        return 0;
+      received++;
+    }
+    if (found == -1)
+      return 0;
+  }
+  return received;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void run(format_t format, size_t payload, size_t messages) {
+  int fds[2];
+  if (pipe(fds) == -1) {
+    perror("frame_bench: pipe");
+    exit(EXIT_FAILURE);
+  }
+  side_args args = {format, fds[1], messages, payload};
+  pthread_t tid;
+
+  double start = now();
+  pthread_create(&tid, NULL, writer, &args);
+  size_t received =
+      format == FORMAT_FIXED ? read_fixed(fds[0]) : read_frames(fds[0]);
+  pthread_join(tid, NULL);
+  double elapsed = now() - start;
+  close(fds[0]);
+
+  if (received != messages) {
+    fprintf(stderr, "frame_bench: received %zu of %zu messages\n", received,
+            messages);
+    exit(EXIT_FAILURE);
+  }
+  printf("%s,%zu,%zu,%.3f,%.0f\n", format_names[format], payload, messages,
+         elapsed, (double)messages / elapsed);
+}
+
+int main(int argc, char **argv) {
+  size_t messages = 200000;
+  size_t payloads[] = {8, 64, 256, MESSAGE_SIZE - 1};
+  if (argc > 1) {
+    messages = strtoul(argv[1], NULL, 10);
+  }
+
+  printf("format,payload,messages,seconds,msgs_per_sec\n");
+  for (size_t i = 0; i < sizeof(payloads) / sizeof(payloads[0]); i++) {
+    run(FORMAT_FIXED, payloads[i], messages);
+    run(FORMAT_FRAMED, payloads[i], messages);
+    run(FORMAT_PACKED, payloads[i], messages);
+  }
+  return 0;
+}
@@ -0,0 +1,120 @@
+// Multi-box throughput benchmark for TécnicoFS.
+//
+// Each thread owns one file (a "box") and repeatedly appends to it and reads
+// it back, so threads never touch the same file. With fine-grained locking the
+// aggregate throughput should grow with the number of threads.
+//
+// With latency_ns, every access to the file system's persistent state takes
+// that long, and the time each call spent in those accesses is reported on
+// stderr.
+//
+// Usage: fs_bench [max_threads] [ops_per_thread] [latency_ns]
+
+#include "operations.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define CHUNK_SIZE 128
+
+static size_t ops_per_thread = 2000;
+
+static void *bench_thread(void *arg) {
+  char name[MAX_FILE_NAME];
+  char buffer[CHUNK_SIZE];
+  size_t id = (size_t)arg;
+
+  snprintf(name, sizeof(name), "/box%zu", id);
+  memset(buffer, 'a' + (int)(id % 26), sizeof(buffer));
+
+  int fh = tfs_open(name, TFS_O_CREAT | TFS_O_TRUNC);
+  if (fh == -1) {
+    fprintf(stderr, "fs_bench: failed to create %s\n", name);
+    exit(EXIT_FAILURE);
+  }
+  tfs_close(fh);
+
+  for (size_t i = 0; i < ops_per_thread; i++) {
+    // starts over whenever the box gets full
+    fh = tfs_open(name, TFS_O_APPEND);
+    if (tfs_write(fh, buffer, sizeof(buffer)) < sizeof(buffer)) {
+      tfs_close(fh);
+      fh = tfs_open(name, TFS_O_TRUNC);
+      tfs_write(fh, buffer, sizeof(buffer));
+    }
+    tfs_close(fh);
+
+    fh = tfs_open(name, 0);
+    while (tfs_read(fh, buffer, sizeof(buffer)) > 0)
+      ;
+    tfs_close(fh);
+  }
+  return NULL;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+  size_t max_threads = 8;
+  if (argc > 1) {
+    max_threads = strtoul(argv[1], NULL, 10);
+  }
+  if (argc > 2) {
+    ops_per_thread = strtoul(argv[2], NULL, 10);
+  }
+  unsigned latency_ns = 0;
+  if (argc > 3) {
+    latency_ns = (unsigned)strtoul(argv[3], NULL, 10);
+  }
+
+  tfs_params params = tfs_default_params();
+  params.max_open_files_count = max_threads * 2;
+  params.max_inode_count = max_threads + 1;
+  if (latency_ns > 0) {
+    params.latency_model = TFS_LATENCY_FIXED;
+    params.latency_ns = latency_ns;
+  }
+
+  printf("threads,ops,seconds,ops_per_sec\n");
+  for (size_t n = 1; n <= max_threads; n *= 2) {
+    if (tfs_init(&params) == -1) {
+      fprintf(stderr, "fs_bench: failed to init tfs\n");
+      return EXIT_FAILURE;
+    }
+
+    pthread_t threads[n];
+    double start = now();
+    for (size_t i = 0; i < n; i++) {
+      pthread_create(&threads[i], NULL, bench_thread, (void *)i);
+    }
+    for (size_t i = 0; i < n; i++) {
+      pthread_join(threads[i], NULL);
+    }
+    double elapsed = now() - start;
+
+    // every iteration does one append and one full read
+    size_t ops = n * ops_per_thread * 2;
+    printf("%zu,%zu,%.3f,%.0f\n", n, ops, elapsed, (double)ops / elapsed);
+    if (latency_ns > 0) {
+      tfs_op_stats_t stats[TFS_OP_COUNT];
+      tfs_op_stats(stats);
+      for (tfs_op op = 0; op < TFS_OP_COUNT; op++) {
+        if (stats[op].os_calls > 0) {
+          fprintf(stderr, "  %-6s %8llu calls %10llu accesses %10.3f ms io\n",
+                  tfs_op_name(op), stats[op].os_calls, stats[op].os_accesses,
+                  (double)stats[op].os_io_ns / 1e6);
+        }
+      }
+    }
+    tfs_destroy();
+  }
+
+  return 0;
+}
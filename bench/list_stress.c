@@ -0,0 +1,231 @@
+// Box listing stress test.
+//
+// Publisher threads append messages to their boxes (the way the broker does,
+// holding each box's lock) while a lister thread lists the boxes in a loop,
+// and the latency of every append is measured. Listings are written to a
+// pipe, drained by another thread, like the broker writing to a manager.
+// Compares:
+//
+// - none: no listing, as a baseline;
+// - lock_all: the old listing, which locked every box in sequence and wrote
+//   to the pipe while holding all the locks;
+// - snapshot: listing from the registry's snapshot, without taking any lock.
+//
+// Usage: list_stress [boxes] [publishers] [appends_per_publisher]
+
+#include "mbroker/registry.h"
+#include "operations.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef enum { LIST_NONE, LIST_LOCK_ALL, LIST_SNAPSHOT } list_mode_t;
+
+static char const *mode_names[] = {"none", "lock_all", "snapshot"};
+
+static size_t box_count = 1000;
+static size_t appends_per_publisher = 100000;
+static broker_box **boxes;
+static int list_pipe[2];
+static _Atomic int publishing;
+static _Atomic size_t lists;
+
+typedef struct {
+  size_t pa_id;
+  size_t pa_publishers;
+  double *pa_latencies; // in microseconds, one per append
+} publisher_args;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// publishers take turns over their share of the boxes
+static void *publisher(void *arg) {
+  publisher_args *args = (publisher_args *)arg;
+  char message[32];
+  memset(message, 'm', sizeof(message));
+  size_t box = args->pa_id;
+
+  for (size_t i = 0; i < appends_per_publisher; i++) {
+    broker_box *target = boxes[box];
+    double start = now();
+    pthread_mutex_lock(&target->bb_lock);
+    ssize_t written = box_log_append(&target->bb_log, message, sizeof(message));
+    if (written != -1)
+      target->bb_size += (uint64_t)written;
+    pthread_mutex_unlock(&target->bb_lock);
+    args->pa_latencies[i] = (now() - start) * 1e6;
+    if (written == -1) {
+      fprintf(stderr, "list_stress: box full\n");
+      exit(EXIT_FAILURE);
+    }
+    box = (box + args->pa_publishers) % box_count;
+  }
+  return NULL;
+}
+
+// reads (and drops) whatever the lister writes
+static void *drainer(void *arg) {
+  (void)arg;
+  char buffer[PIPE_BUF];
+  while (read(list_pipe[0], buffer, sizeof(buffer)) > 0)
+    ;
+  return NULL;
+}
+
+static void write_listing(mail_box const *listing, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    if (write(list_pipe[1], &listing[i], sizeof(mail_box)) == -1) {
+      perror("list_stress: write");
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+static void copy_box(broker_box *box, mail_box *info) {
+  memcpy(info->box_name, box->bb_name, BOX_NAME_SIZE);
+  info->box_size = box->bb_size;
+  info->n_pubs = box->bb_n_pubs;
+  info->n_subs = box->bb_n_subs;
+}
+
+typedef struct {
+  mail_box *sv_listing;
+  size_t sv_size;
+} snapshot_visit_args;
+
+static void snapshot_visit(broker_box *box, void *arg) {
+  snapshot_visit_args *args = (snapshot_visit_args *)arg;
+  if (args->sv_size < box_count)
+    copy_box(box, &args->sv_listing[args->sv_size++]);
+}
+
+static void *lister(void *arg) {
+  list_mode_t mode = *(list_mode_t *)arg;
+  mail_box *listing = (mail_box *)malloc(box_count * sizeof(mail_box));
+
+  while (atomic_load(&publishing)) {
+    if (mode == LIST_LOCK_ALL) {
+      for (size_t i = 0; i < box_count; i++) {
+        pthread_mutex_lock(&boxes[i]->bb_lock);
+      }
+      for (size_t i = 0; i < box_count; i++) {
+        copy_box(boxes[i], &listing[i]);
+      }
+      write_listing(listing, box_count);
+      for (size_t i = 0; i < box_count; i++) {
+        pthread_mutex_unlock(&boxes[i]->bb_lock);
+      }
+    } else {
+      snapshot_visit_args args = {listing, 0};
+      registry_foreach(snapshot_visit, &args);
+      write_listing(listing, args.sv_size);
+    }
+    atomic_fetch_add(&lists, 1);
+  }
+  free(listing);
+  return NULL;
+}
+
+static int compare_doubles(void const *a, void const *b) {
+  double x = *(double const *)a, y = *(double const *)b;
+  return (x > y) - (x < y);
+}
+
+static void run(list_mode_t mode, size_t publishers) {
+  static size_t round;
+  char name[MAX_FILE_NAME];
+  for (size_t i = 0; i < box_count; i++) {
+    snprintf(name, sizeof(name), "/r%zub%zu", round, i);
+    if (registry_create(name, NULL) != 0) {
+      fprintf(stderr, "list_stress: failed to create %s\n", name);
+      exit(EXIT_FAILURE);
+    }
+    boxes[i] = registry_get(name);
+  }
+
+  size_t samples = publishers * appends_per_publisher;
+  double *latencies = (double *)malloc(samples * sizeof(double));
+  publisher_args args[publishers];
+  pthread_t tids[publishers], lister_tid, drainer_tid;
+  if (pipe(list_pipe) == -1) {
+    perror("list_stress: pipe");
+    exit(EXIT_FAILURE);
+  }
+  atomic_store(&publishing, 1);
+  atomic_store(&lists, 0);
+  pthread_create(&drainer_tid, NULL, drainer, NULL);
+  if (mode != LIST_NONE)
+    pthread_create(&lister_tid, NULL, lister, &mode);
+
+  double start = now();
+  for (size_t i = 0; i < publishers; i++) {
+    args[i].pa_id = i;
+    args[i].pa_publishers = publishers;
+    args[i].pa_latencies = latencies + i * appends_per_publisher;
+    pthread_create(&tids[i], NULL, publisher, &args[i]);
+  }
+  for (size_t i = 0; i < publishers; i++) {
+    pthread_join(tids[i], NULL);
+  }
+  double elapsed = now() - start;
+  atomic_store(&publishing, 0);
+  if (mode != LIST_NONE)
+    pthread_join(lister_tid, NULL);
+  close(list_pipe[1]);
+  pthread_join(drainer_tid, NULL);
+  close(list_pipe[0]);
+
+  qsort(latencies, samples, sizeof(double), compare_doubles);
+  printf("%s,%zu,%zu,%zu,%.0f,%.1f,%.1f,%.1f\n", mode_names[mode], box_count,
+         publishers, atomic_load(&lists), (double)samples / elapsed,
+         latencies[samples / 2], latencies[samples * 99 / 100],
+         latencies[samples - 1]);
+  free(latencies);
+
+  // frees the boxes' blocks for the next run
+  for (size_t i = 0; i < box_count; i++) {
+    broker_box *removed;
+    if (registry_remove(boxes[i]->bb_name, &removed) == 0)
+      box_unref(removed);
+    box_unref(boxes[i]);
+  }
+  round++;
+}
+
+int main(int argc, char **argv) {
+  size_t publishers = 2;
+  if (argc > 1)
+    box_count = strtoul(argv[1], NULL, 10);
+  if (argc > 2)
+    publishers = strtoul(argv[2], NULL, 10);
+  if (argc > 3)
+    appends_per_publisher = strtoul(argv[3], NULL, 10);
+  if (box_count == 0 || publishers == 0 || appends_per_publisher == 0) {
+    fprintf(stderr, "list_stress: arguments must be positive\n");
+    return EXIT_FAILURE;
+  }
+
+  tfs_params params = tfs_default_params();
+  params.max_inode_count = box_count + 1;
+  params.max_open_files_count = box_count;
+  params.max_block_count = 64 * 1024;
+  if (tfs_init(&params) == -1 || registry_init() == -1) {
+    fprintf(stderr, "list_stress: failed to initialize\n");
+    return EXIT_FAILURE;
+  }
+  boxes = (broker_box **)malloc(box_count * sizeof(broker_box *));
+
+  printf("mode,boxes,publishers,lists,appends_per_sec,p50_us,p99_us,max_us\n");
+  run(LIST_NONE, publishers);
+  run(LIST_LOCK_ALL, publishers);
+  run(LIST_SNAPSHOT, publishers);
+  free(boxes);
+  return 0;
+}
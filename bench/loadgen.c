@@ -0,0 +1,403 @@
+// End-to-end load generator for a live mbroker.
+//
+// For every combination of message size and publish rate, creates K boxes,
+// starts M subscriber threads (spread over the boxes) and N publisher threads
+// (one per box, as the broker allows no more), publishes for a while, waits
+// for the subscribers to get every message, and removes the boxes, which ends
+// the subscribers' sessions. Every message carries the time it was sent, so
+// subscribers measure the delivery latency of each one.
+//
+// Prints a CSV line per run: the messages sent and delivered per second, and
+// the delivery latency percentiles (in microseconds).
+//
+// Usage: loadgen <register_pipe> [--boxes K] [--pubs N] [--subs M]
+//            [--sizes s1,s2,...] [--rates r1,r2,...] [--seconds S] [--shm]
+//            [--durable]
+// Rates are messages per second per publisher, 0 for as fast as possible.
+
+#include "extras.h"
+#include "histogram.h"
+#include "shm_ring.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+
+#define MAX_VALUES 16
+// how long subscribers may take to get the last messages after publishing
+// stops
+#define DRAIN_TIMEOUT_NS (10 * 1000000000ULL)
+
+static char const *register_pipe;
+static size_t n_boxes = 4, n_pubs = 4, n_subs = 4;
+static double seconds = 2.0;
+static int shm = 0, durable = 0;
+
+// current run
+static size_t run;
+static size_t message_size;
+static double rate;
+static histogram latency;
+static atomic_bool publishing;
+
+typedef struct {
+  pthread_t c_thread;
+  size_t c_id;
+  size_t c_box;
+  int c_ready; // publishers: registered; subscribers: pipe opened
+  _Atomic uint64_t c_count; // messages sent or received
+  _Atomic uint64_t c_last;  // subscribers: when the last message was received
+  pthread_mutex_t *c_lock;
+  pthread_cond_t *c_cond;
+} client;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void box_name(char *name, size_t box) {
+  snprintf(name, BOX_NAME_SIZE, "/lg.%d.%zu.%zu", (int)getpid(), run, box);
+}
+
+// sends a register request for a client pipe, which is created first
+//
+// Returns 0 if successful, -1 otherwise
+static int register_client(protocol *request, uint8_t code, char const *role,
+                           size_t id, size_t box) {
+  memset(request, 0, sizeof(*request));
+  request->code = code;
+  snprintf(request->pipename, PIPE_NAME_SIZE, "/tmp/loadgen.%d.%s%zu",
+           (int)getpid(), role, id);
+  box_name(request->boxname, box);
+  unlink(request->pipename);
+  if (mkfifo(request->pipename, 0666) == -1)
+    return -1;
+  int fd = open(register_pipe, O_WRONLY);
+  if (fd == -1)
+    return -1;
+  int result = frame_write_register(fd, request);
+  close(fd);
+  return result;
+}
+
+// creates (code 3) or removes (code 5) a box
+//
+// Returns 0 if successful, -1 otherwise
+static int manage_box(uint8_t code, size_t box) {
+  protocol request;
+  if (register_client(&request, code, "m", box, box) == -1)
+    return -1;
+  int fd = open(request.pipename, O_RDONLY);
+  unlink(request.pipename);
+  if (fd == -1)
+    return -1;
+  frame_reader reader;
+  frame_header header;
+  box_response response;
+  memset(&response, 0, sizeof(response));
+  frame_reader_init(&reader, fd);
+  int result = frame_read(&reader, &header, &response, sizeof(response)) == 1
+                   ? response.return_code
+                   : -1;
+  close(fd);
+  return result;
+}
+
+static void client_ready(client *c) {
+  pthread_mutex_lock(c->c_lock);
+  c->c_ready = 1;
+  pthread_cond_broadcast(c->c_cond);
+  pthread_mutex_unlock(c->c_lock);
+}
+
+static void *publisher_thread(void *arg) {
+  client *c = (client *)arg;
+  protocol request;
+  if (register_client(&request, durable ? 13 : 1, "p", c->c_id, c->c_box) ==
+      -1) {
+    perror("loadgen: error registering publisher");
+    client_ready(c);
+    return NULL;
+  }
+  int fd = open(request.pipename, O_WRONLY);
+  unlink(request.pipename);
+  client_ready(c);
+  if (fd == -1)
+    return NULL;
+
+  // messages are packed into frames, as many as fit in a pipe write when
+  // publishing as fast as possible, and one at a time otherwise
+  char out[PIPE_BUF];
+  char message[MESSAGE_SIZE];
+  memset(message, 'x', sizeof(message));
+  size_t frame_size = sizeof(frame_header) + message_size;
+  size_t per_write = rate > 0 ? 1 : PIPE_BUF / frame_size;
+  uint64_t start = now_ns();
+  while (atomic_load(&publishing)) {
+    if (rate > 0) {
+      // waits until the next message is due
+      uint64_t due =
+          start + (uint64_t)((double)atomic_load(&c->c_count) * 1e9 / rate);
+      uint64_t now = now_ns();
+      if (due > now) {
+        struct timespec ts = {(time_t)((due - now) / 1000000000ULL),
+                              (long)((due - now) % 1000000000ULL)};
+        nanosleep(&ts, NULL);
+        continue;
+      }
+    }
+    size_t used = 0;
+    for (size_t i = 0; i < per_write; i++) {
+      uint64_t sent = now_ns();
+      memcpy(message, &sent, sizeof(sent));
+      used += frame_pack(out + used, 9, message, message_size);
+    }
+    if (write(fd, out, used) == -1) {
+      // the broker ends the session of a publisher whose box is full
+      if (errno == EPIPE)
+        fprintf(stderr, "loadgen: publisher %zu stopped by the broker\n",
+                c->c_id);
+      else
+        perror("loadgen: error publishing");
+      break;
+    }
+    atomic_fetch_add(&c->c_count, per_write);
+  }
+  close(fd);
+  return NULL;
+}
+
+// counts a message received by a subscriber
+static void subscriber_got(client *c, char const *message, size_t length) {
+  uint64_t now = now_ns();
+  uint64_t sent;
+  if (length < sizeof(sent))
+    return;
+  memcpy(&sent, message, sizeof(sent));
+  histogram_record(&latency, now > sent ? now - sent : 0);
+  atomic_store(&c->c_last, now);
+  atomic_fetch_add(&c->c_count, 1);
+}
+
+static void subscriber_ring(client *c, char const *attach) {
+  char name[PIPE_NAME_SIZE];
+  uint64_t position;
+  shm_ring_reader reader;
+  if (sscanf(attach, "%255s %" SCNu64, name, &position) != 2 ||
+      shm_ring_attach(&reader, name, position) == -1) {
+    perror("loadgen: error attaching to ring");
+    return;
+  }
+  char buffer[MESSAGE_SIZE];
+  ssize_t n;
+  while ((n = shm_ring_read(&reader, buffer, sizeof(buffer))) > 0) {
+    subscriber_got(c, buffer, (size_t)n);
+  }
+  shm_ring_detach(&reader);
+}
+
+static void *subscriber_thread(void *arg) {
+  client *c = (client *)arg;
+  protocol request;
+  if (register_client(&request, shm ? 11 : 2, "s", c->c_id, c->c_box) == -1) {
+    perror("loadgen: error registering subscriber");
+    client_ready(c);
+    return NULL;
+  }
+  int fd = open(request.pipename, O_RDONLY);
+  unlink(request.pipename);
+  client_ready(c);
+  if (fd == -1)
+    return NULL;
+
+  frame_reader reader;
+  frame_header header;
+  char payload[FRAME_MAX_PAYLOAD + 1];
+  frame_reader_init(&reader, fd);
+  // ends when the box is removed
+  while (frame_read(&reader, &header, payload, FRAME_MAX_PAYLOAD) > 0) {
+    if (header.code == 12) {
+      payload[header.length] = '\0';
+      subscriber_ring(c, payload);
+      break;
+    }
+    if (header.code != 10)
+      break;
+    subscriber_got(c, payload, header.length);
+  }
+  close(fd);
+  return NULL;
+}
+
+// starts clients and waits for all of them to be ready
+static void start_clients(client *clients, size_t n, void *(*thread)(void *),
+                          pthread_mutex_t *lock, pthread_cond_t *cond) {
+  for (size_t i = 0; i < n; i++) {
+    clients[i].c_id = i;
+    clients[i].c_box = i % n_boxes;
+    clients[i].c_ready = 0;
+    atomic_init(&clients[i].c_count, 0);
+    atomic_init(&clients[i].c_last, 0);
+    clients[i].c_lock = lock;
+    clients[i].c_cond = cond;
+    pthread_create(&clients[i].c_thread, NULL, thread, &clients[i]);
+  }
+  pthread_mutex_lock(lock);
+  for (size_t i = 0; i < n; i++) {
+    while (!clients[i].c_ready)
+      pthread_cond_wait(cond, lock);
+  }
+  pthread_mutex_unlock(lock);
+}
+
+static int run_once(void) {
+  pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+  pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+  client pubs[n_pubs], subs[n_subs];
+
+  for (size_t b = 0; b < n_boxes; b++) {
+    if (manage_box(3, b) == -1) {
+      fprintf(stderr, "loadgen: error creating box %zu\n", b);
+      return -1;
+    }
+  }
+  histogram_init(&latency);
+  start_clients(subs, n_subs, subscriber_thread, &lock, &cond);
+
+  atomic_store(&publishing, true);
+  uint64_t start = now_ns();
+  start_clients(pubs, n_pubs, publisher_thread, &lock, &cond);
+  struct timespec period = {(time_t)seconds,
+                            (long)((seconds - (double)(time_t)seconds) * 1e9)};
+  nanosleep(&period, NULL);
+  atomic_store(&publishing, false);
+  uint64_t sent = 0, sent_per_box[n_boxes];
+  memset(sent_per_box, 0, sizeof(sent_per_box));
+  for (size_t i = 0; i < n_pubs; i++) {
+    pthread_join(pubs[i].c_thread, NULL);
+    sent += atomic_load(&pubs[i].c_count);
+    sent_per_box[pubs[i].c_box] += atomic_load(&pubs[i].c_count);
+  }
+  uint64_t published = now_ns();
+
+  // waits for the subscribers to catch up (those over shared memory may have
+  // lost messages, so not forever)
+  for (size_t i = 0; i < n_subs; i++) {
+    while (atomic_load(&subs[i].c_count) <
+               sent_per_box[subs[i].c_box] &&
+           now_ns() - published < DRAIN_TIMEOUT_NS) {
+      struct timespec ts = {0, 1000000};
+      nanosleep(&ts, NULL);
+    }
+  }
+  uint64_t received = 0, last = published;
+  for (size_t i = 0; i < n_subs; i++) {
+    received += atomic_load(&subs[i].c_count);
+    if (atomic_load(&subs[i].c_last) > last)
+      last = atomic_load(&subs[i].c_last);
+  }
+  for (size_t b = 0; b < n_boxes; b++) {
+    manage_box(5, b);
+  }
+  for (size_t i = 0; i < n_subs; i++) {
+    pthread_join(subs[i].c_thread, NULL);
+  }
+
+  histogram_snapshot *snapshot =
+      (histogram_snapshot *)malloc(sizeof(histogram_snapshot));
+  if (snapshot == NULL)
+    return -1;
+  histogram_snapshot_take(&latency, snapshot);
+  double publish_seconds = (double)(published - start) / 1e9;
+  double deliver_seconds = (double)(last - start) / 1e9;
+  printf("%s,%zu,%zu,%zu,%zu,%.0f,%" PRIu64 ",%" PRIu64 ",%.0f,%.0f,%.1f,%.1f,"
+         "%.1f,%.1f\n",
+         shm ? "shm" : "pipe", n_boxes, n_pubs, n_subs, message_size, rate,
+         sent, received, (double)sent / publish_seconds,
+         (double)received / deliver_seconds,
+         (double)histogram_percentile(snapshot, 50) / 1e3,
+         (double)histogram_percentile(snapshot, 99) / 1e3,
+         (double)histogram_percentile(snapshot, 99.9) / 1e3,
+         (double)snapshot->hs_max / 1e3);
+  fflush(stdout);
+  free(snapshot);
+  run++;
+  return 0;
+}
+
+// parses a comma separated list of numbers
+static size_t parse_list(char const *list, double *values) {
+  size_t n = 0;
+  char *end;
+  while (n < MAX_VALUES) {
+    values[n++] = strtod(list, &end);
+    if (*end != ',')
+      break;
+    list = end + 1;
+  }
+  return n;
+}
+
+int main(int argc, char **argv) {
+  double sizes[MAX_VALUES] = {16, 256, 1000}, rates[MAX_VALUES] = {0};
+  size_t n_sizes = 3, n_rates = 1;
+  if (argc < 2) {
+    fprintf(stderr, "usage: loadgen <register_pipe> [--boxes K] [--pubs N] "
+                    "[--subs M] [--sizes s1,...] [--rates r1,...] "
+                    "[--seconds S] [--shm] [--durable]\n");
+    return EXIT_FAILURE;
+  }
+  register_pipe = argv[1];
+  for (int i = 2; i < argc; i++) {
+    if (!strcmp(argv[i], "--boxes") && i + 1 < argc) {
+      n_boxes = strtoul(argv[++i], NULL, 10);
+    } else if (!strcmp(argv[i], "--pubs") && i + 1 < argc) {
+      n_pubs = strtoul(argv[++i], NULL, 10);
+    } else if (!strcmp(argv[i], "--subs") && i + 1 < argc) {
+      n_subs = strtoul(argv[++i], NULL, 10);
+    } else if (!strcmp(argv[i], "--sizes") && i + 1 < argc) {
+      n_sizes = parse_list(argv[++i], sizes);
+    } else if (!strcmp(argv[i], "--rates") && i + 1 < argc) {
+      n_rates = parse_list(argv[++i], rates);
+    } else if (!strcmp(argv[i], "--seconds") && i + 1 < argc) {
+      seconds = strtod(argv[++i], NULL);
+    } else if (!strcmp(argv[i], "--shm")) {
+      shm = 1;
+    } else if (!strcmp(argv[i], "--durable")) {
+      durable = 1;
+    } else {
+      fprintf(stderr, "loadgen: unknown option: %s\n", argv[i]);
+      return EXIT_FAILURE;
+    }
+  }
+  // boxes take a single publisher each
+  if (n_boxes == 0 || n_pubs > n_boxes) {
+    fprintf(stderr, "loadgen: there must be at least as many boxes as "
+                    "publishers\n");
+    return EXIT_FAILURE;
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  printf("transport,boxes,pubs,subs,size,rate,sent,received,sent_per_sec,"
+         "delivered_per_sec,p50_us,p99_us,p999_us,max_us\n");
+  for (size_t s = 0; s < n_sizes; s++) {
+    // every message carries its send time, and the broker truncates the
+    // longer ones
+    message_size = (size_t)sizes[s];
+    if (message_size < sizeof(uint64_t))
+      message_size = sizeof(uint64_t);
+    if (message_size > MESSAGE_SIZE - 1)
+      message_size = MESSAGE_SIZE - 1;
+    for (size_t r = 0; r < n_rates; r++) {
+      rate = rates[r];
+      if (run_once() == -1)
+        return EXIT_FAILURE;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,94 @@
+// Producer-consumer queue microbenchmark.
+//
+// Compares the throughput (operations per second, counting both enqueues and
+// dequeues) of the mutex/condvar queue and the lock-free ring, with half of
+// the threads producing and the other half consuming (from 2 to max_threads
+// threads, doubling each time).
+//
+// Usage: pcq_bench [max_threads] [total_elements] [capacity]
+
+#include "producer-consumer.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static pc_queue_t queue;
+static size_t per_producer, per_consumer;
+
+static void *producer(void *arg) {
+  (void)arg;
+  for (size_t i = 0; i < per_producer; i++) {
+    // elements are never NULL, like the broker's protocol messages
+    pcq_enqueue(&queue, (void *)(uintptr_t)(i + 1));
+  }
+  return NULL;
+}
+
+static void *consumer(void *arg) {
+  (void)arg;
+  for (size_t i = 0; i < per_consumer; i++) {
+    if (pcq_dequeue(&queue) == NULL) {
+      fprintf(stderr, "pcq_bench: dequeued NULL\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  return NULL;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void run(pcq_mode_t mode, size_t threads, size_t total,
+                size_t capacity) {
+  size_t producers = threads / 2 > 0 ? threads / 2 : 1;
+  size_t consumers = threads - producers > 0 ? threads - producers : 1;
+  // rounds down so that every element produced is consumed
+  size_t elements = total / (producers * consumers) * producers * consumers;
+  per_producer = elements / producers;
+  per_consumer = elements / consumers;
+
+  pcq_create_mode(&queue, capacity, mode);
+  pthread_t tids[producers + consumers];
+  double start = now();
+  for (size_t i = 0; i < consumers; i++) {
+    pthread_create(&tids[i], NULL, consumer, NULL);
+  }
+  for (size_t i = 0; i < producers; i++) {
+    pthread_create(&tids[consumers + i], NULL, producer, NULL);
+  }
+  for (size_t i = 0; i < producers + consumers; i++) {
+    pthread_join(tids[i], NULL);
+  }
+  double elapsed = now() - start;
+  pcq_destroy(&queue);
+
+  printf("%s,%zu,%zu,%zu,%.3f,%.0f\n",
+         mode == PCQ_LOCK_FREE ? "lock-free" : "mutex", producers + consumers,
+         capacity, elements * 2, elapsed, (double)(elements * 2) / elapsed);
+}
+
+int main(int argc, char **argv) {
+  size_t max_threads = 64, total = 1000000, capacity = 128;
+  if (argc > 1) {
+    max_threads = strtoul(argv[1], NULL, 10);
+  }
+  if (argc > 2) {
+    total = strtoul(argv[2], NULL, 10);
+  }
+  if (argc > 3) {
+    capacity = strtoul(argv[3], NULL, 10);
+  }
+
+  printf("mode,threads,capacity,ops,seconds,ops_per_sec\n");
+  for (size_t threads = 2; threads <= max_threads; threads *= 2) {
+    run(PCQ_MUTEX, threads, total, capacity);
+    run(PCQ_LOCK_FREE, threads, total, capacity);
+  }
+  return 0;
+}
@@ -0,0 +1,169 @@
+// Register request spread benchmark for a live mbroker.
+//
+// Sends a burst of subscriber register requests with a single write, so that
+// the broker reads and announces them together. The client of the first one
+// only opens its pipe after stalling for a while, which blocks the worker
+// handling its request; the other clients open theirs straight away. Their
+// registrations only wait for the stalled one if they are handled by the same
+// worker, so how long they take shows whether the burst is spread over the
+// workers (including those the broker spawns for it).
+//
+// The requests are for a box that doesn't exist, so the broker just opens
+// each client's pipe and closes it again.
+//
+// Prints a CSV line per round: the time the stalled client took, and the
+// median and maximum times the others took (in milliseconds).
+//
+// Usage: register_spread <register_pipe> [--clients N] [--stall ms]
+//            [--rounds R]
+
+#include "extras.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
+
+#define MAX_CLIENTS (64)
+
+static char const *register_pipe;
+static size_t n_clients = 16;
+static unsigned stall_ms = 200;
+static size_t rounds = 3;
+
+typedef struct {
+  pthread_t c_thread;
+  char c_pipe[PIPE_NAME_SIZE];
+  unsigned c_stall_ms;
+  uint64_t c_start;   // when the requests were sent
+  uint64_t c_elapsed; // until the broker opened the client's pipe
+} client;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void *client_thread(void *arg) {
+  client *c = (client *)arg;
+  if (c->c_stall_ms > 0) {
+    struct timespec stall = {(time_t)(c->c_stall_ms / 1000),
+                             (long)(c->c_stall_ms % 1000) * 1000000};
+    while (nanosleep(&stall, &stall) == -1 && errno == EINTR) {
+    }
+  }
+  // waits for the broker to open the pipe for writing
+  int fd = open(c->c_pipe, O_RDONLY);
+  c->c_elapsed = now_ns() - c->c_start;
+  if (fd == -1) {
+    perror("register_spread: failed to open client pipe");
+    return NULL;
+  }
+  char buffer[FRAME_BUFFER_SIZE];
+  while (read(fd, buffer, sizeof(buffer)) > 0) {
+  }
+  close(fd);
+  return NULL;
+}
+
+static int compare(void const *a, void const *b) {
+  uint64_t x = *(uint64_t const *)a, y = *(uint64_t const *)b;
+  return x < y ? -1 : x > y;
+}
+
+// sends the burst of requests and waits for every client
+//
+// Returns 0 if successful, -1 otherwise
+static int run_once(size_t round) {
+  static client clients[MAX_CLIENTS];
+  static char burst[PIPE_BUF];
+  size_t size = 0;
+  for (size_t i = 0; i < n_clients; i++) {
+    client *c = &clients[i];
+    snprintf(c->c_pipe, PIPE_NAME_SIZE, "/tmp/register_spread.%d.%zu",
+             (int)getpid(), i);
+    unlink(c->c_pipe);
+    if (mkfifo(c->c_pipe, 0666) == -1) {
+      perror("register_spread: failed to create client pipe");
+      return -1;
+    }
+    c->c_stall_ms = i == 0 ? stall_ms : 0;
+    // a pipe name and a box name, each '\0' terminated
+    char payload[PIPE_NAME_SIZE + BOX_NAME_SIZE];
+    size_t length = strlen(c->c_pipe) + 1;
+    memcpy(payload, c->c_pipe, length);
+    length += (size_t)snprintf(payload + length, BOX_NAME_SIZE,
+                               "/register_spread.%d", (int)getpid()) +
+              1;
+    if (size + sizeof(frame_header) + length > sizeof(burst)) {
+      fprintf(stderr, "register_spread: too many clients for one write\n");
+      return -1;
+    }
+    size += frame_pack(burst + size, 2, payload, length);
+  }
+
+  int fd = open(register_pipe, O_WRONLY);
+  if (fd == -1) {
+    perror("register_spread: failed to open register pipe");
+    return -1;
+  }
+  uint64_t start = now_ns();
+  for (size_t i = 0; i < n_clients; i++) {
+    clients[i].c_start = start;
+    pthread_create(&clients[i].c_thread, NULL, client_thread, &clients[i]);
+  }
+  int result = write(fd, burst, size) == (ssize_t)size ? 0 : -1;
+  close(fd);
+  for (size_t i = 0; i < n_clients; i++) {
+    pthread_join(clients[i].c_thread, NULL);
+    unlink(clients[i].c_pipe);
+  }
+  if (result == -1) {
+    perror("register_spread: failed to send requests");
+    return -1;
+  }
+
+  uint64_t others[MAX_CLIENTS];
+  for (size_t i = 1; i < n_clients; i++) {
+    others[i - 1] = clients[i].c_elapsed;
+  }
+  qsort(others, n_clients - 1, sizeof(others[0]), compare);
+  printf("%zu,%.1f,%.1f,%.1f\n", round, (double)clients[0].c_elapsed / 1e6,
+         (double)others[(n_clients - 1) / 2] / 1e6,
+         (double)others[n_clients - 2] / 1e6);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: register_spread <register_pipe> [--clients N] "
+                    "[--stall ms] [--rounds R]\n");
+    return 1;
+  }
+  register_pipe = argv[1];
+  for (int i = 2; i < argc; i++) {
+    if (!strcmp(argv[i], "--clients") && i + 1 < argc) {
+      n_clients = strtoul(argv[++i], NULL, 10);
+    } else if (!strcmp(argv[i], "--stall") && i + 1 < argc) {
+      stall_ms = (unsigned)strtoul(argv[++i], NULL, 10);
+    } else if (!strcmp(argv[i], "--rounds") && i + 1 < argc) {
+      rounds = strtoul(argv[++i], NULL, 10);
+    } else {
+      fprintf(stderr, "register_spread: unknown option: %s\n", argv[i]);
+      return 1;
+    }
+  }
+  if (n_clients < 2 || n_clients > MAX_CLIENTS) {
+    fprintf(stderr, "register_spread: --clients must be between 2 and %d\n",
+            MAX_CLIENTS);
+    return 1;
+  }
+
+  printf("round,stalled_ms,others_p50_ms,others_max_ms\n");
+  for (size_t round = 0; round < rounds; round++) {
+    if (run_once(round) == -1) {
+      return 1;
+    }
+  }
+  return 0;
+}
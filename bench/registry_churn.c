@@ -0,0 +1,141 @@
+// Box creation and removal benchmark.
+//
+// Fills the registry with a number of boxes (from 1024 up to max_boxes,
+// doubling each time) and measures the latency of creating and removing
+// boxes among them, which replace the registry's snapshot. Box names are
+// scattered, so that creations and removals land all over the snapshot. The
+// snapshot is checked to list every box, in order, after each round.
+//
+// Usage: registry_churn [max_boxes] [changes]
+
+#include "mbroker/registry.h"
+#include "operations.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct {
+  size_t cv_count;
+  char cv_last[BOX_NAME_SIZE];
+  int cv_sorted;
+} check_visit_args;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// the i-th box name, scattered over the name space
+static void box_name(char *name, size_t i) {
+  snprintf(name, BOX_NAME_SIZE, "/%08zx",
+           (size_t)((i * 2654435761u) & 0xFFFFFFFF));
+}
+
+static void check_visit(broker_box *box, void *arg) {
+  check_visit_args *args = (check_visit_args *)arg;
+  if (args->cv_count > 0 && strcmp(args->cv_last, box->bb_name) >= 0)
+    args->cv_sorted = 0;
+  memcpy(args->cv_last, box->bb_name, BOX_NAME_SIZE);
+  args->cv_count++;
+}
+
+static int compare_doubles(void const *a, void const *b) {
+  double x = *(double const *)a, y = *(double const *)b;
+  return (x > y) - (x < y);
+}
+
+static void remove_box(char const *name) {
+  broker_box *removed;
+  if (registry_remove(name, &removed) != 0) {
+    fprintf(stderr, "registry_churn: failed to remove %s\n", name);
+    exit(EXIT_FAILURE);
+  }
+  box_unref(removed);
+}
+
+int main(int argc, char **argv) {
+  size_t max_boxes = 128 * 1024, changes = 10000;
+  if (argc > 1)
+    max_boxes = strtoul(argv[1], NULL, 10);
+  if (argc > 2)
+    changes = strtoul(argv[2], NULL, 10);
+  if (max_boxes < 1024 || changes == 0) {
+    fprintf(stderr, "registry_churn: needs at least 1024 boxes and 1 change\n");
+    return EXIT_FAILURE;
+  }
+
+  tfs_params params = tfs_default_params();
+  params.max_inode_count = max_boxes + 2;
+  // every box keeps its file open, and takes a block for its log's header
+  // (plus the root directory's blocks)
+  params.max_open_files_count = max_boxes + 2;
+  params.max_block_count = max_boxes + max_boxes / 16 + 1024;
+  if (tfs_init(&params) == -1 || registry_init() == -1) {
+    fprintf(stderr, "registry_churn: failed to initialize\n");
+    return EXIT_FAILURE;
+  }
+  double *latencies = (double *)malloc(2 * changes * sizeof(double));
+  if (latencies == NULL) {
+    fprintf(stderr, "registry_churn: out of memory\n");
+    return EXIT_FAILURE;
+  }
+
+  printf("boxes,changes,create_p50_us,create_p99_us,remove_p50_us,"
+         "remove_p99_us\n");
+  char name[BOX_NAME_SIZE];
+  size_t boxes = 0;
+  for (size_t target = 1024; target <= max_boxes; target *= 2) {
+    for (; boxes < target - 1; boxes++) {
+      box_name(name, boxes);
+      if (registry_create(name, NULL) != 0) {
+        fprintf(stderr, "registry_churn: failed to create %s\n", name);
+        return EXIT_FAILURE;
+      }
+    }
+
+    // each change creates a new box, somewhere among the others, and removes
+    // it
+    for (size_t i = 0; i < changes; i++) {
+      box_name(name, boxes + i);
+      double start = now();
+      if (registry_create(name, NULL) != 0) {
+        fprintf(stderr, "registry_churn: failed to create %s\n", name);
+        return EXIT_FAILURE;
+      }
+      double created = now();
+      remove_box(name);
+      latencies[i] = (created - start) * 1e6;
+      latencies[changes + i] = (now() - created) * 1e6;
+    }
+    qsort(latencies, changes, sizeof(double), compare_doubles);
+    qsort(latencies + changes, changes, sizeof(double), compare_doubles);
+    printf("%zu,%zu,%.2f,%.2f,%.2f,%.2f\n", boxes, changes,
+           latencies[changes / 2], latencies[changes * 99 / 100],
+           latencies[changes + changes / 2],
+           latencies[changes + changes * 99 / 100]);
+
+    check_visit_args args = {0, "", 1};
+    registry_foreach(check_visit, &args);
+    if (args.cv_count != boxes || !args.cv_sorted) {
+      fprintf(stderr, "registry_churn: snapshot lists %zu boxes%s, not %zu\n",
+              args.cv_count, args.cv_sorted ? "" : " out of order", boxes);
+      return EXIT_FAILURE;
+    }
+  }
+
+  for (size_t i = 0; i < boxes; i++) {
+    box_name(name, i);
+    remove_box(name);
+  }
+  check_visit_args args = {0, "", 1};
+  registry_foreach(check_visit, &args);
+  if (args.cv_count != 0) {
+    fprintf(stderr, "registry_churn: %zu boxes left\n", args.cv_count);
+    return EXIT_FAILURE;
+  }
+  free(latencies);
+  return 0;
+}
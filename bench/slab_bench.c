@@ -0,0 +1,115 @@
+// Slab pool microbenchmark.
+//
+// Compares the throughput (allocations per second) of malloc/free and the
+// slab pool for objects the size of the broker's register requests, with
+// every thread taking a few objects at a time and returning them (from 1 to
+// max_threads threads, doubling each time). Every object taken is stamped
+// with its thread and checked before it is returned, so that an object handed
+// to two threads at once is caught.
+//
+// Usage: slab_bench [max_threads] [total_allocations] [held]
+
+#include "slab.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// about the size of a register request (a protocol and a timestamp)
+#define OBJECT_SIZE (480)
+#define MAX_HELD (64)
+
+static slab_pool pool;
+static int use_pool;
+static size_t per_thread, held;
+
+static void *run_thread(void *arg) {
+  uintptr_t id = (uintptr_t)arg;
+  void *objects[MAX_HELD];
+  for (size_t i = 0; i < per_thread; i += held) {
+    for (size_t j = 0; j < held; j++) {
+      objects[j] = use_pool ? slab_pool_alloc(&pool) : malloc(OBJECT_SIZE);
+      if (objects[j] == NULL) {
+        fprintf(stderr, "slab_bench: out of objects\n");
+        exit(EXIT_FAILURE);
+      }
+      memcpy(objects[j], &id, sizeof(id));
+    }
+    for (size_t j = 0; j < held; j++) {
+      uintptr_t stamp;
+      memcpy(&stamp, objects[j], sizeof(stamp));
+      if (stamp != id) {
+        fprintf(stderr, "slab_bench: object shared by two threads\n");
+        exit(EXIT_FAILURE);
+      }
+      if (use_pool) {
+        slab_pool_free(&pool, objects[j]);
+      } else {
+        free(objects[j]);
+      }
+    }
+  }
+  return NULL;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void run(int pool_mode, size_t threads, size_t total) {
+  use_pool = pool_mode;
+  per_thread = total / threads / held * held;
+  // as many objects as can be held at once, like the broker's pool
+  if (use_pool &&
+      slab_pool_init(&pool, OBJECT_SIZE, (uint32_t)(threads * held)) == -1) {
+    perror("slab_bench: creating pool");
+    exit(EXIT_FAILURE);
+  }
+
+  pthread_t tids[threads];
+  double start = now();
+  for (size_t i = 0; i < threads; i++) {
+    pthread_create(&tids[i], NULL, run_thread, (void *)(uintptr_t)(i + 1));
+  }
+  for (size_t i = 0; i < threads; i++) {
+    pthread_join(tids[i], NULL);
+  }
+  double elapsed = now() - start;
+  if (use_pool) {
+    slab_pool_destroy(&pool);
+  }
+
+  size_t allocations = per_thread * threads;
+  printf("%s,%zu,%zu,%zu,%.3f,%.0f\n", use_pool ? "slab" : "malloc", threads,
+         held, allocations, elapsed, (double)allocations / elapsed);
+}
+
+int main(int argc, char **argv) {
+  size_t max_threads = 16, total = 10000000;
+  held = 8;
+  if (argc > 1) {
+    max_threads = strtoul(argv[1], NULL, 10);
+  }
+  if (argc > 2) {
+    total = strtoul(argv[2], NULL, 10);
+  }
+  if (argc > 3) {
+    held = strtoul(argv[3], NULL, 10);
+  }
+  if (held == 0 || held > MAX_HELD) {
+    fprintf(stderr, "slab_bench: held must be between 1 and %d\n", MAX_HELD);
+    return EXIT_FAILURE;
+  }
+
+  printf("allocator,threads,held,allocations,seconds,allocs_per_sec\n");
+  for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+    run(0, threads, total);
+    run(1, threads, total);
+  }
+  return 0;
+}
@@ -0,0 +1,347 @@
+#include "allocator.h"
+#include "betterassert.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Cache of free entries of a thread.
+ *
+ * Its lock is only ever contended by allocator_drain and by threads taking
+ * entries from other caches when the bitmap runs out, and is never held while
+ * taking the allocator's lock (which is always taken first).
+ */
+typedef struct alloc_cache {
+  allocator_t *ac_allocator;
+  pthread_mutex_t ac_lock;
+  size_t ac_size;
+  struct alloc_cache *ac_next; // in the allocator's list of caches
+  int ac_entries[];
+} alloc_cache_t;
+
+static void mutex_lock(pthread_mutex_t *mutex) {
+  ALWAYS_ASSERT(pthread_mutex_lock(mutex) == 0, "failed to lock mutex");
+}
+
+static void mutex_unlock(pthread_mutex_t *mutex) {
+  ALWAYS_ASSERT(pthread_mutex_unlock(mutex) == 0, "failed to unlock mutex");
+}
+
+/**
+ * Take a free entry from the bitmap.
+ *
+ * The caller must hold the allocator's lock.
+ *
+ * Returns the entry, or -1 if every entry is taken.
+ */
+static int bitmap_take(allocator_t *allocator) {
+  if (allocator->al_free == 0) {
+    return -1;
+  }
+  size_t summary_words = ALLOCATOR_WORDS(ALLOCATOR_WORDS(allocator->al_size));
+  for (size_t i = 0; i < summary_words; i++) {
+    size_t s = (allocator->al_cursor + i) % summary_words;
+    uint64_t not_full = ~allocator->al_full[s];
+    if (not_full == 0) {
+      continue;
+    }
+    size_t w = s * 64 + (size_t)__builtin_ctzll(not_full);
+    size_t bit = (size_t)__builtin_ctzll(~allocator->al_words[w]);
+    allocator->al_words[w] |= 1ULL << bit;
+    if (allocator->al_words[w] == UINT64_MAX) {
+      allocator->al_full[s] |= 1ULL << (w % 64);
+    }
+    allocator->al_free--;
+    allocator->al_cursor = s;
+    return (int)(w * 64 + bit);
+  }
+  PANIC("allocator: free entries missing from the bitmap");
+}
+
+/**
+ * Give an entry back to the bitmap.
+ *
+ * The caller must hold the allocator's lock.
+ */
+static void bitmap_put(allocator_t *allocator, int entry) {
+  size_t w = (size_t)entry / 64;
+  uint64_t bit = 1ULL << ((size_t)entry % 64);
+  ALWAYS_ASSERT(allocator->al_words[w] & bit,
+                "allocator: entry freed while already free");
+  allocator->al_words[w] &= ~bit;
+  allocator->al_full[w / 64] &= ~(1ULL << (w % 64));
+  allocator->al_free++;
+}
+
+/**
+ * Give every entry in a cache back to the bitmap.
+ *
+ * The caller must hold the allocator's lock and the cache's lock.
+ */
+static void cache_empty(allocator_t *allocator, alloc_cache_t *cache) {
+  while (cache->ac_size > 0) {
+    bitmap_put(allocator, cache->ac_entries[--cache->ac_size]);
+  }
+}
+
+/**
+ * Give a thread's cache back when the thread exits.
+ */
+static void cache_release(void *arg) {
+  alloc_cache_t *cache = (alloc_cache_t *)arg;
+  allocator_t *allocator = cache->ac_allocator;
+
+  mutex_lock(&allocator->al_lock);
+  alloc_cache_t **link = &allocator->al_caches;
+  while (*link != cache) {
+    link = &(*link)->ac_next;
+  }
+  *link = cache->ac_next;
+  mutex_lock(&cache->ac_lock);
+  cache_empty(allocator, cache);
+  mutex_unlock(&cache->ac_lock);
+  mutex_unlock(&allocator->al_lock);
+
+  pthread_mutex_destroy(&cache->ac_lock);
+  free(cache);
+}
+
+/**
+ * Obtain the calling thread's cache, creating it on first use.
+ *
+ * Returns the cache, or NULL if there are no caches (or it couldn't be
+ * created, in which case the thread goes to the bitmap every time).
+ */
+static alloc_cache_t *cache_get(allocator_t *allocator) {
+  if (allocator->al_cache_capacity == 0) {
+    return NULL;
+  }
+  alloc_cache_t *cache =
+      (alloc_cache_t *)pthread_getspecific(allocator->al_key);
+  if (cache != NULL) {
+    return cache;
+  }
+
+  cache = malloc(sizeof(alloc_cache_t) +
+                 allocator->al_cache_capacity * sizeof(int));
+  if (cache == NULL) {
+    return NULL;
+  }
+  cache->ac_allocator = allocator;
+  pthread_mutex_init(&cache->ac_lock, NULL);
+  cache->ac_size = 0;
+  if (pthread_setspecific(allocator->al_key, cache) != 0) {
+    pthread_mutex_destroy(&cache->ac_lock);
+    free(cache);
+    return NULL;
+  }
+  mutex_lock(&allocator->al_lock);
+  cache->ac_next = allocator->al_caches;
+  allocator->al_caches = cache;
+  mutex_unlock(&allocator->al_lock);
+  return cache;
+}
+
+/**
+ * Initialize an allocator.
+ *
+ * Input:
+ *   - allocator: the allocator
+ *   - words: the bitmap (ALLOCATOR_WORDS(size) words), either zero-filled or
+ *     holding the entries already taken
+ *   - size: number of entries
+ *   - cache_capacity: number of free entries each thread may cache (0 for no
+ *     caches)
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int allocator_init(allocator_t *allocator, uint64_t *words, size_t size,
+                   size_t cache_capacity) {
+  size_t n_words = ALLOCATOR_WORDS(size);
+  size_t summary_words = ALLOCATOR_WORDS(n_words);
+  allocator->al_full = calloc(summary_words, sizeof(uint64_t));
+  if (allocator->al_full == NULL) {
+    return -1;
+  }
+  if (cache_capacity > 0 &&
+      pthread_key_create(&allocator->al_key, cache_release) != 0) {
+    free(allocator->al_full);
+    return -1;
+  }
+  allocator->al_words = words;
+  allocator->al_size = size;
+  allocator->al_cursor = 0;
+  allocator->al_cache_capacity = cache_capacity;
+  allocator->al_caches = NULL;
+  pthread_mutex_init(&allocator->al_lock, NULL);
+
+  // the bits past the last entry are taken, and so are the summary's bits
+  // past the last word, so that they are never found free
+  if (size % 64 != 0) {
+    words[n_words - 1] |= UINT64_MAX << (size % 64);
+  }
+  if (n_words % 64 != 0) {
+    allocator->al_full[summary_words - 1] = UINT64_MAX << (n_words % 64);
+  }
+  size_t taken = 0;
+  for (size_t w = 0; w < n_words; w++) {
+    taken += (size_t)__builtin_popcountll(words[w]);
+    if (words[w] == UINT64_MAX) {
+      allocator->al_full[w / 64] |= 1ULL << (w % 64);
+    }
+  }
+  allocator->al_free = n_words * 64 - taken;
+  return 0;
+}
+
+/**
+ * Destroy an allocator, along with every thread's cache.
+ */
+void allocator_destroy(allocator_t *allocator) {
+  if (allocator->al_cache_capacity > 0) {
+    pthread_key_delete(allocator->al_key);
+  }
+  alloc_cache_t *cache = allocator->al_caches;
+  while (cache != NULL) {
+    alloc_cache_t *next = cache->ac_next;
+    pthread_mutex_destroy(&cache->ac_lock);
+    free(cache);
+    cache = next;
+  }
+  allocator->al_caches = NULL;
+  pthread_mutex_destroy(&allocator->al_lock);
+  free(allocator->al_full);
+  allocator->al_full = NULL;
+}
+
+/**
+ * Take a free entry from another thread's cache, once the bitmap has none.
+ *
+ * Returns the entry, or -1 if there are no free entries at all.
+ */
+static int cache_steal(allocator_t *allocator) {
+  int entry = -1;
+  mutex_lock(&allocator->al_lock);
+  entry = bitmap_take(allocator);
+  for (alloc_cache_t *cache = allocator->al_caches;
+       cache != NULL && entry == -1; cache = cache->ac_next) {
+    mutex_lock(&cache->ac_lock);
+    if (cache->ac_size > 0) {
+      entry = cache->ac_entries[--cache->ac_size];
+    }
+    mutex_unlock(&cache->ac_lock);
+  }
+  mutex_unlock(&allocator->al_lock);
+  return entry;
+}
+
+/**
+ * Allocate an entry.
+ *
+ * Returns the entry if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - No free entries.
+ */
+int allocator_alloc(allocator_t *allocator) {
+  alloc_cache_t *cache = cache_get(allocator);
+  if (cache == NULL) {
+    mutex_lock(&allocator->al_lock);
+    int entry = bitmap_take(allocator);
+    mutex_unlock(&allocator->al_lock);
+    return entry;
+  }
+
+  mutex_lock(&cache->ac_lock);
+  if (cache->ac_size > 0) {
+    int entry = cache->ac_entries[--cache->ac_size];
+    mutex_unlock(&cache->ac_lock);
+    return entry;
+  }
+  mutex_unlock(&cache->ac_lock);
+
+  // refills half of the cache at once (the cache is only ever filled by its
+  // own thread, so it still has room for them)
+  int batch[allocator->al_cache_capacity / 2 + 1];
+  size_t taken = 0;
+  mutex_lock(&allocator->al_lock);
+  while (taken < allocator->al_cache_capacity / 2 + 1 &&
+         (batch[taken] = bitmap_take(allocator)) != -1) {
+    taken++;
+  }
+  mutex_unlock(&allocator->al_lock);
+  if (taken == 0) {
+    return cache_steal(allocator);
+  }
+
+  mutex_lock(&cache->ac_lock);
+  for (size_t i = 1; i < taken; i++) {
+    cache->ac_entries[cache->ac_size++] = batch[i];
+  }
+  mutex_unlock(&cache->ac_lock);
+  return batch[0];
+}
+
+/**
+ * Free an entry.
+ *
+ * Input:
+ *   - entry: the entry (previously allocated with allocator_alloc)
+ */
+void allocator_free(allocator_t *allocator, int entry) {
+  ALWAYS_ASSERT(entry >= 0 && (size_t)entry < allocator->al_size,
+                "allocator_free: invalid entry");
+
+  alloc_cache_t *cache = cache_get(allocator);
+  if (cache == NULL) {
+    mutex_lock(&allocator->al_lock);
+    bitmap_put(allocator, entry);
+    mutex_unlock(&allocator->al_lock);
+    return;
+  }
+
+  // a full cache gives half of its entries back to the bitmap
+  int batch[allocator->al_cache_capacity / 2 + 1];
+  size_t spilled = 0;
+  mutex_lock(&cache->ac_lock);
+  if (cache->ac_size == allocator->al_cache_capacity) {
+    while (spilled < allocator->al_cache_capacity / 2) {
+      batch[spilled++] = cache->ac_entries[--cache->ac_size];
+    }
+  }
+  cache->ac_entries[cache->ac_size++] = entry;
+  mutex_unlock(&cache->ac_lock);
+
+  if (spilled > 0) {
+    mutex_lock(&allocator->al_lock);
+    for (size_t i = 0; i < spilled; i++) {
+      bitmap_put(allocator, batch[i]);
+    }
+    mutex_unlock(&allocator->al_lock);
+  }
+}
+
+/**
+ * Whether an entry is taken (or in a thread's cache) in the bitmap.
+ */
+bool allocator_taken(allocator_t const *allocator, int entry) {
+  ALWAYS_ASSERT(entry >= 0 && (size_t)entry < allocator->al_size,
+                "allocator_taken: invalid entry");
+  return allocator->al_words[(size_t)entry / 64] &
+         (1ULL << ((size_t)entry % 64));
+}
+
+/**
+ * Give every entry in the threads' caches back to the bitmap, so that it only
+ * has the entries in use set.
+ */
+void allocator_drain(allocator_t *allocator) {
+  mutex_lock(&allocator->al_lock);
+  for (alloc_cache_t *cache = allocator->al_caches; cache != NULL;
+       cache = cache->ac_next) {
+    mutex_lock(&cache->ac_lock);
+    cache_empty(allocator, cache);
+    mutex_unlock(&cache->ac_lock);
+  }
+  mutex_unlock(&allocator->al_lock);
+}
@@ -0,0 +1,53 @@
+#ifndef ALLOCATOR_H
+#define ALLOCATOR_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Allocator of the entries of a table (inodes, data blocks, open file
+ * entries).
+ *
+ * Which entries are taken is kept in a bitmap of 64-bit words (a set bit for
+ * a taken entry), which may live in the file system image. A summary bitmap,
+ * with a bit set for every full word, lets a free entry be found by looking
+ * at a summary word and a bitmap word (with ctz) for every 4096 entries at
+ * most, instead of at every entry.
+ *
+ * On top of it, each thread may keep a cache of free entries, taken from the
+ * bitmap (and given back to it) in batches, so that most allocations and
+ * frees never take the allocator's lock. Cached entries are taken in the
+ * bitmap, so they are given back by allocator_drain whenever the bitmap has
+ * to be exact (e.g., to write the image).
+ */
+
+/**
+ * Number of words in the bitmap of a table with size entries.
+ */
+#define ALLOCATOR_WORDS(size) (((size) + 63) / 64)
+
+struct alloc_cache;
+
+typedef struct {
+  uint64_t *al_words; // the bitmap
+  uint64_t *al_full;  // bit w set when word w of the bitmap is full
+  size_t al_size;     // number of entries
+  size_t al_free;     // free entries in the bitmap (not counting caches)
+  size_t al_cursor;   // summary word where the last entry was found
+  size_t al_cache_capacity; // 0 for no caches
+  pthread_mutex_t al_lock;  // protects the fields above and the caches list
+  pthread_key_t al_key;     // the calling thread's cache
+  struct alloc_cache *al_caches;
+} allocator_t;
+
+int allocator_init(allocator_t *allocator, uint64_t *words, size_t size,
+                   size_t cache_capacity);
+void allocator_destroy(allocator_t *allocator);
+int allocator_alloc(allocator_t *allocator);
+void allocator_free(allocator_t *allocator, int entry);
+bool allocator_taken(allocator_t const *allocator, int entry);
+void allocator_drain(allocator_t *allocator);
+
+#endif // ALLOCATOR_H
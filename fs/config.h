@@ -6,6 +6,17 @@
 
 #define MAX_FILE_NAME (40)
 
-#define DELAY (5000)
+// number of data blocks referenced directly by an inode (more are reached
+// through its indirect and double indirect blocks)
+#define INODE_DIRECT_BLOCKS (12)
+
+// emulated storage accesses shorter than this (in nanoseconds) yield the
+// processor until they complete instead of sleeping, which can't be timed that
+// finely
+#define LATENCY_SLEEP_MIN_NS (50000)
+
+// number of sets of call statistics, each thread counting in one of them, so
+// that threads seldom share a cache line when counting
+#define LATENCY_SHARDS (64)
 
 #endif // CONFIG_H
\ No newline at end of file
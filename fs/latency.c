@@ -0,0 +1,163 @@
+#include "latency.h"
+#include "config.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+
+static tfs_latency_model model;
+static uint64_t latency_ns;
+static uint64_t jitter_ns;
+static bool count_accesses;
+
+typedef struct {
+  atomic_ullong lo_calls;
+  atomic_ullong lo_accesses;
+  atomic_ullong lo_io_ns;
+} latency_op_counters_t;
+
+/*
+ * Call statistics, split in shards that each start a cache line. Each thread
+ * counts in a shard of its own (threads are given shards in turn, so they
+ * only share one when there are more than LATENCY_SHARDS of them), and the
+ * shards are summed in latency_stats.
+ */
+typedef struct {
+  _Alignas(64) latency_op_counters_t ls_ops[TFS_OP_COUNT];
+} latency_shard_t;
+
+static latency_shard_t shards[LATENCY_SHARDS];
+static atomic_uint next_shard;
+
+// the call the thread is in, its shard, and the state of its random number
+// generator
+static _Thread_local tfs_op current_op = TFS_OP_INIT;
+static _Thread_local latency_op_counters_t *thread_counters;
+static _Thread_local uint64_t random_state;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * Obtain a pseudo-random number (xorshift64), seeded differently for each
+ * thread on first use.
+ */
+static uint64_t random_next(void) {
+  if (random_state == 0) {
+    random_state = now_ns() ^ (uint64_t)(uintptr_t)&random_state;
+    random_state |= 1;
+  }
+  random_state ^= random_state << 13;
+  random_state ^= random_state >> 7;
+  random_state ^= random_state << 17;
+  return random_state;
+}
+
+/**
+ * Set the latency model, and reset every call's statistics.
+ */
+void latency_init(tfs_params const *params) {
+  model = params->latency_model;
+  latency_ns = params->latency_ns;
+  jitter_ns = params->latency_jitter_ns < params->latency_ns
+                  ? params->latency_jitter_ns
+                  : params->latency_ns;
+  count_accesses = model != TFS_LATENCY_NONE || params->count_accesses;
+  for (size_t s = 0; s < LATENCY_SHARDS; s++) {
+    for (size_t i = 0; i < TFS_OP_COUNT; i++) {
+      latency_op_counters_t *counters = &shards[s].ls_ops[i];
+      atomic_store(&counters->lo_calls, 0);
+      atomic_store(&counters->lo_accesses, 0);
+      atomic_store(&counters->lo_io_ns, 0);
+    }
+  }
+}
+
+/**
+ * Obtain the calling thread's statistics of a call.
+ */
+static latency_op_counters_t *op_counters(tfs_op op) {
+  if (thread_counters == NULL) {
+    unsigned shard = atomic_fetch_add_explicit(&next_shard, 1,
+                                               memory_order_relaxed);
+    thread_counters = shards[shard % LATENCY_SHARDS].ls_ops;
+  }
+  return &thread_counters[op];
+}
+
+/**
+ * Start a TécnicoFS call in the calling thread: the accesses it makes until
+ * it starts another count towards op.
+ */
+void latency_op(tfs_op op) {
+  current_op = op;
+  atomic_fetch_add_explicit(&op_counters(op)->lo_calls, 1,
+                            memory_order_relaxed);
+}
+
+/**
+ * Wait for an access to the persistent state to complete.
+ *
+ * Sleeps until the access would complete, unless it would complete sooner
+ * than a sleep can be timed (LATENCY_SLEEP_MIN_NS), in which case the thread
+ * yields the processor until then instead.
+ */
+void latency_access(void) {
+  if (!count_accesses) {
+    return; // no latency model, and no one to count accesses for
+  }
+  latency_op_counters_t *op = op_counters(current_op);
+  atomic_fetch_add_explicit(&op->lo_accesses, 1, memory_order_relaxed);
+
+  uint64_t delay;
+  switch (model) {
+  case TFS_LATENCY_NONE:
+    return;
+  case TFS_LATENCY_FIXED:
+    delay = latency_ns;
+    break;
+  case TFS_LATENCY_UNIFORM:
+    delay = latency_ns - jitter_ns + random_next() % (2 * jitter_ns + 1);
+    break;
+  default:
+    return;
+  }
+
+  uint64_t start = now_ns();
+  uint64_t deadline = start + delay;
+  if (delay >= LATENCY_SLEEP_MIN_NS) {
+    struct timespec ts = {
+        .tv_sec = (time_t)(deadline / 1000000000ULL),
+        .tv_nsec = (long)(deadline % 1000000000ULL),
+    };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+           EINTR) {
+    }
+  } else {
+    while (now_ns() < deadline) {
+      sched_yield();
+    }
+  }
+  atomic_fetch_add_explicit(&op->lo_io_ns, now_ns() - start,
+                            memory_order_relaxed);
+}
+
+/**
+ * Obtain every call's statistics.
+ */
+void latency_stats(tfs_op_stats_t stats[TFS_OP_COUNT]) {
+  for (size_t i = 0; i < TFS_OP_COUNT; i++) {
+    stats[i] = (tfs_op_stats_t){0, 0, 0};
+    for (size_t s = 0; s < LATENCY_SHARDS; s++) {
+      latency_op_counters_t *counters = &shards[s].ls_ops[i];
+      stats[i].os_calls += atomic_load(&counters->lo_calls);
+      stats[i].os_accesses += atomic_load(&counters->lo_accesses);
+      stats[i].os_io_ns += atomic_load(&counters->lo_io_ns);
+    }
+  }
+}
@@ -0,0 +1,23 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include "operations.h"
+
+/**
+ * Storage latency model
+ *
+ * Every access to the persistent state (an inode, a data block, a bitmap)
+ * goes through latency_access, which waits as long as the model set in
+ * tfs_params says the access would take on a storage device. The time spent
+ * is added to the statistics of the TécnicoFS call the calling thread is in
+ * (see latency_op), so each call can report how much of it was emulated I/O.
+ * Without a latency model, accesses are only counted if
+ * tfs_params.count_accesses is set.
+ */
+
+void latency_init(tfs_params const *params);
+void latency_op(tfs_op op);
+void latency_access(void);
+void latency_stats(tfs_op_stats_t stats[TFS_OP_COUNT]);
+
+#endif // LATENCY_H
@@ -1,8 +1,10 @@
 #include "operations.h"
 #include "config.h"
+#include "latency.h"
 #include "state.h"
-#include <errno.h>
+#include "wal.h"
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,18 +12,206 @@
 
 #include "betterassert.h"
 
-pthread_mutex_t g_library_mutex = PTHREAD_MUTEX_INITIALIZER;
-
 tfs_params tfs_default_params() {
   tfs_params params = {
       .max_inode_count = 64,
       .max_block_count = 1024,
       .max_open_files_count = 16,
       .block_size = 1024,
+      .wal_path = NULL,
+      .image_path = NULL,
+      .sync_policy = TFS_SYNC_INTERVAL,
+      .sync_interval_ms = 100,
+      .wal_checkpoint_size = 64 * 1024 * 1024,
+      .latency_model = TFS_LATENCY_NONE,
+      .latency_ns = 0,
+      .latency_jitter_ns = 0,
+      .count_accesses = false,
   };
   return params;
 }
 
+static ssize_t inode_write(inode_t *inode, void const *buffer, size_t to_write,
+                           size_t offset);
+
+/*
+ * Inumbers of the files being rebuilt from the write-ahead log, indexed by
+ * the inumbers they were logged with (-1 for none).
+ */
+static int *replay_inumbers;
+static size_t replay_inumbers_size;
+
+// whether the file system is written back to an image on tfs_destroy
+static bool image_enabled;
+
+/*
+ * Checkpoints
+ *
+ * Changes to the persistent state are made (and logged) with checkpoint_lock
+ * held for reading, taken before any other lock, so that a checkpoint holding
+ * it for writing sees no change in progress and every change it writes to the
+ * image logged. A thread waiting to checkpoint also holds checkpoint_gate,
+ * which changes wait for before taking checkpoint_lock, so that a steady
+ * stream of them can't starve it.
+ */
+static pthread_rwlock_t checkpoint_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t checkpoint_gate = PTHREAD_MUTEX_INITIALIZER;
+static atomic_bool checkpoint_waiting;
+// position of the log the image is up to date with, and how far past it the
+// log may grow before the next checkpoint (0 for no checkpoints)
+static _Atomic uint64_t checkpoint_lsn;
+static size_t checkpoint_size;
+
+/**
+ * Start a change to the persistent state.
+ */
+static void change_begin(void) {
+  if (atomic_load_explicit(&checkpoint_waiting, memory_order_relaxed)) {
+    pthread_mutex_lock(&checkpoint_gate);
+    pthread_mutex_unlock(&checkpoint_gate);
+  }
+  pthread_rwlock_rdlock(&checkpoint_lock);
+}
+
+/**
+ * Write the file system to the image and empty the log, with every change
+ * stopped meanwhile.
+ */
+static void checkpoint(void) {
+  // a single thread checkpoints; the others go on with their changes
+  if (atomic_exchange(&checkpoint_waiting, true)) {
+    return;
+  }
+  pthread_mutex_lock(&checkpoint_gate);
+  pthread_rwlock_wrlock(&checkpoint_lock);
+  uint64_t lsn = wal_tail();
+  if (lsn >= atomic_load(&checkpoint_lsn) + checkpoint_size &&
+      (state_checkpoint(lsn) == -1 || wal_reset() == -1)) {
+    // retried once as much has been logged again
+    perror("tfs: failed to checkpoint");
+  }
+  atomic_store(&checkpoint_lsn, lsn);
+  pthread_rwlock_unlock(&checkpoint_lock);
+  atomic_store(&checkpoint_waiting, false);
+  pthread_mutex_unlock(&checkpoint_gate);
+}
+
+/**
+ * End a change to the persistent state, logged up to lsn (0 if nothing was
+ * logged), checkpointing if the log has grown enough since the last time.
+ * Must be called without holding any other file system lock.
+ */
+static void change_end(uint64_t lsn) {
+  pthread_rwlock_unlock(&checkpoint_lock);
+  if (checkpoint_size > 0 &&
+      lsn >= atomic_load(&checkpoint_lsn) + checkpoint_size) {
+    checkpoint();
+  }
+  wal_commit(lsn);
+}
+
+/**
+ * Map a file restored from the image to itself, since the log refers to it by
+ * the inumber it already has.
+ */
+static void replay_map_restored(char const *sub_name, void *arg) {
+  int inum = find_in_dir((inode_t const *)arg, sub_name);
+  if (inum != -1) {
+    replay_inumbers[inum] = inum;
+  }
+}
+
+/**
+ * Map an inumber from the write-ahead log to the file being rebuilt.
+ *
+ * Returns the file's inode, or NULL if there is no such file.
+ */
+static inode_t *replay_inode(int32_t logged) {
+  if (logged < 0 || (size_t)logged >= replay_inumbers_size ||
+      replay_inumbers[logged] == -1) {
+    return NULL;
+  }
+  return inode_get(replay_inumbers[logged]);
+}
+
+/**
+ * Apply a record of the write-ahead log to the file system being rebuilt.
+ *
+ * Records are replayed by a single thread before the file system is in use,
+ * so no locks are taken.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int replay_record(wal_record_header const *header, void const *payload) {
+  inode_t *root_dir_inode = inode_get(ROOT_DIR_INUM);
+  char name[MAX_FILE_NAME];
+  if (header->wr_type == WAL_CREATE || header->wr_type == WAL_UNLINK) {
+    if (header->wr_length == 0 || header->wr_length >= MAX_FILE_NAME) {
+      return -1;
+    }
+    memcpy(name, payload, header->wr_length);
+    name[header->wr_length] = '\0';
+  }
+
+  switch ((wal_record_type)header->wr_type) {
+  case WAL_CREATE: {
+    if (header->wr_inumber < 0 ||
+        (size_t)header->wr_inumber >= replay_inumbers_size) {
+      return -1;
+    }
+    int inum = inode_create(T_FILE);
+    if (inum == -1) {
+      return -1;
+    }
+    if (add_dir_entry(root_dir_inode, name, inum) == -1) {
+      inode_delete(inum);
+      return -1;
+    }
+    replay_inumbers[header->wr_inumber] = inum;
+    return 0;
+  }
+  case WAL_TRUNCATE: {
+    inode_t *inode = replay_inode(header->wr_inumber);
+    if (inode == NULL) {
+      return -1;
+    }
+    inode_truncate(inode);
+    return 0;
+  }
+  case WAL_WRITE: {
+    inode_t *inode = replay_inode(header->wr_inumber);
+    if (inode == NULL || inode_write(inode, payload, header->wr_length,
+                                     header->wr_offset) !=
+                             (ssize_t)header->wr_length) {
+      return -1;
+    }
+    return 0;
+  }
+  case WAL_PUNCH: {
+    inode_t *inode = replay_inode(header->wr_inumber);
+    uint64_t length;
+    if (inode == NULL || header->wr_length != sizeof(length)) {
+      return -1;
+    }
+    memcpy(&length, payload, sizeof(length));
+    inode_punch(inode, header->wr_offset, length);
+    return 0;
+  }
+  case WAL_UNLINK: {
+    int inum = find_in_dir(root_dir_inode, name);
+    if (inum == -1 || replay_inode(header->wr_inumber) != inode_get(inum)) {
+      return -1;
+    }
+    inode_delete(inum);
+    clear_dir_entry(root_dir_inode, name);
+    replay_inumbers[header->wr_inumber] = -1;
+    return 0;
+  }
+  default:
+    return -1;
+  }
+}
+
 int tfs_init(tfs_params const *params_ptr) {
   tfs_params params;
   if (params_ptr != NULL) {
@@ -30,24 +220,73 @@ int tfs_init(tfs_params const *params_ptr) {
     params = tfs_default_params();
   }
 
-  if (state_init(params) != 0) {
+  latency_init(&params);
+  latency_op(TFS_OP_INIT);
+  uint64_t image_lsn = 0;
+  int restored = state_init(params, &image_lsn);
+  if (restored == -1) {
     return -1;
   }
 
-  // create root inode
-  int root = inode_create(T_DIRECTORY);
-  if (root != ROOT_DIR_INUM) {
-    return -1;
+  // create root inode (unless it was restored from the image)
+  if (!restored) {
+    int root = inode_create(T_DIRECTORY);
+    if (root != ROOT_DIR_INUM) {
+      return -1;
+    }
+  }
+  image_enabled = params.image_path != NULL;
+
+  // rebuild the files changed since the image was written from the
+  // write-ahead log, and log from then on
+  if (params.wal_path != NULL) {
+    replay_inumbers_size = params.max_inode_count;
+    replay_inumbers = malloc(replay_inumbers_size * sizeof(int));
+    if (replay_inumbers == NULL) {
+      state_destroy();
+      return -1;
+    }
+    memset(replay_inumbers, -1, replay_inumbers_size * sizeof(int));
+    inode_t *root_dir_inode = inode_get(ROOT_DIR_INUM);
+    dir_foreach(root_dir_inode, replay_map_restored, root_dir_inode);
+    int result = wal_init(&params, image_lsn, replay_record);
+    free(replay_inumbers);
+    replay_inumbers = NULL;
+    if (result == -1) {
+      state_destroy();
+      return -1;
+    }
+
+    // after a crash, writes the changes replayed to the image right away, so
+    // that the log doesn't keep growing across crashes
+    uint64_t lsn = wal_tail();
+    if (image_enabled && lsn > image_lsn &&
+        (state_checkpoint(lsn) == -1 || wal_reset() == -1)) {
+      wal_destroy();
+      state_destroy();
+      return -1;
+    }
+    atomic_store(&checkpoint_lsn, wal_tail());
+    checkpoint_size = image_enabled ? params.wal_checkpoint_size : 0;
   }
 
   return 0;
 }
 
 int tfs_destroy() {
+  int result = 0;
+  // the log is only emptied once everything in it is in the image
+  if (image_enabled &&
+      (state_checkpoint(wal_tail()) == -1 || wal_reset() == -1)) {
+    result = -1;
+  }
+  image_enabled = false;
+  checkpoint_size = 0;
+  wal_destroy();
   if (state_destroy() != 0) {
     return -1;
   }
-  return 0;
+  return result;
 }
 
 static bool valid_pathname(char const *name) {
@@ -77,36 +316,41 @@ static int tfs_lookup(char const *name, inode_t const *root_inode) {
 }
 
 int tfs_open(char const *name, tfs_file_mode_t mode) {
-  if (pthread_mutex_lock(&g_library_mutex) == -1) {
-    WARN("failed to lock mutex: %s", strerror(errno));
-    return -1;
-  }
+  latency_op(TFS_OP_OPEN);
   // Checks if the path name is valid
   if (!valid_pathname(name)) {
-    if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-      WARN("failed to unlock mutex: %s", strerror(errno));
-      return -1;
-    }
     return -1;
   }
 
+  // Creating a file changes the directory; everything else only reads it
+  change_begin();
+  if (mode & TFS_O_CREAT) {
+    inode_wrlock(ROOT_DIR_INUM);
+  } else {
+    inode_rdlock(ROOT_DIR_INUM);
+  }
+
   inode_t *root_dir_inode = inode_get(ROOT_DIR_INUM);
   ALWAYS_ASSERT(root_dir_inode != NULL, "tfs_open: root dir inode must exist");
   int inum = tfs_lookup(name, root_dir_inode);
   size_t offset;
+  uint64_t lsn = 0;
 
   if (inum >= 0) {
     // The file already exists
+    if (mode & TFS_O_TRUNC) {
+      inode_wrlock(inum);
+    } else {
+      inode_rdlock(inum);
+    }
     inode_t *inode = inode_get(inum);
     ALWAYS_ASSERT(inode != NULL,
                   "tfs_open: directory files must have an inode");
 
     // Truncate (if requested)
     if (mode & TFS_O_TRUNC) {
-      if (inode->i_size > 0) {
-        data_block_free(inode->i_data_block);
-        inode->i_size = 0;
-      }
+      inode_truncate(inode);
+      lsn = wal_append(WAL_TRUNCATE, inum, 0, NULL, 0);
     }
     // Determine initial offset
     if (mode & TFS_O_APPEND) {
@@ -114,44 +358,39 @@ int tfs_open(char const *name, tfs_file_mode_t mode) {
     } else {
       offset = 0;
     }
+    inode_unlock(inum);
   } else if (mode & TFS_O_CREAT) {
     // The file does not exist; the mode specified that it should be created
     // Create inode
     inum = inode_create(T_FILE);
     if (inum == -1) {
-      if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-        WARN("failed to unlock mutex: %s", strerror(errno));
-        return -1;
-      }
+      inode_unlock(ROOT_DIR_INUM);
+      change_end(0);
       return -1; // no space in inode table
     }
 
     // Add entry in the root directory
     if (add_dir_entry(root_dir_inode, name + 1, inum) == -1) {
       inode_delete(inum);
-      if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-        WARN("failed to unlock mutex: %s", strerror(errno));
-        return -1;
-      }
+      inode_unlock(ROOT_DIR_INUM);
+      change_end(0);
       return -1; // no space in directory
     }
+    lsn = wal_append(WAL_CREATE, inum, 0, name + 1, strlen(name + 1));
 
     offset = 0;
   } else {
-    if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-      WARN("failed to unlock mutex: %s", strerror(errno));
-      return -1;
-    }
+    inode_unlock(ROOT_DIR_INUM);
+    change_end(0);
     return -1;
   }
 
   // Finally, add entry to the open file table and return the corresponding
-  // handle
+  // handle. The directory lock is only released afterwards, so that the file
+  // can't be unlinked in between.
   int ret = add_to_open_file_table(inum, offset);
-  if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-    WARN("failed to unlock mutex: %s", strerror(errno));
-    return -1;
-  }
+  inode_unlock(ROOT_DIR_INUM);
+  change_end(lsn);
   return ret;
 
   // Note: for simplification, if file was created with TFS_O_CREAT and there
@@ -160,167 +399,372 @@ int tfs_open(char const *name, tfs_file_mode_t mode) {
 }
 
 int tfs_close(int fhandle) {
-  if (pthread_mutex_lock(&g_library_mutex) == -1) {
-    WARN("failed to lock mutex: %s", strerror(errno));
-    return -1;
+  latency_op(TFS_OP_CLOSE);
+  if (open_file_lock(fhandle) == -1) {
+    return -1; // invalid fd
   }
   open_file_entry_t *file = get_open_file_entry(fhandle);
   if (file == NULL) {
-    if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-      WARN("failed to unlock mutex: %s", strerror(errno));
-      return -1;
-    }
+    open_file_unlock(fhandle);
     return -1; // invalid fd
   }
 
   remove_from_open_file_table(fhandle);
+  open_file_unlock(fhandle);
 
-  if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-    WARN("failed to unlock mutex: %s", strerror(errno));
-    return -1;
-  }
   return 0;
 }
 
-ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write) {
-  if (pthread_mutex_lock(&g_library_mutex) == -1) {
-    WARN("failed to lock mutex: %s", strerror(errno));
-    return -1;
-  }
-  open_file_entry_t *file = get_open_file_entry(fhandle);
-  if (file == NULL) {
-    if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-      WARN("failed to unlock mutex: %s", strerror(errno));
-      return -1;
-    }
-    return -1;
+/**
+ * Write to a file at a given offset.
+ *
+ * The caller must hold the inode's write lock.
+ *
+ * Input:
+ *   - inode: the file's inode
+ *   - buffer: buffer containing the contents to write
+ *   - to_write: length of the buffer contents (in bytes)
+ *   - offset: offset in the file where the contents are written
+ *
+ * Returns the number of bytes written, or -1 if no block could be allocated.
+ */
+static ssize_t inode_write(inode_t *inode, void const *buffer, size_t to_write,
+                           size_t offset) {
+  // Determine how many bytes to write
+  size_t max_size = inode_max_size();
+  if (offset >= max_size) {
+    to_write = 0;
+  } else if (to_write > max_size - offset) {
+    to_write = max_size - offset;
   }
 
-  //  From the open file table entry, we get the inode
-  inode_t *inode = inode_get(file->of_inumber);
-  ALWAYS_ASSERT(inode != NULL, "tfs_write: inode of open file deleted");
-
-  // Determine how many bytes to write
+  // Copies straight from the caller's buffer into each block, allocating the
+  // blocks as they are reached
   size_t block_size = state_block_size();
-  if (to_write + file->of_offset > block_size) {
-    to_write = block_size - file->of_offset;
-  }
-
-  if (to_write > 0) {
-    if (inode->i_size == 0) {
-      // If empty file, allocate new block
-      int bnum = data_block_alloc();
-      if (bnum == -1) {
-        if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-          WARN("failed to unlock mutex: %s", strerror(errno));
-          return -1;
-        }
-        return -1; // no space
-      }
-
-      inode->i_data_block = bnum;
+  size_t written = 0;
+  while (written < to_write) {
+    size_t block_offset = offset % block_size;
+    int bnum = inode_block_get(inode, offset / block_size, true);
+    if (bnum == -1) {
+      break; // no space
     }
 
-    void *block = data_block_get(inode->i_data_block);
+    void *block = data_block_get(bnum);
     ALWAYS_ASSERT(block != NULL, "tfs_write: data block deleted mid-write");
 
+    size_t chunk = block_size - block_offset;
+    if (chunk > to_write - written) {
+      chunk = to_write - written;
+    }
+
     // Perform the actual write
-    memcpy(block + file->of_offset, buffer, to_write);
+    memcpy(block + block_offset, (char const *)buffer + written, chunk);
+    written += chunk;
+    offset += chunk;
+    if (offset > inode->i_size) {
+      inode->i_size = offset;
+    }
+  }
 
-    // The offset associated with the file handle is incremented accordingly
-    file->of_offset += to_write;
-    if (file->of_offset > inode->i_size) {
-      inode->i_size = file->of_offset;
+  if (written == 0 && to_write > 0) {
+    return -1; // no space
+  }
+  return (ssize_t)written;
+}
+
+/**
+ * Read from a file at a given offset.
+ *
+ * The caller must hold the inode's read (or write) lock.
+ *
+ * Input:
+ *   - inode: the file's inode
+ *   - buffer: destination buffer
+ *   - len: length of the buffer
+ *   - offset: offset in the file where the read starts
+ *
+ * Returns the number of bytes read.
+ */
+static size_t inode_read(inode_t *inode, void *buffer, size_t len,
+                         size_t offset) {
+  // Determine how many bytes to read
+  size_t to_read = 0;
+  if (offset < inode->i_size) {
+    to_read = inode->i_size - offset;
+  }
+  if (to_read > len) {
+    to_read = len;
+  }
+
+  // Copies each block straight into the caller's buffer
+  size_t block_size = state_block_size();
+  size_t bytes_read = 0;
+  while (bytes_read < to_read) {
+    size_t block_offset = offset % block_size;
+    int bnum = inode_block_get(inode, offset / block_size, false);
+    size_t chunk = block_size - block_offset;
+    if (chunk > to_read - bytes_read) {
+      chunk = to_read - bytes_read;
+    }
+
+    // blocks freed by tfs_punch read as zeros
+    if (bnum == -1) {
+      memset((char *)buffer + bytes_read, 0, chunk);
+      bytes_read += chunk;
+      offset += chunk;
+      continue;
     }
+    void *block = data_block_get(bnum);
+    ALWAYS_ASSERT(block != NULL, "tfs_read: data block deleted mid-read");
+
+    // Perform the actual read
+    memcpy((char *)buffer + bytes_read, block + block_offset, chunk);
+    bytes_read += chunk;
+    offset += chunk;
   }
 
-  if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-    WARN("failed to unlock mutex: %s", strerror(errno));
+  return to_read;
+}
+
+ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write) {
+  latency_op(TFS_OP_WRITE);
+  change_begin();
+  if (open_file_lock(fhandle) == -1) {
+    change_end(0);
     return -1;
   }
-  return (ssize_t)to_write;
+  open_file_entry_t *file = get_open_file_entry(fhandle);
+  if (file == NULL) {
+    open_file_unlock(fhandle);
+    change_end(0);
+    return -1;
+  }
+
+  //  From the open file table entry, we get the inode
+  int inum = file->of_inumber;
+  inode_wrlock(inum);
+  inode_t *inode = inode_get(inum);
+  ALWAYS_ASSERT(inode != NULL, "tfs_write: inode of open file deleted");
+
+  ssize_t written = inode_write(inode, buffer, to_write, file->of_offset);
+  uint64_t lsn = 0;
+  if (written > 0) {
+    // The write is logged while the inode is still locked, so that writes to
+    // the same file are logged in the order they were made
+    lsn = wal_append(WAL_WRITE, inum, file->of_offset, buffer,
+                     (size_t)written);
+    // The offset associated with the file handle is incremented accordingly
+    file->of_offset += (size_t)written;
+  }
+
+  inode_unlock(inum);
+  open_file_unlock(fhandle);
+  change_end(lsn);
+  return written;
 }
 
 ssize_t tfs_read(int fhandle, void *buffer, size_t len) {
-  if (pthread_mutex_lock(&g_library_mutex) == -1) {
-    WARN("failed to lock mutex: %s", strerror(errno));
+  latency_op(TFS_OP_READ);
+  if (open_file_lock(fhandle) == -1) {
     return -1;
   }
   open_file_entry_t *file = get_open_file_entry(fhandle);
   if (file == NULL) {
-    if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-      WARN("failed to unlock mutex: %s", strerror(errno));
-      return -1;
-    }
+    open_file_unlock(fhandle);
     return -1;
   }
 
   // From the open file table entry, we get the inode
-  inode_t const *inode = inode_get(file->of_inumber);
+  int inum = file->of_inumber;
+  inode_rdlock(inum);
+  inode_t *inode = inode_get(inum);
   ALWAYS_ASSERT(inode != NULL, "tfs_read: inode of open file deleted");
 
-  // Determine how many bytes to read
-  size_t to_read = inode->i_size - file->of_offset;
-  if (to_read > len) {
-    to_read = len;
-  }
+  size_t bytes_read = inode_read(inode, buffer, len, file->of_offset);
+  // The offset associated with the file handle is incremented accordingly
+  file->of_offset += bytes_read;
 
-  if (to_read > 0) {
-    void *block = data_block_get(inode->i_data_block);
-    ALWAYS_ASSERT(block != NULL, "tfs_read: data block deleted mid-read");
+  inode_unlock(inum);
+  open_file_unlock(fhandle);
+  return (ssize_t)bytes_read;
+}
 
-    // Perform the actual read
-    memcpy(buffer, block + file->of_offset, to_read);
-    // The offset associated with the file handle is incremented accordingly
-    file->of_offset += to_read;
+/**
+ * Lock the inode of an open file, without keeping the open file entry locked
+ * (positional operations don't use the file's offset).
+ *
+ * Returns the inumber of the locked inode, or -1 if fhandle is invalid.
+ */
+static int open_file_inode_lock(int fhandle, bool exclusive) {
+  if (open_file_lock(fhandle) == -1) {
+    return -1;
+  }
+  open_file_entry_t *file = get_open_file_entry(fhandle);
+  if (file == NULL) {
+    open_file_unlock(fhandle);
+    return -1;
   }
 
-  if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-    WARN("failed to unlock mutex: %s", strerror(errno));
+  int inum = file->of_inumber;
+  if (exclusive) {
+    inode_wrlock(inum);
+  } else {
+    inode_rdlock(inum);
+  }
+  open_file_unlock(fhandle);
+  return inum;
+}
+
+ssize_t tfs_pwrite(int fhandle, void const *buffer, size_t len,
+                   size_t offset) {
+  latency_op(TFS_OP_PWRITE);
+  change_begin();
+  int inum = open_file_inode_lock(fhandle, true);
+  if (inum == -1) {
+    change_end(0);
     return -1;
   }
-  return (ssize_t)to_read;
+
+  inode_t *inode = inode_get(inum);
+  ALWAYS_ASSERT(inode != NULL, "tfs_pwrite: inode of open file deleted");
+  ssize_t written = inode_write(inode, buffer, len, offset);
+  uint64_t lsn = 0;
+  if (written > 0) {
+    lsn = wal_append(WAL_WRITE, inum, offset, buffer, (size_t)written);
+  }
+
+  inode_unlock(inum);
+  change_end(lsn);
+  return written;
 }
 
-int tfs_unlink(char const *target) {
-  if (pthread_mutex_lock(&g_library_mutex) == -1) {
-    WARN("failed to lock mutex: %s", strerror(errno));
+ssize_t tfs_pread(int fhandle, void *buffer, size_t len, size_t offset) {
+  latency_op(TFS_OP_PREAD);
+  int inum = open_file_inode_lock(fhandle, false);
+  if (inum == -1) {
     return -1;
   }
+
+  inode_t *inode = inode_get(inum);
+  ALWAYS_ASSERT(inode != NULL, "tfs_pread: inode of open file deleted");
+  size_t bytes_read = inode_read(inode, buffer, len, offset);
+
+  inode_unlock(inum);
+  return (ssize_t)bytes_read;
+}
+
+int tfs_unlink(char const *target) {
+  latency_op(TFS_OP_UNLINK);
   // Checks if the path name is valid
   if (!valid_pathname(target)) {
-    if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-      WARN("failed to unlock mutex: %s", strerror(errno));
-      return -1;
-    }
     return -1;
   }
 
+  change_begin();
+  inode_wrlock(ROOT_DIR_INUM);
   inode_t *root_dir_inode = inode_get(ROOT_DIR_INUM);
   ALWAYS_ASSERT(root_dir_inode != NULL, "tfs_open: root dir inode must exist");
   int inum = tfs_lookup(target, root_dir_inode);
 
   if (inum == -1) {
-    if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-      WARN("failed to unlock mutex: %s", strerror(errno));
-      return -1;
-    }
+    inode_unlock(ROOT_DIR_INUM);
+    change_end(0);
     return -1;
   }
 
+  // waits for any read/write in progress on the file to finish
+  inode_wrlock(inum);
   inode_delete(inum);
+  inode_unlock(inum);
   if (clear_dir_entry(root_dir_inode, target + 1) == -1) {
-    if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-      WARN("failed to unlock mutex: %s", strerror(errno));
-      return -1;
-    }
+    inode_unlock(ROOT_DIR_INUM);
+    change_end(0);
     return -1;
   }
+  uint64_t lsn =
+      wal_append(WAL_UNLINK, inum, 0, target + 1, strlen(target + 1));
 
-  if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-    WARN("failed to unlock mutex: %s", strerror(errno));
+  inode_unlock(ROOT_DIR_INUM);
+  change_end(lsn);
+  return 0;
+}
+
+int tfs_punch(int fhandle, size_t offset, size_t length) {
+  latency_op(TFS_OP_PUNCH);
+  change_begin();
+  int inum = open_file_inode_lock(fhandle, true);
+  if (inum == -1) {
+    change_end(0);
     return -1;
   }
 
+  inode_t *inode = inode_get(inum);
+  ALWAYS_ASSERT(inode != NULL, "tfs_punch: inode of open file deleted");
+  inode_punch(inode, offset, length);
+  uint64_t logged_length = length;
+  uint64_t lsn = wal_append(WAL_PUNCH, inum, offset, &logged_length,
+                            sizeof(logged_length));
+
+  inode_unlock(inum);
+  change_end(lsn);
   return 0;
-}
\ No newline at end of file
+}
+
+size_t tfs_max_file_size(void) { return inode_max_size(); }
+
+int tfs_fsync(int fhandle) {
+  latency_op(TFS_OP_FSYNC);
+  if (open_file_lock(fhandle) == -1) {
+    return -1;
+  }
+  if (get_open_file_entry(fhandle) == NULL) {
+    open_file_unlock(fhandle);
+    return -1;
+  }
+  open_file_unlock(fhandle);
+
+  // the log is shared by all files, so this syncs the changes to every file,
+  // together with those of any other thread syncing at the same time
+  return wal_wait(wal_tail());
+}
+
+/**
+ * Arguments of tfs_list's directory visitor.
+ */
+typedef struct {
+  void (*la_visit)(char const *name, void *arg);
+  void *la_arg;
+} list_args_t;
+
+static void list_visit(char const *sub_name, void *arg) {
+  list_args_t *args = (list_args_t *)arg;
+  char name[MAX_FILE_NAME + 1];
+  name[0] = '/';
+  strcpy(name + 1, sub_name);
+  args->la_visit(name, args->la_arg);
+}
+
+int tfs_list(void (*visit)(char const *name, void *arg), void *arg) {
+  latency_op(TFS_OP_LIST);
+  list_args_t args = {visit, arg};
+  inode_rdlock(ROOT_DIR_INUM);
+  inode_t *root_dir_inode = inode_get(ROOT_DIR_INUM);
+  ALWAYS_ASSERT(root_dir_inode != NULL, "tfs_list: root dir inode must exist");
+  int result = dir_foreach(root_dir_inode, list_visit, &args);
+  inode_unlock(ROOT_DIR_INUM);
+  return result;
+}
+
+void tfs_op_stats(tfs_op_stats_t stats[TFS_OP_COUNT]) { latency_stats(stats); }
+
+char const *tfs_op_name(tfs_op op) {
+  static char const *const names[TFS_OP_COUNT] = {
+      [TFS_OP_INIT] = "init",     [TFS_OP_OPEN] = "open",
+      [TFS_OP_CLOSE] = "close",   [TFS_OP_READ] = "read",
+      [TFS_OP_WRITE] = "write",   [TFS_OP_PREAD] = "pread",
+      [TFS_OP_PWRITE] = "pwrite", [TFS_OP_FSYNC] = "fsync",
+      [TFS_OP_LIST] = "list",     [TFS_OP_UNLINK] = "unlink",
+      [TFS_OP_PUNCH] = "punch",
+  };
+  return op < TFS_OP_COUNT ? names[op] : "unknown";
+}
@@ -2,10 +2,47 @@
 #define OPERATIONS_H
 
 #include "config.h"
+#include <stdbool.h>
 #include <sys/types.h>
 
+/**
+ * When changes logged to the write-ahead log are synced to disk.
+ */
+typedef enum {
+  TFS_SYNC_INTERVAL = 0, // every sync_interval_ms milliseconds
+  TFS_SYNC_ALWAYS = 1,   // before every change returns
+  TFS_SYNC_NEVER = 2,    // only when asked to (with tfs_fsync)
+} tfs_sync_policy;
+
+/**
+ * How long each access to the persistent state takes, to emulate it being
+ * kept in secondary storage.
+ */
+typedef enum {
+  TFS_LATENCY_NONE = 0,    // accesses take no time
+  TFS_LATENCY_FIXED = 1,   // latency_ns per access
+  TFS_LATENCY_UNIFORM = 2, // uniformly distributed within latency_ns plus or
+                           // minus latency_jitter_ns
+} tfs_latency_model;
+
 /**
  * TécnicoFS parameters.
+ *
+ * If wal_path is set, every change is logged to the write-ahead log at that
+ * path (see wal.h), and the file system is rebuilt from it on tfs_init.
+ *
+ * If image_path is set, the file system is restored on tfs_init from the
+ * image at that path (see state_checkpoint), and written back to it on
+ * tfs_destroy. With both set, only the changes made since the image was
+ * written are kept in the log: once wal_checkpoint_size bytes have been logged
+ * since, the image is written again and the log emptied (0 to only do so on
+ * tfs_destroy), which bounds both the size of the log and how long replaying
+ * it takes.
+ *
+ * Emulated accesses to the persistent state wait for the latency_model's
+ * latency by sleeping (or by yielding the processor, for latencies too short
+ * to sleep for), never by spinning. They are only counted in tfs_op_stats
+ * with a latency model, or if count_accesses is set.
  */
 typedef struct {
   size_t max_inode_count;
@@ -13,6 +50,17 @@ typedef struct {
   size_t max_open_files_count;
 
   size_t block_size;
+
+  char const *wal_path;
+  char const *image_path;
+  tfs_sync_policy sync_policy;
+  unsigned sync_interval_ms;
+  size_t wal_checkpoint_size;
+
+  tfs_latency_model latency_model;
+  unsigned latency_ns;
+  unsigned latency_jitter_ns;
+  bool count_accesses;
 } tfs_params;
 
 /**
@@ -113,6 +161,82 @@ ssize_t tfs_write(int fhandle, void const *buffer, size_t len);
  */
 ssize_t tfs_read(int fhandle, void *buffer, size_t len);
 
+/**
+ * Write to an open file at a given offset, without using or changing the
+ * file's current offset.
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - buffer: buffer containing the contents to write
+ *   - len: length of the buffer contents (in bytes)
+ *   - offset: offset in the file where the contents are written
+ *
+ * Returns the number of bytes that were written (can be lower than 'len' if the
+ * maximum file size is exceeded), or -1 in case of error.
+ */
+ssize_t tfs_pwrite(int fhandle, void const *buffer, size_t len, size_t offset);
+
+/**
+ * Read from an open file at a given offset, without using or changing the
+ * file's current offset.
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - buffer: destination buffer
+ *   - len: length of the buffer
+ *   - offset: offset in the file where the read starts
+ *
+ * Returns the number of bytes that were copied from the file to the buffer (can
+ * be lower than 'len' if the file size was reached), or -1 in case of error.
+ */
+ssize_t tfs_pread(int fhandle, void *buffer, size_t len, size_t offset);
+
+/**
+ * Free the data blocks of an open file that only hold contents within a
+ * range, which then read as zeros (blocks partially in the range are kept).
+ * The file's size is unchanged, so the rest of its contents keep their
+ * offsets.
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - offset: offset in the file where the range starts
+ *   - length: length of the range (in bytes)
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_punch(int fhandle, size_t offset, size_t length);
+
+/**
+ * Maximum size of a file (given the block size the file system was
+ * initialized with): writes past it fail.
+ *
+ * Returns the maximum size, in bytes.
+ */
+size_t tfs_max_file_size(void);
+
+/**
+ * Make every change made so far durable (if the file system is logged),
+ * whatever the sync policy.
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_fsync(int fhandle);
+
+/**
+ * Visit every file in the root directory, in no particular order.
+ *
+ * Input:
+ *   - visit: called with the absolute path name of each file; must not call
+ *     any other TécnicoFS function
+ *   - arg: passed on to visit
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_list(void (*visit)(char const *name, void *arg), void *arg);
+
 /**
  * Delete a link, or a file if the number of hard links reaches 0, that
  * exists in TécnicoFS.
@@ -137,4 +261,42 @@ int tfs_unlink(char const *target);
  */
 int tfs_copy_from_external_fs(char const *source_path, char const *dest_path);
 
+/**
+ * TécnicoFS calls, for their statistics (see tfs_op_stats). TFS_OP_INIT
+ * covers rebuilding the file system in tfs_init.
+ */
+typedef enum {
+  TFS_OP_INIT,
+  TFS_OP_OPEN,
+  TFS_OP_CLOSE,
+  TFS_OP_READ,
+  TFS_OP_WRITE,
+  TFS_OP_PREAD,
+  TFS_OP_PWRITE,
+  TFS_OP_FSYNC,
+  TFS_OP_LIST,
+  TFS_OP_UNLINK,
+  TFS_OP_PUNCH,
+  TFS_OP_COUNT,
+} tfs_op;
+
+typedef struct {
+  unsigned long long os_calls;
+  unsigned long long os_accesses; // emulated accesses to persistent state
+  unsigned long long os_io_ns;    // time spent in them
+} tfs_op_stats_t;
+
+/**
+ * Obtain the statistics of every TécnicoFS call since tfs_init.
+ *
+ * Input:
+ *   - stats: where to store them, indexed by tfs_op
+ */
+void tfs_op_stats(tfs_op_stats_t stats[TFS_OP_COUNT]);
+
+/**
+ * Name of a TécnicoFS call (e.g., "open" for TFS_OP_OPEN).
+ */
+char const *tfs_op_name(tfs_op op);
+
 #endif // OPERATIONS_H
\ No newline at end of file
@@ -1,32 +1,114 @@
+// MAP_ANONYMOUS is only exposed with _GNU_SOURCE
+#define _GNU_SOURCE
 #include "state.h"
+#include "allocator.h"
 #include "betterassert.h"
+#include "hashmap.h"
+#include "latency.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 /*
  * Persistent FS state
- * (in reality, it should be maintained in secondary memory;
- * for simplicity, this project maintains it in primary memory).
+ *
+ * The inode table, the allocation bitmaps and the data blocks live in a single
+ * memory region, laid out as in the image file (see state_checkpoint): a
+ * superblock followed by each of them, at page-aligned offsets. The region is
+ * either zero-filled (an empty file system, since a clear bit is a free entry)
+ * or a private mapping of the image, whose pages are only read from the file
+ * (through the page cache) when first accessed, and copied when first written
+ * to, so the image itself is only ever replaced as a whole.
  */
 static tfs_params fs_params;
 
+#define IMAGE_MAGIC (0x4547414D49534654ULL) // "TFSIMAGE"
+#define IMAGE_VERSION (2)
+
+typedef struct {
+  uint64_t sb_magic;
+  uint32_t sb_version;
+  uint32_t sb_clean; // set once the rest of the image is on disk
+  uint64_t sb_block_size;
+  uint64_t sb_inode_count;
+  uint64_t sb_block_count;
+  uint64_t sb_wal_lsn; // position of the write-ahead log the image is up to
+                       // date with
+} superblock_t;
+
+static char *image; // the whole region
+static size_t image_size;
+static size_t inode_table_offset;
+static size_t inode_bitmap_offset;
+static size_t block_bitmap_offset;
+static size_t fs_data_offset;
+
 // Inode table
 static inode_t *inode_table;
-static allocation_state_t *freeinode_ts;
+static allocator_t inode_allocator;
 
 // Data blocks
 static char *fs_data; // # blocks * block size
-static allocation_state_t *free_blocks;
+static allocator_t block_allocator;
 
 /*
  * Volatile FS state
  */
 static open_file_entry_t *open_file_table;
-static allocation_state_t *free_open_file_entries;
+static allocation_state_t *free_open_file_entries; // under the entry's lock
+static uint64_t *open_file_bitmap;
+static allocator_t open_file_allocator;
+
+// Free entries each thread may keep to itself (see allocator.h). Inodes are
+// not cached, so that inode_delete can tell a freed inode from one in use.
+#define BLOCK_CACHE_CAPACITY (64)
+#define OPEN_FILE_CACHE_CAPACITY (8)
+
+/*
+ * Locks
+ *
+ * Each inode has its own reader-writer lock (the root directory's lock is the
+ * one protecting the directory entries), and each open file entry has its own
+ * mutex protecting its offset. Each allocation table has its own allocator (see
+ * allocator.h), so that allocating in one table never blocks the others.
+ *
+ * Lock ordering: directory inode -> open file entry -> file inode ->
+ * allocation tables. Reads and writes through a handle lock the open file
+ * entry first, to find its inode; tfs_open only takes an open file entry (a
+ * free one) with the directory locked, after releasing the file's inode.
+ * Changes take operations.c's checkpoint lock before all of them.
+ */
+static pthread_rwlock_t *inode_locks;
+static pthread_mutex_t *open_file_locks;
+
+/*
+ * Directory indexes
+ *
+ * Every directory has an in-memory index of its entries, mapping each name to
+ * its slot (entry number) in the directory's blocks, so that looking a name up
+ * doesn't scan the entries. Slots freed by clear_dir_entry are kept in a stack
+ * to be reused. An index is protected by its directory inode's lock.
+ */
+typedef struct {
+  hashmap di_names;      // name -> slot + 1
+  size_t di_slots;       // number of slots in the directory's blocks
+  size_t *di_free_slots; // stack of slots not in use
+  size_t di_free_size;
+  size_t di_free_capacity;
+} dir_index_t;
+
+static dir_index_t **dir_indexes; // indexed by inumber, NULL for files
+
+static dir_entry_t *dir_entry_get(inode_t *inode, size_t slot, bool alloc);
 
 // Convenience macros
 #define INODE_TABLE_SIZE (fs_params.max_inode_count)
@@ -34,6 +116,9 @@ static allocation_state_t *free_open_file_entries;
 #define MAX_OPEN_FILES (fs_params.max_open_files_count)
 #define BLOCK_SIZE (fs_params.block_size)
 #define MAX_DIR_ENTRIES (BLOCK_SIZE / sizeof(dir_entry_t))
+#define BLOCK_REFS (BLOCK_SIZE / sizeof(int))
+#define MAX_FILE_BLOCKS                                                        \
+  (INODE_DIRECT_BLOCKS + BLOCK_REFS + BLOCK_REFS * BLOCK_REFS)
 
 static inline bool valid_inumber(int inumber) {
   return inumber >= 0 && inumber < INODE_TABLE_SIZE;
@@ -49,102 +134,410 @@ static inline bool valid_file_handle(int file_handle) {
 
 size_t state_block_size(void) { return BLOCK_SIZE; }
 
+static void mutex_lock(pthread_mutex_t *mutex) {
+  ALWAYS_ASSERT(pthread_mutex_lock(mutex) == 0, "failed to lock mutex");
+}
+
+static void mutex_unlock(pthread_mutex_t *mutex) {
+  ALWAYS_ASSERT(pthread_mutex_unlock(mutex) == 0, "failed to unlock mutex");
+}
+
 /**
- * Do nothing, while preventing the compiler from performing any optimizations.
+ * Create the (empty) index of a directory.
  *
- * We need to defeat the optimizer for the insert_delay() function.
- * Under optimization, the empty loop would be completely optimized away.
- * This function tells the compiler that the assembly code being run (which is
- * none) might potentially change *all memory in the process*.
+ * Input:
+ *   - inumber: the directory's inode number
  *
- * This prevents the optimizer from optimizing this code away, because it does
- * not know what it does and it may have side effects.
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int dir_index_create(int inumber) {
+  dir_index_t *index = malloc(sizeof(dir_index_t));
+  if (index == NULL) {
+    return -1;
+  }
+  if (hashmap_init(&index->di_names) == -1) {
+    free(index);
+    return -1;
+  }
+  index->di_slots = 0;
+  index->di_free_slots = NULL;
+  index->di_free_size = 0;
+  index->di_free_capacity = 0;
+  dir_indexes[inumber] = index;
+  return 0;
+}
+
+/**
+ * Destroy the index of a directory, if it has one.
  *
- * Reference with more information: https://youtu.be/nXaxk27zwlk?t=2775
+ * Input:
+ *   - inumber: the directory's inode number
+ */
+static void dir_index_destroy(int inumber) {
+  dir_index_t *index = dir_indexes[inumber];
+  if (index == NULL) {
+    return;
+  }
+  hashmap_destroy(&index->di_names);
+  free(index->di_free_slots);
+  free(index);
+  dir_indexes[inumber] = NULL;
+}
+
+static size_t page_align(size_t size) {
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  return (size + page - 1) / page * page;
+}
+
+/**
+ * Compute the offsets of the persistent state's tables in the image, and its
+ * total size.
+ */
+static void image_layout(void) {
+  size_t offset = page_align(sizeof(superblock_t));
+  inode_table_offset = offset;
+  offset = page_align(offset + INODE_TABLE_SIZE * sizeof(inode_t));
+  inode_bitmap_offset = offset;
+  offset =
+      page_align(offset + ALLOCATOR_WORDS(INODE_TABLE_SIZE) * sizeof(uint64_t));
+  block_bitmap_offset = offset;
+  offset = page_align(offset + ALLOCATOR_WORDS(DATA_BLOCKS) * sizeof(uint64_t));
+  fs_data_offset = offset;
+  image_size = offset + DATA_BLOCKS * BLOCK_SIZE;
+}
+
+/**
+ * Map the image file privately.
  *
- * Exercise: try removing this function and look at the assembly generated to
- * compare.
+ * Input:
+ *   - wal_lsn: where to store the position of the write-ahead log the image
+ *     is up to date with
+ *
+ * Returns the mapping, MAP_FAILED if there is no image file (with errno set to
+ * ENOENT), or MAP_FAILED if the image can't be used (written by another
+ * version, or for other parameters).
  */
-static void touch_all_memory(void) { __asm volatile("" : : : "memory"); }
+static void *image_map(uint64_t *wal_lsn) {
+  int fd = open(fs_params.image_path, O_RDONLY);
+  if (fd == -1) {
+    return MAP_FAILED;
+  }
+
+  superblock_t superblock;
+  struct stat st;
+  if (pread(fd, &superblock, sizeof(superblock), 0) != sizeof(superblock) ||
+      fstat(fd, &st) == -1 || superblock.sb_magic != IMAGE_MAGIC ||
+      superblock.sb_version != IMAGE_VERSION || !superblock.sb_clean ||
+      superblock.sb_block_size != BLOCK_SIZE ||
+      superblock.sb_inode_count != INODE_TABLE_SIZE ||
+      superblock.sb_block_count != DATA_BLOCKS ||
+      (size_t)st.st_size < image_size) {
+    close(fd);
+    errno = EINVAL;
+    return MAP_FAILED;
+  }
+
+  void *region =
+      mmap(NULL, image_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  *wal_lsn = superblock.sb_wal_lsn;
+  return region;
+}
 
 /**
- * Artifically delay execution (busy loop).
+ * Rebuild the index of a directory restored from the image, from the entries
+ * in its blocks.
+ *
+ * Input:
+ *   - inumber: the directory's inode number
  *
- * Auxiliary function to insert a delay.
- * Used in accesses to persistent FS state as a way of emulating access
- * latencies as if such data structures were really stored in secondary memory.
+ * Returns 0 if successful, -1 otherwise.
  */
-static void insert_delay(void) {
-  for (int i = 0; i < DELAY; i++) {
-    touch_all_memory();
+static int dir_index_rebuild(int inumber) {
+  if (dir_index_create(inumber) == -1) {
+    return -1;
+  }
+  dir_index_t *index = dir_indexes[inumber];
+  inode_t *inode = &inode_table[inumber];
+
+  // the free slots stack must be able to hold every slot in use
+  size_t capacity = inode->i_size / BLOCK_SIZE * MAX_DIR_ENTRIES;
+  index->di_free_slots = malloc(capacity * sizeof(size_t));
+  if (index->di_free_slots == NULL) {
+    return -1;
+  }
+  index->di_free_capacity = capacity;
+
+  for (size_t slot = 0; slot < capacity; slot++) {
+    dir_entry_t *dir_entry = dir_entry_get(inode, slot, false);
+    if (dir_entry == NULL || dir_entry->d_inumber == -1) {
+      continue;
+    }
+    if (hashmap_put(&index->di_names, dir_entry->d_name,
+                    (void *)(uintptr_t)(slot + 1)) == -1) {
+      return -1;
+    }
+    index->di_slots = slot + 1;
   }
+  for (size_t slot = 0; slot < index->di_slots; slot++) {
+    dir_entry_t *dir_entry = dir_entry_get(inode, slot, false);
+    if (dir_entry == NULL || dir_entry->d_inumber == -1) {
+      index->di_free_slots[index->di_free_size++] = slot;
+    }
+  }
+  return 0;
 }
 
 /**
  * Initialize FS state.
  *
+ * If params.image_path is set and there is an image file there, the
+ * persistent state is restored from it, which only takes mapping it (and
+ * rebuilding the directories' indexes).
+ *
  * Input:
  *   - params: TécnicoFS parameters
+ *   - wal_lsn: where to store the position of the write-ahead log the
+ *     restored state is up to date with
  *
- * Returns 0 if successful, -1 otherwise.
+ * Returns 1 if the state was restored from the image, 0 if it starts empty,
+ * -1 otherwise.
  *
  * Possible errors:
  *   - TFS already initialized.
  *   - malloc failure when allocating TFS structures.
+ *   - The image can't be read, or was written by another version of TFS or
+ *     with other parameters.
  */
-int state_init(tfs_params params) {
-  fs_params = params;
-
+int state_init(tfs_params params, uint64_t *wal_lsn) {
   if (inode_table != NULL) {
     return -1; // already initialized
   }
 
-  inode_table = malloc(INODE_TABLE_SIZE * sizeof(inode_t));
-  freeinode_ts = malloc(INODE_TABLE_SIZE * sizeof(allocation_state_t));
-  fs_data = malloc(DATA_BLOCKS * BLOCK_SIZE);
-  free_blocks = malloc(DATA_BLOCKS * sizeof(allocation_state_t));
+  fs_params = params;
+  image_layout();
+  bool restored = false;
+  void *region = MAP_FAILED;
+  if (fs_params.image_path != NULL) {
+    region = image_map(wal_lsn);
+    if (region == MAP_FAILED && errno != ENOENT) {
+      return -1; // never overwrite an image that can't be used
+    }
+    restored = region != MAP_FAILED;
+  }
+  if (!restored) {
+    region = mmap(NULL, image_size, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED) {
+      return -1;
+    }
+  }
+  image = (char *)region;
+  inode_table = (inode_t *)(image + inode_table_offset);
+  fs_data = image + fs_data_offset;
+
   open_file_table = malloc(MAX_OPEN_FILES * sizeof(open_file_entry_t));
   free_open_file_entries = malloc(MAX_OPEN_FILES * sizeof(allocation_state_t));
+  open_file_bitmap = calloc(ALLOCATOR_WORDS(MAX_OPEN_FILES), sizeof(uint64_t));
+  inode_locks = malloc(INODE_TABLE_SIZE * sizeof(pthread_rwlock_t));
+  open_file_locks = malloc(MAX_OPEN_FILES * sizeof(pthread_mutex_t));
+  dir_indexes = calloc(INODE_TABLE_SIZE, sizeof(dir_index_t *));
 
-  if (!inode_table || !freeinode_ts || !fs_data || !free_blocks ||
-      !open_file_table || !free_open_file_entries) {
+  if (!open_file_table || !free_open_file_entries || !open_file_bitmap ||
+      !inode_locks || !open_file_locks || !dir_indexes) {
     return -1; // allocation failed
   }
 
-  for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
-    freeinode_ts[i] = FREE;
+  // the bitmaps of an empty file system are already zero-filled
+  if (allocator_init(&inode_allocator,
+                     (uint64_t *)(image + inode_bitmap_offset),
+                     INODE_TABLE_SIZE, 0) == -1 ||
+      allocator_init(&block_allocator,
+                     (uint64_t *)(image + block_bitmap_offset), DATA_BLOCKS,
+                     BLOCK_CACHE_CAPACITY) == -1 ||
+      allocator_init(&open_file_allocator, open_file_bitmap, MAX_OPEN_FILES,
+                     OPEN_FILE_CACHE_CAPACITY) == -1) {
+    return -1;
   }
 
-  for (size_t i = 0; i < DATA_BLOCKS; i++) {
-    free_blocks[i] = FREE;
+  for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
+    if (pthread_rwlock_init(&inode_locks[i], NULL) != 0) {
+      return -1;
+    }
+    if (restored && allocator_taken(&inode_allocator, (int)i) &&
+        inode_table[i].i_node_type == T_DIRECTORY &&
+        dir_index_rebuild((int)i) == -1) {
+      return -1;
+    }
   }
 
   for (size_t i = 0; i < MAX_OPEN_FILES; i++) {
     free_open_file_entries[i] = FREE;
+    if (pthread_mutex_init(&open_file_locks[i], NULL) != 0) {
+      return -1;
+    }
   }
 
+  return restored ? 1 : 0;
+}
+
+/**
+ * Write a whole buffer to a file, at the given offset.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int pwrite_full(int fd, void const *buffer, size_t len, size_t offset) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = pwrite(fd, (char const *)buffer + done, len - done,
+                       (off_t)(offset + done));
+    if (n == -1 && errno != EINTR) {
+      return -1;
+    }
+    if (n > 0) {
+      done += (size_t)n;
+    }
+  }
   return 0;
 }
 
+/**
+ * Sync the directory holding a file, so that a rename to it is durable.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int sync_parent_dir(char const *path) {
+  char const *slash = strrchr(path, '/');
+  char *dir = slash == NULL ? strdup(".")
+                            : strndup(path, (size_t)(slash - path) + 1);
+  if (dir == NULL) {
+    return -1;
+  }
+  int fd = open(dir, O_RDONLY);
+  free(dir);
+  if (fd == -1) {
+    return -1;
+  }
+  int result = fsync(fd);
+  close(fd);
+  return result;
+}
+
+/**
+ * Write the persistent state to a new image file, and replace the image with
+ * it once it is completely on disk (so there is always a whole image, even if
+ * the process or the system crashes halfway through).
+ *
+ * The tables are written whole, and the data blocks only if in use, leaving
+ * holes in the file for the rest.
+ *
+ * The caller must make sure the state doesn't change meanwhile.
+ *
+ * Input:
+ *   - wal_lsn: position of the write-ahead log the state is up to date with
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int state_checkpoint(uint64_t wal_lsn) {
+  if (fs_params.image_path == NULL) {
+    return -1;
+  }
+  size_t path_length = strlen(fs_params.image_path);
+  char *tmp_path = malloc(path_length + sizeof(".tmp"));
+  if (tmp_path == NULL) {
+    return -1;
+  }
+  memcpy(tmp_path, fs_params.image_path, path_length);
+  memcpy(tmp_path + path_length, ".tmp", sizeof(".tmp"));
+
+  int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    free(tmp_path);
+    return -1;
+  }
+
+  superblock_t superblock = {
+      .sb_magic = IMAGE_MAGIC,
+      .sb_version = IMAGE_VERSION,
+      .sb_clean = 0,
+      .sb_block_size = BLOCK_SIZE,
+      .sb_inode_count = INODE_TABLE_SIZE,
+      .sb_block_count = DATA_BLOCKS,
+      .sb_wal_lsn = wal_lsn,
+  };
+  // blocks cached by threads are free, and must be written as such
+  allocator_drain(&block_allocator);
+  bool ok = ftruncate(fd, (off_t)image_size) == 0 &&
+            pwrite_full(fd, &superblock, sizeof(superblock), 0) == 0 &&
+            pwrite_full(fd, image + inode_table_offset,
+                        fs_data_offset - inode_table_offset,
+                        inode_table_offset) == 0;
+  // writes each run of consecutive blocks in use at once
+  for (size_t start = 0; ok && start < DATA_BLOCKS;) {
+    if (!allocator_taken(&block_allocator, (int)start)) {
+      start++;
+      continue;
+    }
+    size_t end = start;
+    while (end < DATA_BLOCKS && allocator_taken(&block_allocator, (int)end)) {
+      end++;
+    }
+    ok = pwrite_full(fd, fs_data + start * BLOCK_SIZE,
+                     (end - start) * BLOCK_SIZE,
+                     fs_data_offset + start * BLOCK_SIZE) == 0;
+    start = end;
+  }
+  // the image is only flagged clean once everything else is on disk
+  superblock.sb_clean = 1;
+  ok = ok && fsync(fd) == 0 &&
+       pwrite_full(fd, &superblock, sizeof(superblock), 0) == 0 &&
+       fsync(fd) == 0;
+  ok = close(fd) == 0 && ok;
+  ok = ok && rename(tmp_path, fs_params.image_path) == 0 &&
+       sync_parent_dir(fs_params.image_path) == 0;
+  if (!ok) {
+    unlink(tmp_path);
+  }
+  free(tmp_path);
+  return ok ? 0 : -1;
+}
+
 /**
  * Destroy FS state.
  *
  * Returns 0 if succesful, -1 otherwise.
  */
 int state_destroy(void) {
-  free(inode_table);
-  free(freeinode_ts);
-  free(fs_data);
-  free(free_blocks);
+  for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
+    pthread_rwlock_destroy(&inode_locks[i]);
+  }
+  for (size_t i = 0; i < MAX_OPEN_FILES; i++) {
+    pthread_mutex_destroy(&open_file_locks[i]);
+  }
+  for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
+    dir_index_destroy((int)i);
+  }
+
+  allocator_destroy(&inode_allocator);
+  allocator_destroy(&block_allocator);
+  allocator_destroy(&open_file_allocator);
+  munmap(image, image_size);
   free(open_file_table);
   free(free_open_file_entries);
+  free(open_file_bitmap);
+  free(inode_locks);
+  free(open_file_locks);
+  free(dir_indexes);
 
+  image = NULL;
   inode_table = NULL;
-  freeinode_ts = NULL;
   fs_data = NULL;
-  free_blocks = NULL;
   open_file_table = NULL;
   free_open_file_entries = NULL;
+  open_file_bitmap = NULL;
+  inode_locks = NULL;
+  open_file_locks = NULL;
+  dir_indexes = NULL;
 
   return 0;
 }
@@ -159,31 +552,18 @@ int state_destroy(void) {
  *   - No free slots in inode table.
  */
 static int inode_alloc(void) {
-  for (size_t inumber = 0; inumber < INODE_TABLE_SIZE; inumber++) {
-    if ((inumber * sizeof(allocation_state_t) % BLOCK_SIZE) == 0) {
-      insert_delay(); // simulate storage access delay (to freeinode_ts)
-    }
-
-    // Finds first free entry in inode table
-    if (freeinode_ts[inumber] == FREE) {
-      //  Found a free entry, so takes it for the new inode
-      freeinode_ts[inumber] = TAKEN;
-
-      return (int)inumber;
-    }
-  }
-
-  // no free inodes
-  return -1;
+  latency_access(); // simulate storage access delay (to the inode bitmap)
+  return allocator_alloc(&inode_allocator);
 }
 
 /**
  * Create a new inode in the inode table.
  *
  * Allocates and initializes a new inode.
- * Directories will have their data block allocated and initialized, with i_size
- * set to BLOCK_SIZE. Regular files will not have their data block allocated
- * (i_size will be set to 0, i_data_block to -1).
+ * Directories will have their first data block allocated and initialized, with
+ * i_size set to BLOCK_SIZE, along with an empty index. Regular files will not
+ * have any data block allocated (i_size will be set to 0, and all block
+ * references to -1).
  *
  * Input:
  *   - i_type: the type of the node (file or directory)
@@ -201,26 +581,33 @@ int inode_create(inode_type i_type) {
   }
 
   inode_t *inode = &inode_table[inumber];
-  insert_delay(); // simulate storage access delay (to inode)
+  latency_access(); // simulate storage access delay (to inode)
 
   inode->i_node_type = i_type;
+  inode->i_size = 0;
+  for (size_t i = 0; i < INODE_DIRECT_BLOCKS; i++) {
+    inode->i_data_blocks[i] = -1;
+  }
+  inode->i_indirect_block = -1;
+  inode->i_double_indirect_block = -1;
+
   switch (i_type) {
   case T_DIRECTORY: {
     // Initializes directory (filling its block with empty entries, labeled
     // with inumber==-1)
     int b = data_block_alloc();
     if (b == -1) {
-      // ensure fields are initialized
-      inode->i_size = 0;
-      inode->i_data_block = -1;
-
       // run regular deletion process
       inode_delete(inumber);
       return -1;
     }
 
     inode_table[inumber].i_size = BLOCK_SIZE;
-    inode_table[inumber].i_data_block = b;
+    inode_table[inumber].i_data_blocks[0] = b;
+    if (dir_index_create(inumber) == -1) {
+      inode_delete(inumber);
+      return -1;
+    }
 
     dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(b);
     ALWAYS_ASSERT(dir_entry != NULL,
@@ -231,9 +618,7 @@ int inode_create(inode_type i_type) {
     }
   } break;
   case T_FILE:
-    // In case of a new file, simply sets its size to 0
-    inode_table[inumber].i_size = 0;
-    inode_table[inumber].i_data_block = -1;
+    // In case of a new file, there is nothing else to initialize
     break;
   default:
     PANIC("inode_create: unknown file type");
@@ -245,24 +630,26 @@ int inode_create(inode_type i_type) {
 /**
  * Delete an inode.
  *
+ * The caller must either hold the inode's write lock or be the only one able
+ * to reach it (e.g., an inode that was never linked to a directory).
+ *
  * Input:
  *   - inumber: inode's number
  */
 void inode_delete(int inumber) {
-  // simulate storage access delay (to inode and freeinode_ts)
-  insert_delay();
-  insert_delay();
+  // simulate storage access delay (to inode and the inode bitmap)
+  latency_access();
+  latency_access();
 
   ALWAYS_ASSERT(valid_inumber(inumber), "inode_delete: invalid inumber");
 
-  ALWAYS_ASSERT(freeinode_ts[inumber] == TAKEN,
+  ALWAYS_ASSERT(allocator_taken(&inode_allocator, inumber),
                 "inode_delete: inode already freed");
 
-  if (inode_table[inumber].i_size > 0) {
-    data_block_free(inode_table[inumber].i_data_block);
-  }
+  inode_truncate(&inode_table[inumber]);
+  dir_index_destroy(inumber);
 
-  freeinode_ts[inumber] = FREE;
+  allocator_free(&inode_allocator, inumber);
 }
 
 /**
@@ -276,13 +663,292 @@ void inode_delete(int inumber) {
 inode_t *inode_get(int inumber) {
   ALWAYS_ASSERT(valid_inumber(inumber), "inode_get: invalid inumber");
 
-  insert_delay(); // simulate storage access delay to inode
+  latency_access(); // simulate storage access delay to inode
   return &inode_table[inumber];
 }
 
+/**
+ * Allocate a new index block (a block of block numbers), with every reference
+ * set to -1.
+ *
+ * Returns block number/index if successful, -1 otherwise.
+ */
+static int index_block_alloc(void) {
+  int block_number = data_block_alloc();
+  if (block_number == -1) {
+    return -1;
+  }
+
+  int *refs = (int *)data_block_get(block_number);
+  for (size_t i = 0; i < BLOCK_REFS; i++) {
+    refs[i] = -1;
+  }
+  return block_number;
+}
+
+/**
+ * Follow a block reference, allocating the block first if requested and the
+ * reference is still unused.
+ *
+ * Input:
+ *   - ref: the block reference (in an inode or in an index block)
+ *   - alloc: whether to allocate a block for an unused reference
+ *   - index: whether the block to allocate is an index block
+ *
+ * Returns the referenced block number, or -1 if there is none.
+ */
+static int block_ref_follow(int *ref, bool alloc, bool index) {
+  if (*ref == -1 && alloc) {
+    *ref = index ? index_block_alloc() : data_block_alloc();
+  }
+  return *ref;
+}
+
+/**
+ * Maximum size of a file, given the block size and the inode layout.
+ */
+size_t inode_max_size(void) { return MAX_FILE_BLOCKS * BLOCK_SIZE; }
+
+/**
+ * Obtain the number of the data block holding a given block of a file.
+ *
+ * The caller must hold the inode's lock (the write lock if alloc is set).
+ *
+ * Input:
+ *   - inode: the file's inode
+ *   - block_index: index of the block within the file (offset / BLOCK_SIZE)
+ *   - alloc: whether to allocate the block (and any index blocks needed to
+ *     reach it) if it doesn't exist yet
+ *
+ * Returns the block number, or -1 if the block doesn't exist (or couldn't be
+ * allocated).
+ */
+int inode_block_get(inode_t *inode, size_t block_index, bool alloc) {
+  if (block_index < INODE_DIRECT_BLOCKS) {
+    return block_ref_follow(&inode->i_data_blocks[block_index], alloc, false);
+  }
+
+  block_index -= INODE_DIRECT_BLOCKS;
+  if (block_index < BLOCK_REFS) {
+    int indirect = block_ref_follow(&inode->i_indirect_block, alloc, true);
+    if (indirect == -1) {
+      return -1;
+    }
+    int *refs = (int *)data_block_get(indirect);
+    return block_ref_follow(&refs[block_index], alloc, false);
+  }
+
+  block_index -= BLOCK_REFS;
+  if (block_index >= BLOCK_REFS * BLOCK_REFS) {
+    return -1; // beyond the maximum file size
+  }
+  int double_indirect =
+      block_ref_follow(&inode->i_double_indirect_block, alloc, true);
+  if (double_indirect == -1) {
+    return -1;
+  }
+  int *outer_refs = (int *)data_block_get(double_indirect);
+  int indirect =
+      block_ref_follow(&outer_refs[block_index / BLOCK_REFS], alloc, true);
+  if (indirect == -1) {
+    return -1;
+  }
+  int *refs = (int *)data_block_get(indirect);
+  return block_ref_follow(&refs[block_index % BLOCK_REFS], alloc, false);
+}
+
+/**
+ * Free an index block, along with every block it references.
+ *
+ * Input:
+ *   - block_number: the index block
+ *   - depth: 1 if it references data blocks, 2 if it references other index
+ *     blocks
+ */
+static void index_block_free(int block_number, int depth) {
+  int *refs = (int *)data_block_get(block_number);
+  for (size_t i = 0; i < BLOCK_REFS; i++) {
+    if (refs[i] == -1) {
+      continue;
+    }
+    if (depth > 1) {
+      index_block_free(refs[i], depth - 1);
+    } else {
+      data_block_free(refs[i]);
+    }
+  }
+  data_block_free(block_number);
+}
+
+/**
+ * Free every block of a file, leaving it empty.
+ *
+ * The caller must hold the inode's write lock.
+ *
+ * Input:
+ *   - inode: the file's inode
+ */
+void inode_truncate(inode_t *inode) {
+  for (size_t i = 0; i < INODE_DIRECT_BLOCKS; i++) {
+    if (inode->i_data_blocks[i] != -1) {
+      data_block_free(inode->i_data_blocks[i]);
+      inode->i_data_blocks[i] = -1;
+    }
+  }
+  if (inode->i_indirect_block != -1) {
+    index_block_free(inode->i_indirect_block, 1);
+    inode->i_indirect_block = -1;
+  }
+  if (inode->i_double_indirect_block != -1) {
+    index_block_free(inode->i_double_indirect_block, 2);
+    inode->i_double_indirect_block = -1;
+  }
+  inode->i_size = 0;
+}
+
+/**
+ * Free an index block if it references no blocks anymore.
+ *
+ * Input:
+ *   - ref: the reference to the index block (-1 if there is none)
+ */
+static void index_block_prune(int *ref) {
+  if (*ref == -1) {
+    return;
+  }
+  int const *refs = (int const *)data_block_get(*ref);
+  for (size_t i = 0; i < BLOCK_REFS; i++) {
+    if (refs[i] != -1) {
+      return;
+    }
+  }
+  data_block_free(*ref);
+  *ref = -1;
+}
+
+/**
+ * Free the data blocks of a file that only hold contents within a range,
+ * leaving holes (which read as zeros) in their place, along with the index
+ * blocks left referencing none. The file's size is unchanged.
+ *
+ * The caller must hold the inode's write lock.
+ *
+ * Input:
+ *   - inode: the file's inode
+ *   - offset: offset in the file where the range starts
+ *   - length: length of the range
+ */
+void inode_punch(inode_t *inode, size_t offset, size_t length) {
+  size_t first = (offset + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  size_t last = (offset + length) / BLOCK_SIZE; // past the last one
+  for (size_t i = first; i < last; i++) {
+    int *ref = NULL;
+    if (i < INODE_DIRECT_BLOCKS) {
+      ref = &inode->i_data_blocks[i];
+    } else if (i - INODE_DIRECT_BLOCKS < BLOCK_REFS) {
+      if (inode->i_indirect_block != -1) {
+        int *refs = (int *)data_block_get(inode->i_indirect_block);
+        ref = &refs[i - INODE_DIRECT_BLOCKS];
+      }
+    } else if (i < MAX_FILE_BLOCKS && inode->i_double_indirect_block != -1) {
+      size_t index = i - INODE_DIRECT_BLOCKS - BLOCK_REFS;
+      int *outer_refs = (int *)data_block_get(inode->i_double_indirect_block);
+      if (outer_refs[index / BLOCK_REFS] != -1) {
+        int *refs = (int *)data_block_get(outer_refs[index / BLOCK_REFS]);
+        ref = &refs[index % BLOCK_REFS];
+      }
+    }
+    if (ref != NULL && *ref != -1) {
+      data_block_free(*ref);
+      *ref = -1;
+    }
+  }
+
+  // index blocks covering the range may be left empty
+  if (last > INODE_DIRECT_BLOCKS) {
+    index_block_prune(&inode->i_indirect_block);
+  }
+  if (last > INODE_DIRECT_BLOCKS + BLOCK_REFS &&
+      inode->i_double_indirect_block != -1) {
+    size_t low = first > INODE_DIRECT_BLOCKS + BLOCK_REFS
+                     ? first - INODE_DIRECT_BLOCKS - BLOCK_REFS
+                     : 0;
+    size_t high = last - INODE_DIRECT_BLOCKS - BLOCK_REFS;
+    int *outer_refs = (int *)data_block_get(inode->i_double_indirect_block);
+    for (size_t j = low / BLOCK_REFS;
+         j < BLOCK_REFS && j <= (high - 1) / BLOCK_REFS; j++) {
+      index_block_prune(&outer_refs[j]);
+    }
+    index_block_prune(&inode->i_double_indirect_block);
+  }
+}
+
+/**
+ * Lock an inode for reading (shared with other readers).
+ *
+ * Input:
+ *   - inumber: inode's number
+ */
+void inode_rdlock(int inumber) {
+  ALWAYS_ASSERT(valid_inumber(inumber), "inode_rdlock: invalid inumber");
+  ALWAYS_ASSERT(pthread_rwlock_rdlock(&inode_locks[inumber]) == 0,
+                "inode_rdlock: failed to lock inode");
+}
+
+/**
+ * Lock an inode for writing (exclusive).
+ *
+ * Input:
+ *   - inumber: inode's number
+ */
+void inode_wrlock(int inumber) {
+  ALWAYS_ASSERT(valid_inumber(inumber), "inode_wrlock: invalid inumber");
+  ALWAYS_ASSERT(pthread_rwlock_wrlock(&inode_locks[inumber]) == 0,
+                "inode_wrlock: failed to lock inode");
+}
+
+/**
+ * Release an inode lock previously taken with inode_rdlock/inode_wrlock.
+ *
+ * Input:
+ *   - inumber: inode's number
+ */
+void inode_unlock(int inumber) {
+  ALWAYS_ASSERT(valid_inumber(inumber), "inode_unlock: invalid inumber");
+  ALWAYS_ASSERT(pthread_rwlock_unlock(&inode_locks[inumber]) == 0,
+                "inode_unlock: failed to unlock inode");
+}
+
+/**
+ * Obtain a pointer to the entry in a given slot of a directory.
+ *
+ * Input:
+ *   - inode: directory inode
+ *   - slot: the entry's number (counting the entries of all its blocks)
+ *   - alloc: whether to allocate the block holding the slot, if needed
+ *
+ * Returns a pointer to the entry, or NULL if its block doesn't exist (or
+ * couldn't be allocated).
+ */
+static dir_entry_t *dir_entry_get(inode_t *inode, size_t slot, bool alloc) {
+  int b = inode_block_get(inode, slot / MAX_DIR_ENTRIES, alloc);
+  if (b == -1) {
+    return NULL;
+  }
+  return (dir_entry_t *)data_block_get(b) + slot % MAX_DIR_ENTRIES;
+}
+
+static dir_index_t *dir_index_get(inode_t const *inode) {
+  dir_index_t *index = dir_indexes[inode - inode_table];
+  ALWAYS_ASSERT(index != NULL, "directory must have an index");
+  return index;
+}
+
 /**
  * Clear the directory entry associated with a sub file.
  *
+ * The caller must hold the directory inode's write lock.
+ *
  * Input:
  *   - inode: directory inode
  *   - sub_name: sub file name
@@ -294,29 +960,37 @@ inode_t *inode_get(int inumber) {
  *   - Directory does not contain an entry for sub_name.
  */
 int clear_dir_entry(inode_t *inode, char const *sub_name) {
-  insert_delay();
+  latency_access();
   if (inode->i_node_type != T_DIRECTORY) {
     return -1; // not a directory
   }
 
-  // Locates the block containing the entries of the directory
-  dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(inode->i_data_block);
+  dir_index_t *index = dir_index_get(inode);
+  void *found = hashmap_remove(&index->di_names, sub_name);
+  if (found == NULL) {
+    return -1; // sub_name not found
+  }
+  size_t slot = (size_t)(uintptr_t)found - 1;
+
+  dir_entry_t *dir_entry = dir_entry_get(inode, slot, false);
   ALWAYS_ASSERT(dir_entry != NULL,
-                "clear_dir_entry: directory must have a data block");
+                "clear_dir_entry: directory must have the entry's block");
+  dir_entry->d_inumber = -1;
+  memset(dir_entry->d_name, 0, MAX_FILE_NAME);
 
-  for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-    if (!strcmp(dir_entry[i].d_name, sub_name)) {
-      dir_entry[i].d_inumber = -1;
-      memset(dir_entry[i].d_name, 0, MAX_FILE_NAME);
-      return 0;
-    }
-  }
-  return -1; // sub_name not found
+  // the stack can hold every slot, so this never fails
+  index->di_free_slots[index->di_free_size++] = slot;
+  return 0;
 }
 
 /**
  * Store the inumber for a sub file in a directory.
  *
+ * Reuses a slot freed by clear_dir_entry if there is one, and otherwise adds
+ * one after the last, growing the directory by one block when needed.
+ *
+ * The caller must hold the directory inode's write lock.
+ *
  * Input:
  *   - inode: directory inode
  *   - sub_name: sub file name
@@ -327,40 +1001,68 @@ int clear_dir_entry(inode_t *inode, char const *sub_name) {
  * Possible errors:
  *   - inode is not a directory inode.
  *   - sub_name is not a valid file name (length 0 or > MAX_FILE_NAME - 1).
- *   - Directory is already full of entries.
+ *   - Directory already has an entry for sub_name.
+ *   - No free data blocks (or memory) to grow the directory.
  */
 int add_dir_entry(inode_t *inode, char const *sub_name, int sub_inumber) {
   if (strlen(sub_name) == 0 || strlen(sub_name) > MAX_FILE_NAME - 1) {
     return -1; // invalid sub_name
   }
 
-  insert_delay(); // simulate storage access delay to inode with inumber
+  latency_access(); // simulate storage access delay to inode with inumber
   if (inode->i_node_type != T_DIRECTORY) {
     return -1; // not a directory
   }
 
-  // Locates the block containing the entries of the directory
-  dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(inode->i_data_block);
-  ALWAYS_ASSERT(dir_entry != NULL,
-                "add_dir_entry: directory must have a data block");
-
-  // Finds and fills the first empty entry
-  for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-    if (dir_entry[i].d_inumber == -1) {
-      dir_entry[i].d_inumber = sub_inumber;
-      strncpy(dir_entry[i].d_name, sub_name, MAX_FILE_NAME - 1);
-      dir_entry[i].d_name[MAX_FILE_NAME - 1] = '\0';
+  dir_index_t *index = dir_index_get(inode);
+  // makes room for the new slot in the free slots stack beforehand, so that
+  // clearing entries never has to allocate memory
+  if (index->di_free_capacity <= index->di_slots) {
+    size_t capacity =
+        index->di_free_capacity == 0 ? MAX_DIR_ENTRIES
+                                     : index->di_free_capacity * 2;
+    size_t *slots = realloc(index->di_free_slots, capacity * sizeof(size_t));
+    if (slots == NULL) {
+      return -1;
+    }
+    index->di_free_slots = slots;
+    index->di_free_capacity = capacity;
+  }
 
-      return 0;
+  bool new_slot = index->di_free_size == 0;
+  size_t slot =
+      new_slot ? index->di_slots : index->di_free_slots[--index->di_free_size];
+  dir_entry_t *dir_entry = dir_entry_get(inode, slot, new_slot);
+  if (dir_entry == NULL ||
+      hashmap_put(&index->di_names, sub_name, (void *)(uintptr_t)(slot + 1)) ==
+          -1) {
+    if (!new_slot) {
+      index->di_free_size++;
     }
+    return -1;
   }
 
-  return -1; // no space for entry
+  if (new_slot) {
+    if (slot % MAX_DIR_ENTRIES == 0) {
+      // new block: marks all of its entries empty
+      for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
+        dir_entry[i].d_inumber = -1;
+      }
+      inode->i_size = (slot / MAX_DIR_ENTRIES + 1) * BLOCK_SIZE;
+    }
+    index->di_slots++;
+  }
+  dir_entry->d_inumber = sub_inumber;
+  strncpy(dir_entry->d_name, sub_name, MAX_FILE_NAME - 1);
+  dir_entry->d_name[MAX_FILE_NAME - 1] = '\0';
+  return 0;
 }
 
 /**
  * Obtain the inumber for a sub file inside a directory.
  *
+ * The caller must hold the directory inode's lock.
+ *
  * Input:
  *   - inode: directory inode
  *   - sub_name: sub file name
@@ -375,27 +1077,53 @@ int find_in_dir(inode_t const *inode, char const *sub_name) {
   ALWAYS_ASSERT(inode != NULL, "find_in_dir: inode must be non-NULL");
   ALWAYS_ASSERT(sub_name != NULL, "find_in_dir: sub_name must be non-NULL");
 
-  insert_delay(); // simulate storage access delay to inode with inumber
+  latency_access(); // simulate storage access delay to inode with inumber
   if (inode->i_node_type != T_DIRECTORY) {
     return -1; // not a directory
   }
 
-  // Locates the block containing the entries of the directory
-  dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(inode->i_data_block);
+  void *found = hashmap_get(&dir_index_get(inode)->di_names, sub_name, NULL);
+  if (found == NULL) {
+    return -1; // entry not found
+  }
+  size_t slot = (size_t)(uintptr_t)found - 1;
+
+  // the entry is only read, so the directory's lock needs not be exclusive
+  dir_entry_t *dir_entry = dir_entry_get((inode_t *)inode, slot, false);
   ALWAYS_ASSERT(dir_entry != NULL,
-                "find_in_dir: directory inode must have a data block");
+                "find_in_dir: directory must have the entry's block");
+  return dir_entry->d_inumber;
+}
 
-  // Iterates over the directory entries looking for one that has the target
-  // name
-  for (int i = 0; i < MAX_DIR_ENTRIES; i++)
-    if ((dir_entry[i].d_inumber != -1) &&
-        (strncmp(dir_entry[i].d_name, sub_name, MAX_FILE_NAME) == 0)) {
+/**
+ * Visit every entry of a directory, in slot order.
+ *
+ * The caller must hold the directory inode's lock.
+ *
+ * Input:
+ *   - inode: directory inode
+ *   - visit: called with the name of each entry
+ *   - arg: passed on to visit
+ *
+ * Returns 0 if successful, -1 if inode is not a directory inode.
+ */
+int dir_foreach(inode_t const *inode,
+                void (*visit)(char const *sub_name, void *arg), void *arg) {
+  latency_access(); // simulate storage access delay to inode with inumber
+  if (inode->i_node_type != T_DIRECTORY) {
+    return -1; // not a directory
+  }
 
-      int sub_inumber = dir_entry[i].d_inumber;
-      return sub_inumber;
+  size_t slots = dir_index_get(inode)->di_slots;
+  for (size_t slot = 0; slot < slots; slot++) {
+    dir_entry_t *dir_entry = dir_entry_get((inode_t *)inode, slot, false);
+    ALWAYS_ASSERT(dir_entry != NULL,
+                  "dir_foreach: directory must have the entry's block");
+    if (dir_entry->d_inumber != -1) {
+      visit(dir_entry->d_name, arg);
     }
-
-  return -1; // entry not found
+  }
+  return 0;
 }
 
 /**
@@ -407,18 +1135,8 @@ int find_in_dir(inode_t const *inode, char const *sub_name) {
  *   - No free data blocks.
  */
 int data_block_alloc(void) {
-  for (size_t i = 0; i < DATA_BLOCKS; i++) {
-    if (i * sizeof(allocation_state_t) % BLOCK_SIZE == 0) {
-      insert_delay(); // simulate storage access delay to free_blocks
-    }
-
-    if (free_blocks[i] == FREE) {
-      free_blocks[i] = TAKEN;
-
-      return (int)i;
-    }
-  }
-  return -1;
+  latency_access(); // simulate storage access delay to the block bitmap
+  return allocator_alloc(&block_allocator);
 }
 
 /**
@@ -431,9 +1149,9 @@ void data_block_free(int block_number) {
   ALWAYS_ASSERT(valid_block_number(block_number),
                 "data_block_free: invalid block number");
 
-  insert_delay(); // simulate storage access delay to free_blocks
+  latency_access(); // simulate storage access delay to the block bitmap
 
-  free_blocks[block_number] = FREE;
+  allocator_free(&block_allocator, block_number);
 }
 
 /**
@@ -448,7 +1166,7 @@ void *data_block_get(int block_number) {
   ALWAYS_ASSERT(valid_block_number(block_number),
                 "data_block_get: invalid block number");
 
-  insert_delay(); // simulate storage access delay to block
+  latency_access(); // simulate storage access delay to block
   return &fs_data[(size_t)block_number * BLOCK_SIZE];
 }
 
@@ -465,22 +1183,27 @@ void *data_block_get(int block_number) {
  *   - No space in open file table for a new open file.
  */
 int add_to_open_file_table(int inumber, size_t offset) {
-  for (int i = 0; i < MAX_OPEN_FILES; i++) {
-    if (free_open_file_entries[i] == FREE) {
-      free_open_file_entries[i] = TAKEN;
-      open_file_table[i].of_inumber = inumber;
-      open_file_table[i].of_offset = offset;
-
-      return i;
-    }
+  int i = allocator_alloc(&open_file_allocator);
+  if (i == -1) {
+    return -1;
   }
 
-  return -1;
+  // a free entry can't be locked by anyone else for longer than it takes them
+  // to notice it is free
+  mutex_lock(&open_file_locks[i]);
+  free_open_file_entries[i] = TAKEN;
+  open_file_table[i].of_inumber = inumber;
+  open_file_table[i].of_offset = offset;
+  mutex_unlock(&open_file_locks[i]);
+
+  return i;
 }
 
 /**
  * Free an entry from the open file table.
  *
+ * The caller must hold the entry's lock (see open_file_lock).
+ *
  * Input:
  *   - fhandle: file handle to free/close
  */
@@ -492,11 +1215,45 @@ void remove_from_open_file_table(int fhandle) {
                 "remove_from_open_file_table: file handle must be taken");
 
   free_open_file_entries[fhandle] = FREE;
+  allocator_free(&open_file_allocator, fhandle);
+}
+
+/**
+ * Lock an entry of the open file table.
+ *
+ * Input:
+ *   - fhandle: file handle
+ *
+ * Returns 0 if successful, -1 if the fhandle is out of range.
+ */
+int open_file_lock(int fhandle) {
+  if (!valid_file_handle(fhandle)) {
+    return -1;
+  }
+
+  mutex_lock(&open_file_locks[fhandle]);
+  return 0;
+}
+
+/**
+ * Unlock an entry of the open file table.
+ *
+ * Input:
+ *   - fhandle: file handle (previously locked with open_file_lock)
+ */
+void open_file_unlock(int fhandle) {
+  ALWAYS_ASSERT(valid_file_handle(fhandle),
+                "open_file_unlock: file handle must be valid");
+
+  mutex_unlock(&open_file_locks[fhandle]);
 }
 
 /**
  * Obtain pointer to a given entry in the open file table.
  *
+ * The caller must hold the entry's lock (see open_file_lock) for as long as it
+ * uses the returned pointer.
+ *
  * Input:
  *   - fhandle: file handle
  *
@@ -5,6 +5,7 @@
 #include "operations.h"
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
@@ -21,12 +22,19 @@ typedef enum { T_FILE, T_DIRECTORY } inode_type;
 
 /**
  * Inode
+ *
+ * Data blocks are referenced in three levels: the first INODE_DIRECT_BLOCKS
+ * directly, the following ones through an indirect block (a block of block
+ * numbers), and the rest through a double indirect block (a block of indirect
+ * blocks). Unused references are set to -1.
  */
 typedef struct {
   inode_type i_node_type;
 
   size_t i_size;
-  int i_data_block;
+  int i_data_blocks[INODE_DIRECT_BLOCKS];
+  int i_indirect_block;
+  int i_double_indirect_block;
 
   // in a more complete FS, more fields could exist here
 } inode_t;
@@ -41,18 +49,28 @@ typedef struct {
   size_t of_offset;
 } open_file_entry_t;
 
-int state_init(tfs_params);
+int state_init(tfs_params params, uint64_t *wal_lsn);
 int state_destroy(void);
+int state_checkpoint(uint64_t wal_lsn);
 
 size_t state_block_size(void);
 
 int inode_create(inode_type n_type);
 void inode_delete(int inumber);
 inode_t *inode_get(int inumber);
+void inode_rdlock(int inumber);
+void inode_wrlock(int inumber);
+void inode_unlock(int inumber);
+size_t inode_max_size(void);
+int inode_block_get(inode_t *inode, size_t block_index, bool alloc);
+void inode_truncate(inode_t *inode);
+void inode_punch(inode_t *inode, size_t offset, size_t length);
 
 int clear_dir_entry(inode_t *inode, char const *sub_name);
 int add_dir_entry(inode_t *inode, char const *sub_name, int sub_inumber);
 int find_in_dir(inode_t const *inode, char const *sub_name);
+int dir_foreach(inode_t const *inode,
+                void (*visit)(char const *sub_name, void *arg), void *arg);
 
 int data_block_alloc(void);
 void data_block_free(int block_number);
@@ -60,6 +78,8 @@ void *data_block_get(int block_number);
 
 int add_to_open_file_table(int inumber, size_t offset);
 void remove_from_open_file_table(int fhandle);
+int open_file_lock(int fhandle);
+void open_file_unlock(int fhandle);
 open_file_entry_t *get_open_file_entry(int fhandle);
 
 #endif // STATE_H
\ No newline at end of file
@@ -0,0 +1,454 @@
+#include "wal.h"
+#include "betterassert.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// appenders wait for the writer thread once this much is buffered (a single
+// larger record is still accepted into an empty buffer)
+#define WAL_BUFFER_MAX (8 * 1024 * 1024)
+// largest payload accepted when replaying, so that a corrupt length is never
+// taken for a huge record
+#define WAL_PAYLOAD_MAX (1 << 30)
+#define WAL_MAGIC (0x314C41575346544EULL) // "NTFSWAL1"
+
+static int wal_fd = -1;
+static tfs_sync_policy sync_policy;
+static unsigned sync_interval_ms;
+
+/*
+ * Log state, protected by wal_lock. Log sequence numbers are positions in the
+ * log, counted from the wh_base_lsn of the file: appended_lsn is past the last
+ * record appended to the buffer, written_lsn past the last one written to the
+ * file, and durable_lsn past the last one synced to disk.
+ */
+static pthread_mutex_t wal_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wal_work;    // wakes the writer thread up
+static pthread_cond_t wal_written; // wakes up threads waiting for the writer
+static char *wal_buffer;
+static size_t wal_buffer_size;
+static size_t wal_buffer_capacity;
+static uint64_t appended_lsn;
+static uint64_t written_lsn;
+static uint64_t durable_lsn;
+static uint64_t sync_requested_lsn; // highest lsn someone waits to be durable
+static bool wal_stopping;
+static bool wal_failed;
+static pthread_t wal_thread;
+
+static uint32_t crc_table[256];
+
+static void crc_init(void) {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320u : crc >> 1;
+    }
+    crc_table[i] = crc;
+  }
+}
+
+static uint32_t crc_update(uint32_t crc, void const *data, size_t length) {
+  unsigned char const *bytes = (unsigned char const *)data;
+  for (size_t i = 0; i < length; i++) {
+    crc = crc_table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+  }
+  return crc;
+}
+
+/**
+ * Checksum of a record: covers the header past the checksum, and the payload.
+ */
+static uint32_t record_checksum(wal_record_header const *header,
+                                void const *payload) {
+  size_t skip = offsetof(wal_record_header, wr_type);
+  uint32_t crc = crc_update(0xFFFFFFFFu, (char const *)header + skip,
+                            sizeof(wal_record_header) - skip);
+  crc = crc_update(crc, &header->wr_length, sizeof(header->wr_length));
+  return ~crc_update(crc, payload, header->wr_length);
+}
+
+static uint64_t now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+/**
+ * Read exactly len bytes (unless the file ends first).
+ *
+ * Returns the number of bytes read, or -1 in case of error.
+ */
+static ssize_t read_full(int fd, void *buffer, size_t len) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = read(fd, (char *)buffer + done, len - done);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n == -1) {
+      return -1;
+    }
+    if (n == 0) {
+      break;
+    }
+    done += (size_t)n;
+  }
+  return (ssize_t)done;
+}
+
+/**
+ * Start the log file over, empty, with records numbered from base_lsn on.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int wal_truncate(int fd, uint64_t base_lsn) {
+  wal_file_header file_header = {WAL_MAGIC, base_lsn};
+  if (ftruncate(fd, 0) == -1 ||
+      pwrite(fd, &file_header, sizeof(file_header), 0) !=
+          sizeof(file_header) ||
+      lseek(fd, sizeof(file_header), SEEK_SET) == -1 || fdatasync(fd) == -1) {
+    return -1;
+  }
+  appended_lsn = written_lsn = durable_lsn = base_lsn;
+  return 0;
+}
+
+/**
+ * Replay every valid record in the log file from from_lsn on, and cut off
+ * whatever follows the last one (a record torn by a crash).
+ *
+ * A file without a valid header (a new one, or one whose header was torn by a
+ * crash while being emptied) is taken as an empty log starting at from_lsn.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int wal_replay(int fd, uint64_t from_lsn, wal_apply_fn apply) {
+  wal_file_header file_header;
+  if (read_full(fd, &file_header, sizeof(file_header)) !=
+          sizeof(file_header) ||
+      file_header.wh_magic != WAL_MAGIC) {
+    return wal_truncate(fd, from_lsn);
+  }
+  if (file_header.wh_base_lsn > from_lsn) {
+    // the records in between (and the changes they describe) are lost
+    errno = EINVAL;
+    return -1;
+  }
+
+  wal_record_header header;
+  char *payload = NULL;
+  size_t payload_capacity = 0;
+  uint64_t lsn = file_header.wh_base_lsn;
+  int result = 0;
+
+  while (read_full(fd, &header, sizeof(header)) == sizeof(header)) {
+    if (header.wr_length > WAL_PAYLOAD_MAX) {
+      break;
+    }
+    if (header.wr_length > payload_capacity) {
+      char *grown = realloc(payload, header.wr_length);
+      if (grown == NULL) {
+        result = -1;
+        break;
+      }
+      payload = grown;
+      payload_capacity = header.wr_length;
+    }
+    if (read_full(fd, payload, header.wr_length) != header.wr_length ||
+        record_checksum(&header, payload) != header.wr_checksum) {
+      break;
+    }
+    // records already in the image are skipped
+    if (lsn >= from_lsn && apply(&header, payload) == -1) {
+      result = -1;
+      break;
+    }
+    lsn += sizeof(header) + header.wr_length;
+  }
+  free(payload);
+  // the image can be ahead of the log, when the last records of the log
+  // weren't synced before the image was written
+  if (result == 0 && lsn < from_lsn) {
+    return wal_truncate(fd, from_lsn);
+  }
+
+  off_t end = (off_t)(sizeof(file_header) + lsn - file_header.wh_base_lsn);
+  if (result == 0 &&
+      (ftruncate(fd, end) == -1 || lseek(fd, end, SEEK_SET) == -1)) {
+    result = -1;
+  }
+  appended_lsn = written_lsn = durable_lsn = lsn;
+  return result;
+}
+
+/**
+ * Whether the writer thread has to sync what it wrote. Must be called with
+ * wal_lock held.
+ */
+static bool sync_due(uint64_t last_sync) {
+  if (wal_stopping || sync_requested_lsn > durable_lsn) {
+    return true;
+  }
+  switch (sync_policy) {
+  case TFS_SYNC_ALWAYS:
+    return true;
+  case TFS_SYNC_INTERVAL:
+    return now_ms() - last_sync >= sync_interval_ms;
+  case TFS_SYNC_NEVER:
+  default:
+    return false;
+  }
+}
+
+/**
+ * Writer thread: writes whatever was appended since its last write (all of
+ * it at once), and syncs it when due.
+ */
+static void *wal_writer(void *arg) {
+  (void)arg;
+  char *spare = NULL;
+  size_t spare_capacity = 0;
+  uint64_t last_sync = now_ms();
+
+  pthread_mutex_lock(&wal_lock);
+  while (true) {
+    // waits for records to write, or for a sync to be due
+    while (wal_buffer_size == 0 && !wal_stopping &&
+           sync_requested_lsn <= durable_lsn) {
+      if (sync_policy == TFS_SYNC_INTERVAL && written_lsn > durable_lsn) {
+        if (sync_due(last_sync)) {
+          break;
+        }
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        uint64_t elapsed = now_ms() - last_sync;
+        uint64_t wait_ns =
+            elapsed < sync_interval_ms ? (sync_interval_ms - elapsed) * 1000000
+                                       : 0;
+        deadline.tv_sec += (time_t)(wait_ns / 1000000000);
+        deadline.tv_nsec += (long)(wait_ns % 1000000000);
+        if (deadline.tv_nsec >= 1000000000) {
+          deadline.tv_sec++;
+          deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&wal_work, &wal_lock, &deadline);
+      } else {
+        pthread_cond_wait(&wal_work, &wal_lock);
+      }
+    }
+    if (wal_stopping && wal_buffer_size == 0 && durable_lsn == written_lsn) {
+      break;
+    }
+
+    // takes the buffer, leaving the spare one for the appenders
+    char *buffer = wal_buffer;
+    size_t size = wal_buffer_size, capacity = wal_buffer_capacity;
+    wal_buffer = spare;
+    wal_buffer_capacity = spare_capacity;
+    wal_buffer_size = 0;
+    spare = buffer;
+    spare_capacity = capacity;
+    uint64_t end = appended_lsn;
+    // lets appenders waiting for buffer space go on
+    pthread_cond_broadcast(&wal_written);
+    pthread_mutex_unlock(&wal_lock);
+
+    bool failed = false;
+    size_t done = 0;
+    while (done < size) {
+      ssize_t n = write(wal_fd, buffer + done, size - done);
+      if (n == -1 && errno == EINTR) {
+        continue;
+      }
+      if (n == -1) {
+        failed = true;
+        break;
+      }
+      done += (size_t)n;
+    }
+
+    pthread_mutex_lock(&wal_lock);
+    bool sync = sync_due(last_sync);
+    if (sync && !failed) {
+      pthread_mutex_unlock(&wal_lock);
+      failed = fdatasync(wal_fd) == -1;
+      last_sync = now_ms();
+      pthread_mutex_lock(&wal_lock);
+    }
+    if (failed) {
+      // nothing logged from now on can be made durable
+      perror("wal: failed to write log");
+      wal_failed = true;
+    } else {
+      written_lsn = end;
+      if (sync) {
+        durable_lsn = end;
+      }
+    }
+    pthread_cond_broadcast(&wal_written);
+    if (failed) {
+      break;
+    }
+  }
+  pthread_mutex_unlock(&wal_lock);
+  free(spare);
+  return NULL;
+}
+
+int wal_init(tfs_params const *params, uint64_t from_lsn, wal_apply_fn apply) {
+  crc_init();
+  int fd = open(params->wal_path, O_RDWR | O_CREAT, 0644);
+  if (fd == -1) {
+    return -1;
+  }
+  if (wal_replay(fd, from_lsn, apply) == -1) {
+    close(fd);
+    return -1;
+  }
+
+  sync_policy = params->sync_policy;
+  sync_interval_ms = params->sync_interval_ms;
+  wal_buffer = NULL;
+  wal_buffer_size = 0;
+  wal_buffer_capacity = 0;
+  sync_requested_lsn = durable_lsn;
+  wal_stopping = false;
+  wal_failed = false;
+
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&wal_work, &attr);
+  pthread_condattr_destroy(&attr);
+  pthread_cond_init(&wal_written, NULL);
+
+  wal_fd = fd;
+  if (pthread_create(&wal_thread, NULL, wal_writer, NULL) != 0) {
+    wal_fd = -1;
+    close(fd);
+    return -1;
+  }
+  return 0;
+}
+
+void wal_destroy(void) {
+  if (wal_fd == -1) {
+    return;
+  }
+  pthread_mutex_lock(&wal_lock);
+  wal_stopping = true;
+  pthread_cond_signal(&wal_work);
+  pthread_mutex_unlock(&wal_lock);
+  pthread_join(wal_thread, NULL);
+
+  close(wal_fd);
+  wal_fd = -1;
+  free(wal_buffer);
+  wal_buffer = NULL;
+  pthread_cond_destroy(&wal_work);
+  pthread_cond_destroy(&wal_written);
+}
+
+bool wal_enabled(void) { return wal_fd != -1; }
+
+uint64_t wal_append(wal_record_type type, int inumber, uint64_t offset,
+                    void const *payload, size_t length) {
+  if (wal_fd == -1) {
+    return 0;
+  }
+
+  wal_record_header header;
+  header.wr_length = (uint32_t)length;
+  header.wr_type = (uint32_t)type;
+  header.wr_inumber = inumber;
+  header.wr_offset = offset;
+  header.wr_checksum = record_checksum(&header, payload);
+  size_t size = sizeof(header) + length;
+
+  pthread_mutex_lock(&wal_lock);
+  if (wal_failed) {
+    // the record could never be made durable anyway
+    pthread_mutex_unlock(&wal_lock);
+    return appended_lsn;
+  }
+  // waits for the writer thread to take a full buffer
+  while (wal_buffer_size > 0 && wal_buffer_size + size > WAL_BUFFER_MAX &&
+         !wal_failed) {
+    pthread_cond_wait(&wal_written, &wal_lock);
+  }
+  if (wal_buffer_size + size > wal_buffer_capacity) {
+    size_t capacity = wal_buffer_capacity > 0 ? wal_buffer_capacity : 4096;
+    while (capacity < wal_buffer_size + size) {
+      capacity *= 2;
+    }
+    char *grown = realloc(wal_buffer, capacity);
+    ALWAYS_ASSERT(grown != NULL, "wal_append: out of memory");
+    wal_buffer = grown;
+    wal_buffer_capacity = capacity;
+  }
+  memcpy(wal_buffer + wal_buffer_size, &header, sizeof(header));
+  memcpy(wal_buffer + wal_buffer_size + sizeof(header), payload, length);
+  wal_buffer_size += size;
+  appended_lsn += size;
+  uint64_t lsn = appended_lsn;
+  pthread_cond_signal(&wal_work);
+  pthread_mutex_unlock(&wal_lock);
+  return lsn;
+}
+
+int wal_wait(uint64_t lsn) {
+  if (wal_fd == -1) {
+    return 0;
+  }
+  pthread_mutex_lock(&wal_lock);
+  if (sync_requested_lsn < lsn) {
+    sync_requested_lsn = lsn;
+    pthread_cond_signal(&wal_work);
+  }
+  while (durable_lsn < lsn && !wal_failed) {
+    pthread_cond_wait(&wal_written, &wal_lock);
+  }
+  int result = durable_lsn >= lsn ? 0 : -1;
+  pthread_mutex_unlock(&wal_lock);
+  return result;
+}
+
+void wal_commit(uint64_t lsn) {
+  if (sync_policy == TFS_SYNC_ALWAYS) {
+    wal_wait(lsn);
+  }
+}
+
+uint64_t wal_tail(void) {
+  pthread_mutex_lock(&wal_lock);
+  uint64_t lsn = appended_lsn;
+  pthread_mutex_unlock(&wal_lock);
+  return lsn;
+}
+
+int wal_reset(void) {
+  if (wal_fd == -1) {
+    return 0;
+  }
+  // lets the writer thread finish with whatever was appended, so that it is
+  // idle while the file is emptied
+  uint64_t lsn = wal_tail();
+  if (wal_wait(lsn) == -1) {
+    return -1;
+  }
+  pthread_mutex_lock(&wal_lock);
+  int result = wal_truncate(wal_fd, lsn);
+  if (result == -1) {
+    wal_failed = true;
+  }
+  pthread_mutex_unlock(&wal_lock);
+  return result;
+}
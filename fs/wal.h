@@ -0,0 +1,121 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include "operations.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Write-ahead log
+ *
+ * Every change to the file system is described by a record appended to the
+ * log file, from which the file system is rebuilt on initialization. Records
+ * are appended to an in-memory buffer by the threads changing the file system
+ * (while they still hold the locks that order their changes), and written to
+ * the log file by a dedicated thread, which takes everything appended since
+ * its last write at once and syncs it to disk according to the sync policy
+ * (group commit). A thread that needs one of its changes to be durable waits
+ * for the thread to sync past its record.
+ *
+ * Records are a wal_record_header followed by a payload: the file name for
+ * WAL_CREATE and WAL_UNLINK, the data written for WAL_WRITE, the length of the
+ * range (uint64_t) for WAL_PUNCH, and nothing for WAL_TRUNCATE. Files are
+ * identified by their inumber when they were logged, which replaying maps to
+ * the inumber they get in the rebuilt file system. A record is only replayed
+ * if it is whole and its checksum matches, so a record torn by a crash (and
+ * everything after it) is discarded.
+ *
+ * The log file starts with a wal_file_header. Log sequence numbers keep
+ * growing when the log is emptied (see wal_reset): the header holds the one
+ * of the first record in the file, so that records already in an image of the
+ * file system are told apart from the ones to replay on top of it.
+ */
+
+typedef enum {
+  WAL_CREATE = 1,
+  WAL_TRUNCATE = 2,
+  WAL_WRITE = 3,
+  WAL_UNLINK = 4,
+  WAL_PUNCH = 5,
+} wal_record_type;
+
+typedef struct {
+  uint32_t wr_length;   // of the payload
+  uint32_t wr_checksum; // of the rest of the header and the payload
+  uint32_t wr_type;
+  int32_t wr_inumber;
+  // WAL_WRITE: where the data was written; WAL_PUNCH: where the range of
+  // dropped contents starts
+  uint64_t wr_offset;
+} wal_record_header;
+
+typedef struct {
+  uint64_t wh_magic;
+  uint64_t wh_base_lsn;
+} wal_file_header;
+
+/**
+ * Applies a record to the file system being rebuilt.
+ *
+ * Returns 0 if successful, -1 otherwise (which stops the replay).
+ */
+typedef int (*wal_apply_fn)(wal_record_header const *header,
+                            void const *payload);
+
+/**
+ * Replay the records of the log at params->wal_path (if it exists) from
+ * from_lsn on through apply, and start logging to it.
+ *
+ * Returns 0 if successful, -1 otherwise (including when records before
+ * from_lsn are missing from the log).
+ */
+int wal_init(tfs_params const *params, uint64_t from_lsn, wal_apply_fn apply);
+
+/**
+ * Sync everything logged to disk, and stop logging.
+ */
+void wal_destroy(void);
+
+/**
+ * Whether changes are being logged.
+ */
+bool wal_enabled(void);
+
+/**
+ * Append a record to the log.
+ *
+ * Returns the log sequence number (position in the log) past the record, to
+ * be given to wal_commit or wal_wait.
+ */
+uint64_t wal_append(wal_record_type type, int inumber, uint64_t offset,
+                    void const *payload, size_t length);
+
+/**
+ * Wait for the record ending at lsn to be durable, if the sync policy is
+ * TFS_SYNC_ALWAYS. Must be called without holding any file system lock.
+ */
+void wal_commit(uint64_t lsn);
+
+/**
+ * Wait for the record ending at lsn to be durable, whatever the sync policy.
+ *
+ * Returns 0 if successful, -1 if the log could not be synced.
+ */
+int wal_wait(uint64_t lsn);
+
+/**
+ * Log sequence number past the last record appended.
+ */
+uint64_t wal_tail(void);
+
+/**
+ * Empty the log, once every record in it is in an image of the file system.
+ * Must be called while nothing is being logged.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int wal_reset(void);
+
+#endif // WAL_H
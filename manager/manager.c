@@ -1,35 +1,89 @@
 #include "extras.h"
 #include "logging.h"
 
-mail_box mail_boxes[MAX_MAILBOXES];
-int mail_boxes_size = 0;
+static void print_usage() {
+  fprintf(stderr,
+          "usage: \n"
+          "   manager <register_pipe_name> <pipe_name> create <box_name>"
+          " [--max-bytes <n>] [--max-messages <n>] [--max-age <seconds>]\n"
+          "   manager <register_pipe_name> <pipe_name> remove <box_name>\n"
+          "   manager <register_pipe_name> <pipe_name> list [--prefix <prefix>]"
+          " [--after <box_name>] [--limit <n>]\n"
+          "   manager <register_pipe_name> <pipe_name> stats"
+          " [--prefix <prefix>]\n");
+}
+
+// reads the listing frames sent by the broker, printing the boxes as they
+// arrive (already sorted), so that memory use doesn't grow with the number
+// of boxes
+//
+// Returns 0 if successful, -1 otherwise
+int list_boxes(int pipe_fd) {
+  char payload[FRAME_MAX_PAYLOAD];
+  frame_reader reader;
+  frame_header header;
+  box_list_header list;
+  mail_box box;
+  size_t listed = 0;
+
+  frame_reader_init(&reader, pipe_fd);
+  do {
+    if (frame_read(&reader, &header, payload, sizeof(payload)) != 1 ||
+        header.code != 8 || header.length < sizeof(list))
+      return -1;
+    memcpy(&list, payload, sizeof(list));
+    size_t position = sizeof(list);
+    for (uint16_t i = 0; i < list.count; i++) {
+      size_t size =
+          box_list_unpack(payload + position, header.length - position, &box);
+      if (size == 0)
+        return -1;
+      position += size;
+      fprintf(stdout, "%s %zu %zu %zu\n", box.box_name, box.box_size,
+              box.n_pubs, box.n_subs);
+      listed++;
+    }
+  } while (list.last == 0);
 
-// compare function to provided as argument in quicksort:
-// compares alphabetically
-int str_compare(const void *a, const void *b) {
-  mail_box *m_a = (mail_box *)a;
-  mail_box *m_b = (mail_box *)b;
-  return strcmp(m_a->box_name, m_b->box_name);
+  if (listed == 0)
+    fprintf(stdout, "NO BOXES FOUND\n");
+  // the limit was reached: the last box listed is where the next page starts
+  else if (list.more)
+    fprintf(stdout, "MORE %s\n", box.box_name);
+  return 0;
+}
+
+// reads the stats sent by the broker, lines of text spread over frames (the
+// last one empty), and prints them as they arrive
+//
+// Returns 0 if successful, -1 otherwise
+int print_stats(int pipe_fd) {
+  char payload[FRAME_MAX_PAYLOAD];
+  frame_reader reader;
+  frame_header header;
+
+  frame_reader_init(&reader, pipe_fd);
+  do {
+    if (frame_read(&reader, &header, payload, sizeof(payload)) != 1 ||
+        header.code != 15)
+      return -1;
+    fwrite(payload, 1, header.length, stdout);
+  } while (header.length > 0);
+  return 0;
 }
 
 int main(int argc, char **argv) {
-  if (argc != 4 && argc != 5) {
-    perror("incorrect number of arguments");
+  if (argc < 4) {
+    print_usage();
     return -1;
   }
   protocol message;
+  memset(&message, 0, sizeof(message));
   char register_pipe[PIPE_NAME_SIZE], *action = argv[3];
   memset(register_pipe, '\0', PIPE_NAME_SIZE);
   memset(message.pipename, '\0', PIPE_NAME_SIZE);
   strcpy(register_pipe, argv[1]);
   strcpy(message.pipename, argv[2]);
-  // initializes mailboxes info array
-  for (int i = 0; i < MAX_MAILBOXES; i++) {
-    mail_boxes[i].box_name[0] = '\0';
-    mail_boxes[i].box_size = 0;
-    mail_boxes[i].n_pubs = 0;
-    mail_boxes[i].n_subs = 0;
-  }
   int regpipe_fd, pipe_fd;
   // unlinks to ensure that if a pipe with the same name exists, it is deleted
   unlink(message.pipename);
@@ -41,70 +95,108 @@ int main(int argc, char **argv) {
   }
   // box listing
   if (!strcmp(action, "list")) {
-    // listar boxes
+    // listar boxes, optionally only those with a prefix, and a page at a time
     message.code = 7;
-    if (write(regpipe_fd, &message, sizeof(protocol)) == -1) {
+    for (int i = 4; i < argc; i += 2) {
+      if (i + 1 == argc || strlen(argv[i + 1]) >= BOX_NAME_SIZE) {
+        print_usage();
+        return -1;
+      }
+      if (!strcmp(argv[i], "--prefix")) {
+        strcpy(message.boxname, argv[i + 1]);
+      } else if (!strcmp(argv[i], "--after")) {
+        strcpy(message.cursor, argv[i + 1]);
+      } else if (!strcmp(argv[i], "--limit")) {
+        message.limit = (uint32_t)strtoul(argv[i + 1], NULL, 10);
+      } else {
+        print_usage();
+        return -1;
+      }
+    }
+    if (frame_write_register(regpipe_fd, &message) == -1) {
       perror("error writing to register pipe");
       return -1;
     }
     close(regpipe_fd);
 
-    uint8_t last = 0;
-    box_list_response res;
-    size_t i = 0;
     pipe_fd = open(message.pipename, O_RDONLY);
-    // reads messages from communication pipe with individual box info
-    do {
-      if (read(pipe_fd, &res, sizeof(res)) == -1)
-        return -1;
-      if (res.code != 8)
-        break;
-
-      last = res.last;
-      if (res.box.box_name[0] != '\0') {
-        mail_boxes[i] = res.box;
-        mail_boxes_size++;
-        i++;
-      }
-    } while (last == 0);
+    if (list_boxes(pipe_fd) == -1) {
+      perror("error reading box listing");
+      return -1;
+    }
     close(pipe_fd);
-
-    if (mail_boxes_size == 0) {
-      fprintf(stdout, "NO BOXES FOUND\n");
-      return 0;
+  }
+  // stats of the boxes (optionally only those with a prefix) and the broker
+  else if (!strcmp(action, "stats")) {
+    message.code = 14;
+    if (argc == 6 && !strcmp(argv[4], "--prefix") &&
+        strlen(argv[5]) < BOX_NAME_SIZE) {
+      strcpy(message.boxname, argv[5]);
+    } else if (argc != 4) {
+      print_usage();
+      return -1;
     }
-    // sorts mailboxes alphabetically
-    qsort(mail_boxes, i, sizeof(mail_box), str_compare);
-    // displays mailboxes info
-    for (int j = 0; j < mail_boxes_size; j++) {
-      fprintf(stdout, "%s %zu %zu %zu\n", mail_boxes[j].box_name,
-              mail_boxes[j].box_size, mail_boxes[j].n_pubs,
-              mail_boxes[j].n_subs);
+    if (frame_write_register(regpipe_fd, &message) == -1) {
+      perror("error writing to register pipe");
+      return -1;
+    }
+    close(regpipe_fd);
+
+    pipe_fd = open(message.pipename, O_RDONLY);
+    if (print_stats(pipe_fd) == -1) {
+      perror("error reading stats");
+      return -1;
     }
+    close(pipe_fd);
   }
   // box creation/deletion request
   else {
     box_response res;
+    frame_reader reader;
+    frame_header header;
 
-    memset(message.boxname, '\0', BOX_NAME_SIZE);
+    int create = !strcmp(action, "create");
+    if (argc < 5 || strlen(argv[4]) >= BOX_NAME_SIZE ||
+        (argc != 5 && !create)) {
+      print_usage();
+      return -1;
+    }
     strcpy(message.boxname, argv[4]);
-    if (!strcmp(action, "create"))
-      message.code = 3;
-    else
-      message.code = 5;
+    // the box only keeps what its retention limits allow, if it has any
+    for (int i = 5; i < argc; i += 2) {
+      char *end;
+      uint64_t value = i + 1 < argc ? strtoull(argv[i + 1], &end, 10) : 0;
+      if (i + 1 == argc || *argv[i + 1] == '\0' || *end != '\0') {
+        print_usage();
+        return -1;
+      }
+      if (!strcmp(argv[i], "--max-bytes")) {
+        message.max_bytes = value;
+      } else if (!strcmp(argv[i], "--max-messages")) {
+        message.max_messages = value;
+      } else if (!strcmp(argv[i], "--max-age")) {
+        message.max_age = value;
+      } else {
+        print_usage();
+        return -1;
+      }
+    }
+    message.code = create ? 3 : 5;
 
-    if (write(regpipe_fd, &message, sizeof(protocol)) == -1) {
+    if (frame_write_register(regpipe_fd, &message) == -1) {
       perror("error writing to register pipe");
       return -1;
     }
     close(regpipe_fd);
     // read code
     pipe_fd = open(message.pipename, O_RDONLY);
+    frame_reader_init(&reader, pipe_fd);
 
-    if (read(pipe_fd, &res, sizeof(res)) == -1) {
+    memset(&res, 0, sizeof(res));
+    if (frame_read(&reader, &header, &res, sizeof(res) - 1) != 1) {
       return -1;
     }
-    if (res.code != message.code + 1) {
+    if (header.code != message.code + 1) {
       perror("incorrect answer code sent");
       return -1;
     }
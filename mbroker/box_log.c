@@ -0,0 +1,667 @@
+#include "box_log.h"
+#include "operations.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RECORD_HEADER_SIZE (sizeof(log_record_header))
+
+uint32_t box_log_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint32_t)((uint64_t)ts.tv_sec * 1000000 +
+                    (uint64_t)ts.tv_nsec / 1000);
+}
+
+// the file position of a position in the log
+static size_t file_position(box_log const *log, size_t position) {
+  if (log->bl_lap_size == 0)
+    return position;
+  return sizeof(log_file_header) +
+         (position - sizeof(log_file_header)) % log->bl_lap_size;
+}
+
+// the position where the lap of a position in the log starts
+static size_t lap_start(box_log const *log, size_t position) {
+  if (log->bl_lap_size == 0)
+    return 0;
+  return position - (position - sizeof(log_file_header)) % log->bl_lap_size;
+}
+
+// opens the tfs file of a log, which is left empty
+static int log_open(box_log *log, char const *name) {
+  log->bl_fhandle = tfs_open(name, 0);
+  if (log->bl_fhandle == -1)
+    return -1;
+  log->bl_segments = NULL;
+  log->bl_segments_size = 0;
+  log->bl_segments_capacity = 0;
+  log->bl_next_offset = 0;
+  log->bl_start = 0;
+  log->bl_end = 0;
+  log->bl_reclaimed = 0;
+  log->bl_lap_size = 0;
+  log->bl_lap_start = 0;
+  log->bl_lap_gap = 0;
+  memset(&log->bl_retention, 0, sizeof(log->bl_retention));
+  box_log_index_name(log->bl_index_name, name);
+  log->bl_checkpointed = 0;
+  pthread_rwlock_init(&log->bl_lock, NULL);
+  return 0;
+}
+
+int box_log_create(box_log *log, char const *name,
+                   log_retention const *retention) {
+  if (log_open(log, name) == -1)
+    return -1;
+  log_file_header header;
+  memset(&header, 0, sizeof(header));
+  header.lh_magic = LOG_MAGIC;
+  header.lh_start = sizeof(header);
+  if (retention != NULL)
+    header.lh_retention = *retention;
+  header.lh_lap_size = tfs_max_file_size() - sizeof(header);
+  if (tfs_pwrite(log->bl_fhandle, &header, sizeof(header), 0) !=
+      sizeof(header)) {
+    box_log_destroy(log);
+    return -1;
+  }
+  log->bl_start = sizeof(header);
+  log->bl_end = sizeof(header);
+  log->bl_reclaimed = sizeof(header);
+  log->bl_lap_size = header.lh_lap_size;
+  log->bl_lap_start = sizeof(header);
+  log->bl_lap_gap = sizeof(header);
+  log->bl_retention = header.lh_retention;
+  log->bl_checkpointed = sizeof(header);
+  tfs_unlink(log->bl_index_name);
+  return 0;
+}
+
+// frees the segments of a log, and their index
+static void segments_free(box_log *log) {
+  for (size_t i = 0; i < log->bl_segments_size; i++) {
+    free(log->bl_segments[i].seg_index);
+  }
+  free(log->bl_segments);
+  log->bl_segments = NULL;
+  log->bl_segments_size = 0;
+  log->bl_segments_capacity = 0;
+}
+
+void box_log_destroy(box_log *log) {
+  segments_free(log);
+  tfs_close(log->bl_fhandle);
+  pthread_rwlock_destroy(&log->bl_lock);
+}
+
+// grows an array (of segments or index entries) so that it has room for one
+// more element, returning -1 if it can't be grown
+static int grow(void **array, size_t *capacity, size_t size, size_t elem) {
+  if (size < *capacity)
+    return 0;
+  size_t new_capacity = *capacity == 0 ? 8 : *capacity * 2;
+  void *new_array = realloc(*array, new_capacity * elem);
+  if (new_array == NULL)
+    return -1;
+  *array = new_array;
+  *capacity = new_capacity;
+  return 0;
+}
+
+// returns the segment the next record goes to, starting a new one if the
+// current segment is full or the record starts a lap, so that segments are
+// never split between laps (which can only fail if bl_segments is full); must
+// be called with the write lock held
+static log_segment *tail_segment(box_log *log) {
+  if (log->bl_segments_size > 0) {
+    log_segment *tail = &log->bl_segments[log->bl_segments_size - 1];
+    if (tail->seg_end - tail->seg_start < LOG_SEGMENT_SIZE &&
+        log->bl_end != log->bl_lap_start)
+      return tail;
+  }
+  if (grow((void **)&log->bl_segments, &log->bl_segments_capacity,
+           log->bl_segments_size, sizeof(log_segment)) == -1)
+    return NULL;
+
+  log_segment *segment = &log->bl_segments[log->bl_segments_size++];
+  segment->seg_base_offset = log->bl_next_offset;
+  segment->seg_start = log->bl_end;
+  segment->seg_end = log->bl_end;
+  segment->seg_index = NULL;
+  segment->seg_index_size = 0;
+  segment->seg_index_capacity = 0;
+  return segment;
+}
+
+// moves the end of the log to the position of the next record: either where
+// the last record ends or the start of the next lap; must be called with the
+// write lock held
+static void lap_enter(box_log *log, size_t position) {
+  size_t start = lap_start(log, position);
+  if (start != log->bl_lap_start) {
+    log->bl_lap_gap = log->bl_end;
+    log->bl_lap_start = start;
+  }
+  log->bl_end = position;
+}
+
+// adds the record at bl_end (already in the file) to the segments and their
+// index, which can only fail if it needs a new segment and bl_segments is
+// full; must be called with the write lock held
+static int index_record(box_log *log, uint32_t length, time_t now) {
+  log_segment *segment = tail_segment(log);
+  if (segment == NULL)
+    return -1;
+  segment->seg_appended = now;
+  // indexes the first record of the segment and then one every
+  // LOG_INDEX_INTERVAL bytes
+  size_t entries = segment->seg_index_size;
+  if (entries == 0 ||
+      log->bl_end - segment->seg_index[entries - 1].ie_position >=
+          LOG_INDEX_INTERVAL) {
+    if (grow((void **)&segment->seg_index, &segment->seg_index_capacity,
+             entries, sizeof(log_index_entry)) == 0) {
+      segment->seg_index[entries].ie_offset = log->bl_next_offset;
+      segment->seg_index[entries].ie_position = log->bl_end;
+      segment->seg_index_size++;
+    }
+  }
+  log->bl_next_offset++;
+  log->bl_end += RECORD_HEADER_SIZE + length;
+  segment->seg_end = log->bl_end;
+  return 0;
+}
+
+// reads the header of the record at a position, if it is whole and follows
+// the last record (the first one kept may have any offset), so a batch cut
+// short by the file system filling up is left out (and then overwritten by the
+// next append), and so are records left from previous laps
+static int record_at(box_log *log, size_t position, log_record_header *header) {
+  size_t file_pos = file_position(log, position);
+  char last;
+  return tfs_pread(log->bl_fhandle, header, RECORD_HEADER_SIZE, file_pos) ==
+             (ssize_t)RECORD_HEADER_SIZE &&
+         (header->rh_offset == log->bl_next_offset ||
+          log->bl_end == log->bl_start) &&
+         (header->rh_length == 0 ||
+          tfs_pread(log->bl_fhandle, &last, 1,
+                    file_pos + RECORD_HEADER_SIZE + header->rh_length - 1) ==
+              1);
+}
+
+void box_log_index_name(char *index_name, char const *name) {
+  snprintf(index_name, LOG_INDEX_NAME_SIZE, "%s%s", name, LOG_INDEX_SUFFIX);
+}
+
+int box_log_is_index(char const *name) {
+  size_t length = strlen(name), suffix = strlen(LOG_INDEX_SUFFIX);
+  return length >= suffix && !strcmp(name + length - suffix, LOG_INDEX_SUFFIX);
+}
+
+// takes the segments of the index file read into buffer (the segments and
+// then their entries) from the first record kept on, if it starts one of them
+// (those before were dropped after the file was written) and the last record
+// indexed is still where it was; must be called on a log with no records yet
+//
+// Returns 0 if successful, -1 otherwise (leaving the log with no records)
+static int index_restore(box_log *log, log_index_header const *header,
+                         char const *buffer, time_t now) {
+  char const *entries =
+      buffer + header->ih_segments * sizeof(log_index_segment);
+  log_index_entry last;
+  log_record_header record;
+  memcpy(&last, entries + (header->ih_entries - 1) * sizeof(last),
+         sizeof(last));
+  if (tfs_pread(log->bl_fhandle, &record, RECORD_HEADER_SIZE,
+                file_position(log, last.ie_position)) !=
+          (ssize_t)RECORD_HEADER_SIZE ||
+      record.rh_offset != last.ie_offset)
+    return -1;
+
+  size_t entry = 0;
+  for (size_t i = 0; i < header->ih_segments; i++) {
+    log_index_segment persisted;
+    memcpy(&persisted, buffer + i * sizeof(persisted), sizeof(persisted));
+    if (persisted.is_entries == 0 ||
+        persisted.is_entries > header->ih_entries - entry) {
+      segments_free(log);
+      return -1;
+    }
+    size_t first = entry;
+    entry += persisted.is_entries;
+    if (persisted.is_start < log->bl_start)
+      continue;
+    if ((log->bl_segments_size == 0 && persisted.is_start != log->bl_start) ||
+        grow((void **)&log->bl_segments, &log->bl_segments_capacity,
+             log->bl_segments_size, sizeof(log_segment)) == -1) {
+      segments_free(log);
+      return -1;
+    }
+    log_segment *segment = &log->bl_segments[log->bl_segments_size];
+    size_t size = persisted.is_entries * sizeof(log_index_entry);
+    segment->seg_index = malloc(size);
+    if (segment->seg_index == NULL) {
+      segments_free(log);
+      return -1;
+    }
+    memcpy(segment->seg_index, entries + first * sizeof(log_index_entry),
+           size);
+    segment->seg_index_size = persisted.is_entries;
+    segment->seg_index_capacity = persisted.is_entries;
+    segment->seg_base_offset = persisted.is_base_offset;
+    segment->seg_start = persisted.is_start;
+    segment->seg_end = persisted.is_end;
+    segment->seg_appended = now;
+    log->bl_segments_size++;
+  }
+  if (log->bl_segments_size == 0)
+    return -1;
+  log->bl_next_offset = header->ih_next_offset;
+  log->bl_end = header->ih_end;
+  log->bl_lap_start = header->ih_lap_start;
+  log->bl_lap_gap = header->ih_lap_gap;
+  log->bl_checkpointed = header->ih_end;
+  return 0;
+}
+
+// loads the segments of a log, and their index, from its index file; must be
+// called on a log with no records yet
+//
+// Returns 0 if successful, -1 otherwise (leaving the log with no records)
+static int index_load(box_log *log, time_t now) {
+  int fhandle = tfs_open(log->bl_index_name, 0);
+  if (fhandle == -1)
+    return -1;
+  log_index_header header;
+  size_t max_size = tfs_max_file_size();
+  char *buffer = NULL;
+  int result = -1;
+  if (tfs_pread(fhandle, &header, sizeof(header), 0) == sizeof(header) &&
+      header.ih_magic == LOG_INDEX_MAGIC &&
+      header.ih_lap_size == log->bl_lap_size &&
+      header.ih_end > log->bl_start && header.ih_segments > 0 &&
+      header.ih_segments < max_size / sizeof(log_index_segment) &&
+      header.ih_entries > 0 &&
+      header.ih_entries < max_size / sizeof(log_index_entry)) {
+    size_t size = header.ih_segments * sizeof(log_index_segment) +
+                  header.ih_entries * sizeof(log_index_entry);
+    buffer = malloc(size);
+    if (buffer != NULL &&
+        tfs_pread(fhandle, buffer, size, sizeof(header)) == (ssize_t)size)
+      result = index_restore(log, &header, buffer, now);
+  }
+  free(buffer);
+  tfs_close(fhandle);
+  return result;
+}
+
+int box_log_recover(box_log *log, char const *name) {
+  if (log_open(log, name) == -1)
+    return -1;
+  log_file_header file_header;
+  // headers written before logs wrapped end before lh_lap_size
+  ssize_t header_size =
+      tfs_pread(log->bl_fhandle, &file_header, sizeof(file_header), 0);
+  if (header_size >= (ssize_t)offsetof(log_file_header, lh_lap_size) &&
+      (file_header.lh_magic == LOG_MAGIC ||
+       file_header.lh_magic == LOG_MAGIC_V1)) {
+    log->bl_start = file_header.lh_start;
+    log->bl_end = file_header.lh_start;
+    log->bl_reclaimed = file_header.lh_start;
+    log->bl_retention = file_header.lh_retention;
+    if (file_header.lh_magic == LOG_MAGIC) {
+      log->bl_lap_size = file_header.lh_lap_size;
+      log->bl_lap_start = lap_start(log, log->bl_start);
+      log->bl_lap_gap = log->bl_lap_start;
+    }
+  }
+
+  // only the records appended after the index file was written are read
+  time_t now = time(NULL);
+  index_load(log, now);
+  log_record_header header;
+  for (;;) {
+    size_t position = log->bl_end;
+    if (!record_at(log, position, &header)) {
+      // the next record may start the next lap
+      if (log->bl_lap_size == 0 || log->bl_end == log->bl_start ||
+          position == lap_start(log, position))
+        break;
+      position = lap_start(log, position) + log->bl_lap_size;
+      if (!record_at(log, position, &header))
+        break;
+    }
+    lap_enter(log, position);
+    log->bl_next_offset = header.rh_offset;
+    if (index_record(log, header.rh_length, now) == -1) {
+      box_log_destroy(log);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+ssize_t box_log_append(box_log *log, void const *message, uint32_t length) {
+  return box_log_append_many(log, &message, &length, 1);
+}
+
+ssize_t box_log_append_many(box_log *log, void const *const *messages,
+                            uint32_t const *lengths, size_t n) {
+  size_t batch_size = 0;
+  for (size_t i = 0; i < n; i++) {
+    batch_size += RECORD_HEADER_SIZE + lengths[i];
+  }
+  char *batch = malloc(batch_size);
+  if (batch == NULL)
+    return -1;
+
+  pthread_rwlock_wrlock(&log->bl_lock);
+  // every record may start a segment, and running out of memory halfway
+  // through the batch would leave it partially visible
+  while (log->bl_segments_capacity < log->bl_segments_size + n) {
+    if (grow((void **)&log->bl_segments, &log->bl_segments_capacity,
+             log->bl_segments_capacity, sizeof(log_segment)) == -1) {
+      pthread_rwlock_unlock(&log->bl_lock);
+      free(batch);
+      return -1;
+    }
+  }
+
+  // the batch starts the next lap if it doesn't fit in the current one, and
+  // only takes blocks that were freed (or never used)
+  size_t start = log->bl_end;
+  if (log->bl_lap_size > 0) {
+    size_t lap_end = lap_start(log, start) + log->bl_lap_size;
+    if (start + batch_size > lap_end)
+      start = lap_end;
+    if (start + batch_size > log->bl_reclaimed + log->bl_lap_size) {
+      pthread_rwlock_unlock(&log->bl_lock);
+      free(batch);
+      return -1;
+    }
+  }
+
+  size_t position = 0;
+  uint32_t now = box_log_now();
+  for (size_t i = 0; i < n; i++) {
+    log_record_header header;
+    header.rh_offset = log->bl_next_offset + i;
+    header.rh_length = lengths[i];
+    header.rh_time = now;
+    memcpy(batch + position, &header, RECORD_HEADER_SIZE);
+    memcpy(batch + position + RECORD_HEADER_SIZE, messages[i], lengths[i]);
+    position += RECORD_HEADER_SIZE + lengths[i];
+  }
+  // the records are only visible to readers once bl_end moves past them, so
+  // a partial write (file system full) is simply overwritten by the next one
+  if (tfs_pwrite(log->bl_fhandle, batch, batch_size,
+                 file_position(log, start)) < (ssize_t)batch_size) {
+    pthread_rwlock_unlock(&log->bl_lock);
+    free(batch);
+    return -1;
+  }
+  free(batch);
+
+  lap_enter(log, start);
+  time_t appended = time(NULL);
+  for (size_t i = 0; i < n; i++) {
+    index_record(log, lengths[i], appended);
+  }
+  pthread_rwlock_unlock(&log->bl_lock);
+  return (ssize_t)batch_size;
+}
+
+int box_log_seek(box_log *log, int fhandle, uint64_t offset,
+                 log_cursor *cursor) {
+  cursor->lc_time = 0;
+  pthread_rwlock_rdlock(&log->bl_lock);
+  if (offset >= log->bl_next_offset || log->bl_segments_size == 0) {
+    cursor->lc_offset = log->bl_next_offset;
+    cursor->lc_position = log->bl_end;
+    pthread_rwlock_unlock(&log->bl_lock);
+    return 0;
+  }
+
+  // last segment starting at or before offset
+  size_t lo = 0, hi = log->bl_segments_size;
+  while (hi - lo > 1) {
+    size_t mid = (lo + hi) / 2;
+    if (log->bl_segments[mid].seg_base_offset <= offset)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  log_segment *segment = &log->bl_segments[lo];
+
+  // last index entry at or before offset (the first record of a segment is
+  // always indexed)
+  lo = 0;
+  hi = segment->seg_index_size;
+  while (hi - lo > 1) {
+    size_t mid = (lo + hi) / 2;
+    if (segment->seg_index[mid].ie_offset <= offset)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  cursor->lc_offset = segment->seg_index[lo].ie_offset;
+  cursor->lc_position = segment->seg_index[lo].ie_position;
+  pthread_rwlock_unlock(&log->bl_lock);
+
+  // walks the (at most LOG_INDEX_INTERVAL bytes of) records in between
+  log_record_header header;
+  while (cursor->lc_offset < offset) {
+    if (tfs_pread(fhandle, &header, RECORD_HEADER_SIZE,
+                  file_position(log, cursor->lc_position)) <
+        (ssize_t)RECORD_HEADER_SIZE)
+      return -1;
+    cursor->lc_offset = header.rh_offset + 1;
+    cursor->lc_position += RECORD_HEADER_SIZE + header.rh_length;
+  }
+  return 0;
+}
+
+// moves a cursor left in dropped segments to the first record kept, and one
+// past the records of the lap before the current one to the start of the
+// current lap; must be called with the lock held
+static void skip_dropped(box_log *log, log_cursor *cursor) {
+  if (cursor->lc_position >= log->bl_lap_gap &&
+      cursor->lc_position < log->bl_lap_start)
+    cursor->lc_position = log->bl_lap_start;
+  if (cursor->lc_position >= log->bl_start)
+    return;
+  cursor->lc_position = log->bl_start;
+  cursor->lc_offset = log->bl_segments_size > 0
+                          ? log->bl_segments[0].seg_base_offset
+                          : log->bl_next_offset;
+}
+
+ssize_t box_log_read_many(box_log *log, int fhandle, log_cursor *cursor,
+                          void *buffer, size_t size, size_t limit) {
+  pthread_rwlock_rdlock(&log->bl_lock);
+  skip_dropped(log, cursor);
+  // records are only read within a lap, which is whole in the file
+  size_t end = cursor->lc_position < log->bl_lap_start ? log->bl_lap_gap
+                                                       : log->bl_end;
+  pthread_rwlock_unlock(&log->bl_lock);
+  if (end > limit)
+    end = limit;
+  if (cursor->lc_position >= end)
+    return 0;
+
+  size_t available = end - cursor->lc_position;
+  if (available > size)
+    available = size;
+  if (tfs_pread(fhandle, buffer, available,
+                file_position(log, cursor->lc_position)) < (ssize_t)available)
+    return -1;
+  // the records read may have been dropped (and their blocks freed, or reused
+  // by the next lap) meanwhile: box_log_trim moves bl_start past them before
+  // freeing anything, so if it hasn't moved yet, they were still there
+  pthread_rwlock_rdlock(&log->bl_lock);
+  int dropped = cursor->lc_position < log->bl_start;
+  pthread_rwlock_unlock(&log->bl_lock);
+  if (dropped)
+    return box_log_read_many(log, fhandle, cursor, buffer, size, limit);
+
+  // the last record read may be cut short, and is left for the next read
+  size_t used = 0;
+  log_record_header header;
+  while (available - used >= RECORD_HEADER_SIZE) {
+    memcpy(&header, (char *)buffer + used, RECORD_HEADER_SIZE);
+    if (header.rh_length > available - used - RECORD_HEADER_SIZE)
+      break;
+    used += RECORD_HEADER_SIZE + header.rh_length;
+    cursor->lc_offset = header.rh_offset + 1;
+    cursor->lc_time = header.rh_time;
+  }
+  if (used == 0)
+    return -1;
+  cursor->lc_position += used;
+  return (ssize_t)used;
+}
+
+size_t box_log_size(box_log *log) {
+  pthread_rwlock_rdlock(&log->bl_lock);
+  size_t size = log->bl_end - log->bl_start;
+  pthread_rwlock_unlock(&log->bl_lock);
+  return size;
+}
+
+int box_log_retains(box_log const *log) {
+  return log->bl_retention.lr_max_bytes > 0 ||
+         log->bl_retention.lr_max_messages > 0 ||
+         log->bl_retention.lr_max_age > 0;
+}
+
+// whether the retention policy of a log drops its oldest segment; must be
+// called with the lock held
+static int drops_oldest(box_log const *log, size_t dropped, time_t now) {
+  log_retention const *retention = &log->bl_retention;
+  // the segment being appended to is kept
+  if (dropped + 1 >= log->bl_segments_size)
+    return 0;
+  log_segment const *oldest = &log->bl_segments[dropped];
+  uint64_t bytes = log->bl_end - oldest->seg_start;
+  uint64_t messages = log->bl_next_offset - oldest->seg_base_offset;
+  return (retention->lr_max_bytes > 0 && bytes > retention->lr_max_bytes) ||
+         (retention->lr_max_messages > 0 &&
+          messages > retention->lr_max_messages) ||
+         (retention->lr_max_age > 0 &&
+          now - oldest->seg_appended > (time_t)retention->lr_max_age);
+}
+
+size_t box_log_trim(box_log *log, time_t now, size_t *from) {
+  pthread_rwlock_wrlock(&log->bl_lock);
+  size_t dropped = 0;
+  while (drops_oldest(log, dropped, now)) {
+    dropped++;
+  }
+  if (dropped == 0) {
+    pthread_rwlock_unlock(&log->bl_lock);
+    return 0;
+  }
+  *from = log->bl_start;
+  for (size_t i = 0; i < dropped; i++) {
+    free(log->bl_segments[i].seg_index);
+  }
+  log->bl_segments_size -= dropped;
+  memmove(log->bl_segments, log->bl_segments + dropped,
+          log->bl_segments_size * sizeof(log_segment));
+  log->bl_start = log->bl_segments[0].seg_start;
+  size_t dropped_size = log->bl_start - *from;
+  pthread_rwlock_unlock(&log->bl_lock);
+  return dropped_size;
+}
+
+int box_log_reclaim(box_log *log, size_t from, size_t length) {
+  // the header is written first, so the log is never recovered from a record
+  // whose block was freed (logs without a header have no retention policy)
+  uint64_t start = from + length;
+  if (tfs_pwrite(log->bl_fhandle, &start, sizeof(start),
+                 offsetof(log_file_header, lh_start)) != sizeof(start))
+    return -1;
+  // tfs only frees blocks wholly in the range, and the block the range starts
+  // in holds the end of the records dropped before, so the range starts where
+  // the previous one did, to free that block too (the blocks freed then are
+  // skipped). It spans at most a lap, as appends never go a lap past it
+  size_t reclaimed = log->bl_reclaimed;
+  size_t lap_end = lap_start(log, reclaimed) + log->bl_lap_size;
+  if (log->bl_lap_size > 0 && start > lap_end) {
+    if (tfs_punch(log->bl_fhandle, file_position(log, reclaimed),
+                  lap_end - reclaimed) == -1)
+      return -1;
+    reclaimed = lap_end;
+  }
+  if (tfs_punch(log->bl_fhandle, file_position(log, reclaimed),
+                start - reclaimed) == -1)
+    return -1;
+  // appends may only reuse the blocks once they are freed
+  pthread_rwlock_wrlock(&log->bl_lock);
+  log->bl_reclaimed = from;
+  pthread_rwlock_unlock(&log->bl_lock);
+  // the index file still has the segments dropped, which recovering the log
+  // skips, so it is written anew to be of use
+  return box_log_checkpoint(log, 0);
+}
+
+int box_log_checkpoint(box_log *log, size_t min_growth) {
+  pthread_rwlock_rdlock(&log->bl_lock);
+  size_t end = log->bl_end;
+  if (end == log->bl_checkpointed || end - log->bl_checkpointed < min_growth) {
+    pthread_rwlock_unlock(&log->bl_lock);
+    return 0;
+  }
+  size_t entries = 0;
+  for (size_t i = 0; i < log->bl_segments_size; i++) {
+    entries += log->bl_segments[i].seg_index_size;
+  }
+  size_t size = sizeof(log_index_header) +
+                log->bl_segments_size * sizeof(log_index_segment) +
+                entries * sizeof(log_index_entry);
+  char *buffer = malloc(size);
+  if (buffer == NULL) {
+    pthread_rwlock_unlock(&log->bl_lock);
+    return -1;
+  }
+  log_index_header header;
+  header.ih_magic = LOG_INDEX_MAGIC;
+  header.ih_lap_size = log->bl_lap_size;
+  header.ih_next_offset = log->bl_next_offset;
+  header.ih_end = end;
+  header.ih_lap_start = log->bl_lap_start;
+  header.ih_lap_gap = log->bl_lap_gap;
+  header.ih_segments = log->bl_segments_size;
+  header.ih_entries = entries;
+  memcpy(buffer, &header, sizeof(header));
+  char *segments = buffer + sizeof(header);
+  char *entry = segments + log->bl_segments_size * sizeof(log_index_segment);
+  for (size_t i = 0; i < log->bl_segments_size; i++) {
+    log_segment const *segment = &log->bl_segments[i];
+    log_index_segment persisted = {segment->seg_base_offset,
+                                   segment->seg_start, segment->seg_end,
+                                   segment->seg_index_size};
+    memcpy(segments + i * sizeof(persisted), &persisted, sizeof(persisted));
+    memcpy(entry, segment->seg_index,
+           segment->seg_index_size * sizeof(log_index_entry));
+    entry += segment->seg_index_size * sizeof(log_index_entry);
+  }
+  pthread_rwlock_unlock(&log->bl_lock);
+
+  // with a single write, which tfs logs whole or not at all (and after the
+  // records indexed, so they are recovered whenever the file is)
+  int fhandle = tfs_open(log->bl_index_name, TFS_O_CREAT);
+  int result = fhandle != -1 &&
+                       tfs_pwrite(fhandle, buffer, size, 0) == (ssize_t)size
+                   ? 0
+                   : -1;
+  if (fhandle != -1)
+    tfs_close(fhandle);
+  free(buffer);
+  if (result == 0)
+    log->bl_checkpointed = end;
+  return result;
+}
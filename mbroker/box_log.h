@@ -0,0 +1,249 @@
+#ifndef __MBROKER_BOX_LOG_H__
+#define __MBROKER_BOX_LOG_H__
+
+#include "extras.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+// Each box is stored in tfs as an append-only log of records. A record is a
+// header (with the length of the message, its offset, i.e. its position in
+// the sequence of messages of the box, and when it was appended) followed by
+// the message itself, so message boundaries never have to be recovered by
+// scanning the text.
+//
+// The log is split into segments of roughly LOG_SEGMENT_SIZE bytes, and every
+// segment keeps a sparse index with one entry every LOG_INDEX_INTERVAL bytes.
+// Finding a message by offset is a binary search over the segments and then
+// over the index of the segment, followed by a short walk over record headers.
+//
+// The file starts with a log_file_header, with the box's retention policy and
+// where its first record is. Old records are dropped a whole segment at a time
+// (see box_log_trim), leaving a hole in the file, whose blocks tfs frees.
+//
+// Records are found by their position in the log, which only grows. The log
+// wraps around in its file, every lh_lap_size bytes (as much as fits in a tfs
+// file), to right after the header, so that a log whose oldest records keep
+// being dropped can be appended to for good: a record's file position is its
+// position less as many whole laps as it is past the first. A batch of records
+// is never split between laps, but starts the next lap instead, leaving what
+// is left of the current one unused.
+//
+// So that a log is recovered without reading every record in it, its segments
+// and their index are also written to a tfs file named after the log's with
+// LOG_INDEX_SUFFIX appended: whenever records are dropped (see
+// box_log_reclaim), and whenever box_log_checkpoint is called. The file has a
+// log_index_header, followed by a log_index_segment for every segment, and
+// then the index entries of every segment in turn. Recovering the log only
+// reads the records appended after the file was written.
+//
+// Files written before logs wrapped have a header with LOG_MAGIC_V1 (and
+// without lh_lap_size), and their positions are file positions. Files written
+// before there was a header start with the first record (whose offset, 0,
+// tells them apart from the header's magic number).
+
+#define LOG_SEGMENT_SIZE (64 * 1024)
+#define LOG_INDEX_INTERVAL (4 * 1024)
+#define LOG_MAGIC (0x32474f4c584f424dULL)    // "MBOXLOG2"
+#define LOG_MAGIC_V1 (0x31474f4c584f424dULL) // "MBOXLOG1"
+#define LOG_INDEX_MAGIC (0x31584449584f424dULL) // "MBOXIDX1"
+#define LOG_INDEX_SUFFIX ".idx"
+// size of the name of the index file of a box's log
+#define LOG_INDEX_NAME_SIZE (BOX_NAME_SIZE + sizeof(LOG_INDEX_SUFFIX) - 1)
+
+// how much of a box is kept: the oldest segments are dropped while the box
+// holds more bytes or messages than allowed, or was last appended to longer
+// ago than allowed (0 for no limit). The segment being appended to is always
+// kept
+typedef struct {
+  uint64_t lr_max_bytes;
+  uint64_t lr_max_messages;
+  uint64_t lr_max_age; // in seconds
+} log_retention;
+
+typedef struct {
+  uint64_t lh_magic;
+  uint64_t lh_start; // position of the first record kept
+  log_retention lh_retention;
+  uint64_t lh_lap_size;
+} log_file_header;
+
+typedef struct {
+  uint64_t rh_offset;
+  uint32_t rh_length;
+  // when the record was appended, in microseconds since the epoch, modulo
+  // 2^32 (so only differences of up to about 71 minutes can be told)
+  uint32_t rh_time;
+} log_record_header;
+
+// box_log_now: the current time, as in rh_time
+uint32_t box_log_now(void);
+
+typedef struct {
+  uint64_t ie_offset;
+  size_t ie_position;
+} log_index_entry;
+
+typedef struct {
+  uint64_t seg_base_offset; // offset of the first record of the segment
+  size_t seg_start;         // position of the first record
+  size_t seg_end;           // position past the last record
+  // when its last record was appended (or, for segments recovered from the
+  // file, when the log was recovered)
+  time_t seg_appended;
+  log_index_entry *seg_index;
+  size_t seg_index_size;
+  size_t seg_index_capacity;
+} log_segment;
+
+typedef struct {
+  uint64_t ih_magic;
+  uint64_t ih_lap_size;    // of the log, which must match
+  uint64_t ih_next_offset; // of the log when written, and so on
+  uint64_t ih_end;
+  uint64_t ih_lap_start;
+  uint64_t ih_lap_gap;
+  uint64_t ih_segments; // number of log_index_segment that follow
+  uint64_t ih_entries;  // number of log_index_entry after them
+} log_index_header;
+
+typedef struct {
+  uint64_t is_base_offset;
+  uint64_t is_start;
+  uint64_t is_end;
+  uint64_t is_entries; // number of index entries of the segment
+} log_index_segment;
+
+typedef struct {
+  int bl_fhandle; // tfs handle used to append to the log
+  log_segment *bl_segments;
+  size_t bl_segments_size;
+  size_t bl_segments_capacity;
+  uint64_t bl_next_offset; // offset the next record will get
+  size_t bl_start;         // position of the first record kept
+  size_t bl_end;           // position past the last record
+  // where the records dropped by the last trim started: the blocks before it
+  // are freed, but for the one it is in, which is shared with those records.
+  // Appends never go a lap past it, so they only reuse freed blocks
+  size_t bl_reclaimed;
+  // 0 for logs that don't wrap. Otherwise, the lap of bl_end starts at
+  // bl_lap_start, and the records in the lap before end at bl_lap_gap
+  size_t bl_lap_size;
+  size_t bl_lap_start;
+  size_t bl_lap_gap;
+  log_retention bl_retention;
+  char bl_index_name[LOG_INDEX_NAME_SIZE];
+  // bl_end when the index file was last written (only used by whoever writes
+  // it, which must be one thread at a time)
+  size_t bl_checkpointed;
+  pthread_rwlock_t bl_lock;
+} box_log;
+
+// position of a reader in the log
+typedef struct {
+  uint64_t lc_offset; // offset of the next record to read
+  size_t lc_position; // position of the next record to read
+  uint32_t lc_time;   // rh_time of the last record read
+} log_cursor;
+
+// box_log_create: creates an empty log on a new (empty) tfs file, with a
+// retention policy (or none, if retention is NULL), which wraps around in the
+// file as it is trimmed. Any index file left by an earlier log with the same
+// name is removed
+//
+// Returns 0 if successful, -1 otherwise
+int box_log_create(box_log *log, char const *name,
+                   log_retention const *retention);
+
+// box_log_recover: opens the log of an existing tfs file (such as one
+// restored by tfs_init), loading its segments and index from its index file
+// (unless it is missing, or was written before the records it indexes were
+// dropped) and rebuilding the rest from the records appended after
+//
+// Returns 0 if successful, -1 otherwise
+int box_log_recover(box_log *log, char const *name);
+
+// box_log_destroy: releases the internal resources of the log
+//
+// Memory: does not free the log pointer itself, nor the tfs file
+void box_log_destroy(box_log *log);
+
+// box_log_append: appends a message to the log
+//
+// Returns the size of the record written (header included), or -1 if the
+// file system has no space left (or the file, with the records kept)
+ssize_t box_log_append(box_log *log, void const *message, uint32_t length);
+
+// box_log_append_many: appends n messages to the log, with a single write to
+// the file system
+//
+// Returns the total size of the records written, or -1 if the file system
+// has no space left (in which case none of the messages is appended)
+ssize_t box_log_append_many(box_log *log, void const *const *messages,
+                            uint32_t const *lengths, size_t n);
+
+// box_log_size: the size of the records kept in the log
+size_t box_log_size(box_log *log);
+
+// box_log_retains: whether the log has a retention policy (which is fixed
+// when the log is created)
+int box_log_retains(box_log const *log);
+
+// box_log_trim: drops the oldest segments of the log that its retention
+// policy doesn't keep, from its index only: readers that were still in them
+// skip to the first record kept. from is set to where the dropped records
+// started, for box_log_reclaim to free them. Appends and reads go on
+// meanwhile, but for the brief update of the index
+//
+// Returns the size of the records dropped
+size_t box_log_trim(box_log *log, time_t now, size_t *from);
+
+// box_log_reclaim: frees the blocks in tfs of the length bytes of records
+// dropped from the log by box_log_trim at from, and of the block they share
+// with the records dropped by the trim before (only once the records are
+// dropped, so no reader reads them anymore), and then writes the index file.
+// Must be called after every trim that drops records, in the same order
+//
+// Returns 0 if successful, -1 otherwise
+int box_log_reclaim(box_log *log, size_t from, size_t length);
+
+// box_log_checkpoint: writes the index file of the log, if the log grew by at
+// least min_growth bytes (and by some) since it was last written, so that it
+// is recovered from there. Appends and reads go on meanwhile, but for the
+// brief copy of the index
+//
+// Returns 0 if successful, -1 otherwise
+int box_log_checkpoint(box_log *log, size_t min_growth);
+
+// box_log_index_name: the name of the index file of the log of a tfs file
+void box_log_index_name(char *index_name, char const *name);
+
+// box_log_is_index: whether a tfs file name is that of a log's index file
+// (and so can't be a log's)
+int box_log_is_index(char const *name);
+
+// box_log_seek: places a cursor on the message with the given offset (or at
+// the end of the log, if there is no such message yet, or at the first record
+// kept, if it was dropped), reading through the tfs handle fhandle
+//
+// Returns 0 if successful, -1 otherwise
+int box_log_seek(box_log *log, int fhandle, uint64_t offset,
+                 log_cursor *cursor);
+
+// box_log_read_many: reads into buffer, with a single read from the file
+// system, as many whole records from the cursor on as fit in size bytes (and
+// end before the position limit, which must be a record boundary), and
+// advances the cursor past them. The records are copied as they are in the
+// log: each a log_record_header followed by its message
+//
+// A cursor left in dropped segments skips to the first record kept.
+//
+// Returns the size of the records read, 0 if the cursor is at the end of the
+// log (or at limit), or -1 in case of error (including a record larger than
+// size)
+ssize_t box_log_read_many(box_log *log, int fhandle, log_cursor *cursor,
+                          void *buffer, size_t size, size_t limit);
+
+#endif // __MBROKER_BOX_LOG_H__
@@ -0,0 +1,113 @@
+#include "groups.h"
+#include "operations.h"
+
+#include <stddef.h>
+#include <stdio.h>
+
+void groups_init(box_groups *groups) {
+  groups->bg_fhandle = -1;
+  groups->bg_groups = NULL;
+  groups->bg_size = 0;
+  groups->bg_capacity = 0;
+}
+
+void groups_destroy(box_groups *groups) {
+  if (groups->bg_fhandle != -1)
+    tfs_close(groups->bg_fhandle);
+  free(groups->bg_groups);
+  groups_init(groups);
+}
+
+void groups_file_name(char *file_name, char const *box_name) {
+  snprintf(file_name, GROUPS_FILE_NAME_SIZE, "%s%s", box_name, GROUPS_SUFFIX);
+}
+
+int groups_is_file(char const *name) {
+  size_t length = strlen(name), suffix = strlen(GROUPS_SUFFIX);
+  return length >= suffix && !strcmp(name + length - suffix, GROUPS_SUFFIX);
+}
+
+// grows the array of subscriptions so that it has room for one more
+static int grow(box_groups *groups) {
+  if (groups->bg_size < groups->bg_capacity)
+    return 0;
+  size_t capacity = groups->bg_capacity == 0 ? 4 : groups->bg_capacity * 2;
+  group *grown = (group *)realloc(groups->bg_groups, capacity * sizeof(group));
+  if (grown == NULL)
+    return -1;
+  groups->bg_groups = grown;
+  groups->bg_capacity = capacity;
+  return 0;
+}
+
+// opens the file of the subscriptions, creating it if needed, and reads them
+static int load(box_groups *groups, char const *box_name) {
+  char file_name[GROUPS_FILE_NAME_SIZE];
+  groups_file_name(file_name, box_name);
+  int fhandle = tfs_open(file_name, TFS_O_CREAT);
+  if (fhandle == -1)
+    return -1;
+
+  group_entry entry;
+  while (tfs_pread(fhandle, &entry, sizeof(entry),
+                   groups->bg_size * sizeof(entry)) == sizeof(entry)) {
+    if (grow(groups) == -1) {
+      tfs_close(fhandle);
+      free(groups->bg_groups);
+      groups_init(groups);
+      return -1;
+    }
+    entry.ge_name[BOX_NAME_SIZE - 1] = '\0';
+    groups->bg_groups[groups->bg_size].g_entry = entry;
+    groups->bg_groups[groups->bg_size++].g_owner = NULL;
+  }
+  groups->bg_fhandle = fhandle;
+  return 0;
+}
+
+ssize_t groups_join(box_groups *groups, char const *box_name, char const *name,
+                    void const *owner, uint64_t *offset) {
+  if (groups->bg_fhandle == -1 && load(groups, box_name) == -1)
+    return -1;
+
+  size_t slot = 0;
+  while (slot < groups->bg_size &&
+         strcmp(groups->bg_groups[slot].g_entry.ge_name, name) != 0) {
+    slot++;
+  }
+  if (slot == groups->bg_size) {
+    // a new subscription is only added once it is in the file
+    group_entry entry;
+    memset(&entry, 0, sizeof(entry));
+    strncpy(entry.ge_name, name, BOX_NAME_SIZE - 1);
+    if (grow(groups) == -1 ||
+        tfs_pwrite(groups->bg_fhandle, &entry, sizeof(entry),
+                   slot * sizeof(entry)) != sizeof(entry))
+      return -1;
+    groups->bg_groups[slot].g_entry = entry;
+    groups->bg_groups[slot].g_owner = NULL;
+    groups->bg_size++;
+  }
+
+  groups->bg_groups[slot].g_owner = owner;
+  *offset = groups->bg_groups[slot].g_entry.ge_offset;
+  return (ssize_t)slot;
+}
+
+int groups_owns(box_groups const *groups, size_t slot, void const *owner) {
+  return groups->bg_groups[slot].g_owner == owner;
+}
+
+int groups_commit(box_groups *groups, size_t slot, uint64_t offset) {
+  if (tfs_pwrite(groups->bg_fhandle, &offset, sizeof(offset),
+                 slot * sizeof(group_entry) +
+                     offsetof(group_entry, ge_offset)) != sizeof(offset))
+    return -1;
+  groups->bg_groups[slot].g_entry.ge_offset = offset;
+  return 0;
+}
+
+void groups_leave(box_groups *groups, size_t slot, void const *owner) {
+  if (groups->bg_groups[slot].g_owner == owner)
+    groups->bg_groups[slot].g_owner = NULL;
+}
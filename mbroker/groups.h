@@ -0,0 +1,77 @@
+#ifndef __MBROKER_GROUPS_H__
+#define __MBROKER_GROUPS_H__
+
+#include "extras.h"
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// Subscriptions (consumer groups) of a box: named positions in the box, which
+// the broker keeps for subscribers so that one reconnecting under the same
+// name resumes where the last one left off. A subscription has at most one
+// subscriber at a time: a new one takes it over from the previous one (which
+// may have left without the broker noticing yet), which can't commit anymore.
+//
+// The subscriptions of a box are stored in a tfs file named after the box
+// with GROUPS_SUFFIX appended, as an array of group_entry. Entries never move,
+// so committing an offset is a single small write at a fixed position. The
+// file is only opened (or created) when one of the box's subscriptions is
+// first used, and is read whole then.
+
+#define GROUPS_SUFFIX ".meta"
+// size of the name of the file of a box's subscriptions
+#define GROUPS_FILE_NAME_SIZE (BOX_NAME_SIZE + sizeof(GROUPS_SUFFIX) - 1)
+
+typedef struct {
+  char ge_name[BOX_NAME_SIZE];
+  uint64_t ge_offset; // offset of the next message to deliver
+} group_entry;
+
+typedef struct {
+  group_entry g_entry;
+  void const *g_owner; // its subscriber, or NULL if it has none
+} group;
+
+// the subscriptions of a box, protected by the box's lock (which also keeps
+// the file from being removed while in use)
+typedef struct {
+  int bg_fhandle; // -1 until the file is opened
+  group *bg_groups;
+  size_t bg_size;
+  size_t bg_capacity;
+} box_groups;
+
+// groups_init: initializes the (not yet loaded) subscriptions of a box
+void groups_init(box_groups *groups);
+
+// groups_destroy: releases the subscriptions of a box, closing their file
+void groups_destroy(box_groups *groups);
+
+// groups_file_name: the name of the file of the subscriptions of a box
+void groups_file_name(char *file_name, char const *box_name);
+
+// groups_is_file: whether a tfs file name is that of a box's subscriptions
+// (and so can't be a box's)
+int groups_is_file(char const *name);
+
+// groups_join: gives the subscription name of the box box_name to owner,
+// creating it (starting at the first message) if it doesn't exist, and sets
+// offset to where it was last committed
+//
+// Returns the subscription's slot, or -1 in case of error
+ssize_t groups_join(box_groups *groups, char const *box_name, char const *name,
+                    void const *owner, uint64_t *offset);
+
+// groups_owns: whether owner still has the subscription in slot
+int groups_owns(box_groups const *groups, size_t slot, void const *owner);
+
+// groups_commit: stores where the subscription in slot is, which only its
+// owner may do
+//
+// Returns 0 if successful, -1 otherwise
+int groups_commit(box_groups *groups, size_t slot, uint64_t offset);
+
+// groups_leave: releases the subscription in slot, if owner still has it
+void groups_leave(box_groups *groups, size_t slot, void const *owner);
+
+#endif // __MBROKER_GROUPS_H__
@@ -1,111 +1,814 @@
+#include "betterassert.h"
+#include "box_log.h"
 #include "extras.h"
+#include "groups.h"
+#include "histogram.h"
 #include "logging.h"
 #include "operations.h"
 #include "producer-consumer.h"
+#include "registry.h"
+#include "slab.h"
 
-// array with information about all mailboxes
-mail_box mail_boxes[MAX_MAILBOXES];
-// arrays of mutexes and locks for each mailbox
-pthread_mutex_t mail_locks[MAX_MAILBOXES];
-pthread_cond_t mail_condvars[MAX_MAILBOXES];
-// global producer-consumer queue pointer
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <time.h>
+
+// maximum number of boxes, each one a file in tfs (the root directory takes
+// one more inode)
+#define BROKER_MAX_BOXES (128 * 1024)
+// number of tfs data blocks available to store messages and the root
+// directory (64 MiB)
+#define BROKER_BLOCK_COUNT (64 * 1024)
+// number of tfs open files: one per box log, plus one per subscriber
+#define BROKER_OPEN_FILES (BROKER_MAX_BOXES + 8192)
+// maximum number of register requests read from the register pipe at once
+#define REGISTER_BATCH (32)
+// maximum number of events a worker takes from epoll at once
+#define EPOLL_BATCH (16)
+// maximum number of reads from a publisher's pipe per event, so that a busy
+// publisher doesn't keep a worker to itself
+#define PUBLISHER_READS (8)
+// maximum number of messages appended to a box with a single write: as many
+// (empty) frames as fit in a publisher's frame reader
+#define PUBLISHER_BATCH (FRAME_BUFFER_SIZE / sizeof(frame_header))
+// maximum number of writes to a subscriber's pipe per event, for the same
+// reason
+#define SUBSCRIBER_WRITES (64)
+// maximum number of frames written to a subscriber at once: as many (empty)
+// records as fit in its buffer, plus the one telling it to read from a ring
+#define SUBSCRIBER_FRAMES (FRAME_MAX_SIZE / sizeof(log_record_header) + 1)
+// size of the shared memory ring of a box, created for its first subscriber
+// over shared memory
+#define BOX_RING_SIZE (1024 * 1024)
+// number of boxes copied out of the registry at once when listing them
+#define LIST_CHUNK (256)
+// size of the buffer where listing frames are packed, to be written at once
+#define LIST_BUFFER_SIZE (16 * PIPE_BUF)
+// maximum length of a line of stats
+#define STATS_LINE_SIZE (256)
+// seconds between passes of the retention thread over the boxes
+#define RETENTION_INTERVAL (1)
+// bytes a box's log grows by before the retention thread writes its index
+// file again, so that a restart only reads what was appended since
+#define CHECKPOINT_GROWTH (1024 * 1024)
+// how long a worker waits for events before retiring (unless there are only
+// as many workers as the minimum), in milliseconds
+#define WORKER_IDLE_TIMEOUT (5000)
+// number of register requests waiting in the queue past which a worker is
+// spawned, if none is waiting for events (or half the queue, if smaller)
+#define WORKER_GROW_DEPTH (REGISTER_BATCH)
+// number of threads handling managers' requests, and of those requests that
+// can wait for them
+#define CONTROL_THREADS (2)
+#define CONTROL_QUEUE_SIZE (64)
+// tag of the epoll events of parked subscribers, which carry their pipe's fd
+// instead of a session (user space pointers never have the top bit set)
+#define PARKED_HANGUP (UINT64_C(1) << 63)
+// maximum number of fds in the table of parked subscribers
+#define PARKED_MAX_FDS (1024 * 1024)
+
+// besides the clients' sessions, there is a single SESSION_WAKER session,
+// which waits in epoll on the wake eventfd, a single SESSION_STOPPER one,
+// which waits on the stop eventfd, and (with --stats-interval) a single
+// SESSION_DUMPER one, which waits on the stats timerfd
+typedef enum {
+  SESSION_PUBLISHER,
+  SESSION_SUBSCRIBER,
+  SESSION_WAKER,
+  SESSION_STOPPER,
+  SESSION_DUMPER
+} session_type;
+
+// state of a client session. Sessions are not tied to threads: a session is
+// either registered (armed) in epoll, being handled by exactly one worker, or
+// parked in its box's list of waiting subscribers, and whoever takes it out
+// of one of these places owns it
+typedef struct session {
+  session_type s_type;
+  int s_pipe;
+  broker_box *s_box; // holds a reference to the box
+  union {
+    // publisher: frames read from the pipe but not yet handled, and whether
+    // every batch appended must be durable before the next one is read
+    struct {
+      frame_reader s_reader;
+      int s_durable;
+    };
+    // subscriber: position in the box, and frames waiting to be written,
+    // made out of the records read from the box (see subscriber_fill).
+    // Subscribers over shared memory get the messages up to s_switch through
+    // the pipe, and are then told to read the box's ring from s_ring_start;
+    // from then on, the session only waits for the pipe to be closed
+    struct {
+      int s_fhandle;
+      log_cursor s_cursor;
+      char s_records[FRAME_MAX_SIZE];
+      char s_attach[sizeof(frame_header) + 96];
+      struct iovec s_out[SUBSCRIBER_FRAMES];
+      int s_out_count;
+      size_t s_out_size;
+      size_t s_out_msgs; // messages in s_out, and their size
+      size_t s_out_bytes;
+      // messages from this offset on were appended after the subscriber
+      // registered, so how long they took to be delivered is measured
+      uint64_t s_live_from;
+      // whether the session counts towards the box's lag (see box_metrics),
+      // and with which offset
+      int s_tracked;
+      uint64_t s_lag_offset;
+      // slot of its subscription in the box's groups, or -1 if it has none
+      ssize_t s_group;
+      int s_shm;
+      int s_attached;
+      log_cursor s_switch;
+      char s_ring_name[64];
+      uint64_t s_ring_start;
+    };
+  };
+  struct session *s_next; // next parked subscriber of the same box
+} session_t;
+
+// session waiting in epoll on the wake eventfd. Publishers that append to a
+// box with parked subscribers add the box to the wake list (unless it is
+// already there) and signal the eventfd, so that several appends before a
+// worker gets to it only wake the subscribers once
+session_t waker;
+pthread_mutex_t wake_lock = PTHREAD_MUTEX_INITIALIZER;
+broker_box *wake_list;
+// parked subscribers, by their pipe's fd. While parked, a subscriber's pipe is
+// armed in epoll for errors only, so that a client hanging up is noticed even
+// if the box stays idle. Those events carry the fd: one may be on its way to
+// a worker when the subscriber is woken (and then ends), so the worker looks
+// the fd up here instead of touching a session that may be gone, and the
+// subscriber goes to whichever of them takes it out first
+session_t **parked;
+size_t parked_size; // fds past it are not watched while parked
+pthread_mutex_t parked_lock = PTHREAD_MUTEX_INITIALIZER;
+// session waiting in epoll on the stop eventfd, signaled when the broker is
+// asked to stop. Every worker that gets it arms it again for the next one,
+// and exits
+session_t stopper;
+volatile sig_atomic_t stopping = 0;
+// the workers, between wp_min and wp_max of them. A worker is spawned when
+// every worker is busy and work backs up: a worker takes a full batch of
+// events from epoll, or register requests pile up in the queue. A worker
+// retires once it has waited WORKER_IDLE_TIMEOUT for events, as long as
+// there are more than wp_min workers. Workers are detached: broker_stop
+// waits for wp_size to drop to 0 instead of joining them
+typedef struct {
+  pthread_mutex_t wp_lock; // protects the fields below, but wp_idle
+  pthread_cond_t wp_exited;
+  int wp_min;
+  int wp_max;
+  int wp_size;
+  int wp_stopping;
+  uint64_t wp_spawned; // since the broker started, not counting wp_min
+  uint64_t wp_retired;
+  // workers waiting for events (or about to), counted without the lock
+  _Atomic int wp_idle;
+} worker_pool;
+
+worker_pool pool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0,
+                    0, 0, 0, 0, 0};
+// global producer-consumer queue pointer, where register requests wait to be
+// picked up by the workers
 pc_queue_t *queue;
+// epoll instance where all sessions (and the register requests' eventfd) wait
+// for events
+int epoll_fd;
+int register_eventfd;
+// session waiting in epoll on the stats timerfd, which dumps the broker's
+// stats to stderr every --stats-interval seconds
+session_t dumper;
+// time from a message being appended to a box to it being sent to a
+// subscriber that registered before, and from a publisher's or subscriber's
+// register request being read to its session starting, in microseconds
+histogram deliver_latency;
+histogram session_start_latency;
+// thread that drops what boxes' retention limits don't keep, and writes the
+// index files of their logs, every RETENTION_INTERVAL seconds until the
+// broker stops
+pthread_t retainer;
+pthread_mutex_t retention_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t retention_cond = PTHREAD_COND_INITIALIZER;
+int retention_stopping = 0;
+
+// a register request, with when it was read from the register pipe
+typedef struct {
+  protocol rr_protocol;
+  uint64_t rr_received; // in microseconds, from CLOCK_MONOTONIC
+  // a manager's request turned away because the control queue was full
+  int rr_rejected;
+} register_request;
+
+// managers' requests (creating, removing, listing boxes and stats) don't go
+// through the workers, which may all be busy with publishers and subscribers,
+// but through their own queue to their own threads. Each of these threads
+// handles one request at a time, and stops when it takes control_stop
+pc_queue_t control_queue;
+pthread_t controllers[CONTROL_THREADS];
+register_request control_stop;
+
+// where register requests are taken from, and returned to once handled. It
+// holds as many as can be in flight at once (see main), so registering never
+// calls malloc and a storm of requests can't take more memory
+slab_pool requests;
+
+uint64_t monotonic_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+// arms a session (or the register eventfd, for a NULL session) in epoll, to be
+// handed to one worker at the next of the given events
+int session_arm(int fd, session_t *session, uint32_t events, int op) {
+  struct epoll_event event;
+  event.events = events | EPOLLONESHOT;
+  event.data.ptr = session;
+  if (epoll_ctl(epoll_fd, op, fd, &event) == -1) {
+    perror("error arming session in epoll");
+    return -1;
+  }
+  return 0;
+}
+
+// parks a subscriber that caught up on its box, whose lock must be held: it
+// waits in the box's list, with its pipe only watched for hangups
+void subscriber_park(broker_box *box, session_t *session) {
+  session->s_next = box->bb_waiters;
+  box->bb_waiters = session;
+  if ((size_t)session->s_pipe >= parked_size)
+    return;
+  pthread_mutex_lock(&parked_lock);
+  parked[session->s_pipe] = session;
+  pthread_mutex_unlock(&parked_lock);
+  struct epoll_event event;
+  event.events = EPOLLONESHOT; // errors need not be asked for
+  event.data.u64 = PARKED_HANGUP | (uint64_t)session->s_pipe;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, session->s_pipe, &event) == -1)
+    perror("error watching parked session");
+}
+
+// hands every subscriber waiting on a box back to epoll: their pipe is
+// writable, so they are picked up by a worker straight away
+void box_wake_subscribers(broker_box *box) {
+  pthread_mutex_lock(&box->bb_lock);
+  session_t *waiters = NULL;
+  // those taken out of parked by a hangup are left to it
+  pthread_mutex_lock(&parked_lock);
+  while (box->bb_waiters != NULL) {
+    session_t *waiter = box->bb_waiters;
+    box->bb_waiters = waiter->s_next;
+    if ((size_t)waiter->s_pipe < parked_size) {
+      if (parked[waiter->s_pipe] != waiter)
+        continue;
+      parked[waiter->s_pipe] = NULL;
+    }
+    waiter->s_next = waiters;
+    waiters = waiter;
+  }
+  pthread_mutex_unlock(&parked_lock);
+  pthread_mutex_unlock(&box->bb_lock);
 
-void lock_all_boxes() {
-  for (int i = 0; i < MAX_MAILBOXES; i++) {
-    pthread_mutex_lock(&mail_locks[i]);
+  while (waiters != NULL) {
+    session_t *next = waiters->s_next;
+    session_arm(waiters->s_pipe, waiters, EPOLLOUT, EPOLL_CTL_MOD);
+    waiters = next;
   }
 }
 
-void unlock_all_boxes() {
-  for (int i = 0; i < MAX_MAILBOXES; i++) {
-    pthread_mutex_unlock(&mail_locks[i]);
+// adds a box to the wake list (unless it is already there) and signals the
+// wake eventfd
+void box_wake_queue(broker_box *box) {
+  if (atomic_flag_test_and_set(&box->bb_wake_queued))
+    return;
+  box_ref(box);
+  pthread_mutex_lock(&wake_lock);
+  box->bb_wake_next = wake_list;
+  wake_list = box;
+  pthread_mutex_unlock(&wake_lock);
+
+  uint64_t one = 1;
+  if (write(waker.s_pipe, &one, sizeof(one)) == -1)
+    perror("error signaling wake eventfd");
+}
+
+// handles an event on the wake eventfd: wakes the parked subscribers of every
+// box in the wake list
+void waker_handle(session_t *session) {
+  uint64_t count;
+  if (read(session->s_pipe, &count, sizeof(count)) == -1 && errno != EAGAIN)
+    perror("error reading wake eventfd");
+  session_arm(session->s_pipe, session, EPOLLIN, EPOLL_CTL_MOD);
+
+  pthread_mutex_lock(&wake_lock);
+  broker_box *box = wake_list;
+  wake_list = NULL;
+  pthread_mutex_unlock(&wake_lock);
+  while (box != NULL) {
+    broker_box *next = box->bb_wake_next;
+    // appends from now on queue the box again
+    atomic_flag_clear(&box->bb_wake_queued);
+    box_wake_subscribers(box);
+    box_unref(box);
+    box = next;
   }
 }
 
-// iterates through the mail_boxes array, returning the index of the box
-// provided as argument, or -1 if it doesn't exist
-int search_mailbox(char *box_name) {
-  for (int i = 0; i < MAX_MAILBOXES; i++) {
-    if (!strcmp(mail_boxes[i].box_name, box_name))
-      return i;
+// stops counting a subscriber towards its box's lag
+void subscriber_untrack(session_t *session) {
+  box_metrics *metrics = &session->s_box->bb_metrics;
+  if (!session->s_tracked)
+    return;
+  atomic_fetch_sub_explicit(&metrics->bm_lag_subs, 1, memory_order_relaxed);
+  atomic_fetch_sub_explicit(&metrics->bm_lag_offsets, session->s_lag_offset,
+                            memory_order_relaxed);
+  session->s_tracked = 0;
+}
+
+// ends a session, releasing everything it holds
+void session_end(session_t *session) {
+  broker_box *box = session->s_box;
+  pthread_mutex_lock(&box->bb_lock);
+  if (!box->bb_removed) {
+    if (session->s_type == SESSION_PUBLISHER)
+      box->bb_n_pubs = 0;
+    else
+      box->bb_n_subs--;
+  }
+  if (session->s_type == SESSION_SUBSCRIBER && session->s_group != -1)
+    groups_leave(&box->bb_groups, (size_t)session->s_group, session);
+  pthread_mutex_unlock(&box->bb_lock);
+
+  if (session->s_type == SESSION_SUBSCRIBER) {
+    subscriber_untrack(session);
+    tfs_close(session->s_fhandle);
   }
-  return -1;
+  // closing the pipe also removes it from epoll
+  close(session->s_pipe);
+  box_unref(box);
+  free(session);
 }
 
-// function that handles the session of an individual publisher
-int session_publisher(protocol *protocol_msg) {
-  int box, pipe;
+// handles a hangup of a parked subscriber's pipe: takes the subscriber out of
+// its box's list and ends it, unless it was woken meanwhile (its pipe is then
+// armed again, and the hangup handled as any other subscriber's)
+void parked_hangup(int pipe) {
+  pthread_mutex_lock(&parked_lock);
+  session_t *session = parked[pipe];
+  // the event may be left from a subscriber that was woken and ended since,
+  // with its fd now taken by another one, which is only ended if its own
+  // client hung up too
+  struct pollfd poll_fd = {pipe, POLLOUT, 0};
+  if (session == NULL || poll(&poll_fd, 1, 0) != 1 ||
+      !(poll_fd.revents & (POLLERR | POLLHUP))) {
+    pthread_mutex_unlock(&parked_lock);
+    return;
+  }
+  parked[pipe] = NULL;
+  pthread_mutex_unlock(&parked_lock);
+
+  broker_box *box = session->s_box;
+  pthread_mutex_lock(&box->bb_lock);
+  // the box's list may have been taken by a wake up that left it out
+  for (session_t **waiter = &box->bb_waiters; *waiter != NULL;
+       waiter = &(*waiter)->s_next) {
+    if (*waiter == session) {
+      *waiter = session->s_next;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&box->bb_lock);
+  session_end(session);
+}
+
+// handles the registration of a publisher, which then waits in epoll for
+// messages to be written to its pipe
+int session_publisher(protocol *protocol_msg, int durable) {
+  int pipe;
   pipe = open(protocol_msg->pipename, O_RDONLY);
   if (pipe == -1) {
     perror("write msg error");
     return -1;
   }
 
-  int idx = search_mailbox(protocol_msg->boxname);
-  if (idx != -1) {
-    // box already has a publisher, ends session
-    if (mail_boxes[idx].n_pubs == 1) {
-      close(pipe);
-      perror("box already busy");
-      return -1;
-    } else
-      mail_boxes[idx].n_pubs = 1;
-  } else { // if the box we want to link to doesn't exist, ends session
+  broker_box *box = registry_get(protocol_msg->boxname);
+  if (box == NULL) {
+    // if the box we want to link to doesn't exist, ends session
     perror("box doesn't exist");
     close(pipe);
     return -1;
   }
-
-  box = tfs_open(protocol_msg->boxname, TFS_O_APPEND);
-  if (box == -1) {
-    perror("error while opening box");
+  pthread_mutex_lock(&box->bb_lock);
+  // box already has a publisher (or was just removed), ends session
+  if (box->bb_n_pubs == 1 || box->bb_removed) {
+    pthread_mutex_unlock(&box->bb_lock);
+    box_unref(box);
     close(pipe);
+    perror("box already busy");
     return -1;
   }
+  box->bb_n_pubs = 1;
+  pthread_mutex_unlock(&box->bb_lock);
+
   // if an error occurred on registry, pipe is closed
   // and SIGPIPE is sent and handled on pub.c
-  p_msg msg;
-  // reads messages from pipe on loop and writes them to the box
-  while (1) {
-    if (read(pipe, &msg, sizeof(msg)) <= 0)
+  session_t *session = (session_t *)malloc(sizeof(session_t));
+  if (session == NULL) {
+    // gives the box's publisher slot back
+    pthread_mutex_lock(&box->bb_lock);
+    box->bb_n_pubs = 0;
+    pthread_mutex_unlock(&box->bb_lock);
+    box_unref(box);
+    close(pipe);
+    perror("error creating session");
+    return -1;
+  }
+  session->s_type = SESSION_PUBLISHER;
+  session->s_pipe = pipe;
+  session->s_box = box;
+  frame_reader_init(&session->s_reader, pipe);
+  session->s_durable = durable;
+  session->s_next = NULL;
+  fcntl(pipe, F_SETFL, O_NONBLOCK);
+  if (session_arm(pipe, session, EPOLLIN, EPOLL_CTL_ADD) == -1) {
+    session_end(session);
+    return -1;
+  }
+  return 0;
+}
+
+// handles an event on a publisher's pipe: reads the messages available and
+// appends them to the box's log
+void publisher_handle(session_t *session) {
+  broker_box *box = session->s_box;
+  int appended = 0, ended = 0, wake = 0;
+
+  for (int reads = 0; reads < PUBLISHER_READS && !ended; reads++) {
+    ssize_t n = frame_reader_fill(&session->s_reader);
+    if (n == -1 && errno == EAGAIN)
       break;
-    if (msg.code != 9)
+    if (n <= 0) {
+      // publisher closed its pipe (or an error occurred)
+      ended = 1;
       break;
+    }
+
+    // takes all the complete frames read (incomplete ones are kept in the
+    // reader for the next read), to append them with a single write
+    frame_header header;
+    char const *messages[PUBLISHER_BATCH];
+    uint32_t lengths[PUBLISHER_BATCH];
+    size_t count = 0;
+    int found;
+    while (count < PUBLISHER_BATCH &&
+           (found = frame_next(&session->s_reader, &header,
+                               &messages[count])) == 1) {
+      // a message the broker can't store whole ends the session, rather than
+      // being stored cut short
+      if (header.code != 9 || header.length >= MESSAGE_SIZE) {
+        found = -1;
+        break;
+      }
+      lengths[count++] = header.length;
+    }
+
     // locks the corresponding box
-    pthread_mutex_lock(&mail_locks[idx]);
-    if (tfs_write(box, msg.message, strlen(msg.message) + 1) == -1)
-      break;
-    mail_boxes[idx].box_size += strlen(msg.message) + 1;
-    memset(msg.message, '\0', MESSAGE_SIZE);
-    pthread_mutex_unlock(&mail_locks[idx]);
-    // alerts all subscribers that something has been written
-    pthread_cond_broadcast(&mail_condvars[idx]);
-  }
-  // ends publisher session
-  mail_boxes[idx].n_pubs = 0;
-  close(pipe);
-  tfs_close(box);
-  return -1;
+    pthread_mutex_lock(&box->bb_lock);
+    if (count > 0 && !box->bb_removed) {
+      ssize_t written = box_log_append_many(
+          &box->bb_log, (void const *const *)messages, lengths, count);
+      if (written == -1) {
+        atomic_fetch_add_explicit(&box->bb_metrics.bm_drops, count,
+                                  memory_order_relaxed);
+        ended = 1;
+      } else {
+        atomic_fetch_add(&box->bb_seq, count);
+        box->bb_size += (uint64_t)written;
+        uint64_t bytes = 0;
+        for (size_t i = 0; i < count; i++) {
+          bytes += lengths[i];
+        }
+        atomic_fetch_add_explicit(&box->bb_metrics.bm_msgs_in, count,
+                                  memory_order_relaxed);
+        atomic_fetch_add_explicit(&box->bb_metrics.bm_bytes_in, bytes,
+                                  memory_order_relaxed);
+        if (box->bb_ring != NULL) {
+          for (size_t i = 0; i < count; i++) {
+            shm_ring_append(box->bb_ring, messages[i], lengths[i]);
+          }
+        }
+        appended = 1;
+      }
+    } else if (box->bb_removed) {
+      atomic_fetch_add_explicit(&box->bb_metrics.bm_drops, count,
+                                memory_order_relaxed);
+      ended = 1;
+    }
+    if (found == -1)
+      ended = 1;
+    if (appended && box->bb_ring != NULL)
+      shm_ring_notify(box->bb_ring);
+    if (appended && box->bb_waiters != NULL)
+      wake = 1;
+    pthread_mutex_unlock(&box->bb_lock);
+  }
+
+  // durable publishers aren't read from again until their messages are on
+  // disk; the box's lock isn't held, so the sync is shared with whatever
+  // other publishers append meanwhile
+  if (appended && session->s_durable &&
+      tfs_fsync(box->bb_log.bl_fhandle) == -1) {
+    perror("error syncing box");
+    ended = 1;
+  }
+
+  // alerts the parked subscribers that something has been written
+  if (wake)
+    box_wake_queue(box);
+  if (ended || session_arm(session->s_pipe, session, EPOLLIN,
+                           EPOLL_CTL_MOD) == -1)
+    session_end(session);
 }
 
-// function that handles the session of an individual subscriber
-int session_subscriber(protocol *protocol_msg) {
-  int box, pipe, i, j;
-  char buffer[MESSAGE_SIZE];
-  p_msg msg;
-  msg.code = 10;
-  int msg_ended = 0, can_read = 1;
-  int box_id, first_read = 1;
+// frame headers are written over the end of the record headers
+_Static_assert(sizeof(frame_header) <= sizeof(log_record_header),
+               "a frame header must fit in a record header");
+
+// reads the records a subscriber has not received yet (as many as fit in its
+// buffer, with a single read from tfs) and turns each into a frame in place,
+// by writing the frame header right before the message, so the frames can
+// be written to the pipe with no further copies. Only called with no frames
+// waiting to be written
+//
+// Returns 0 if successful, -1 otherwise
+int subscriber_fill(session_t *session) {
+  broker_box *box = session->s_box;
+  size_t limit = SIZE_MAX;
+
+  if (session->s_attached)
+    return 0;
+  if (session->s_shm) {
+    limit = session->s_switch.lc_position;
+    if (session->s_cursor.lc_position >= limit) {
+      // the rest of the messages are in the ring
+      char attach[MESSAGE_SIZE];
+      int length = snprintf(attach, sizeof(attach), "%s %" PRIu64,
+                            session->s_ring_name, session->s_ring_start);
+      session->s_out[0].iov_base = session->s_attach;
+      session->s_out[0].iov_len =
+          frame_pack(session->s_attach, 12, attach, (size_t)length);
+      session->s_out_count = 1;
+      session->s_out_size = session->s_out[0].iov_len;
+      session->s_attached = 1;
+      return 0;
+    }
+  }
+
+  // caught up, which can be told without going through the log
+  if (session->s_cursor.lc_offset == atomic_load(&box->bb_seq))
+    return 0;
+
+  uint64_t offset = session->s_cursor.lc_offset;
+  ssize_t n = box_log_read_many(&box->bb_log, session->s_fhandle,
+                                &session->s_cursor, session->s_records,
+                                sizeof(session->s_records), limit);
+  if (n <= 0)
+    return (int)n;
+  uint32_t now = box_log_now();
+  for (size_t position = 0; position < (size_t)n; offset++) {
+    log_record_header record;
+    memcpy(&record, session->s_records + position, sizeof(record));
+    if (offset >= session->s_live_from)
+      histogram_record(&deliver_latency, (uint32_t)(now - record.rh_time));
+
+    char *frame = session->s_records + position + sizeof(record) -
+                  sizeof(frame_header);
+    frame_header header;
+    header.version = FRAME_VERSION;
+    header.code = 10;
+    header.length = (uint16_t)record.rh_length;
+    memcpy(frame, &header, sizeof(header));
+    struct iovec *out = &session->s_out[session->s_out_count++];
+    out->iov_base = frame;
+    out->iov_len = sizeof(header) + record.rh_length;
+    session->s_out_size += out->iov_len;
+    session->s_out_msgs++;
+    session->s_out_bytes += record.rh_length;
+    position += sizeof(record) + record.rh_length;
+  }
+  return 0;
+}
+
+// accounts for the messages in a subscriber's output buffer, just written to
+// its pipe
+//
+// Returns 0 if successful, or -1 if the subscriber's subscription was taken
+// over by another one (and so it must end)
+int subscriber_delivered(session_t *session) {
+  box_metrics *metrics = &session->s_box->bb_metrics;
+  atomic_fetch_add_explicit(&metrics->bm_msgs_out, session->s_out_msgs,
+                            memory_order_relaxed);
+  atomic_fetch_add_explicit(&metrics->bm_bytes_out, session->s_out_bytes,
+                            memory_order_relaxed);
+  session->s_out_msgs = 0;
+  session->s_out_bytes = 0;
+  if (session->s_group != -1) {
+    // the messages written to the pipe are taken as delivered (those read
+    // from a ring aren't followed, so a subscription over shared memory
+    // resumes where the ring started)
+    broker_box *box = session->s_box;
+    pthread_mutex_lock(&box->bb_lock);
+    if (!groups_owns(&box->bb_groups, (size_t)session->s_group, session)) {
+      pthread_mutex_unlock(&box->bb_lock);
+      return -1;
+    }
+    if (!box->bb_removed &&
+        groups_commit(&box->bb_groups, (size_t)session->s_group,
+                      session->s_cursor.lc_offset) == -1)
+      perror("error committing subscription");
+    pthread_mutex_unlock(&box->bb_lock);
+  }
+  if (session->s_attached) {
+    // the rest of the messages go through the ring
+    subscriber_untrack(session);
+  } else if (session->s_tracked) {
+    atomic_fetch_add_explicit(&metrics->bm_lag_offsets,
+                              session->s_cursor.lc_offset -
+                                  session->s_lag_offset,
+                              memory_order_relaxed);
+    session->s_lag_offset = session->s_cursor.lc_offset;
+  }
+  return 0;
+}
+
+// handles a subscriber that may have messages to receive: sends them until
+// its pipe is full (then waits in epoll for it to be writable) or it has
+// received every message in the box (then waits in the box's list)
+void subscriber_handle(session_t *session) {
+  broker_box *box = session->s_box;
+
+  // the only event an attached subscriber waits for is its pipe being closed
+  if (session->s_attached && session->s_out_size == 0) {
+    session_end(session);
+    return;
+  }
+
+  for (int writes = 0; writes < SUBSCRIBER_WRITES; writes++) {
+    if (session->s_out_size == 0 && subscriber_fill(session) == -1) {
+      perror("error reading box contents");
+      session_end(session);
+      return;
+    }
+    if (session->s_out_size == 0) {
+      // caught up: parks the session, unless a message arrived (or the box
+      // was destroyed, or its subscription taken over) meanwhile
+      pthread_mutex_lock(&box->bb_lock);
+      if (box->bb_removed ||
+          (session->s_group != -1 &&
+           !groups_owns(&box->bb_groups, (size_t)session->s_group,
+                        session))) {
+        pthread_mutex_unlock(&box->bb_lock);
+        session_end(session);
+        return;
+      }
+      if (session->s_cursor.lc_offset == atomic_load(&box->bb_seq)) {
+        subscriber_park(box, session);
+        pthread_mutex_unlock(&box->bb_lock);
+        return;
+      }
+      pthread_mutex_unlock(&box->bb_lock);
+      continue;
+    }
+
+    // the frames add up to at most PIPE_BUF bytes (each is smaller than its
+    // record), so they are either written whole or not at all
+    if (writev(session->s_pipe, session->s_out, session->s_out_count) ==
+        -1) {
+      if (errno == EAGAIN)
+        break;
+      // session final case: the pipe is closed
+      session_end(session);
+      return;
+    }
+    session->s_out_count = 0;
+    session->s_out_size = 0;
+    if (subscriber_delivered(session) == -1) {
+      session_end(session);
+      return;
+    }
+    if (session->s_attached) {
+      // no events but errors (which need not be asked for)
+      if (session_arm(session->s_pipe, session, 0, EPOLL_CTL_MOD) == -1)
+        session_end(session);
+      return;
+    }
+  }
+
+  // pipe is full (or the session had its share of the worker): waits until
+  // it can write again
+  if (session_arm(session->s_pipe, session, EPOLLOUT, EPOLL_CTL_MOD) == -1)
+    session_end(session);
+}
+
+// decides where a new subscriber over shared memory switches from the log to
+// the box's ring, creating the ring if needed: messages appended from now on
+// are in both. Must be called with the box's lock held
+int box_ring_attach(broker_box *box, session_t *session) {
+  // rings are named after the broker and a counter, since box names may
+  // contain any character and be reused once their box is destroyed. A name
+  // left behind by a broker that crashed with the same pid is skipped, not
+  // removed, since some subscriber may still be reading it
+  static _Atomic uint64_t ring_count;
+  if (box->bb_ring == NULL) {
+    shm_ring *ring = (shm_ring *)malloc(sizeof(shm_ring));
+    if (ring == NULL)
+      return -1;
+    int created;
+    do {
+      char name[64];
+      snprintf(name, sizeof(name), "/mbroker.%d.%" PRIu64, (int)getpid(),
+               atomic_fetch_add(&ring_count, 1));
+      created = shm_ring_create(ring, name, BOX_RING_SIZE);
+    } while (created == -1 && errno == EEXIST);
+    if (created == -1) {
+      free(ring);
+      return -1;
+    }
+    box->bb_ring = ring;
+  }
+  strcpy(session->s_ring_name, box->bb_ring->sr_name);
+  session->s_ring_start = shm_ring_tail(box->bb_ring);
+  return box_log_seek(&box->bb_log, session->s_fhandle, UINT64_MAX,
+                      &session->s_switch);
+}
+
+// decides where a new subscriber starts reading its box, taking its
+// subscription if it has one. Must be called with the box's lock held
+//
+// Returns 0 if successful, -1 otherwise
+int subscriber_start(broker_box *box, session_t *session,
+                     protocol const *protocol_msg) {
+  uint64_t offset = 0;
+  switch ((sub_start)protocol_msg->start) {
+  case SUB_START_DEFAULT:
+  case SUB_START_EARLIEST:
+    break;
+  case SUB_START_LATEST:
+    offset = UINT64_MAX;
+    break;
+  case SUB_START_OFFSET:
+    offset = protocol_msg->offset;
+    break;
+  default:
+    return -1;
+  }
+  if (protocol_msg->group[0] != '\0') {
+    uint64_t committed;
+    session->s_group = groups_join(&box->bb_groups, box->bb_name,
+                                   protocol_msg->group, session, &committed);
+    if (session->s_group == -1) {
+      perror("error opening subscription");
+      return -1;
+    }
+    if (protocol_msg->start == SUB_START_DEFAULT)
+      offset = committed;
+  }
+  // a reconnecting subscriber only goes through the messages it missed
+  if (box_log_seek(&box->bb_log, session->s_fhandle, offset,
+                   &session->s_cursor) == -1) {
+    perror("error seeking box");
+    return -1;
+  }
+  return 0;
+}
+
+// handles the registration of a subscriber, which is then sent the messages in
+// the box from where it asked to start (through its pipe, or through the box's
+// shared memory ring if shm is set)
+int session_subscriber(protocol *protocol_msg, int shm) {
+  int box, pipe;
 
   pipe = open(protocol_msg->pipename, O_WRONLY);
   if (pipe == -1) {
     perror("error opening communication pipe");
     return -1;
   }
-  box_id = search_mailbox(protocol_msg->boxname);
+  broker_box *mbox = registry_get(protocol_msg->boxname);
   // if the box we want to subscribe doesn't exist, ends session
-  if (box_id == -1) {
+  if (mbox == NULL) {
     close(pipe);
     // perror("no such box found");
     return -1;
@@ -115,70 +818,86 @@ int session_subscriber(protocol *protocol_msg) {
   box = tfs_open(protocol_msg->boxname, 0);
   if (box == -1) {
     perror("error while opening box");
+    box_unref(mbox);
     close(pipe);
     return -1;
   }
 
-  mail_boxes[box_id].n_subs++;
+  session_t *session = (session_t *)malloc(sizeof(session_t));
+  if (session == NULL) {
+    perror("error creating session");
+    tfs_close(box);
+    box_unref(mbox);
+    close(pipe);
+    return -1;
+  }
+  session->s_type = SESSION_SUBSCRIBER;
+  session->s_pipe = pipe;
+  session->s_box = mbox;
+  session->s_fhandle = box;
+  session->s_out_count = 0;
+  session->s_out_size = 0;
+  session->s_out_msgs = 0;
+  session->s_out_bytes = 0;
+  session->s_tracked = 0;
+  session->s_lag_offset = 0;
+  session->s_group = -1;
+  session->s_shm = shm;
+  session->s_attached = 0;
+  session->s_next = NULL;
 
-  while (can_read) {
-    memset(buffer, '\0', MESSAGE_SIZE);
-    memset(msg.message, '\0', MESSAGE_SIZE);
-    // waits on corresponding box condvar until a publisher broadcasts that
-    // a change has been made
-    pthread_mutex_lock(&mail_locks[box_id]);
-    // doesn't want on condvar if it just entered the box: prints out the
-    // previous content of the box first, and then wait on next iteration
-    if (!first_read)
-      pthread_cond_wait(&mail_condvars[box_id], &mail_locks[box_id]);
-    first_read = 0;
-    if (tfs_read(box, buffer, MAX_BOX_SIZE) == -1) {
-      perror("error reading box contents");
-      break;
-    }
-    pthread_mutex_unlock(&mail_locks[box_id]);
-    j = 0;
-    msg_ended = 0;
-    // composes 1 or more protocol messages to send to subscriber.c
-    // via the communication pipe
-    while (!msg_ended) {
-      memset(msg.message, '\0', MESSAGE_SIZE);
-      // produces a single message
-      for (i = 0; i < MESSAGE_SIZE; i++) {
-        if (buffer[i] == '\0') {
-          // final buffer case (two followed '\0's)
-          if (buffer[i - 1] == '\0') {
-            break;
-          }
-          msg.message[j] = '\0';
-          // session final case: if the pipe is closed, stop reading
-          if (write(pipe, &msg, sizeof(msg)) == -1) {
-            can_read = 0;
-            break;
-          }
-          memset(msg.message, '\0', MESSAGE_SIZE);
-          j = 0;
-        } else {
-          msg.message[j] = buffer[i];
-          j++;
-        }
-      }
-      msg_ended = 1;
-    }
+  pthread_mutex_lock(&mbox->bb_lock);
+  int failed =
+      mbox->bb_removed || subscriber_start(mbox, session, protocol_msg) == -1;
+  if (!failed && shm && box_ring_attach(mbox, session) == -1) {
+    perror("error creating shared memory ring");
+    failed = 1;
+  }
+  if (failed) {
+    if (session->s_group != -1)
+      groups_leave(&mbox->bb_groups, (size_t)session->s_group, session);
+    pthread_mutex_unlock(&mbox->bb_lock);
+    close(pipe);
+    tfs_close(box);
+    box_unref(mbox);
+    free(session);
+    return -1;
+  }
+  mbox->bb_n_subs++;
+  session->s_live_from = atomic_load(&mbox->bb_seq);
+  // the subscriber is as far behind as there are messages after where it
+  // starts
+  session->s_tracked = 1;
+  session->s_lag_offset = session->s_cursor.lc_offset;
+  atomic_fetch_add_explicit(&mbox->bb_metrics.bm_lag_subs, 1,
+                            memory_order_relaxed);
+  atomic_fetch_add_explicit(&mbox->bb_metrics.bm_lag_offsets,
+                            session->s_lag_offset, memory_order_relaxed);
+  pthread_mutex_unlock(&mbox->bb_lock);
+  // a previous subscriber of the subscription may be parked, and only ends
+  // once woken up
+  if (session->s_group != -1)
+    box_wake_subscribers(mbox);
+
+  fcntl(pipe, F_SETFL, O_NONBLOCK);
+  if (session_arm(pipe, session, EPOLLOUT, EPOLL_CTL_ADD) == -1) {
+    session_end(session);
+    return -1;
   }
-  mail_boxes[box_id].n_subs--;
-  // end of subscriber session
-  close(pipe);
-  tfs_close(box);
   return 0;
 }
 
+// size of a box response's payload, which ends with its error message
+size_t box_response_size(box_response const *msg) {
+  return offsetof(box_response, error_message) +
+         strnlen(msg->error_message, ERROR_MESSAGE_SIZE);
+}
+
 // function that handles the request of box creation by a manager
 int manager_create_box(protocol *protocol_msg) {
   box_response msg;
-  msg.code = 4;
   msg.return_code = 0;
-  int box, pipe;
+  int pipe;
 
   memset(msg.error_message, '\0', ERROR_MESSAGE_SIZE);
   pipe = open(protocol_msg->pipename, O_WRONLY);
@@ -187,28 +906,28 @@ int manager_create_box(protocol *protocol_msg) {
     return -1;
   }
 
-  lock_all_boxes();
-  // check if box already exists
-  if (search_mailbox(protocol_msg->boxname) != -1) {
+  log_retention retention = {protocol_msg->max_bytes,
+                             protocol_msg->max_messages, protocol_msg->max_age};
+  // names of files of subscriptions and of log indexes are not available for
+  // boxes
+  int result = groups_is_file(protocol_msg->boxname) ||
+                       box_log_is_index(protocol_msg->boxname)
+                   ? -3
+                   : registry_create(protocol_msg->boxname, &retention);
+  if (result == -1) {
     msg.return_code = -1;
     strcpy(msg.error_message, "box already exists");
-  } else if ((box = tfs_open(protocol_msg->boxname, TFS_O_CREAT)) == -1) {
+  } else if (result == -2) {
     msg.return_code = -1;
     perror("error creating box");
     strcpy(msg.error_message, "cannot create box");
-  } else {
-    tfs_close(box);
-    // adds box name to mailboxes array
-    for (int i = 0; i < MAX_MAILBOXES; i++) {
-      if (mail_boxes[i].box_name[0] == '\0') {
-        strcpy(mail_boxes[i].box_name, protocol_msg->boxname);
-        break;
-      }
-    }
+  } else if (result == -3) {
+    msg.return_code = -1;
+    strcpy(msg.error_message, "box name is reserved");
   }
-  unlock_all_boxes();
 
-  if (write(pipe, &msg, sizeof(msg)) == -1) {
+  if (frame_write(pipe, protocol_msg->code + 1, &msg,
+                  box_response_size(&msg)) == -1) {
     perror("error writing to communication pipe");
     return -1;
   }
@@ -220,11 +939,10 @@ int manager_create_box(protocol *protocol_msg) {
 // function that handles the request of box destruction by a manager
 int manager_destroy_box(protocol *protocol_msg) {
   box_response msg;
-  msg.code = 6;
   msg.return_code = 0;
-  int pipe, box_id;
-  char error_message[ERROR_MESSAGE_SIZE];
-  memset(error_message, '\0', ERROR_MESSAGE_SIZE);
+  int pipe;
+  broker_box *box;
+  memset(msg.error_message, '\0', ERROR_MESSAGE_SIZE);
 
   pipe = open(protocol_msg->pipename, O_WRONLY);
   if (pipe == -1) {
@@ -232,26 +950,21 @@ int manager_destroy_box(protocol *protocol_msg) {
     return -1;
   }
 
-  if ((box_id = search_mailbox(protocol_msg->boxname)) == -1) {
+  int result = registry_remove(protocol_msg->boxname, &box);
+  if (result == -1) {
     msg.return_code = -1;
     strcpy(msg.error_message, "box does not exist");
+  } else if (result == -2) {
+    msg.return_code = -1;
+    strcpy(msg.error_message, "cannot remove box");
   } else {
-    pthread_mutex_lock(&mail_locks[box_id]);
-    if (tfs_unlink(protocol_msg->boxname) == -1) {
-      msg.return_code = -1;
-      strcpy(msg.error_message, "cannot remove box");
-    }
-    // no error found, regular case, resets box info from mailboxes array
-    else {
-      memset(mail_boxes[box_id].box_name, '\0', BOX_NAME_SIZE);
-      mail_boxes[box_id].box_size = 0;
-      mail_boxes[box_id].n_pubs = 0;
-      mail_boxes[box_id].n_subs = 0;
-    }
-    pthread_mutex_unlock(&mail_locks[box_id]);
+    // subscribers waiting on the box find out it is gone and end
+    box_wake_subscribers(box);
+    box_unref(box);
   }
 
-  if (write(pipe, &msg, sizeof(msg)) == -1) {
+  if (frame_write(pipe, protocol_msg->code + 1, &msg,
+                  box_response_size(&msg)) == -1) {
     perror("error writing to communication pipe");
     return -1;
   }
@@ -260,103 +973,893 @@ int manager_destroy_box(protocol *protocol_msg) {
   return 0;
 }
 
-// function that handles the request of box listing by a manager
+// state of a listing being sent: a chunk of boxes copied out of the registry,
+// the frame being built, and the frames waiting to be written
+typedef struct {
+  mail_box bl_chunk[LIST_CHUNK];
+  char bl_frame[FRAME_MAX_PAYLOAD];
+  size_t bl_frame_size;
+  uint16_t bl_count; // boxes in the frame being built
+  char bl_out[LIST_BUFFER_SIZE];
+  size_t bl_out_size;
+} box_listing;
+
+// packs the listing frame being built into a listing's output buffer, and
+// starts a new one
+void box_list_frame_end(box_listing *listing, uint8_t last, uint8_t more) {
+  box_list_header header;
+  header.last = last;
+  header.more = more;
+  header.count = listing->bl_count;
+  memcpy(listing->bl_frame, &header, sizeof(header));
+  listing->bl_out_size += frame_pack(listing->bl_out + listing->bl_out_size, 8,
+                                     listing->bl_frame, listing->bl_frame_size);
+  listing->bl_frame_size = sizeof(header);
+  listing->bl_count = 0;
+}
+
+// writes a whole buffer to fd
+int write_all(int fd, void const *buffer, size_t size) {
+  size_t written = 0;
+  while (written < size) {
+    ssize_t n = write(fd, (char const *)buffer + written, size - written);
+    if (n == -1)
+      return -1;
+    written += (size_t)n;
+  }
+  return 0;
+}
+
+// writes a listing's output buffer to the manager's pipe
+int box_list_flush(box_listing *listing, int pipe) {
+  if (write_all(pipe, listing->bl_out, listing->bl_out_size) == -1)
+    return -1;
+  listing->bl_out_size = 0;
+  return 0;
+}
+
+// function that handles the request of box listing by a manager: sends the
+// boxes whose name has the given prefix, in order, starting after the cursor
+// and up to the limit. The boxes are copied out of the registry a chunk at a
+// time, and packed into frames that are written several at once, so memory
+// use is bounded however many boxes there are
 int manager_list_boxes(protocol *protocol_msg) {
-  int pipe, i;
-  box_list_response res;
-  res.code = 8;
-  res.last = 0;
+  int pipe, more = 0;
+  box_listing *listing = (box_listing *)malloc(sizeof(box_listing));
   pipe = open(protocol_msg->pipename, O_WRONLY);
-  if (pipe == -1) {
+  if (pipe == -1 || listing == NULL) {
     perror("case 8 open pipe error");
+    if (pipe != -1)
+      close(pipe);
+    free(listing);
     return -1;
   }
-  lock_all_boxes();
-  // sends box individual info via pipe to manager
-  for (i = 0; i < MAX_MAILBOXES; i++) {
-    res.box = mail_boxes[i];
-    if (i == MAX_MAILBOXES - 1)
-      res.last = 1;
-    if (write(pipe, &res, sizeof(res)) == -1) {
-      perror("case 8 write pipe error");
-      return -1;
+  listing->bl_out_size = 0;
+  listing->bl_frame_size = sizeof(box_list_header);
+  listing->bl_count = 0;
+
+  char cursor[BOX_NAME_SIZE];
+  memcpy(cursor, protocol_msg->cursor, BOX_NAME_SIZE);
+  size_t remaining = protocol_msg->limit > 0 ? protocol_msg->limit : SIZE_MAX;
+  int result = 0;
+  do {
+    size_t n = registry_list(protocol_msg->boxname, cursor, listing->bl_chunk,
+                             remaining < LIST_CHUNK ? remaining : LIST_CHUNK,
+                             &more);
+    for (size_t i = 0; i < n; i++) {
+      mail_box const *box = &listing->bl_chunk[i];
+      if (listing->bl_frame_size +
+              BOX_LIST_ENTRY_SIZE(strlen(box->box_name)) >
+          FRAME_MAX_PAYLOAD)
+        box_list_frame_end(listing, 0, 0);
+      if (LIST_BUFFER_SIZE - listing->bl_out_size < FRAME_MAX_SIZE &&
+          box_list_flush(listing, pipe) == -1) {
+        result = -1;
+        break;
+      }
+      listing->bl_frame_size +=
+          box_list_pack(listing->bl_frame + listing->bl_frame_size, box);
+      listing->bl_count++;
     }
+    if (n > 0)
+      memcpy(cursor, listing->bl_chunk[n - 1].box_name, BOX_NAME_SIZE);
+    remaining -= n;
+  } while (result == 0 && more && remaining > 0);
+
+  // the last frame tells whether the limit cut the listing short
+  if (result == 0) {
+    if (LIST_BUFFER_SIZE - listing->bl_out_size < FRAME_MAX_SIZE)
+      result = box_list_flush(listing, pipe);
+    box_list_frame_end(listing, 1, (uint8_t)more);
+    if (result == 0)
+      result = box_list_flush(listing, pipe);
   }
-  unlock_all_boxes();
+  if (result == -1)
+    perror("case 8 write pipe error");
+  free(listing);
   close(pipe);
-  return 0;
+  return result;
 }
 
-// session function associated to every thread upon its creation
-void *session() {
-  uint8_t code;
-  while (1) {
-    // every thread awaits in pcq_dequeue on a condvar, for an enqueue to
-    // be made, avoid active wait
-    protocol *p = pcq_dequeue(queue);
-    code = p->code;
-    switch (code) {
-    case 1:
-      session_publisher(p);
-      break;
-    case 2:
-      session_subscriber(p);
-      break;
-    case 3:
-      manager_create_box(p);
-      break;
-    case 5:
-      manager_destroy_box(p);
-      break;
-    case 7:
-      manager_list_boxes(p);
-      break;
-    default:
-      perror("invalid code");
+// stats being sent, as lines of text: to a manager, in frames (the last one
+// empty), or to the periodic dump, as they are. Lines are gathered into
+// frames, which are written several at once
+typedef struct {
+  int so_fd;
+  int so_framed;
+  int so_error;
+  char so_frame[FRAME_MAX_PAYLOAD];
+  size_t so_frame_size;
+  char so_out[LIST_BUFFER_SIZE];
+  size_t so_out_size;
+} stats_output;
+
+// packs the frame being built into the output buffer (writing the buffer out
+// first if it is full), and starts a new one
+void stats_frame_end(stats_output *out) {
+  if (LIST_BUFFER_SIZE - out->so_out_size < FRAME_MAX_SIZE) {
+    if (!out->so_error &&
+        write_all(out->so_fd, out->so_out, out->so_out_size) == -1)
+      out->so_error = 1;
+    out->so_out_size = 0;
+  }
+  if (out->so_framed) {
+    out->so_out_size += frame_pack(out->so_out + out->so_out_size, 15,
+                                   out->so_frame, out->so_frame_size);
+  } else {
+    memcpy(out->so_out + out->so_out_size, out->so_frame, out->so_frame_size);
+    out->so_out_size += out->so_frame_size;
+  }
+  out->so_frame_size = 0;
+}
+
+// adds a line of stats to the output
+__attribute__((format(printf, 2, 3))) void
+stats_line(stats_output *out, char const *format, ...) {
+  char line[STATS_LINE_SIZE];
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(line, sizeof(line) - 1, format, args);
+  va_end(args);
+  if (length < 0)
+    return;
+  if ((size_t)length > sizeof(line) - 2)
+    length = sizeof(line) - 2;
+  line[length++] = '\n';
+  if (out->so_frame_size + (size_t)length > FRAME_MAX_PAYLOAD)
+    stats_frame_end(out);
+  memcpy(out->so_frame + out->so_frame_size, line, (size_t)length);
+  out->so_frame_size += (size_t)length;
+}
+
+// ends the output, writing everything left
+//
+// Returns 0 if successful, -1 otherwise
+int stats_finish(stats_output *out) {
+  if (out->so_frame_size > 0)
+    stats_frame_end(out);
+  // an empty frame ends the stats sent to a manager
+  if (out->so_framed)
+    stats_frame_end(out);
+  if (!out->so_error &&
+      write_all(out->so_fd, out->so_out, out->so_out_size) == -1)
+    out->so_error = 1;
+  out->so_out_size = 0;
+  return out->so_error ? -1 : 0;
+}
+
+// number of messages subscribers reading a box through their pipes have yet
+// to be sent, added up
+uint64_t box_lag(broker_box *box) {
+  box_metrics *metrics = &box->bb_metrics;
+  uint64_t subs =
+      atomic_load_explicit(&metrics->bm_lag_subs, memory_order_relaxed);
+  uint64_t offsets =
+      atomic_load_explicit(&metrics->bm_lag_offsets, memory_order_relaxed);
+  uint64_t seq = atomic_load_explicit(&box->bb_seq, memory_order_relaxed);
+  // the counters are read one at a time, so they may not quite add up
+  return subs * seq > offsets ? subs * seq - offsets : 0;
+}
+
+// adds a line with a box's counters to the output
+void stats_box(stats_output *out, broker_box *box) {
+  box_metrics *metrics = &box->bb_metrics;
+  stats_line(out,
+             "box %s size %" PRIu64 " pubs %" PRIu64 " subs %" PRIu64
+             " msgs_in %" PRIu64 " bytes_in %" PRIu64 " msgs_out %" PRIu64
+             " bytes_out %" PRIu64 " drops %" PRIu64 " lag %" PRIu64,
+             box->bb_name, atomic_load(&box->bb_size),
+             atomic_load(&box->bb_n_pubs), atomic_load(&box->bb_n_subs),
+             atomic_load(&metrics->bm_msgs_in),
+             atomic_load(&metrics->bm_bytes_in),
+             atomic_load(&metrics->bm_msgs_out),
+             atomic_load(&metrics->bm_bytes_out),
+             atomic_load(&metrics->bm_drops), box_lag(box));
+}
+
+// counters of every box, added up
+typedef struct {
+  uint64_t st_boxes;
+  uint64_t st_pubs, st_subs;
+  uint64_t st_msgs_in, st_bytes_in, st_msgs_out, st_bytes_out;
+  uint64_t st_drops, st_lag;
+} stats_totals;
+
+static void stats_totals_visit(broker_box *box, void *arg) {
+  stats_totals *totals = (stats_totals *)arg;
+  box_metrics *metrics = &box->bb_metrics;
+  totals->st_boxes++;
+  totals->st_pubs += atomic_load(&box->bb_n_pubs);
+  totals->st_subs += atomic_load(&box->bb_n_subs);
+  totals->st_msgs_in += atomic_load(&metrics->bm_msgs_in);
+  totals->st_bytes_in += atomic_load(&metrics->bm_bytes_in);
+  totals->st_msgs_out += atomic_load(&metrics->bm_msgs_out);
+  totals->st_bytes_out += atomic_load(&metrics->bm_bytes_out);
+  totals->st_drops += atomic_load(&metrics->bm_drops);
+  totals->st_lag += box_lag(box);
+}
+
+// adds a line with a latency histogram's percentiles to the output
+void stats_histogram(stats_output *out, char const *name, histogram *h) {
+  histogram_snapshot *snapshot =
+      (histogram_snapshot *)malloc(sizeof(histogram_snapshot));
+  if (snapshot == NULL)
+    return;
+  histogram_snapshot_take(h, snapshot);
+  stats_line(out,
+             "latency %s count %" PRIu64 " p50 %" PRIu64 " p90 %" PRIu64
+             " p99 %" PRIu64 " p999 %" PRIu64 " max %" PRIu64,
+             name, snapshot->hs_total, histogram_percentile(snapshot, 50),
+             histogram_percentile(snapshot, 90),
+             histogram_percentile(snapshot, 99),
+             histogram_percentile(snapshot, 99.9), snapshot->hs_max);
+  free(snapshot);
+}
+
+// adds the broker-wide stats to the output: the boxes' counters added up,
+// the latency histograms, and how much of each tfs call was emulated I/O
+void stats_summary(stats_output *out) {
+  stats_totals totals;
+  memset(&totals, 0, sizeof(totals));
+  registry_foreach(stats_totals_visit, &totals);
+  stats_line(out,
+             "total boxes %" PRIu64 " pubs %" PRIu64 " subs %" PRIu64
+             " msgs_in %" PRIu64 " bytes_in %" PRIu64 " msgs_out %" PRIu64
+             " bytes_out %" PRIu64 " drops %" PRIu64 " lag %" PRIu64,
+             totals.st_boxes, totals.st_pubs, totals.st_subs,
+             totals.st_msgs_in, totals.st_bytes_in, totals.st_msgs_out,
+             totals.st_bytes_out, totals.st_drops, totals.st_lag);
+  pthread_mutex_lock(&pool.wp_lock);
+  stats_line(out,
+             "workers size %d idle %d min %d max %d spawned %" PRIu64
+             " retired %" PRIu64,
+             pool.wp_size, atomic_load(&pool.wp_idle), pool.wp_min,
+             pool.wp_max, pool.wp_spawned, pool.wp_retired);
+  pthread_mutex_unlock(&pool.wp_lock);
+  stats_line(out, "queue register depth %zu capacity %zu", pcq_depth(queue),
+             queue->pcq_capacity);
+  stats_line(out, "queue control depth %zu capacity %zu",
+             pcq_depth(&control_queue), control_queue.pcq_capacity);
+  stats_histogram(out, "publish_to_deliver_us", &deliver_latency);
+  stats_histogram(out, "register_to_session_us", &session_start_latency);
+
+  tfs_op_stats_t fs_stats[TFS_OP_COUNT];
+  tfs_op_stats(fs_stats);
+  for (tfs_op op = 0; op < TFS_OP_COUNT; op++) {
+    stats_line(out, "fs %s calls %llu accesses %llu io_us %llu",
+               tfs_op_name(op), fs_stats[op].os_calls,
+               fs_stats[op].os_accesses, fs_stats[op].os_io_ns / 1000);
+  }
+}
+
+// function that handles the request of stats by a manager: sends a line with
+// the counters of every box whose name has the given prefix (in order, a
+// chunk at a time, as listings do), followed by the broker-wide stats
+int manager_stats(protocol *protocol_msg) {
+  stats_output *out = (stats_output *)malloc(sizeof(stats_output));
+  int pipe = open(protocol_msg->pipename, O_WRONLY);
+  if (pipe == -1 || out == NULL) {
+    perror("error opening communication pipe");
+    if (pipe != -1)
+      close(pipe);
+    free(out);
+    return -1;
+  }
+  out->so_fd = pipe;
+  out->so_framed = 1;
+  out->so_error = 0;
+  out->so_frame_size = 0;
+  out->so_out_size = 0;
+
+  broker_box *boxes[LIST_CHUNK];
+  char cursor[BOX_NAME_SIZE] = "";
+  int more;
+  do {
+    size_t n = registry_collect(protocol_msg->boxname, cursor, boxes,
+                                LIST_CHUNK, &more);
+    for (size_t i = 0; i < n; i++) {
+      stats_box(out, boxes[i]);
+    }
+    if (n > 0)
+      memcpy(cursor, boxes[n - 1]->bb_name, BOX_NAME_SIZE);
+    for (size_t i = 0; i < n; i++) {
+      box_unref(boxes[i]);
     }
-    free(p);
+  } while (more && !out->so_error);
+  stats_summary(out);
+
+  int result = stats_finish(out);
+  if (result == -1)
+    perror("error writing stats");
+  free(out);
+  close(pipe);
+  return result;
+}
+
+// handles an expiration of the stats timerfd: dumps the broker-wide stats to
+// stderr
+void dumper_handle(session_t *session) {
+  uint64_t expirations;
+  if (read(session->s_pipe, &expirations, sizeof(expirations)) == -1 &&
+      errno != EAGAIN)
+    perror("error reading stats timerfd");
+  session_arm(session->s_pipe, session, EPOLLIN, EPOLL_CTL_MOD);
+
+  stats_output *out = (stats_output *)malloc(sizeof(stats_output));
+  if (out == NULL)
+    return;
+  out->so_fd = STDERR_FILENO;
+  out->so_framed = 0;
+  out->so_error = 0;
+  out->so_frame_size = 0;
+  out->so_out_size = 0;
+  stats_line(out, "stats %lld", (long long)time(NULL));
+  stats_summary(out);
+  stats_finish(out);
+  free(out);
+}
+
+// answers a manager whose request was turned away: box creations and
+// removals get an error, while listings and stats end with no frames, which
+// the manager reports as an error too
+void control_reject(protocol *protocol_msg) {
+  int pipe = open(protocol_msg->pipename, O_WRONLY);
+  if (pipe == -1) {
+    perror("error opening communication pipe");
+    return;
   }
+  if (protocol_msg->code == 3 || protocol_msg->code == 5) {
+    box_response msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.return_code = -1;
+    strcpy(msg.error_message, "broker busy, try again");
+    if (frame_write(pipe, protocol_msg->code + 1, &msg,
+                    box_response_size(&msg)) == -1)
+      perror("error writing to communication pipe");
+  }
+  close(pipe);
 }
 
-int main(int argc, char **argv) {
-  if (tfs_init(NULL) == -1) {
-    perror("error initializing tfs");
+// handles a register request taken from one of the queues
+void register_handle(register_request *request) {
+  protocol *p = &request->rr_protocol;
+  int started = -1;
+  if (request->rr_rejected) {
+    control_reject(p);
+    slab_pool_free(&requests, request);
+    return;
+  }
+  switch (p->code) {
+  case 1:
+    started = session_publisher(p, 0);
+    break;
+  case 13:
+    started = session_publisher(p, 1);
+    break;
+  case 2:
+    started = session_subscriber(p, 0);
+    break;
+  case 11:
+    started = session_subscriber(p, 1);
+    break;
+  case 3:
+    manager_create_box(p);
+    break;
+  case 5:
+    manager_destroy_box(p);
+    break;
+  case 7:
+    manager_list_boxes(p);
+    break;
+  case 14:
+    manager_stats(p);
+    break;
+  default:
+    perror("invalid code");
+  }
+  if (started == 0)
+    histogram_record(&session_start_latency,
+                     monotonic_us() - request->rr_received);
+  slab_pool_free(&requests, request);
+}
+
+// whether a register request is a manager's, handled by the control threads
+int register_is_control(uint8_t code) {
+  return code == 3 || code == 5 || code == 7 || code == 14;
+}
+
+// function run by every control thread: handles managers' requests, one at a
+// time, until the broker stops
+void *controller() {
+  register_request *request;
+  while ((request = (register_request *)pcq_dequeue(&control_queue)) !=
+         &control_stop) {
+    register_handle(request);
+  }
+  return NULL;
+}
+
+int worker_spawn();
+
+// takes one of the register requests announced in the register eventfd from
+// the queue, and handles it. The eventfd is a semaphore, so each worker that
+// gets it takes a single request: handling one may block opening its client's
+// pipe, which then only holds up that client, as the others are left to the
+// next workers (one is spawned if none is free to take them)
+void register_drain() {
+  uint64_t count;
+  if (read(register_eventfd, &count, sizeof(count)) != sizeof(count))
+    return; // another worker got the last one first
+  // lets other workers take the requests left
+  session_arm(register_eventfd, NULL, EPOLLIN, EPOLL_CTL_MOD);
+  if (pcq_depth(queue) > 1 && atomic_load(&pool.wp_idle) == 0)
+    worker_spawn();
+  // requests are enqueued before being announced, so this never sleeps
+  register_handle((register_request *)pcq_dequeue(queue));
+}
+
+void *worker();
+
+// starts a new worker, unless there are already as many as the maximum or the
+// broker is stopping. It counts as idle from the start, so that workers
+// spawned meanwhile don't spawn more for the same work
+//
+// Returns 0 if successful, -1 otherwise
+int worker_spawn() {
+  pthread_mutex_lock(&pool.wp_lock);
+  if (pool.wp_stopping || pool.wp_size >= pool.wp_max) {
+    pthread_mutex_unlock(&pool.wp_lock);
     return -1;
   }
-  // initializes mailboxes info array
-  // and the individual mutexes/condvars arrays
-  for (int i = 0; i < MAX_MAILBOXES; i++) {
-    mail_boxes[i].box_name[0] = '\0';
-    mail_boxes[i].box_size = 0;
-    mail_boxes[i].n_pubs = 0;
-    mail_boxes[i].n_subs = 0;
-    pthread_mutex_init(&mail_locks[i], NULL);
-    pthread_cond_init(&mail_condvars[i], NULL);
+  // SIGINT and SIGTERM are only for the main thread, which may be the one
+  // spawning the worker
+  sigset_t stop_signals, previous;
+  sigemptyset(&stop_signals);
+  sigaddset(&stop_signals, SIGINT);
+  sigaddset(&stop_signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &stop_signals, &previous);
+  pthread_t thread;
+  int result = pthread_create(&thread, NULL, worker, NULL) == 0 ? 0 : -1;
+  pthread_sigmask(SIG_SETMASK, &previous, NULL);
+  if (result == 0) {
+    pthread_detach(thread);
+    atomic_fetch_add(&pool.wp_idle, 1);
+    if (pool.wp_size++ >= pool.wp_min)
+      pool.wp_spawned++;
+  } else {
+    perror("error creating worker");
+  }
+  pthread_mutex_unlock(&pool.wp_lock);
+  return result;
+}
+
+// takes a worker that has been idle out of the pool, unless it is needed to
+// keep the minimum
+//
+// Returns whether the worker retires
+int worker_retire() {
+  pthread_mutex_lock(&pool.wp_lock);
+  int retire = pool.wp_size > pool.wp_min && !pool.wp_stopping;
+  if (retire) {
+    pool.wp_size--;
+    pool.wp_retired++;
+  }
+  pthread_mutex_unlock(&pool.wp_lock);
+  return retire;
+}
+
+// function run by every worker thread: waits for events on any session (or
+// for register requests) and handles them, avoiding active wait
+void *worker() {
+  struct epoll_event events[EPOLL_BATCH];
+  int stopped = 0;
+  while (!stopped) {
+    int n = epoll_wait(epoll_fd, events, EPOLL_BATCH, WORKER_IDLE_TIMEOUT);
+    int idle = atomic_fetch_sub(&pool.wp_idle, 1) - 1;
+    if (n == 0 && worker_retire())
+      return NULL;
+    if (n == -1 && errno != EINTR)
+      perror("error waiting for events");
+    // a full batch may have left more events behind, which no other worker
+    // is free to take
+    if (n == EPOLL_BATCH && idle == 0)
+      worker_spawn();
+    for (int i = 0; i < n; i++) {
+      session_t *session = (session_t *)events[i].data.ptr;
+      if (events[i].data.u64 & PARKED_HANGUP)
+        parked_hangup((int)(events[i].data.u64 & ~PARKED_HANGUP));
+      else if (session == NULL)
+        register_drain();
+      else if (session->s_type == SESSION_PUBLISHER)
+        publisher_handle(session);
+      else if (session->s_type == SESSION_SUBSCRIBER)
+        subscriber_handle(session);
+      else if (session->s_type == SESSION_WAKER)
+        waker_handle(session);
+      else if (session->s_type == SESSION_DUMPER)
+        dumper_handle(session);
+      else
+        stopped = 1;
+    }
+    if (!stopped)
+      atomic_fetch_add(&pool.wp_idle, 1);
+  }
+  session_arm(stopper.s_pipe, &stopper, EPOLLIN, EPOLL_CTL_MOD);
+  pthread_mutex_lock(&pool.wp_lock);
+  pool.wp_size--;
+  pthread_cond_signal(&pool.wp_exited);
+  pthread_mutex_unlock(&pool.wp_lock);
+  return NULL;
+}
+
+// drops the oldest messages of a box that its retention limits don't keep.
+// Publishers and readers are only held back while the log's index is updated
+// (no message is copied); the dropped blocks are freed afterwards, with the
+// box's file lock keeping the file from being removed meanwhile
+static void retention_trim(broker_box *box, time_t now) {
+  if (!box_log_retains(&box->bb_log))
+    return;
+  size_t from = 0, dropped = 0;
+  pthread_mutex_lock(&box->bb_lock);
+  if (!box->bb_removed) {
+    dropped = box_log_trim(&box->bb_log, now, &from);
+    box->bb_size -= dropped;
+  }
+  pthread_mutex_unlock(&box->bb_lock);
+  if (dropped == 0)
+    return;
+
+  // the blocks are freed without bb_lock, so publishers aren't held up by
+  // tfs; the reference taken by the caller keeps the box alive meanwhile
+  pthread_mutex_lock(&box->bb_file_lock);
+  if (!box->bb_file_removed &&
+      box_log_reclaim(&box->bb_log, from, dropped) == -1)
+    perror("error trimming box");
+  pthread_mutex_unlock(&box->bb_file_lock);
+}
+
+// writes the index file of a box's log, if it grew by min_growth bytes since
+// it was last written; the box's file lock keeps the file from being removed
+// meanwhile
+static void retention_checkpoint(broker_box *box, size_t min_growth) {
+  pthread_mutex_lock(&box->bb_file_lock);
+  if (!box->bb_file_removed &&
+      box_log_checkpoint(&box->bb_log, min_growth) == -1)
+    perror("error writing box index");
+  pthread_mutex_unlock(&box->bb_file_lock);
+}
+
+// goes over every box, a chunk at a time, trimming it and writing the index
+// of its log once it grew by CHECKPOINT_GROWTH bytes, or, in the last pass
+// (when the broker stops), writing the index of every log that grew at all
+static void retention_pass(int last) {
+  broker_box *boxes[LIST_CHUNK];
+  char cursor[BOX_NAME_SIZE] = "";
+  int more;
+  time_t now = time(NULL);
+  do {
+    size_t n = registry_collect("", cursor, boxes, LIST_CHUNK, &more);
+    for (size_t i = 0; i < n; i++) {
+      if (!last)
+        retention_trim(boxes[i], now);
+      retention_checkpoint(boxes[i], last ? 0 : CHECKPOINT_GROWTH);
+    }
+    if (n > 0)
+      memcpy(cursor, boxes[n - 1]->bb_name, BOX_NAME_SIZE);
+    for (size_t i = 0; i < n; i++) {
+      box_unref(boxes[i]);
+    }
+  } while (more);
+}
+
+// function run by the retention thread: goes over every box every
+// RETENTION_INTERVAL seconds, and once more when the broker stops
+void *retention_worker() {
+  pthread_mutex_lock(&retention_lock);
+  while (!retention_stopping) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += RETENTION_INTERVAL;
+    pthread_cond_timedwait(&retention_cond, &retention_lock, &deadline);
+    if (retention_stopping)
+      break;
+    pthread_mutex_unlock(&retention_lock);
+    retention_pass(0);
+    pthread_mutex_lock(&retention_lock);
+  }
+  pthread_mutex_unlock(&retention_lock);
+  retention_pass(1);
+  return NULL;
+}
+
+// handler for SIGINT and SIGTERM: interrupts the main thread's read of the
+// register pipe, so that it stops the broker
+void stop_handler(int signum) {
+  (void)signum;
+  stopping = 1;
+}
+
+// stops the workers and control threads (letting each finish what it is
+// handling), the retention thread (which writes the index files of the boxes'
+// logs) and then tfs, which writes its image (when kept in --data) so that
+// the next start is fast
+int broker_stop(char const *reg_pipename) {
+  uint64_t one = 1;
+  pthread_mutex_lock(&pool.wp_lock);
+  pool.wp_stopping = 1;
+  pthread_mutex_unlock(&pool.wp_lock);
+  if (write(stopper.s_pipe, &one, sizeof(one)) == -1)
+    perror("error signaling stop eventfd");
+  pthread_mutex_lock(&pool.wp_lock);
+  while (pool.wp_size > 0) {
+    pthread_cond_wait(&pool.wp_exited, &pool.wp_lock);
+  }
+  pthread_mutex_unlock(&pool.wp_lock);
+  for (int i = 0; i < CONTROL_THREADS; i++) {
+    pcq_enqueue(&control_queue, &control_stop);
+  }
+  for (int i = 0; i < CONTROL_THREADS; i++) {
+    pthread_join(controllers[i], NULL);
+  }
+  pthread_mutex_lock(&retention_lock);
+  retention_stopping = 1;
+  pthread_cond_signal(&retention_cond);
+  pthread_mutex_unlock(&retention_lock);
+  pthread_join(retainer, NULL);
+  unlink(reg_pipename);
+  if (tfs_destroy() == -1) {
+    perror("error destroying tfs");
+    return -1;
+  }
+  return 0;
+}
+
+// names of the boxes found in tfs on startup
+typedef struct {
+  char (*rb_names)[BOX_NAME_SIZE];
+  size_t rb_size;
+  size_t rb_capacity;
+} restored_boxes;
+
+static void restore_visit(char const *name, void *arg) {
+  restored_boxes *restored = (restored_boxes *)arg;
+  // the subscriptions of boxes are loaded with them, when used, and so are
+  // the indexes of their logs
+  if (groups_is_file(name) || box_log_is_index(name))
+    return;
+  if (restored->rb_size == restored->rb_capacity) {
+    size_t capacity =
+        restored->rb_capacity == 0 ? 64 : restored->rb_capacity * 2;
+    void *names = realloc(restored->rb_names, capacity * BOX_NAME_SIZE);
+    if (names == NULL)
+      return;
+    restored->rb_names = (char(*)[BOX_NAME_SIZE])names;
+    restored->rb_capacity = capacity;
+  }
+  strncpy(restored->rb_names[restored->rb_size], name, BOX_NAME_SIZE - 1);
+  restored->rb_names[restored->rb_size++][BOX_NAME_SIZE - 1] = '\0';
+}
+
+// adds the boxes restored by tfs_init to the registry (tfs can't be called
+// while listing it, so their names are collected first)
+int restore_boxes() {
+  restored_boxes restored = {NULL, 0, 0};
+  if (tfs_list(restore_visit, &restored) == -1)
+    return -1;
+  int result = 0;
+  for (size_t i = 0; i < restored.rb_size && result == 0; i++) {
+    if (registry_restore(restored.rb_names[i]) != 0)
+      result = -1;
   }
-  if (argc != 3) {
+  free(restored.rb_names);
+  return result;
+}
+
+int main(int argc, char **argv) {
+  // mbroker <register_pipe> <max_sessions> [--data <dir>]
+  //     [--fsync always|never|<ms>] [--fs-latency <ns>[,<jitter_ns>]]
+  //     [--stats-interval <s>] [--min-workers <n>]
+  if (argc < 3) {
     perror("incorrect number of arguments");
     return -1;
   }
+  // boxes are files in tfs, so the number of blocks bounds the total amount
+  // of messages stored in the broker
+  tfs_params params = tfs_default_params();
+  params.max_inode_count = BROKER_MAX_BOXES + 1;
+  params.max_block_count = BROKER_BLOCK_COUNT;
+  params.max_open_files_count = BROKER_OPEN_FILES;
+  // with --data, boxes are kept in that directory, in an image written when
+  // the broker stops and a write-ahead log of the changes made since, and are
+  // restored from them on startup
+  char wal_path[PATH_MAX], image_path[PATH_MAX];
+  long stats_interval = 0;
+  int min_workers = 1;
+  for (int i = 3; i < argc; i++) {
+    if (!strcmp(argv[i], "--data") && i + 1 < argc) {
+      char const *dir = argv[++i];
+      if ((mkdir(dir, 0755) == -1 && errno != EEXIST) ||
+          snprintf(wal_path, sizeof(wal_path), "%s/tfs.wal", dir) >=
+              (int)sizeof(wal_path) ||
+          snprintf(image_path, sizeof(image_path), "%s/tfs.img", dir) >=
+              (int)sizeof(image_path)) {
+        perror("invalid data directory");
+        return -1;
+      }
+      params.wal_path = wal_path;
+      params.image_path = image_path;
+    } else if (!strcmp(argv[i], "--fsync") && i + 1 < argc) {
+      i++;
+      if (!strcmp(argv[i], "always")) {
+        params.sync_policy = TFS_SYNC_ALWAYS;
+      } else if (!strcmp(argv[i], "never")) {
+        params.sync_policy = TFS_SYNC_NEVER;
+      } else {
+        params.sync_policy = TFS_SYNC_INTERVAL;
+        params.sync_interval_ms = (unsigned)atoi(argv[i]);
+      }
+    } else if (!strcmp(argv[i], "--fs-latency") && i + 1 < argc) {
+      // emulates tfs being kept in a storage device with that latency per
+      // access (uniformly distributed within the jitter, if given)
+      char *jitter;
+      params.latency_ns = (unsigned)strtoul(argv[++i], &jitter, 10);
+      params.latency_model = TFS_LATENCY_FIXED;
+      if (*jitter == ',') {
+        params.latency_jitter_ns = (unsigned)strtoul(jitter + 1, NULL, 10);
+        params.latency_model = TFS_LATENCY_UNIFORM;
+      }
+    } else if (!strcmp(argv[i], "--stats-interval") && i + 1 < argc) {
+      stats_interval = atol(argv[++i]);
+    } else if (!strcmp(argv[i], "--min-workers") && i + 1 < argc) {
+      // workers kept even when there is nothing to do
+      min_workers = atoi(argv[++i]);
+    } else {
+      fprintf(stderr, "unknown option: %s\n", argv[i]);
+      return -1;
+    }
+  }
+  // accesses to tfs are only counted (which every thread does in the fs hot
+  // path) when the stats are logged periodically, or emulated anyway
+  params.count_accesses = stats_interval > 0;
+  if (tfs_init(&params) == -1 || registry_init() == -1 ||
+      restore_boxes() == -1) {
+    perror("error initializing tfs");
+    return -1;
+  }
   char *reg_pipename = argv[1];
+  // sessions are multiplexed over the workers, so max_sessions only bounds
+  // the number of threads, not of clients
   int max_sessions = atoi(argv[2]);
+  if (max_sessions <= 0) {
+    perror("invalid number of sessions");
+    return -1;
+  }
+  if (min_workers <= 0 || min_workers > max_sessions) {
+    fprintf(stderr, "--min-workers must be between 1 and max_sessions\n");
+    return -1;
+  }
+  pool.wp_min = min_workers;
+  pool.wp_max = max_sessions;
   // arbitrary value, decided to be double of max_sessions
   size_t pcqueue_size = (size_t)max_sessions * 2;
+  size_t grow_depth = pcqueue_size / 2;
+  if (grow_depth > WORKER_GROW_DEPTH)
+    grow_depth = WORKER_GROW_DEPTH;
+  // requests in flight are those in the queues, those taken from them by each
+  // worker and control thread (one), and the batch being read by this thread
+  size_t max_requests = pcqueue_size + CONTROL_QUEUE_SIZE + CONTROL_THREADS +
+                        (size_t)max_sessions + REGISTER_BATCH;
+  if (max_requests >= SLAB_NONE ||
+      slab_pool_init(&requests, sizeof(register_request),
+                     (uint32_t)max_requests) == -1) {
+    perror("error creating register request pool");
+    return -1;
+  }
   // if any subscriber disconnects, a SIGPIPE is sent; we ignore it
   signal(SIGPIPE, SIG_IGN);
+  // SIGINT and SIGTERM stop the broker. They are only handled by the main
+  // thread (the workers inherit them blocked), and without SA_RESTART, so
+  // that they interrupt its reads
+  struct sigaction stop_action;
+  memset(&stop_action, 0, sizeof(stop_action));
+  stop_action.sa_handler = stop_handler;
+  sigemptyset(&stop_action.sa_mask);
+  sigaction(SIGINT, &stop_action, NULL);
+  sigaction(SIGTERM, &stop_action, NULL);
+  sigset_t stop_signals;
+  sigemptyset(&stop_signals);
+  sigaddset(&stop_signals, SIGINT);
+  sigaddset(&stop_signals, SIGTERM);
   // unlinks any pipe that may exist with the same name before creating it
   unlink(reg_pipename);
   mkfifo(reg_pipename, 0666);
-  // initializes the global queue and the threads
+  // initializes the global queue, the epoll instance and the threads
   queue = (pc_queue_t *)malloc(sizeof(pc_queue_t));
-  pcq_create(queue, pcqueue_size);
-  // creates max_sessions threads
-  pthread_t sessions[max_sessions];
-  for (int i = 0; i < max_sessions; i++) {
-    pthread_create(&sessions[i], NULL, session, NULL);
+  pcq_create_mode(queue, pcqueue_size, PCQ_LOCK_FREE);
+  pcq_create_mode(&control_queue, CONTROL_QUEUE_SIZE, PCQ_LOCK_FREE);
+  epoll_fd = epoll_create1(0);
+  register_eventfd = eventfd(0, EFD_NONBLOCK | EFD_SEMAPHORE);
+  if (epoll_fd == -1 || register_eventfd == -1 ||
+      session_arm(register_eventfd, NULL, EPOLLIN, EPOLL_CTL_ADD) == -1) {
+    perror("error creating epoll instance");
+    return -1;
+  }
+  waker.s_type = SESSION_WAKER;
+  waker.s_pipe = eventfd(0, EFD_NONBLOCK);
+  if (waker.s_pipe == -1 ||
+      session_arm(waker.s_pipe, &waker, EPOLLIN, EPOLL_CTL_ADD) == -1) {
+    perror("error creating wake eventfd");
+    return -1;
+  }
+  // every fd the broker can open fits in the parked table, up to
+  // PARKED_MAX_FDS (subscribers with fds past it are not watched while parked)
+  struct rlimit files;
+  parked_size = PARKED_MAX_FDS;
+  if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < parked_size)
+    parked_size = (size_t)files.rlim_cur;
+  parked = (session_t **)calloc(parked_size, sizeof(session_t *));
+  if (parked == NULL) {
+    perror("error creating parked subscribers table");
+    return -1;
+  }
+  stopper.s_type = SESSION_STOPPER;
+  stopper.s_pipe = eventfd(0, EFD_NONBLOCK);
+  if (stopper.s_pipe == -1 ||
+      session_arm(stopper.s_pipe, &stopper, EPOLLIN, EPOLL_CTL_ADD) == -1) {
+    perror("error creating stop eventfd");
+    return -1;
   }
+  histogram_init(&deliver_latency);
+  histogram_init(&session_start_latency);
+  if (stats_interval > 0) {
+    struct itimerspec period;
+    memset(&period, 0, sizeof(period));
+    period.it_interval.tv_sec = stats_interval;
+    period.it_value.tv_sec = stats_interval;
+    dumper.s_type = SESSION_DUMPER;
+    dumper.s_pipe = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (dumper.s_pipe == -1 ||
+        timerfd_settime(dumper.s_pipe, 0, &period, NULL) == -1 ||
+        session_arm(dumper.s_pipe, &dumper, EPOLLIN, EPOLL_CTL_ADD) == -1) {
+      perror("error creating stats timerfd");
+      return -1;
+    }
+  }
+  // starts the minimum number of workers, up to max_sessions as needed
+  pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+  for (int i = 0; i < min_workers; i++) {
+    worker_spawn();
+  }
+  for (int i = 0; i < CONTROL_THREADS; i++) {
+    pthread_create(&controllers[i], NULL, controller, NULL);
+  }
+  pthread_create(&retainer, NULL, retention_worker, NULL);
+  pthread_sigmask(SIG_UNBLOCK, &stop_signals, NULL);
   int reg_pipe, reg_pipe_wrfd;
   // waits for register requests and handles them
   reg_pipe = open(reg_pipename, O_RDONLY);
+  if (reg_pipe == -1 && stopping)
+    return broker_stop(reg_pipename);
   if (reg_pipe == -1) {
     perror("error opening register pipe");
     return -1;
@@ -365,16 +1868,73 @@ int main(int argc, char **argv) {
   reg_pipe_wrfd = open(reg_pipename, O_WRONLY);
   (void)reg_pipe_wrfd;
 
-  // reads and handles protocol type messages, enqueueing them
-  protocol *protocol_msg;
+  // reads and handles register requests, enqueueing them. Every read() may
+  // return several requests (and part of the next one, which the reader keeps
+  // for the following read), and all complete ones are enqueued as a batch
+  // and announced to the workers through the register eventfd
+  frame_reader reader;
+  frame_reader_init(&reader, reg_pipe);
+  register_request *batch[REGISTER_BATCH];
   while (1) {
-    protocol_msg = (protocol *)malloc(sizeof(protocol));
     // non-active wait because read is blocking
-    if (read(reg_pipe, protocol_msg, sizeof(protocol)) == -1) {
+    ssize_t n = frame_reader_fill(&reader);
+    if (stopping)
+      return broker_stop(reg_pipename);
+    if (n <= 0) {
       perror("error reading protocol");
       continue;
     }
-    pcq_enqueue(queue, protocol_msg);
+
+    frame_header header;
+    char const *payload;
+    int found;
+    do {
+      size_t count = 0;
+      while (count < REGISTER_BATCH &&
+             (found = frame_next(&reader, &header, &payload)) == 1) {
+        // the pool holds as many requests as can be in flight at once
+        batch[count] = (register_request *)slab_pool_alloc(&requests);
+        ALWAYS_ASSERT(batch[count] != NULL,
+                      "mbroker: register request pool exhausted");
+        if (frame_parse_register(&header, payload,
+                                 &batch[count]->rr_protocol) == -1) {
+          slab_pool_free(&requests, batch[count]);
+          continue;
+        }
+        batch[count]->rr_received = monotonic_us();
+        batch[count]->rr_rejected = 0;
+        // managers' requests skip the workers' queue (and the batch), unless
+        // the control threads are so far behind that their queue is full:
+        // then a worker turns them away, rather than this thread waiting
+        if (register_is_control(batch[count]->rr_protocol.code)) {
+          if (pcq_try_enqueue(&control_queue, batch[count]) == 0)
+            continue;
+          batch[count]->rr_rejected = 1;
+        }
+        count++;
+      }
+      // each chunk is announced as soon as it is enqueued, so that the
+      // workers make room for the next one when the queue is smaller than
+      // the batch
+      for (size_t i = 0; i < count;) {
+        size_t chunk = count - i < pcqueue_size ? count - i : pcqueue_size;
+        // checked before enqueueing, which may wait for the workers
+        if (pcq_depth(queue) + chunk > grow_depth &&
+            atomic_load(&pool.wp_idle) == 0)
+          worker_spawn();
+        pcq_enqueue_many(queue, (void **)batch + i, chunk);
+        uint64_t announced = chunk;
+        if (write(register_eventfd, &announced, sizeof(announced)) == -1)
+          perror("error announcing register requests");
+        i += chunk;
+      }
+    } while (found == 1);
+    // clients write each request at once, so this only happens if one of
+    // them wrote something else: there is no way to find the next frame
+    if (found == -1) {
+      perror("invalid register request");
+      frame_reader_init(&reader, reg_pipe);
+    }
   }
   return 0;
 }
@@ -0,0 +1,406 @@
+#include "registry.h"
+#include "epoch.h"
+#include "hashmap.h"
+#include "operations.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// every box in the registry at some point in time, in order of name, split
+// into chunks of consecutive boxes. Snapshots share the chunks they have in
+// common, so that replacing one only copies the list of chunks and the chunk
+// changed, rather than every box in the registry
+#define CHUNK_MAX (256)
+
+typedef struct {
+  size_t sc_size; // never 0
+  broker_box *sc_boxes[];
+} snapshot_chunk;
+
+typedef struct {
+  size_t rs_size; // number of chunks
+  snapshot_chunk *rs_chunks[];
+} registry_snapshot;
+
+// position of a box in a snapshot: rs_size chunks in for the end
+typedef struct {
+  size_t sp_chunk;
+  size_t sp_box;
+} snapshot_position;
+
+static hashmap boxes;
+static _Atomic(registry_snapshot *) snapshot;
+// serializes creations and removals, so that a box's name and tfs file always
+// come and go together, and so that snapshots are replaced one at a time
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int registry_init(void) {
+  registry_snapshot *empty =
+      (registry_snapshot *)calloc(1, sizeof(registry_snapshot));
+  if (empty == NULL)
+    return -1;
+  atomic_init(&snapshot, empty);
+  return hashmap_init(&boxes);
+}
+
+void box_ref(broker_box *box) { atomic_fetch_add(&box->bb_refs, 1); }
+
+static void box_free(void *arg) {
+  broker_box *box = (broker_box *)arg;
+  box_log_destroy(&box->bb_log);
+  groups_destroy(&box->bb_groups);
+  pthread_mutex_destroy(&box->bb_lock);
+  pthread_mutex_destroy(&box->bb_file_lock);
+  free(box);
+}
+
+void box_unref(broker_box *box) {
+  if (atomic_fetch_sub(&box->bb_refs, 1) == 1)
+    epoch_retire(box, box_free);
+}
+
+// takes a reference to a box found in the hash map, unless its last one was
+// already dropped
+static int box_hold(void *value) {
+  broker_box *box = (broker_box *)value;
+  size_t refs = atomic_load(&box->bb_refs);
+  do {
+    if (refs == 0)
+      return 0;
+  } while (!atomic_compare_exchange_weak(&box->bb_refs, &refs, refs + 1));
+  return 1;
+}
+
+broker_box *registry_get(char const *name) {
+  return (broker_box *)hashmap_get(&boxes, name, box_hold);
+}
+
+// whether a box's name comes after name (or is equal to it, if inclusive is
+// set)
+static int comes_after(broker_box const *box, char const *name,
+                       int inclusive) {
+  int order = strcmp(box->bb_name, name);
+  return order > 0 || (order == 0 && inclusive);
+}
+
+// position of the first box in a snapshot whose name comes after name (or
+// is equal to it, if inclusive is set)
+static snapshot_position snapshot_search(registry_snapshot const *current,
+                                         char const *name, int inclusive) {
+  // the first chunk whose last box comes after name has the box
+  size_t low = 0, high = current->rs_size;
+  while (low < high) {
+    size_t middle = low + (high - low) / 2;
+    snapshot_chunk const *chunk = current->rs_chunks[middle];
+    if (comes_after(chunk->sc_boxes[chunk->sc_size - 1], name, inclusive))
+      high = middle;
+    else
+      low = middle + 1;
+  }
+  snapshot_position position = {low, 0};
+  if (low == current->rs_size)
+    return position;
+  snapshot_chunk const *chunk = current->rs_chunks[low];
+  high = chunk->sc_size - 1;
+  while (position.sp_box < high) {
+    size_t middle = position.sp_box + (high - position.sp_box) / 2;
+    if (comes_after(chunk->sc_boxes[middle], name, inclusive))
+      high = middle;
+    else
+      position.sp_box = middle + 1;
+  }
+  return position;
+}
+
+// box at a position, or NULL at the end of the snapshot
+static broker_box *snapshot_box(registry_snapshot const *current,
+                                snapshot_position position) {
+  if (position.sp_chunk == current->rs_size)
+    return NULL;
+  return current->rs_chunks[position.sp_chunk]->sc_boxes[position.sp_box];
+}
+
+static void snapshot_next(registry_snapshot const *current,
+                          snapshot_position *position) {
+  if (++position->sp_box == current->rs_chunks[position->sp_chunk]->sc_size) {
+    position->sp_chunk++;
+    position->sp_box = 0;
+  }
+}
+
+static snapshot_chunk *chunk_alloc(size_t size) {
+  return (snapshot_chunk *)malloc(sizeof(snapshot_chunk) +
+                                  size * sizeof(broker_box *));
+}
+
+// replaces the snapshot with a copy with the box added in its place (or
+// removed, if removed is set); must be called with the registry lock held.
+// Only the chunk the box is in is copied: a full one is split in two, and one
+// left empty is dropped, so a change costs O(boxes / CHUNK_MAX + CHUNK_MAX)
+static int snapshot_replace(broker_box *box, int removed) {
+  registry_snapshot *old = atomic_load(&snapshot);
+  snapshot_position position = snapshot_search(old, box->bb_name, 1);
+  // a new box past every other one goes at the end of the last chunk
+  if (!removed && position.sp_chunk == old->rs_size && old->rs_size > 0) {
+    position.sp_chunk--;
+    position.sp_box = old->rs_chunks[position.sp_chunk]->sc_size;
+  }
+  snapshot_chunk *changed =
+      position.sp_chunk < old->rs_size ? old->rs_chunks[position.sp_chunk]
+                                       : NULL;
+  size_t size = changed != NULL ? changed->sc_size : 0;
+  size = removed ? size - 1 : size + 1;
+
+  // the boxes of the changed chunk, with the box added or removed, go into
+  // as many chunks as needed
+  size_t parts = size == 0 ? 0 : size > CHUNK_MAX ? 2 : 1;
+  registry_snapshot *next = (registry_snapshot *)malloc(
+      sizeof(registry_snapshot) +
+      (old->rs_size + parts - (changed != NULL)) * sizeof(snapshot_chunk *));
+  snapshot_chunk *chunks[2] = {NULL, NULL};
+  for (size_t i = 0; i < parts; i++) {
+    chunks[i] = chunk_alloc(size / parts + size % parts * i);
+  }
+  if (next == NULL || (parts > 0 && chunks[0] == NULL) ||
+      (parts > 1 && chunks[1] == NULL)) {
+    free(next);
+    free(chunks[0]);
+    free(chunks[1]);
+    return -1;
+  }
+  broker_box *boxes_in[CHUNK_MAX + 1];
+  if (changed != NULL) {
+    memcpy(boxes_in, changed->sc_boxes, position.sp_box * sizeof(broker_box *));
+  }
+  size_t after = removed ? position.sp_box + 1 : position.sp_box;
+  if (!removed)
+    boxes_in[position.sp_box] = box;
+  if (changed != NULL) {
+    memcpy(boxes_in + position.sp_box + !removed, changed->sc_boxes + after,
+           (changed->sc_size - after) * sizeof(broker_box *));
+  }
+  for (size_t i = 0, copied = 0; i < parts; i++) {
+    chunks[i]->sc_size = size / parts + size % parts * i;
+    memcpy(chunks[i]->sc_boxes, boxes_in + copied,
+           chunks[i]->sc_size * sizeof(broker_box *));
+    copied += chunks[i]->sc_size;
+  }
+
+  size_t skip = changed != NULL;
+  memcpy(next->rs_chunks, old->rs_chunks,
+         position.sp_chunk * sizeof(snapshot_chunk *));
+  memcpy(next->rs_chunks + position.sp_chunk, chunks,
+         parts * sizeof(snapshot_chunk *));
+  memcpy(next->rs_chunks + position.sp_chunk + parts,
+         old->rs_chunks + position.sp_chunk + skip,
+         (old->rs_size - position.sp_chunk - skip) * sizeof(snapshot_chunk *));
+  next->rs_size = old->rs_size + parts - skip;
+  atomic_store_explicit(&snapshot, next, memory_order_release);
+  epoch_retire(old, free);
+  if (changed != NULL)
+    epoch_retire(changed, free);
+  return 0;
+}
+
+// adds a box to the registry, either creating its tfs file (with the given
+// retention policy) or, if restore is set, recovering its log from the
+// existing one
+static int registry_add(char const *name, int restore,
+                        log_retention const *retention) {
+  int result = 0;
+  pthread_mutex_lock(&registry_lock);
+  if (hashmap_get(&boxes, name, NULL) != NULL) {
+    pthread_mutex_unlock(&registry_lock);
+    return -1;
+  }
+
+  broker_box *box = (broker_box *)malloc(sizeof(broker_box));
+  int fhandle = restore ? -1 : tfs_open(name, TFS_O_CREAT);
+  if (box == NULL || (fhandle == -1 && !restore)) {
+    if (fhandle != -1)
+      tfs_close(fhandle);
+    pthread_mutex_unlock(&registry_lock);
+    free(box);
+    return -2;
+  }
+  if (fhandle != -1)
+    tfs_close(fhandle);
+  char groups_name[GROUPS_FILE_NAME_SIZE];
+  groups_file_name(groups_name, name);
+  if (!restore)
+    tfs_unlink(groups_name);
+
+  strncpy(box->bb_name, name, BOX_NAME_SIZE - 1);
+  box->bb_name[BOX_NAME_SIZE - 1] = '\0';
+  pthread_mutex_init(&box->bb_lock, NULL);
+  atomic_init(&box->bb_size, 0);
+  atomic_init(&box->bb_n_pubs, 0);
+  atomic_init(&box->bb_n_subs, 0);
+  box->bb_removed = 0;
+  box->bb_waiters = NULL;
+  box->bb_ring = NULL;
+  atomic_init(&box->bb_seq, 0);
+  atomic_flag_clear(&box->bb_wake_queued);
+  box->bb_wake_next = NULL;
+  atomic_init(&box->bb_refs, 1); // the registry's
+  atomic_init(&box->bb_metrics.bm_msgs_in, 0);
+  atomic_init(&box->bb_metrics.bm_bytes_in, 0);
+  atomic_init(&box->bb_metrics.bm_msgs_out, 0);
+  atomic_init(&box->bb_metrics.bm_bytes_out, 0);
+  atomic_init(&box->bb_metrics.bm_drops, 0);
+  atomic_init(&box->bb_metrics.bm_lag_subs, 0);
+  atomic_init(&box->bb_metrics.bm_lag_offsets, 0);
+  groups_init(&box->bb_groups);
+  pthread_mutex_init(&box->bb_file_lock, NULL);
+  box->bb_file_removed = 0;
+  if ((restore ? box_log_recover(&box->bb_log, name)
+               : box_log_create(&box->bb_log, name, retention)) == -1) {
+    groups_destroy(&box->bb_groups);
+    pthread_mutex_destroy(&box->bb_lock);
+    pthread_mutex_destroy(&box->bb_file_lock);
+    free(box);
+    if (!restore)
+      tfs_unlink(name);
+    pthread_mutex_unlock(&registry_lock);
+    return -2;
+  }
+
+  // a restored box starts with the messages already in its log
+  atomic_store(&box->bb_size, box_log_size(&box->bb_log));
+  atomic_store(&box->bb_seq, box->bb_log.bl_next_offset);
+  if (hashmap_put(&boxes, name, box) == -1) {
+    box_unref(box);
+    result = -2;
+  } else if (snapshot_replace(box, 0) == -1) {
+    hashmap_remove(&boxes, name);
+    box_unref(box);
+    result = -2;
+  }
+  if (result != 0 && !restore)
+    tfs_unlink(name);
+  pthread_mutex_unlock(&registry_lock);
+  return result;
+}
+
+int registry_create(char const *name, log_retention const *retention) {
+  return registry_add(name, 0, retention);
+}
+
+int registry_restore(char const *name) { return registry_add(name, 1, NULL); }
+
+int registry_remove(char const *name, broker_box **removed) {
+  pthread_mutex_lock(&registry_lock);
+  broker_box *box = (broker_box *)hashmap_get(&boxes, name, NULL);
+  if (box == NULL) {
+    pthread_mutex_unlock(&registry_lock);
+    return -1;
+  }
+  // the snapshot is replaced first, since it is the only step that can fail
+  // for lack of memory
+  if (snapshot_replace(box, 1) == -1) {
+    pthread_mutex_unlock(&registry_lock);
+    return -2;
+  }
+  pthread_mutex_lock(&box->bb_file_lock);
+  if (tfs_unlink(name) == -1) {
+    pthread_mutex_unlock(&box->bb_file_lock);
+    snapshot_replace(box, 0);
+    pthread_mutex_unlock(&registry_lock);
+    return -2;
+  }
+  tfs_unlink(box->bb_log.bl_index_name);
+  box->bb_file_removed = 1;
+  pthread_mutex_unlock(&box->bb_file_lock);
+  hashmap_remove(&boxes, name);
+  pthread_mutex_unlock(&registry_lock);
+
+  pthread_mutex_lock(&box->bb_lock);
+  box->bb_removed = 1;
+  // with the box's lock held, so no subscription can be added afterwards
+  char groups_name[GROUPS_FILE_NAME_SIZE];
+  groups_file_name(groups_name, name);
+  tfs_unlink(groups_name);
+  // subscribers reading the ring see it closed and end
+  if (box->bb_ring != NULL) {
+    shm_ring_destroy(box->bb_ring);
+    free(box->bb_ring);
+    box->bb_ring = NULL;
+  }
+  pthread_mutex_unlock(&box->bb_lock);
+  *removed = box;
+  return 0;
+}
+
+void registry_foreach(void (*visit)(broker_box *box, void *arg), void *arg) {
+  epoch_enter();
+  registry_snapshot *current =
+      atomic_load_explicit(&snapshot, memory_order_acquire);
+  for (size_t i = 0; i < current->rs_size; i++) {
+    snapshot_chunk const *chunk = current->rs_chunks[i];
+    for (size_t j = 0; j < chunk->sc_size; j++) {
+      visit(chunk->sc_boxes[j], arg);
+    }
+  }
+  epoch_exit();
+}
+
+// position of the first box in a snapshot whose name starts with prefix and
+// comes after after (boxes with the prefix are all together, starting where
+// the prefix would)
+static snapshot_position snapshot_range(registry_snapshot const *current,
+                                        char const *prefix,
+                                        char const *after) {
+  return strcmp(after, prefix) >= 0 ? snapshot_search(current, after, 0)
+                                    : snapshot_search(current, prefix, 1);
+}
+
+size_t registry_list(char const *prefix, char const *after, mail_box *infos,
+                     size_t max, int *more) {
+  size_t prefix_length = strlen(prefix);
+  size_t count = 0;
+  epoch_enter();
+  registry_snapshot *current =
+      atomic_load_explicit(&snapshot, memory_order_acquire);
+  snapshot_position i = snapshot_range(current, prefix, after);
+  broker_box *box;
+  for (; (box = snapshot_box(current, i)) != NULL;
+       snapshot_next(current, &i)) {
+    if (strncmp(box->bb_name, prefix, prefix_length) != 0)
+      break;
+    if (count == max)
+      break;
+    // the counters are read without the box's lock, so that listing never
+    // stalls publishers or subscribers
+    mail_box *info = &infos[count++];
+    memcpy(info->box_name, box->bb_name, BOX_NAME_SIZE);
+    info->box_size = atomic_load_explicit(&box->bb_size, memory_order_relaxed);
+    info->n_pubs = atomic_load_explicit(&box->bb_n_pubs, memory_order_relaxed);
+    info->n_subs = atomic_load_explicit(&box->bb_n_subs, memory_order_relaxed);
+  }
+  *more = box != NULL && strncmp(box->bb_name, prefix, prefix_length) == 0;
+  epoch_exit();
+  return count;
+}
+
+size_t registry_collect(char const *prefix, char const *after,
+                        broker_box **taken, size_t max, int *more) {
+  size_t prefix_length = strlen(prefix);
+  size_t count = 0;
+  epoch_enter();
+  registry_snapshot *current =
+      atomic_load_explicit(&snapshot, memory_order_acquire);
+  snapshot_position i = snapshot_range(current, prefix, after);
+  broker_box *box;
+  for (; (box = snapshot_box(current, i)) != NULL && count < max;
+       snapshot_next(current, &i)) {
+    if (strncmp(box->bb_name, prefix, prefix_length) != 0)
+      break;
+    // a box whose last reference was just dropped is left out, as if it had
+    // been removed before the snapshot was taken
+    if (box_hold(box))
+      taken[count++] = box;
+  }
+  *more = box != NULL && strncmp(box->bb_name, prefix, prefix_length) == 0;
+  epoch_exit();
+  return count;
+}
@@ -0,0 +1,141 @@
+#ifndef __MBROKER_REGISTRY_H__
+#define __MBROKER_REGISTRY_H__
+
+#include "box_log.h"
+#include "extras.h"
+#include "groups.h"
+#include "shm_ring.h"
+
+#include <stdatomic.h>
+
+// Registry of the broker's boxes, indexed by name in a concurrent hash map.
+//
+// Boxes are reference counted: the registry holds one reference to each box
+// it indexes, and so does every session (or any other thread) using the box,
+// so that a box removed from the registry is only freed once nobody uses it
+// anymore. Removed boxes are flagged as such, so that their sessions end.
+//
+// Reading the registry takes no lock: lookups go through the hash map, and
+// listings through an immutable snapshot of every box, which creations and
+// removals (serialized only against each other) replace, copying only the
+// chunk of it they change. Boxes, like old snapshots, are retired (see
+// epoch.h) rather than freed, so readers can still look at a box whose last
+// reference was just dropped.
+
+struct session;
+
+// counters of what goes through a box since the broker started, updated with
+// relaxed atomic operations (without the box's lock) and read the same way,
+// so each one is exact but they are not a consistent snapshot together
+typedef struct {
+  _Atomic uint64_t bm_msgs_in; // appended by publishers
+  _Atomic uint64_t bm_bytes_in;
+  _Atomic uint64_t bm_msgs_out; // sent to subscribers through their pipes
+  _Atomic uint64_t bm_bytes_out;
+  // read from publishers but not appended (box removed, or tfs full)
+  _Atomic uint64_t bm_drops;
+  // subscribers reading the box through their pipes (those reading it over
+  // shared memory aren't followed by the broker), and the sum of the offsets
+  // of the next message each one will get: their total lag is how far that
+  // is from the number of messages in the box for each of them
+  _Atomic uint64_t bm_lag_subs;
+  _Atomic uint64_t bm_lag_offsets;
+} box_metrics;
+
+typedef struct broker_box {
+  char bb_name[BOX_NAME_SIZE];
+  box_log bb_log; // where the contents of the box are stored
+  // protects the fields below, and serializes appends to the log. The
+  // counters are only written with the lock held, but are atomic so that
+  // listings can read them without it
+  pthread_mutex_t bb_lock;
+  _Atomic uint64_t bb_size;
+  _Atomic uint64_t bb_n_pubs;
+  _Atomic uint64_t bb_n_subs;
+  int bb_removed;
+  // subscribers waiting for new messages
+  struct session *bb_waiters;
+  // shared memory ring (NULL until a subscriber asks for one), where every
+  // message is appended once for all subscribers over shared memory
+  shm_ring *bb_ring;
+  // number of messages published to the box: subscribers compare it with the
+  // offset of the next message they will read to know whether they are
+  // caught up, without taking any lock
+  _Atomic uint64_t bb_seq;
+  // whether the box is in the broker's list of boxes to wake up, and the next
+  // box in that list
+  atomic_flag bb_wake_queued;
+  struct broker_box *bb_wake_next;
+  _Atomic size_t bb_refs;
+  box_metrics bb_metrics;
+  // named subscriptions, whose file is removed with the box
+  box_groups bb_groups;
+  // serializes freeing the blocks of trimmed messages, which happens without
+  // bb_lock held, with the removal of the box's file (after which its blocks
+  // are gone). Taken after bb_lock or the registry's lock, when either is held
+  pthread_mutex_t bb_file_lock;
+  int bb_file_removed;
+} broker_box;
+
+// registry_init: initializes an empty registry
+//
+// Returns 0 if successful, -1 otherwise
+int registry_init(void);
+
+// registry_get: looks a box up, taking a reference to it
+//
+// Returns the box, or NULL if there is no box with that name
+broker_box *registry_get(char const *name);
+
+// registry_create: creates a box (and its tfs file, removing any file of
+// subscriptions or log index left by an earlier box with the same name), which
+// keeps its messages as retention allows (forever if it is NULL)
+//
+// Returns 0 if successful, or -1 if the box already exists, or -2 if it can't
+// be created
+int registry_create(char const *name, log_retention const *retention);
+
+// registry_restore: adds a box whose tfs file already exists (such as one
+// restored by tfs_init), with the messages already in it
+//
+// Returns 0 if successful, or -1 if the box already exists, or -2 if it can't
+// be restored
+int registry_restore(char const *name);
+
+// registry_remove: removes a box (and its tfs files) from the registry, and
+// flags it as removed. The registry's reference to the box is handed to the
+// caller through removed, so that it can wake up the box's sessions first
+//
+// Returns 0 if successful, or -1 if the box doesn't exist, or -2 if its file
+// can't be removed
+int registry_remove(char const *name, broker_box **removed);
+
+// registry_foreach: calls visit on every box in a snapshot of the registry,
+// taken at a single point in time, in order of name. visit must not block (nor
+// take the boxes' locks), since boxes removed meanwhile can't be freed until
+// it returns
+void registry_foreach(void (*visit)(broker_box *box, void *arg), void *arg);
+
+// registry_list: copies the information of (at most max of) the boxes whose
+// name starts with prefix and comes after after, in order of name, to infos.
+// more is set if there are more such boxes than were copied
+//
+// Returns the number of boxes copied
+size_t registry_list(char const *prefix, char const *after, mail_box *infos,
+                     size_t max, int *more);
+
+// registry_collect: takes a reference to (at most max of) the boxes whose
+// name starts with prefix and comes after after, in order of name, storing
+// them in taken. more is set if there are more such boxes than were taken
+//
+// Returns the number of boxes taken, each to be released with box_unref
+size_t registry_collect(char const *prefix, char const *after,
+                        broker_box **taken, size_t max, int *more);
+
+// box_ref: takes a reference to a box
+void box_ref(broker_box *box);
+
+// box_unref: drops a reference to a box, freeing it if it was the last one
+void box_unref(broker_box *box);
+
+#endif // __MBROKER_REGISTRY_H__
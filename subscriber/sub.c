@@ -1,5 +1,8 @@
 #include "extras.h"
 #include "logging.h"
+#include "shm_ring.h"
+
+#include <inttypes.h>
 
 protocol message;
 int msg_num = 0;
@@ -21,12 +24,68 @@ void sigint_handler(int signum) {
   _exit(signum);
 }
 
+// reads the rest of the messages from the box's shared memory ring, whose name
+// and starting position were sent by mbroker
+int read_ring(char const *attach) {
+  char name[PIPE_NAME_SIZE];
+  uint64_t position;
+  shm_ring_reader reader;
+  if (sscanf(attach, "%255s %" SCNu64, name, &position) != 2 ||
+      shm_ring_attach(&reader, name, position) == -1) {
+    perror("attaching to shared memory ring");
+    return -1;
+  }
+
+  char buffer[MESSAGE_SIZE];
+  ssize_t n;
+  uint64_t overruns = 0;
+  while ((n = shm_ring_read(&reader, buffer, sizeof(buffer))) > 0) {
+    if (reader.rd_overruns != overruns) {
+      overruns = reader.rd_overruns;
+      fprintf(stderr, "fell behind the box, some messages were lost\n");
+    }
+    msg_num++;
+    fprintf(stdout, "%.*s\n", (int)n, buffer);
+  }
+  // the ring is closed when the box is destroyed
+  shm_ring_detach(&reader);
+  return -1;
+}
+
 int main(int argc, char **argv) {
   signal(SIGINT, sigint_handler);
   signal(SIGPIPE, sigpipe_handler);
 
-  if (argc != 4)
+  // sub <register_pipe> <pipe_name> <box_name> [--shm] [--group <name>]
+  //     [--from earliest|latest|<offset>]
+  if (argc < 4)
     return -1;
+  int shm = 0;
+  for (int i = 4; i < argc; i++) {
+    if (!strcmp(argv[i], "--shm")) {
+      shm = 1;
+    } else if (!strcmp(argv[i], "--group") && i + 1 < argc &&
+               strlen(argv[i + 1]) < BOX_NAME_SIZE) {
+      // the broker remembers where the subscription is left, and it starts
+      // there again by default
+      strcpy(message.group, argv[++i]);
+    } else if (!strcmp(argv[i], "--from") && i + 1 < argc) {
+      char const *from = argv[++i];
+      if (!strcmp(from, "earliest")) {
+        message.start = SUB_START_EARLIEST;
+      } else if (!strcmp(from, "latest")) {
+        message.start = SUB_START_LATEST;
+      } else {
+        char *end;
+        message.start = SUB_START_OFFSET;
+        message.offset = strtoull(from, &end, 10);
+        if (*from == '\0' || *end != '\0')
+          return -1;
+      }
+    } else {
+      return -1;
+    }
+  }
   // buffer initializations and copies from argvs to compose protocol
   int pipen;
   char reg_pipename[PIPE_NAME_SIZE];
@@ -36,7 +95,7 @@ int main(int argc, char **argv) {
   strcpy(reg_pipename, argv[1]);
   strcpy(message.pipename, argv[2]);
   strcpy(message.boxname, argv[3]);
-  message.code = 2;
+  message.code = shm ? 11 : 2;
 
   unlink(message.pipename);
   mkfifo(message.pipename, 0666);
@@ -47,7 +106,7 @@ int main(int argc, char **argv) {
     return -1;
   }
   // sends register request to mbroker
-  if (write(pipen, &message, sizeof(protocol)) == -1) {
+  if (frame_write_register(pipen, &message) == -1) {
     perror("sub protocol writing");
     return -1;
   }
@@ -58,15 +117,20 @@ int main(int argc, char **argv) {
     return -1;
   }
 
-  int n;
-  p_msg msg;
+  frame_reader reader;
+  frame_header header;
+  char payload[FRAME_MAX_PAYLOAD + 1];
+  frame_reader_init(&reader, pipe_num);
   // reads messages sent to communication pipe, and prints them on stdout
-  while ((n = (int)read(pipe_num, &msg, sizeof(msg))) > 0) {
-    if (msg.code != 10)
+  while (frame_read(&reader, &header, payload, FRAME_MAX_PAYLOAD) > 0) {
+    if (header.code == 12) {
+      payload[header.length] = '\0';
+      return read_ring(payload);
+    }
+    if (header.code != 10)
       break;
     msg_num++;
-    fprintf(stdout, "%s\n", msg.message);
-    memset(msg.message, '\0', MESSAGE_SIZE);
+    fprintf(stdout, "%.*s\n", (int)header.length, payload);
   }
   // not supposed to reach this return, because the previous while only
   // ends with a SIGINT
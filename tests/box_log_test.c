@@ -0,0 +1,415 @@
+// Box log test.
+//
+// Appends messages of varying lengths to a log spanning several segments,
+// one at a time and in batches, and checks that seeking to any offset places
+// a cursor on that message (or at the end of the log, past the last one),
+// that reading from a cursor returns every message whole and in order, for
+// any buffer size, and that a log recovered from its file is the same.
+// Also checks that trimming a log to its retention policy keeps its size (and
+// the blocks of its file) bounded while messages keep being appended, that
+// cursors in dropped records skip to the first record kept, and that a log
+// recovered after being trimmed starts there too. Then pushes several times
+// what a tfs file can hold through a log that keeps being trimmed, which
+// wraps around in its file, checking that a reader following it and one left
+// behind read every message kept, and that the log is recovered in any lap.
+// Checks that a log is recovered from its index file, reading only the records
+// appended after it was written, and without it, or from one written before
+// records were dropped. Finally, checks that a log written before logs
+// wrapped is still recovered.
+
+#include "betterassert.h"
+#include "mbroker/box_log.h"
+#include "operations.h"
+#include "state.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MESSAGES (5000)
+#define MAX_LENGTH (200)
+#define BATCH (7)
+#define RETAINED (3 * LOG_SEGMENT_SIZE)
+#define ROUND (500)
+#define ROUNDS (200)
+
+static uint32_t message_length(uint64_t offset) {
+  return (uint32_t)(offset % MAX_LENGTH + 1);
+}
+
+static void message_fill(char *message, uint64_t offset) {
+  for (size_t i = 0; i < message_length(offset); i++) {
+    message[i] = (char)(offset * 31 + i);
+  }
+}
+
+static void init_fs(size_t blocks) {
+  tfs_params params = tfs_default_params();
+  params.max_block_count = blocks;
+  ALWAYS_ASSERT(tfs_init(&params) == 0, "box_log_test: failed to init tfs");
+}
+
+static void create_log(box_log *log, char const *name,
+                       log_retention const *retention) {
+  int fhandle = tfs_open(name, TFS_O_CREAT);
+  ALWAYS_ASSERT(fhandle != -1, "box_log_test: failed to create %s", name);
+  tfs_close(fhandle);
+  ALWAYS_ASSERT(box_log_create(log, name, retention) == 0,
+                "box_log_test: failed to create log");
+}
+
+// appends the messages from offset first to last (excluded), taking turns
+// between single messages and batches
+static void append(box_log *log, uint64_t first, uint64_t last) {
+  static char messages[BATCH][MAX_LENGTH];
+  void const *pointers[BATCH];
+  uint32_t lengths[BATCH];
+  for (uint64_t offset = first; offset < last;) {
+    size_t n = offset % 2 == 0 ? 1 : BATCH;
+    if (n > last - offset) {
+      n = (size_t)(last - offset);
+    }
+    for (size_t i = 0; i < n; i++) {
+      message_fill(messages[i], offset + i);
+      pointers[i] = messages[i];
+      lengths[i] = message_length(offset + i);
+    }
+    ALWAYS_ASSERT(box_log_append_many(log, pointers, lengths, n) > 0,
+                  "box_log_test: failed to append");
+    offset += n;
+  }
+}
+
+// reads every message from the cursor on with a buffer of the given size,
+// checking they are the messages from offset first to last (excluded)
+static void expect_messages(box_log *log, int fhandle, log_cursor *cursor,
+                            size_t size, uint64_t first, uint64_t last) {
+  char *buffer = malloc(size);
+  ALWAYS_ASSERT(buffer != NULL, "box_log_test: out of memory");
+  char expected[MAX_LENGTH];
+  uint64_t next = first;
+  ssize_t n;
+  while ((n = box_log_read_many(log, fhandle, cursor, buffer, size,
+                                SIZE_MAX)) > 0) {
+    for (size_t used = 0; used < (size_t)n;) {
+      log_record_header header;
+      memcpy(&header, buffer + used, sizeof(header));
+      message_fill(expected, next);
+      ALWAYS_ASSERT(header.rh_offset == next &&
+                        header.rh_length == message_length(next) &&
+                        memcmp(buffer + used + sizeof(header), expected,
+                               header.rh_length) == 0,
+                    "box_log_test: message %lu differs", (unsigned long)next);
+      used += sizeof(header) + header.rh_length;
+      next++;
+    }
+    ALWAYS_ASSERT(cursor->lc_offset == next,
+                  "box_log_test: cursor not past the messages read");
+  }
+  ALWAYS_ASSERT(n == 0 && next == last,
+                "box_log_test: read up to %lu of %lu messages",
+                (unsigned long)next, (unsigned long)last);
+  free(buffer);
+}
+
+static void expect_seek(box_log *log, int fhandle, uint64_t offset,
+                        uint64_t expected, uint64_t last) {
+  log_cursor cursor;
+  ALWAYS_ASSERT(box_log_seek(log, fhandle, offset, &cursor) == 0 &&
+                    cursor.lc_offset == expected,
+                "box_log_test: seek to %lu misplaced", (unsigned long)offset);
+  expect_messages(log, fhandle, &cursor, sizeof(log_record_header) + MAX_LENGTH,
+                  expected, last);
+}
+
+static void test_seek(void) {
+  init_fs(2048);
+  box_log log;
+  create_log(&log, "/box", NULL);
+  append(&log, 0, MESSAGES);
+  size_t size = 0;
+  for (uint64_t offset = 0; offset < MESSAGES; offset++) {
+    size += sizeof(log_record_header) + message_length(offset);
+  }
+  ALWAYS_ASSERT(box_log_size(&log) == size, "box_log_test: wrong log size");
+  ALWAYS_ASSERT(log.bl_segments_size > 3,
+                "box_log_test: log spans too few segments");
+
+  int fhandle = tfs_open("/box", 0);
+  for (uint64_t offset = 0; offset < MESSAGES; offset += 97) {
+    expect_seek(&log, fhandle, offset, offset, MESSAGES);
+  }
+  expect_seek(&log, fhandle, MESSAGES - 1, MESSAGES - 1, MESSAGES);
+  expect_seek(&log, fhandle, MESSAGES, MESSAGES, MESSAGES);
+  expect_seek(&log, fhandle, MESSAGES + 10, MESSAGES, MESSAGES);
+  size_t sizes[] = {sizeof(log_record_header) + MAX_LENGTH, 1000, 64 * 1024};
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    log_cursor cursor;
+    box_log_seek(&log, fhandle, 0, &cursor);
+    expect_messages(&log, fhandle, &cursor, sizes[i], 0, MESSAGES);
+  }
+  // a buffer too small for the next record
+  log_cursor cursor;
+  box_log_seek(&log, fhandle, MAX_LENGTH - 1, &cursor);
+  char small[sizeof(log_record_header) + MAX_LENGTH - 1];
+  ALWAYS_ASSERT(box_log_read_many(&log, fhandle, &cursor, small, sizeof(small),
+                                  SIZE_MAX) == -1,
+                "box_log_test: record larger than the buffer read");
+
+  box_log_destroy(&log);
+  ALWAYS_ASSERT(box_log_recover(&log, "/box") == 0,
+                "box_log_test: failed to recover log");
+  ALWAYS_ASSERT(box_log_size(&log) == size && log.bl_next_offset == MESSAGES,
+                "box_log_test: recovered log differs");
+  append(&log, MESSAGES, MESSAGES + BATCH + 1);
+  for (uint64_t offset = 0; offset < MESSAGES; offset += 397) {
+    expect_seek(&log, fhandle, offset, offset, MESSAGES + BATCH + 1);
+  }
+  tfs_close(fhandle);
+  box_log_destroy(&log);
+  ALWAYS_ASSERT(tfs_destroy() == 0, "box_log_test: failed to destroy tfs");
+}
+
+// the number of data blocks of a file (not counting its index blocks)
+static size_t file_blocks(int fhandle) {
+  int inumber = get_open_file_entry(fhandle)->of_inumber;
+  inode_t *inode = inode_get(inumber);
+  size_t blocks = 0;
+  inode_rdlock(inumber);
+  for (size_t i = 0; i < inode_max_size() / state_block_size(); i++) {
+    if (inode_block_get(inode, i, false) != -1) {
+      blocks++;
+    }
+  }
+  inode_unlock(inumber);
+  return blocks;
+}
+
+// drops what a log's retention policy doesn't keep, checking that the records
+// dropped are the ones right before the first record kept
+static size_t trim(box_log *log, time_t now) {
+  size_t start = log->bl_start, size = box_log_size(log), from;
+  size_t dropped = box_log_trim(log, now, &from);
+  if (dropped > 0) {
+    ALWAYS_ASSERT(from == start && log->bl_start == start + dropped &&
+                      box_log_size(log) == size - dropped,
+                  "box_log_test: trim dropped the wrong records");
+    ALWAYS_ASSERT(box_log_reclaim(log, from, dropped) == 0,
+                  "box_log_test: failed to reclaim");
+  }
+  return dropped;
+}
+
+static void test_retention(void) {
+  // room for little more than what is retained, so blocks that were never
+  // freed soon leave no room to append
+  init_fs(2 * RETAINED / 1024);
+  box_log log;
+  log_retention retention = {RETAINED, 0, 0};
+  create_log(&log, "/box", &retention);
+  ALWAYS_ASSERT(box_log_retains(&log), "box_log_test: retention ignored");
+  int fhandle = tfs_open("/box", 0);
+  log_cursor cursor;
+  box_log_seek(&log, fhandle, 0, &cursor);
+
+  size_t trimmed = 0;
+  for (uint64_t next = 0; next < ROUNDS * ROUND; next += ROUND) {
+    append(&log, next, next + ROUND);
+    trimmed += trim(&log, time(NULL));
+    ALWAYS_ASSERT(box_log_size(&log) <= RETAINED,
+                  "box_log_test: log grew past its retention");
+    // only the blocks the records kept span (the first one shared with the
+    // last record dropped), and the header's
+    ALWAYS_ASSERT(file_blocks(fhandle) <=
+                      box_log_size(&log) / state_block_size() + 3,
+                  "box_log_test: blocks of dropped records kept");
+  }
+  ALWAYS_ASSERT(trimmed > 10 * RETAINED, "box_log_test: log barely trimmed");
+
+  uint64_t first = log.bl_segments[0].seg_base_offset;
+  expect_messages(&log, fhandle, &cursor, 1000, first, ROUNDS * ROUND);
+  expect_seek(&log, fhandle, 0, first, ROUNDS * ROUND);
+  size_t start = log.bl_start;
+  box_log_destroy(&log);
+  ALWAYS_ASSERT(box_log_recover(&log, "/box") == 0 &&
+                    log.bl_start == start &&
+                    log.bl_next_offset == ROUNDS * ROUND &&
+                    box_log_retains(&log),
+                "box_log_test: trimmed log recovered differently");
+  expect_seek(&log, fhandle, 0, first, ROUNDS * ROUND);
+  expect_seek(&log, fhandle, first + 1, first + 1, ROUNDS * ROUND);
+
+  tfs_close(fhandle);
+  box_log_destroy(&log);
+  ALWAYS_ASSERT(tfs_unlink("/box") == 0, "box_log_test: failed to unlink");
+
+  // by age, every segment but the one being appended to
+  retention = (log_retention){0, 0, 60};
+  create_log(&log, "/aged", &retention);
+  append(&log, 0, 4 * LOG_SEGMENT_SIZE / (MAX_LENGTH / 2));
+  ALWAYS_ASSERT(log.bl_segments_size > 1 && trim(&log, time(NULL)) == 0,
+                "box_log_test: recent records dropped");
+  ALWAYS_ASSERT(trim(&log, time(NULL) + 120) > 0 && log.bl_segments_size == 1,
+                "box_log_test: old records kept");
+  box_log_destroy(&log);
+  ALWAYS_ASSERT(tfs_destroy() == 0, "box_log_test: failed to destroy tfs");
+}
+
+// recovers a log, checking that it is the same as before
+static void expect_recovered(box_log *log) {
+  size_t start = log->bl_start, end = log->bl_end;
+  uint64_t next_offset = log->bl_next_offset;
+  box_log_destroy(log);
+  ALWAYS_ASSERT(box_log_recover(log, "/box") == 0 && log->bl_start == start &&
+                    log->bl_end == end && log->bl_next_offset == next_offset,
+                "box_log_test: log recovered differently");
+}
+
+static void test_wrap(void) {
+  init_fs(2 * RETAINED / 1024);
+  box_log log;
+  log_retention retention = {RETAINED, 0, 0};
+  create_log(&log, "/box", &retention);
+  int fhandle = tfs_open("/box", 0);
+  log_cursor follower, behind;
+  box_log_seek(&log, fhandle, 0, &follower);
+  box_log_seek(&log, fhandle, 0, &behind);
+
+  uint64_t next = 0;
+  size_t laps = 0;
+  while (laps < 3) {
+    size_t lap = log.bl_lap_start;
+    append(&log, next, next + ROUND);
+    next += ROUND;
+    trim(&log, time(NULL));
+    expect_messages(&log, fhandle, &follower, 1000, follower.lc_offset, next);
+    if (log.bl_lap_start != lap) {
+      laps++;
+      ALWAYS_ASSERT(file_blocks(fhandle) <=
+                        box_log_size(&log) / state_block_size() + 3,
+                    "box_log_test: blocks of dropped records kept");
+      expect_recovered(&log);
+    }
+  }
+  ALWAYS_ASSERT(log.bl_end > 3 * inode_max_size(),
+                "box_log_test: log didn't wrap");
+
+  uint64_t first = log.bl_segments[0].seg_base_offset;
+  expect_messages(&log, fhandle, &behind, 1000, first, next);
+  expect_recovered(&log);
+  for (uint64_t offset = first; offset < next; offset += 97) {
+    expect_seek(&log, fhandle, offset, offset, next);
+  }
+  tfs_close(fhandle);
+  box_log_destroy(&log);
+  ALWAYS_ASSERT(tfs_destroy() == 0, "box_log_test: failed to destroy tfs");
+}
+
+// reads a whole tfs file into buffer, returning its size
+static size_t read_file(char const *name, char *buffer, size_t size) {
+  int fhandle = tfs_open(name, 0);
+  ssize_t n = fhandle == -1 ? -1 : tfs_pread(fhandle, buffer, size, 0);
+  ALWAYS_ASSERT(n >= 0 && (size_t)n < size, "box_log_test: failed to read %s",
+                name);
+  tfs_close(fhandle);
+  return (size_t)n;
+}
+
+static void test_index(void) {
+  init_fs(2048);
+  box_log log;
+  log_retention retention = {RETAINED, 0, 0};
+  create_log(&log, "/box", &retention);
+  int fhandle = tfs_open("/box", 0);
+  append(&log, 0, MESSAGES);
+  ALWAYS_ASSERT(trim(&log, time(NULL)) > 0 && log.bl_segments_size > 2 &&
+                    log.bl_checkpointed == log.bl_end,
+                "box_log_test: index file not written when trimmed");
+  size_t indexed = log.bl_end;
+  // the records past the index file, which is only written again once the
+  // log grew by enough
+  append(&log, MESSAGES, MESSAGES + ROUND);
+  ALWAYS_ASSERT(box_log_checkpoint(&log, 1024 * 1024) == 0 &&
+                    log.bl_checkpointed == indexed,
+                "box_log_test: index file written too soon");
+
+  // a record covered by the index file is not read when recovering, so
+  // corrupting it makes no difference
+  size_t position = log.bl_segments[1].seg_index[1].ie_position;
+  log_record_header saved, corrupt = {UINT64_MAX, 0, 0};
+  tfs_pread(fhandle, &saved, sizeof(saved), position);
+  tfs_pwrite(fhandle, &corrupt, sizeof(corrupt), position);
+  expect_recovered(&log);
+  ALWAYS_ASSERT(log.bl_checkpointed == indexed,
+                "box_log_test: log not recovered from its index file");
+  tfs_pwrite(fhandle, &saved, sizeof(saved), position);
+  uint64_t first = log.bl_segments[0].seg_base_offset;
+  uint64_t next = MESSAGES + ROUND;
+  for (uint64_t offset = first; offset < next; offset += 97) {
+    expect_seek(&log, fhandle, offset, offset, next);
+  }
+  ALWAYS_ASSERT(box_log_checkpoint(&log, 0) == 0 &&
+                    log.bl_checkpointed == log.bl_end,
+                "box_log_test: index file not written");
+  expect_recovered(&log);
+
+  // an index file written before records were dropped, and then none
+  static char index[64 * 1024];
+  size_t size = read_file(log.bl_index_name, index, sizeof(index));
+  append(&log, next, next + ROUNDS * BATCH);
+  next += ROUNDS * BATCH;
+  ALWAYS_ASSERT(trim(&log, time(NULL)) > 0,
+                "box_log_test: no records dropped");
+  int index_fhandle = tfs_open(log.bl_index_name, 0);
+  tfs_pwrite(index_fhandle, index, size, 0);
+  tfs_close(index_fhandle);
+  first = log.bl_segments[0].seg_base_offset;
+  expect_recovered(&log);
+  expect_seek(&log, fhandle, 0, first, next);
+  ALWAYS_ASSERT(tfs_unlink(log.bl_index_name) == 0,
+                "box_log_test: failed to unlink index file");
+  expect_recovered(&log);
+  expect_seek(&log, fhandle, 0, first, next);
+
+  tfs_close(fhandle);
+  box_log_destroy(&log);
+  ALWAYS_ASSERT(tfs_destroy() == 0, "box_log_test: failed to destroy tfs");
+}
+
+static void test_v1(void) {
+  init_fs(64);
+  int fhandle = tfs_open("/box", TFS_O_CREAT);
+  log_file_header header = {LOG_MAGIC_V1, 0, {0, 0, 0}, 0};
+  header.lh_start = offsetof(log_file_header, lh_lap_size);
+  size_t position = header.lh_start;
+  ALWAYS_ASSERT(tfs_pwrite(fhandle, &header, position, 0) == (ssize_t)position,
+                "box_log_test: failed to write header");
+  char message[MAX_LENGTH];
+  for (uint64_t offset = 0; offset < BATCH; offset++) {
+    log_record_header record = {offset, message_length(offset), 0};
+    message_fill(message, offset);
+    tfs_pwrite(fhandle, &record, sizeof(record), position);
+    tfs_pwrite(fhandle, message, record.rh_length, position + sizeof(record));
+    position += sizeof(record) + record.rh_length;
+  }
+
+  box_log log;
+  ALWAYS_ASSERT(box_log_recover(&log, "/box") == 0 &&
+                    log.bl_lap_size == 0 && log.bl_end == position,
+                "box_log_test: log without laps recovered wrong");
+  append(&log, BATCH, 2 * BATCH);
+  expect_seek(&log, fhandle, 0, 0, 2 * BATCH);
+  tfs_close(fhandle);
+  box_log_destroy(&log);
+  ALWAYS_ASSERT(tfs_destroy() == 0, "box_log_test: failed to destroy tfs");
+}
+
+int main(void) {
+  test_seek();
+  test_retention();
+  test_wrap();
+  test_index();
+  test_v1();
+  return 0;
+}
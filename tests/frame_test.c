@@ -0,0 +1,226 @@
+// Frame protocol test.
+//
+// Checks that frames are put back together from reads of any size (a byte
+// at a time, or several frames at once), that malformed and truncated frames
+// are refused rather than taken for valid ones, and that register requests
+// and listing entries survive being packed and parsed, while any truncation
+// of them is either refused or parsed into well-formed fields.
+
+#include "betterassert.h"
+#include "extras.h"
+
+#include <stdio.h>
+
+static void make_pipe(int fds[2]) {
+  ALWAYS_ASSERT(pipe(fds) == 0, "frame_test: failed to create pipe");
+}
+
+static void test_partial_reads(void) {
+  int fds[2];
+  make_pipe(fds);
+  char frame[FRAME_MAX_SIZE];
+  char const message[] = "hello, broker";
+  size_t size = frame_pack(frame, 9, message, sizeof(message));
+
+  frame_reader reader;
+  frame_reader_init(&reader, fds[0]);
+  frame_header header;
+  char const *payload;
+  for (size_t i = 0; i < size; i++) {
+    ALWAYS_ASSERT(frame_next(&reader, &header, &payload) == 0,
+                  "frame_test: frame taken after %zu of %zu bytes", i, size);
+    ALWAYS_ASSERT(write(fds[1], frame + i, 1) == 1, "frame_test: write");
+    ALWAYS_ASSERT(frame_reader_fill(&reader) == 1, "frame_test: fill");
+  }
+  ALWAYS_ASSERT(frame_next(&reader, &header, &payload) == 1 &&
+                    header.code == 9 && header.length == sizeof(message) &&
+                    memcmp(payload, message, sizeof(message)) == 0,
+                "frame_test: frame read a byte at a time differs");
+  ALWAYS_ASSERT(frame_next(&reader, &header, &payload) == 0,
+                "frame_test: frame taken from an empty buffer");
+
+  // several frames (one of them empty) with a single write
+  size = 0;
+  for (uint8_t code = 1; code <= 3; code++) {
+    size += frame_pack(frame + size, code, message, code == 2 ? 0 : code);
+  }
+  ALWAYS_ASSERT(write(fds[1], frame, size) == (ssize_t)size,
+                "frame_test: write");
+  ALWAYS_ASSERT(frame_reader_fill(&reader) == (ssize_t)size,
+                "frame_test: fill");
+  for (uint8_t code = 1; code <= 3; code++) {
+    ALWAYS_ASSERT(frame_next(&reader, &header, &payload) == 1 &&
+                      header.code == code &&
+                      header.length == (code == 2 ? 0 : code) &&
+                      memcmp(payload, message, header.length) == 0,
+                  "frame_test: frame %d of a batch differs", code);
+  }
+  ALWAYS_ASSERT(frame_next(&reader, &header, &payload) == 0,
+                "frame_test: frame taken past a batch");
+  close(fds[0]);
+  close(fds[1]);
+}
+
+// reads what was written to a pipe that is then closed
+static int read_written(void const *data, size_t size, frame_header *header,
+                        char *payload) {
+  int fds[2];
+  make_pipe(fds);
+  ALWAYS_ASSERT(write(fds[1], data, size) == (ssize_t)size,
+                "frame_test: write");
+  close(fds[1]);
+  frame_reader reader;
+  frame_reader_init(&reader, fds[0]);
+  int result = frame_read(&reader, header, payload, FRAME_MAX_PAYLOAD);
+  close(fds[0]);
+  return result;
+}
+
+static void test_malformed(void) {
+  char frame[FRAME_MAX_SIZE], payload[FRAME_MAX_PAYLOAD];
+  frame_header header;
+  size_t size = frame_pack(frame, 9, "message", 7);
+  ALWAYS_ASSERT(read_written(frame, size, &header, payload) == 1,
+                "frame_test: valid frame refused");
+  // a frame cut short by the end of the pipe is never returned
+  for (size_t i = 0; i < size; i++) {
+    ALWAYS_ASSERT(read_written(frame, i, &header, payload) == 0,
+                  "frame_test: frame truncated to %zu bytes taken", i);
+  }
+
+  frame_header bad = {FRAME_VERSION + 1, 9, 0};
+  ALWAYS_ASSERT(read_written(&bad, sizeof(bad), &header, payload) == -1,
+                "frame_test: frame of an unknown version taken");
+  bad.version = FRAME_VERSION;
+  bad.length = FRAME_MAX_PAYLOAD + 1;
+  ALWAYS_ASSERT(read_written(&bad, sizeof(bad), &header, payload) == -1,
+                "frame_test: frame larger than the maximum taken");
+}
+
+// parses a register request payload of exactly size bytes (copied to its
+// own allocation, so that reading past it is caught by tools like ASan)
+static int parse(char const *data, size_t size, protocol *request) {
+  char *payload = (char *)malloc(size > 0 ? size : 1);
+  ALWAYS_ASSERT(payload != NULL, "frame_test: out of memory");
+  memcpy(payload, data, size);
+  frame_header header = {FRAME_VERSION, 3, (uint16_t)size};
+  int result = frame_parse_register(&header, payload, request);
+  free(payload);
+  return result;
+}
+
+static int terminated(char const *field, size_t size) {
+  return strnlen(field, size) < size;
+}
+
+static void test_register(void) {
+  protocol sent;
+  memset(&sent, 0, sizeof(sent));
+  sent.code = 3;
+  strcpy(sent.pipename, "/tmp/client");
+  strcpy(sent.boxname, "/box");
+  strcpy(sent.cursor, "/after");
+  sent.limit = 7;
+  strcpy(sent.group, "readers");
+  sent.start = SUB_START_OFFSET;
+  sent.offset = 42;
+  sent.max_bytes = 1;
+  sent.max_messages = 2;
+  sent.max_age = 3;
+
+  int fds[2];
+  make_pipe(fds);
+  ALWAYS_ASSERT(frame_write_register(fds[1], &sent) == 0,
+                "frame_test: failed to write register request");
+  close(fds[1]);
+  frame_reader reader;
+  frame_reader_init(&reader, fds[0]);
+  frame_header header;
+  char payload[FRAME_MAX_PAYLOAD];
+  ALWAYS_ASSERT(frame_read(&reader, &header, payload, sizeof(payload)) == 1,
+                "frame_test: failed to read register request");
+  close(fds[0]);
+
+  protocol received;
+  ALWAYS_ASSERT(frame_parse_register(&header, payload, &received) == 0 &&
+                    received.code == sent.code &&
+                    !strcmp(received.pipename, sent.pipename) &&
+                    !strcmp(received.boxname, sent.boxname) &&
+                    !strcmp(received.cursor, sent.cursor) &&
+                    received.limit == sent.limit &&
+                    !strcmp(received.group, sent.group) &&
+                    received.start == sent.start &&
+                    received.offset == sent.offset &&
+                    received.max_bytes == sent.max_bytes &&
+                    received.max_messages == sent.max_messages &&
+                    received.max_age == sent.max_age,
+                "frame_test: register request differs once parsed");
+
+  // every truncation is either refused, or parsed into terminated strings
+  // (fields cut off entirely are taken as absent)
+  for (size_t size = 0; size < header.length; size++) {
+    memset(&received, 'x', sizeof(received));
+    if (parse(payload, size, &received) == 0) {
+      ALWAYS_ASSERT(terminated(received.pipename, PIPE_NAME_SIZE) &&
+                        terminated(received.boxname, BOX_NAME_SIZE) &&
+                        terminated(received.cursor, BOX_NAME_SIZE) &&
+                        terminated(received.group, BOX_NAME_SIZE),
+                    "frame_test: unterminated field parsed from %zu bytes",
+                    size);
+    }
+  }
+
+  // strings without a terminator, or too long for their field
+  ALWAYS_ASSERT(parse("/tmp/client", 11, &received) == -1,
+                "frame_test: unterminated pipe name taken");
+  ALWAYS_ASSERT(parse("/tmp/client\0/box", 16, &received) == -1,
+                "frame_test: unterminated box name taken");
+  char long_name[PIPE_NAME_SIZE + 1];
+  memset(long_name, 'p', PIPE_NAME_SIZE);
+  long_name[PIPE_NAME_SIZE] = '\0';
+  ALWAYS_ASSERT(parse(long_name, sizeof(long_name), &received) == -1,
+                "frame_test: pipe name too long taken");
+  char long_box[sizeof("/p") + BOX_NAME_SIZE + 1];
+  memcpy(long_box, "/p", sizeof("/p"));
+  memset(long_box + sizeof("/p"), 'b', BOX_NAME_SIZE);
+  long_box[sizeof(long_box) - 1] = '\0';
+  ALWAYS_ASSERT(parse(long_box, sizeof(long_box), &received) == -1,
+                "frame_test: box name too long taken");
+
+  // requests of earlier versions, without the later fields
+  ALWAYS_ASSERT(parse("/tmp/client\0/box", 17, &received) == 0 &&
+                    !strcmp(received.pipename, "/tmp/client") &&
+                    !strcmp(received.boxname, "/box") &&
+                    received.cursor[0] == '\0' && received.limit == 0 &&
+                    received.group[0] == '\0' && received.offset == 0 &&
+                    received.max_bytes == 0,
+                "frame_test: request without optional fields misparsed");
+}
+
+static void test_box_list(void) {
+  mail_box box = {"/listed", 1, 2, 3}, unpacked;
+  char entry[BOX_LIST_ENTRY_SIZE(BOX_NAME_SIZE)];
+  size_t size = box_list_pack(entry, &box);
+  ALWAYS_ASSERT(size == BOX_LIST_ENTRY_SIZE(strlen(box.box_name)),
+                "frame_test: wrong listing entry size");
+  ALWAYS_ASSERT(box_list_unpack(entry, size, &unpacked) == size &&
+                    !strcmp(unpacked.box_name, box.box_name) &&
+                    unpacked.box_size == 1 && unpacked.n_pubs == 2 &&
+                    unpacked.n_subs == 3,
+                "frame_test: listing entry differs once unpacked");
+  for (size_t i = 0; i < size; i++) {
+    ALWAYS_ASSERT(box_list_unpack(entry, i, &unpacked) == 0,
+                  "frame_test: listing entry truncated to %zu bytes taken", i);
+  }
+  entry[3 * sizeof(uint64_t)] = (char)BOX_NAME_SIZE;
+  ALWAYS_ASSERT(box_list_unpack(entry, sizeof(entry), &unpacked) == 0,
+                "frame_test: listing entry with too long a name taken");
+}
+
+int main(void) {
+  test_partial_reads();
+  test_malformed();
+  test_register();
+  test_box_list();
+  return 0;
+}
@@ -0,0 +1,117 @@
+// Subscription (consumer group) test.
+//
+// Checks that subscriptions start at the first message, that a new
+// subscriber takes a subscription over from the previous one, and that the
+// offsets committed are restored once tfs is, both after a clean shutdown
+// and from what a crash right after committing would leave behind.
+
+#include "betterassert.h"
+#include "mbroker/groups.h"
+#include "operations.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+static char dir[] = "/tmp/groups_test.XXXXXX";
+static char wal_path[64], image_path[64], saved_wal[64], saved_image[64];
+static int owners[3];
+
+static void init_fs(void) {
+  tfs_params params = tfs_default_params();
+  params.wal_path = wal_path;
+  params.image_path = image_path;
+  params.sync_policy = TFS_SYNC_ALWAYS;
+  ALWAYS_ASSERT(tfs_init(&params) == 0, "groups_test: failed to init tfs");
+}
+
+static void copy_file(char const *from, char const *to) {
+  FILE *in = fopen(from, "rb"), *out = fopen(to, "wb");
+  ALWAYS_ASSERT(in != NULL && out != NULL, "groups_test: failed to copy %s",
+                from);
+  char buffer[4096];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), in)) > 0) {
+    ALWAYS_ASSERT(fwrite(buffer, 1, n, out) == n, "groups_test: write failed");
+  }
+  fclose(in);
+  fclose(out);
+}
+
+// joins a subscription, checking its slot and where it was committed
+static void expect_join(box_groups *groups, char const *name,
+                        void const *owner, ssize_t slot, uint64_t offset) {
+  uint64_t committed;
+  ALWAYS_ASSERT(groups_join(groups, "/box", name, owner, &committed) == slot &&
+                    committed == offset,
+                "groups_test: %s joined at the wrong slot or offset", name);
+  ALWAYS_ASSERT(groups_owns(groups, (size_t)slot, owner),
+                "groups_test: %s not owned by its subscriber", name);
+}
+
+static void commit(box_groups *groups, size_t slot, uint64_t offset) {
+  ALWAYS_ASSERT(groups_commit(groups, slot, offset) == 0,
+                "groups_test: failed to commit");
+}
+
+int main(void) {
+  ALWAYS_ASSERT(mkdtemp(dir) != NULL, "groups_test: failed to create %s", dir);
+  snprintf(wal_path, sizeof(wal_path), "%s/tfs.wal", dir);
+  snprintf(image_path, sizeof(image_path), "%s/tfs.img", dir);
+  snprintf(saved_wal, sizeof(saved_wal), "%s/saved.wal", dir);
+  snprintf(saved_image, sizeof(saved_image), "%s/saved.img", dir);
+
+  char file_name[GROUPS_FILE_NAME_SIZE];
+  groups_file_name(file_name, "/box");
+  ALWAYS_ASSERT(groups_is_file(file_name) && !groups_is_file("/box"),
+                "groups_test: subscriptions file taken for a box");
+
+  init_fs();
+  box_groups groups;
+  groups_init(&groups);
+  expect_join(&groups, "alpha", &owners[0], 0, 0);
+  expect_join(&groups, "beta", &owners[1], 1, 0);
+  commit(&groups, 0, 42);
+  commit(&groups, 1, 7);
+  // a new subscriber takes alpha over, and the previous one can't release it
+  expect_join(&groups, "alpha", &owners[2], 0, 42);
+  ALWAYS_ASSERT(!groups_owns(&groups, 0, &owners[0]),
+                "groups_test: subscription kept by its previous subscriber");
+  groups_leave(&groups, 0, &owners[0]);
+  ALWAYS_ASSERT(groups_owns(&groups, 0, &owners[2]),
+                "groups_test: subscription released by another subscriber");
+  groups_leave(&groups, 0, &owners[2]);
+  ALWAYS_ASSERT(!groups_owns(&groups, 0, &owners[2]),
+                "groups_test: subscription not released");
+  commit(&groups, 0, 43);
+  groups_destroy(&groups);
+  ALWAYS_ASSERT(tfs_destroy() == 0, "groups_test: failed to destroy tfs");
+
+  init_fs();
+  groups_init(&groups);
+  expect_join(&groups, "beta", &owners[1], 1, 7);
+  expect_join(&groups, "alpha", &owners[0], 0, 43);
+  expect_join(&groups, "gamma", &owners[2], 2, 0);
+  commit(&groups, 2, 99);
+  // what a crash right now would leave behind
+  copy_file(wal_path, saved_wal);
+  copy_file(image_path, saved_image);
+  commit(&groups, 2, 100);
+  groups_destroy(&groups);
+  ALWAYS_ASSERT(tfs_destroy() == 0, "groups_test: failed to destroy tfs");
+
+  rename(saved_wal, wal_path);
+  rename(saved_image, image_path);
+  init_fs();
+  groups_init(&groups);
+  expect_join(&groups, "gamma", &owners[2], 2, 99);
+  expect_join(&groups, "alpha", &owners[0], 0, 43);
+  expect_join(&groups, "beta", &owners[1], 1, 7);
+  groups_destroy(&groups);
+  ALWAYS_ASSERT(tfs_destroy() == 0, "groups_test: failed to destroy tfs");
+
+  unlink(wal_path);
+  unlink(image_path);
+  rmdir(dir);
+  return 0;
+}
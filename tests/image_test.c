@@ -0,0 +1,145 @@
+// Image restore test.
+//
+// Checks that the file system is restored from its image as it was written:
+// file contents, punched holes, unlinked files, and which blocks are in use
+// (so that filling the restored file system never overwrites a restored
+// file). Also checks that an image written with other parameters, or that is
+// corrupt, is refused and left as it was.
+
+#include "betterassert.h"
+#include "operations.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BLOCK (1024)
+#define FILE_BLOCKS (4)
+
+static char dir[] = "/tmp/image_test.XXXXXX";
+static char image_path[64];
+
+static tfs_params params(void) {
+  tfs_params p = tfs_default_params();
+  p.image_path = image_path;
+  p.block_size = BLOCK;
+  return p;
+}
+
+static void fill(char *data, char seed) {
+  for (size_t i = 0; i < FILE_BLOCKS * BLOCK; i++) {
+    data[i] = (char)(seed + (char)(i % 251));
+  }
+}
+
+static void write_file(char const *name, char const *data) {
+  int fhandle = tfs_open(name, TFS_O_CREAT | TFS_O_TRUNC);
+  ALWAYS_ASSERT(fhandle != -1, "image_test: failed to create %s", name);
+  ALWAYS_ASSERT(tfs_write(fhandle, data, FILE_BLOCKS * BLOCK) ==
+                    FILE_BLOCKS * BLOCK,
+                "image_test: failed to write %s", name);
+  tfs_close(fhandle);
+}
+
+static void expect_file(char const *name, char const *data) {
+  int fhandle = tfs_open(name, 0);
+  ALWAYS_ASSERT(fhandle != -1, "image_test: %s is missing", name);
+  char buffer[FILE_BLOCKS * BLOCK + 1];
+  ALWAYS_ASSERT(tfs_pread(fhandle, buffer, sizeof(buffer), 0) ==
+                        FILE_BLOCKS * BLOCK &&
+                    memcmp(buffer, data, FILE_BLOCKS * BLOCK) == 0,
+                "image_test: %s has the wrong contents", name);
+  tfs_close(fhandle);
+}
+
+// the files every test expects, with the second block onwards of /b punched
+static void expect_files(char const *a, char *b) {
+  expect_file("/a", a);
+  memset(b + BLOCK, 0, (FILE_BLOCKS - 2) * BLOCK);
+  expect_file("/b", b);
+  ALWAYS_ASSERT(tfs_open("/c", 0) == -1, "image_test: unlinked file restored");
+}
+
+// writes files until the file system runs out of blocks (or inodes), and
+// removes them again
+static void fill_up(void) {
+  static char block[BLOCK];
+  memset(block, 'z', sizeof(block));
+  char name[32];
+  size_t files = 0;
+  for (size_t written = BLOCK; written >= BLOCK; files++) {
+    snprintf(name, sizeof(name), "/fill%zu", files);
+    int fhandle = tfs_open(name, TFS_O_CREAT);
+    if (fhandle == -1) {
+      break;
+    }
+    // until the file is as large as a file can be, or no block is left
+    ssize_t n;
+    for (written = 0; (n = tfs_write(fhandle, block, sizeof(block))) > 0;) {
+      written += (size_t)n;
+    }
+    tfs_close(fhandle);
+  }
+  ALWAYS_ASSERT(files > 1, "image_test: restored file system is full");
+  while (files-- > 0) {
+    snprintf(name, sizeof(name), "/fill%zu", files);
+    tfs_unlink(name);
+  }
+}
+
+int main(void) {
+  ALWAYS_ASSERT(mkdtemp(dir) != NULL, "image_test: failed to create %s", dir);
+  snprintf(image_path, sizeof(image_path), "%s/tfs.img", dir);
+  tfs_params p = params();
+
+  static char a[FILE_BLOCKS * BLOCK], b[FILE_BLOCKS * BLOCK],
+      c[FILE_BLOCKS * BLOCK];
+  fill(a, 'a');
+  fill(b, 'b');
+  fill(c, 'c');
+  ALWAYS_ASSERT(tfs_init(&p) == 0, "image_test: failed to init");
+  write_file("/a", a);
+  write_file("/c", c);
+  write_file("/b", b);
+  int fhandle = tfs_open("/b", 0);
+  ALWAYS_ASSERT(fhandle != -1 &&
+                    tfs_punch(fhandle, BLOCK, (FILE_BLOCKS - 2) * BLOCK) == 0,
+                "image_test: failed to punch /b");
+  tfs_close(fhandle);
+  ALWAYS_ASSERT(tfs_unlink("/c") == 0, "image_test: failed to unlink /c");
+  ALWAYS_ASSERT(tfs_destroy() == 0, "image_test: failed to write image");
+
+  ALWAYS_ASSERT(tfs_init(&p) == 0, "image_test: failed to restore");
+  expect_files(a, b);
+  fill_up();
+  expect_files(a, b);
+  ALWAYS_ASSERT(tfs_destroy() == 0, "image_test: failed to write image");
+
+  // restored once more, from the image written by a restored file system
+  ALWAYS_ASSERT(tfs_init(&p) == 0, "image_test: failed to restore");
+  expect_files(a, b);
+  ALWAYS_ASSERT(tfs_destroy() == 0, "image_test: failed to write image");
+
+  tfs_params other = p;
+  other.block_size = 2 * BLOCK;
+  ALWAYS_ASSERT(tfs_init(&other) == -1,
+                "image_test: image with another block size taken");
+  other = p;
+  other.max_inode_count *= 2;
+  ALWAYS_ASSERT(tfs_init(&other) == -1,
+                "image_test: image with another inode count taken");
+  ALWAYS_ASSERT(tfs_init(&p) == 0, "image_test: refused image overwritten");
+  expect_files(a, b);
+  ALWAYS_ASSERT(tfs_destroy() == 0, "image_test: failed to write image");
+
+  FILE *image = fopen(image_path, "r+b");
+  ALWAYS_ASSERT(image != NULL && fputc('X', image) != EOF &&
+                    fclose(image) == 0,
+                "image_test: failed to corrupt image");
+  ALWAYS_ASSERT(tfs_init(&p) == -1, "image_test: corrupt image taken");
+
+  unlink(image_path);
+  rmdir(dir);
+  return 0;
+}
@@ -0,0 +1,149 @@
+// Producer-consumer queue test.
+//
+// For both implementations: checks that try_enqueue refuses elements once the
+// queue is full, and then has producers and consumers go through a queue
+// small enough to be full and empty all the time, checking that every
+// element comes out exactly once, and each producer's in the order it put
+// them in.
+
+#include "betterassert.h"
+#include "producer-consumer.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PRODUCERS (4)
+#define CONSUMERS (4)
+#define PER_PRODUCER (50000)
+#define CAPACITY (8)
+#define BATCH (5)
+
+static pc_queue_t queue;
+// how many times each element came out
+static _Atomic uint8_t seen[PRODUCERS][PER_PRODUCER];
+
+// elements carry their producer and sequence number, plus one so that none
+// is NULL
+static void *element(size_t producer, size_t sequence) {
+  return (void *)(uintptr_t)((producer << 32 | sequence) + 1);
+}
+
+static void *producer(void *arg) {
+  size_t id = (size_t)(uintptr_t)arg;
+  for (size_t i = 0; i < PER_PRODUCER;) {
+    // takes turns between the ways of enqueuing
+    switch (i % 3) {
+    case 0:
+      ALWAYS_ASSERT(pcq_enqueue(&queue, element(id, i)) == 0,
+                    "pcq_test: enqueue failed");
+      i++;
+      break;
+    case 1:
+      if (pcq_try_enqueue(&queue, element(id, i)) == 0) {
+        i++;
+      }
+      break;
+    default: {
+      void *batch[BATCH];
+      size_t n = 0;
+      for (; n < BATCH && i + n < PER_PRODUCER; n++) {
+        batch[n] = element(id, i + n);
+      }
+      ALWAYS_ASSERT(pcq_enqueue_many(&queue, batch, n) == 0,
+                    "pcq_test: enqueue_many failed");
+      i += n;
+    }
+    }
+  }
+  return NULL;
+}
+
+static void *consumer(void *arg) {
+  size_t count = (size_t)(uintptr_t)arg;
+  // the next sequence number this consumer may see from each producer
+  size_t next[PRODUCERS] = {0};
+  for (size_t taken = 0; taken < count;) {
+    void *batch[BATCH];
+    size_t n = 1;
+    if (taken % 2 == 0) {
+      batch[0] = pcq_dequeue(&queue);
+    } else {
+      size_t max = count - taken < BATCH ? count - taken : BATCH;
+      n = pcq_dequeue_many(&queue, batch, max);
+    }
+    for (size_t j = 0; j < n; j++) {
+      uint64_t value = (uint64_t)(uintptr_t)batch[j] - 1;
+      size_t id = (size_t)(value >> 32);
+      size_t sequence = (size_t)(value & 0xFFFFFFFF);
+      ALWAYS_ASSERT(id < PRODUCERS && sequence < PER_PRODUCER,
+                    "pcq_test: dequeued an element never enqueued");
+      ALWAYS_ASSERT(sequence >= next[id],
+                    "pcq_test: a producer's elements came out of order");
+      next[id] = sequence + 1;
+      atomic_fetch_add(&seen[id][sequence], 1);
+    }
+    taken += n;
+  }
+  return NULL;
+}
+
+static void test_full(pcq_mode_t mode) {
+  ALWAYS_ASSERT(pcq_create_mode(&queue, CAPACITY, mode) == 0,
+                "pcq_test: failed to create queue");
+  for (size_t i = 0; i < CAPACITY; i++) {
+    ALWAYS_ASSERT(pcq_try_enqueue(&queue, element(0, i)) == 0,
+                  "pcq_test: try_enqueue refused an element with room");
+  }
+  ALWAYS_ASSERT(pcq_try_enqueue(&queue, element(0, CAPACITY)) == -1,
+                "pcq_test: try_enqueue took an element into a full queue");
+  ALWAYS_ASSERT(pcq_depth(&queue) == CAPACITY, "pcq_test: wrong depth");
+  for (size_t i = 0; i < CAPACITY; i++) {
+    ALWAYS_ASSERT(pcq_dequeue(&queue) == element(0, i),
+                  "pcq_test: elements came out of order");
+  }
+  ALWAYS_ASSERT(pcq_depth(&queue) == 0, "pcq_test: wrong depth");
+  pcq_destroy(&queue);
+}
+
+static void test_concurrent(pcq_mode_t mode) {
+  ALWAYS_ASSERT(pcq_create_mode(&queue, CAPACITY, mode) == 0,
+                "pcq_test: failed to create queue");
+  memset(seen, 0, sizeof(seen));
+  pthread_t producers[PRODUCERS], consumers[CONSUMERS];
+  size_t total = PRODUCERS * PER_PRODUCER;
+  for (size_t i = 0; i < CONSUMERS; i++) {
+    // the first consumer takes whatever the others' shares leave
+    size_t share = total / CONSUMERS + (i == 0 ? total % CONSUMERS : 0);
+    pthread_create(&consumers[i], NULL, consumer, (void *)(uintptr_t)share);
+  }
+  for (size_t i = 0; i < PRODUCERS; i++) {
+    pthread_create(&producers[i], NULL, producer, (void *)(uintptr_t)i);
+  }
+  for (size_t i = 0; i < PRODUCERS; i++) {
+    pthread_join(producers[i], NULL);
+  }
+  for (size_t i = 0; i < CONSUMERS; i++) {
+    pthread_join(consumers[i], NULL);
+  }
+
+  for (size_t i = 0; i < PRODUCERS; i++) {
+    for (size_t j = 0; j < PER_PRODUCER; j++) {
+      ALWAYS_ASSERT(atomic_load(&seen[i][j]) == 1,
+                    "pcq_test: element %zu of producer %zu came out %d times",
+                    j, i, (int)atomic_load(&seen[i][j]));
+    }
+  }
+  ALWAYS_ASSERT(pcq_depth(&queue) == 0, "pcq_test: queue left with elements");
+  pcq_destroy(&queue);
+}
+
+int main(void) {
+  pcq_mode_t modes[] = {PCQ_MUTEX, PCQ_LOCK_FREE};
+  for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+    test_full(modes[i]);
+    test_concurrent(modes[i]);
+  }
+  return 0;
+}
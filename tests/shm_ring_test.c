@@ -0,0 +1,101 @@
+// Shared memory ring test.
+//
+// A writer appends messages of varying lengths to a ring small enough to be
+// overwritten all the time, while readers read them. Every message read must
+// be whole (each one's bytes are derived from its sequence number), and
+// readers must get messages in order, skipping some only when they count an
+// overrun. Also checks that a ring is never created over an existing one.
+
+#include "betterassert.h"
+#include "shm_ring.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define READERS (3)
+#define MESSAGES (200000)
+#define MAX_LENGTH (300)
+#define RING_SIZE (4096)
+
+static uint32_t message_length(uint64_t sequence) {
+  return (uint32_t)(sizeof(sequence) + sequence % MAX_LENGTH);
+}
+
+static void message_fill(char *message, uint64_t sequence) {
+  memcpy(message, &sequence, sizeof(sequence));
+  for (size_t i = sizeof(sequence); i < message_length(sequence); i++) {
+    message[i] = (char)(sequence * 31 + i);
+  }
+}
+
+static void *reader(void *arg) {
+  shm_ring_reader *ring_reader = (shm_ring_reader *)arg;
+  char message[sizeof(uint64_t) + MAX_LENGTH], expected[sizeof(message)];
+  uint64_t last = 0, overruns = 0;
+  size_t received = 0;
+  ssize_t n;
+  while ((n = shm_ring_read(ring_reader, message, sizeof(message))) > 0) {
+    uint64_t sequence;
+    ALWAYS_ASSERT((size_t)n >= sizeof(sequence),
+                  "shm_ring_test: message too short");
+    memcpy(&sequence, message, sizeof(sequence));
+    message_fill(expected, sequence);
+    ALWAYS_ASSERT(sequence < MESSAGES &&
+                      (size_t)n == message_length(sequence) &&
+                      memcmp(message, expected, (size_t)n) == 0,
+                  "shm_ring_test: torn message");
+    ALWAYS_ASSERT(received == 0 || sequence > last,
+                  "shm_ring_test: messages out of order");
+    ALWAYS_ASSERT(sequence == (received == 0 ? 0 : last + 1) ||
+                      ring_reader->rd_overruns > overruns,
+                  "shm_ring_test: messages skipped without an overrun");
+    last = sequence;
+    overruns = ring_reader->rd_overruns;
+    received++;
+  }
+  ALWAYS_ASSERT(n == 0, "shm_ring_test: message larger than the buffer");
+  ALWAYS_ASSERT(received > 0, "shm_ring_test: no message received");
+  shm_ring_detach(ring_reader);
+  return NULL;
+}
+
+int main(void) {
+  char ring_name[64];
+  snprintf(ring_name, sizeof(ring_name), "/shm_ring_test.%d", (int)getpid());
+  shm_ring ring, again;
+  ALWAYS_ASSERT(shm_ring_create(&ring, ring_name, RING_SIZE) == 0,
+                "shm_ring_test: failed to create ring");
+  ALWAYS_ASSERT(shm_ring_create(&again, ring_name, RING_SIZE) == -1 &&
+                    errno == EEXIST,
+                "shm_ring_test: created a ring over an existing one");
+
+  // readers attach before the writer starts, since the ring's name is gone
+  // once it is destroyed
+  shm_ring_reader readers[READERS];
+  pthread_t tids[READERS];
+  for (size_t i = 0; i < READERS; i++) {
+    ALWAYS_ASSERT(shm_ring_attach(&readers[i], ring_name, 0) == 0,
+                  "shm_ring_test: failed to attach");
+    pthread_create(&tids[i], NULL, reader, &readers[i]);
+  }
+  static char message[RING_SIZE];
+  for (uint64_t sequence = 0; sequence < MESSAGES; sequence++) {
+    message_fill(message, sequence);
+    ALWAYS_ASSERT(
+        shm_ring_append(&ring, message, message_length(sequence)) == 0,
+        "shm_ring_test: failed to append");
+    shm_ring_notify(&ring);
+  }
+  ALWAYS_ASSERT(shm_ring_append(&ring, message, RING_SIZE) == -1,
+                "shm_ring_test: appended a message larger than the ring");
+  shm_ring_destroy(&ring);
+  for (size_t i = 0; i < READERS; i++) {
+    pthread_join(tids[i], NULL);
+  }
+  return 0;
+}
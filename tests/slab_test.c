@@ -0,0 +1,93 @@
+// Slab pool test.
+//
+// Checks that a pool hands out each of its objects once (aligned, and within
+// its memory) until it runs out, and then has threads take and return objects
+// concurrently, stamping each one while they hold it, so that an object
+// handed to two threads at once is caught. Every object must be back in the
+// pool afterwards.
+
+#include "betterassert.h"
+#include "slab.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define OBJECT_SIZE (100)
+#define THREADS (8)
+#define HELD (6)
+#define ROUNDS (100000)
+// fewer objects than the threads can hold at once, so the pool runs out
+#define CAPACITY (THREADS * HELD - 4)
+
+static slab_pool pool;
+
+// takes every object in the pool, checking that none is handed out twice
+static void take_all(void) {
+  char *taken[CAPACITY];
+  for (size_t i = 0; i < CAPACITY; i++) {
+    taken[i] = (char *)slab_pool_alloc(&pool);
+    ALWAYS_ASSERT(taken[i] != NULL, "slab_test: pool ran out early");
+    ALWAYS_ASSERT(taken[i] >= pool.sp_objects &&
+                      taken[i] < pool.sp_objects +
+                                     CAPACITY * pool.sp_object_size &&
+                      (uintptr_t)taken[i] % _Alignof(max_align_t) == 0,
+                  "slab_test: object out of the pool, or misaligned");
+    memset(taken[i], 0, OBJECT_SIZE);
+    taken[i][0] = 1;
+  }
+  ALWAYS_ASSERT(slab_pool_alloc(&pool) == NULL,
+                "slab_test: empty pool handed out an object");
+  for (size_t i = 0; i < CAPACITY; i++) {
+    for (size_t j = 0; j < CAPACITY; j++) {
+      ALWAYS_ASSERT(i == j || taken[i] != taken[j],
+                    "slab_test: object handed out twice");
+    }
+  }
+  for (size_t i = 0; i < CAPACITY; i++) {
+    slab_pool_free(&pool, taken[i]);
+  }
+}
+
+static void *run_thread(void *arg) {
+  uintptr_t id = (uintptr_t)arg;
+  void *objects[HELD];
+  for (size_t round = 0; round < ROUNDS; round++) {
+    size_t held = 0;
+    for (; held < HELD; held++) {
+      objects[held] = slab_pool_alloc(&pool);
+      if (objects[held] == NULL) {
+        break;
+      }
+      memcpy(objects[held], &id, sizeof(id));
+    }
+    for (size_t i = 0; i < held; i++) {
+      uintptr_t stamp;
+      memcpy(&stamp, objects[i], sizeof(stamp));
+      ALWAYS_ASSERT(stamp == id, "slab_test: object shared by two threads");
+      slab_pool_free(&pool, objects[i]);
+    }
+  }
+  return NULL;
+}
+
+int main(void) {
+  ALWAYS_ASSERT(slab_pool_init(&pool, OBJECT_SIZE, 0) == -1,
+                "slab_test: created a pool without objects");
+  ALWAYS_ASSERT(slab_pool_init(&pool, OBJECT_SIZE, CAPACITY) == 0,
+                "slab_test: failed to create pool");
+  take_all();
+
+  pthread_t tids[THREADS];
+  for (size_t i = 0; i < THREADS; i++) {
+    pthread_create(&tids[i], NULL, run_thread, (void *)(uintptr_t)(i + 1));
+  }
+  for (size_t i = 0; i < THREADS; i++) {
+    pthread_join(tids[i], NULL);
+  }
+
+  take_all();
+  slab_pool_destroy(&pool);
+  return 0;
+}
@@ -0,0 +1,169 @@
+// Write-ahead log test.
+//
+// Checks that the file system is rebuilt from its log up to the last whole
+// record: a record torn by a crash (cut short, or with a corrupt byte) is
+// dropped along with everything after it, and logging goes on from there.
+// Also checks that with an image, the log is emptied by checkpoints once it
+// grows past wal_checkpoint_size, and that the file system is rebuilt from
+// the image and log left at any point.
+
+#include "betterassert.h"
+#include "operations.h"
+#include "wal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CHECKPOINT_SIZE (4096)
+#define RECORD_PAYLOAD (200)
+#define WRITES (100)
+
+static char dir[] = "/tmp/wal_test.XXXXXX";
+static char wal_path[64], image_path[64], saved_wal[64], saved_image[64];
+
+static tfs_params params(int image) {
+  tfs_params p = tfs_default_params();
+  p.wal_path = wal_path;
+  p.image_path = image ? image_path : NULL;
+  p.sync_policy = TFS_SYNC_ALWAYS;
+  p.wal_checkpoint_size = CHECKPOINT_SIZE;
+  return p;
+}
+
+static off_t file_size(char const *path) {
+  struct stat st;
+  return stat(path, &st) == 0 ? st.st_size : -1;
+}
+
+static void copy_file(char const *from, char const *to) {
+  FILE *in = fopen(from, "rb"), *out = fopen(to, "wb");
+  ALWAYS_ASSERT(in != NULL && out != NULL, "wal_test: failed to copy %s",
+                from);
+  char buffer[4096];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), in)) > 0) {
+    ALWAYS_ASSERT(fwrite(buffer, 1, n, out) == n, "wal_test: write failed");
+  }
+  fclose(in);
+  fclose(out);
+}
+
+// checks that a file has exactly the given contents
+static void expect_contents(char const *name, char const *contents,
+                            size_t size) {
+  int fhandle = tfs_open(name, 0);
+  ALWAYS_ASSERT(fhandle != -1, "wal_test: %s is missing", name);
+  static char buffer[WRITES * RECORD_PAYLOAD + 1];
+  size_t read = 0;
+  ssize_t n;
+  while ((n = tfs_read(fhandle, buffer + read, sizeof(buffer) - read)) > 0) {
+    read += (size_t)n;
+  }
+  ALWAYS_ASSERT(n == 0 && read == size && memcmp(buffer, contents, size) == 0,
+                "wal_test: %s has the wrong contents", name);
+  tfs_close(fhandle);
+}
+
+static void write_at(char const *name, char const *data, size_t offset) {
+  int fhandle = tfs_open(name, TFS_O_CREAT);
+  ALWAYS_ASSERT(fhandle != -1, "wal_test: failed to open %s", name);
+  ALWAYS_ASSERT(tfs_pwrite(fhandle, data, strlen(data), offset) ==
+                    (ssize_t)strlen(data),
+                "wal_test: failed to write %s", name);
+  tfs_close(fhandle);
+}
+
+static void test_torn_tail(void) {
+  tfs_params p = params(0);
+  ALWAYS_ASSERT(tfs_init(&p) == 0, "wal_test: failed to init");
+  write_at("/f", "hello", 0);
+  write_at("/f", "world", 5);
+  // without an image, the log is all that is left
+  ALWAYS_ASSERT(tfs_destroy() == 0, "wal_test: failed to destroy");
+  off_t whole = file_size(wal_path);
+  off_t last_record = (off_t)(sizeof(wal_record_header) + strlen("world"));
+
+  // the last record cut short by a crash
+  ALWAYS_ASSERT(truncate(wal_path, whole - 3) == 0, "wal_test: truncate");
+  ALWAYS_ASSERT(tfs_init(&p) == 0, "wal_test: failed to replay torn log");
+  expect_contents("/f", "hello", 5);
+  ALWAYS_ASSERT(file_size(wal_path) == whole - last_record,
+                "wal_test: torn record left in the log");
+  // logging goes on right after the last whole record
+  write_at("/f", "there", 5);
+  ALWAYS_ASSERT(tfs_destroy() == 0, "wal_test: failed to destroy");
+  ALWAYS_ASSERT(tfs_init(&p) == 0, "wal_test: failed to replay log");
+  expect_contents("/f", "hellothere", 10);
+  write_at("/f", "!", 10);
+  write_at("/g", "after", 0);
+  ALWAYS_ASSERT(tfs_destroy() == 0, "wal_test: failed to destroy");
+
+  // a corrupt byte in a record drops it and every record after it
+  whole = file_size(wal_path);
+  last_record = (off_t)(sizeof(wal_record_header) + strlen("after"));
+  off_t create_g = (off_t)(sizeof(wal_record_header) + strlen("g"));
+  off_t corrupt = whole - last_record - create_g - 1;
+  FILE *log = fopen(wal_path, "r+b");
+  ALWAYS_ASSERT(log != NULL && fseek(log, corrupt, SEEK_SET) == 0,
+                "wal_test: failed to open log");
+  int byte = fgetc(log);
+  ALWAYS_ASSERT(fseek(log, corrupt, SEEK_SET) == 0 &&
+                    fputc(byte ^ 0xFF, log) != EOF && fclose(log) == 0,
+                "wal_test: failed to corrupt log");
+  ALWAYS_ASSERT(tfs_init(&p) == 0, "wal_test: failed to replay corrupt log");
+  expect_contents("/f", "hellothere", 10);
+  ALWAYS_ASSERT(tfs_open("/g", 0) == -1,
+                "wal_test: file created after a corrupt record restored");
+  ALWAYS_ASSERT(tfs_destroy() == 0, "wal_test: failed to destroy");
+  unlink(wal_path);
+}
+
+static void test_checkpoints(void) {
+  tfs_params p = params(1);
+  ALWAYS_ASSERT(tfs_init(&p) == 0, "wal_test: failed to init");
+  char expected[WRITES * RECORD_PAYLOAD + 1];
+  for (size_t i = 0; i < WRITES; i++) {
+    memset(expected + i * RECORD_PAYLOAD, 'a' + (int)(i % 26), RECORD_PAYLOAD);
+    expected[(i + 1) * RECORD_PAYLOAD] = '\0';
+    write_at("/big", expected + i * RECORD_PAYLOAD, i * RECORD_PAYLOAD);
+    // only the records since the last checkpoint are kept in the log
+    off_t log_size = file_size(wal_path);
+    ALWAYS_ASSERT(log_size <= (off_t)(sizeof(wal_file_header) +
+                                      CHECKPOINT_SIZE +
+                                      sizeof(wal_record_header) +
+                                      RECORD_PAYLOAD),
+                  "wal_test: log grew to %ld bytes", (long)log_size);
+    // what a crash right now would leave behind
+    if (i == WRITES / 2) {
+      copy_file(wal_path, saved_wal);
+      copy_file(image_path, saved_image);
+    }
+  }
+  ALWAYS_ASSERT(tfs_destroy() == 0, "wal_test: failed to destroy");
+  ALWAYS_ASSERT(tfs_init(&p) == 0, "wal_test: failed to restore");
+  expect_contents("/big", expected, sizeof(expected) - 1);
+  ALWAYS_ASSERT(tfs_destroy() == 0, "wal_test: failed to destroy");
+
+  rename(saved_wal, wal_path);
+  rename(saved_image, image_path);
+  ALWAYS_ASSERT(tfs_init(&p) == 0, "wal_test: failed to recover");
+  expect_contents("/big", expected, (WRITES / 2 + 1) * RECORD_PAYLOAD);
+  ALWAYS_ASSERT(tfs_destroy() == 0, "wal_test: failed to destroy");
+  unlink(wal_path);
+  unlink(image_path);
+}
+
+int main(void) {
+  ALWAYS_ASSERT(mkdtemp(dir) != NULL, "wal_test: failed to create %s", dir);
+  snprintf(wal_path, sizeof(wal_path), "%s/tfs.wal", dir);
+  snprintf(image_path, sizeof(image_path), "%s/tfs.img", dir);
+  snprintf(saved_wal, sizeof(saved_wal), "%s/saved.wal", dir);
+  snprintf(saved_image, sizeof(saved_image), "%s/saved.img", dir);
+  test_torn_tail();
+  test_checkpoints();
+  rmdir(dir);
+  return 0;
+}
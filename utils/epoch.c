@@ -0,0 +1,157 @@
+#include "epoch.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// set in a reader's announced epoch while it is in a read-side section
+#define EPOCH_ACTIVE (1)
+
+// every thread that has entered a read-side section has a record. Records are
+// never freed, but a thread's record is released when it exits, for the next
+// new thread to take over, so there are only as many records as there were
+// threads using them at once
+typedef struct epoch_record {
+  _Atomic uint64_t er_epoch; // epoch << 1 | EPOCH_ACTIVE, or 0 when outside
+  unsigned er_depth;         // only touched by the owner thread
+  atomic_flag er_taken;      // whether a thread owns the record
+  struct epoch_record *er_next;
+} epoch_record;
+
+typedef struct retired {
+  void *r_object;
+  void (*r_free)(void *object);
+  uint64_t r_epoch;
+  struct retired *r_next;
+} retired;
+
+static _Atomic uint64_t global_epoch = 1;
+static _Atomic(epoch_record *) records;
+static _Thread_local epoch_record *self;
+// releases the record of a thread when it exits
+static pthread_key_t record_key;
+static pthread_once_t record_key_once = PTHREAD_ONCE_INIT;
+// protects the limbo list, and serializes advancing the global epoch
+static pthread_mutex_t retire_lock = PTHREAD_MUTEX_INITIALIZER;
+static retired *limbo;
+
+// called on the exit of a thread that had a record, which is outside any
+// read-side section by then (its announced epoch is 0)
+static void record_release(void *arg) {
+  epoch_record *record = (epoch_record *)arg;
+  atomic_flag_clear_explicit(&record->er_taken, memory_order_release);
+}
+
+static void record_key_create(void) {
+  if (pthread_key_create(&record_key, record_release) != 0) {
+    perror("epoch: creating thread key");
+    abort();
+  }
+}
+
+static epoch_record *record_get(void) {
+  if (self != NULL)
+    return self;
+  pthread_once(&record_key_once, record_key_create);
+  // takes over the record of a thread that exited, if there is one
+  epoch_record *record;
+  for (record = atomic_load(&records); record != NULL;
+       record = record->er_next) {
+    if (!atomic_flag_test_and_set_explicit(&record->er_taken,
+                                           memory_order_acquire))
+      break;
+  }
+  if (record == NULL) {
+    record = (epoch_record *)calloc(1, sizeof(epoch_record));
+    if (record == NULL) {
+      perror("epoch: out of memory");
+      abort();
+    }
+    atomic_flag_test_and_set(&record->er_taken);
+    record->er_next = atomic_load(&records);
+    while (!atomic_compare_exchange_weak(&records, &record->er_next, record))
+      ;
+  }
+  pthread_setspecific(record_key, record);
+  self = record;
+  return record;
+}
+
+void epoch_enter(void) {
+  epoch_record *record = record_get();
+  if (record->er_depth++ > 0)
+    return;
+
+  // the announced epoch must be current once it is visible, or the epoch
+  // might advance twice past it before this reader is noticed
+  uint64_t epoch;
+  do {
+    epoch = atomic_load(&global_epoch);
+    atomic_store(&record->er_epoch, epoch << 1 | EPOCH_ACTIVE);
+    atomic_thread_fence(memory_order_seq_cst);
+  } while (atomic_load(&global_epoch) != epoch);
+}
+
+void epoch_exit(void) {
+  epoch_record *record = self;
+  if (--record->er_depth == 0)
+    atomic_store_explicit(&record->er_epoch, 0, memory_order_release);
+}
+
+// advances the global epoch, unless an active reader hasn't entered in it
+// yet; must be called with the retire lock held
+static void epoch_try_advance(void) {
+  uint64_t epoch = atomic_load(&global_epoch);
+  for (epoch_record *record = atomic_load(&records); record != NULL;
+       record = record->er_next) {
+    uint64_t announced = atomic_load(&record->er_epoch);
+    if ((announced & EPOCH_ACTIVE) && announced >> 1 != epoch)
+      return;
+  }
+  atomic_store(&global_epoch, epoch + 1);
+}
+
+void epoch_retire(void *object, void (*free_fn)(void *object)) {
+  retired *entry = (retired *)malloc(sizeof(retired));
+  if (entry == NULL) {
+    // leaking the object is the only safe option left
+    perror("epoch: out of memory");
+    return;
+  }
+  entry->r_object = object;
+  entry->r_free = free_fn;
+
+  pthread_mutex_lock(&retire_lock);
+  entry->r_epoch = atomic_load(&global_epoch);
+  entry->r_next = limbo;
+  limbo = entry;
+  // with no readers around, the epoch advances twice and the object is
+  // freed right away
+  epoch_try_advance();
+  epoch_try_advance();
+
+  // takes the objects no reader can see anymore out of the limbo list
+  uint64_t epoch = atomic_load(&global_epoch);
+  retired *expired = NULL;
+  retired **link = &limbo;
+  while (*link != NULL) {
+    retired *current = *link;
+    if (current->r_epoch + 2 <= epoch) {
+      *link = current->r_next;
+      current->r_next = expired;
+      expired = current;
+    } else {
+      link = &current->r_next;
+    }
+  }
+  pthread_mutex_unlock(&retire_lock);
+
+  while (expired != NULL) {
+    retired *next = expired->r_next;
+    expired->r_free(expired->r_object);
+    free(expired);
+    expired = next;
+  }
+}
@@ -0,0 +1,29 @@
+#ifndef __UTILS_EPOCH_H__
+#define __UTILS_EPOCH_H__
+
+// Epoch-based reclamation, which lets readers traverse shared structures
+// without taking any lock, while writers unlink and free parts of them.
+//
+// Readers bracket every traversal with epoch_enter and epoch_exit. Writers
+// unlink whatever they remove, so that new readers can't reach it, and then
+// retire it with epoch_retire instead of freeing it: it is only freed once
+// every reader that might have reached it has exited.
+//
+// There is a global epoch, and readers announce the epoch they entered in. A
+// retired object is tagged with the global epoch, which only advances when
+// every active reader has entered in it; once it has advanced twice, no
+// reader can still see the object. Retiring is meant to be rare (it takes a
+// global lock), while entering and exiting only touch the calling thread's
+// own record.
+
+// epoch_enter: starts a read-side section, which may be nested
+void epoch_enter(void);
+
+// epoch_exit: ends a read-side section
+void epoch_exit(void);
+
+// epoch_retire: schedules an object, which readers can no longer reach, to be
+// freed by calling free_fn on it once no reader can still be using it
+void epoch_retire(void *object, void (*free_fn)(void *object));
+
+#endif // __UTILS_EPOCH_H__
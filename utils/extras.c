@@ -0,0 +1,189 @@
+#include "extras.h"
+#include <errno.h>
+#include <stddef.h>
+
+void frame_reader_init(frame_reader *reader, int fd) {
+  reader->fr_fd = fd;
+  reader->fr_start = 0;
+  reader->fr_end = 0;
+}
+
+ssize_t frame_reader_fill(frame_reader *reader) {
+  if (reader->fr_start > 0) {
+    memmove(reader->fr_buffer, reader->fr_buffer + reader->fr_start,
+            reader->fr_end - reader->fr_start);
+    reader->fr_end -= reader->fr_start;
+    reader->fr_start = 0;
+  }
+  ssize_t n = read(reader->fr_fd, reader->fr_buffer + reader->fr_end,
+                   FRAME_BUFFER_SIZE - reader->fr_end);
+  if (n > 0)
+    reader->fr_end += (size_t)n;
+  return n;
+}
+
+int frame_next(frame_reader *reader, frame_header *header,
+               char const **payload) {
+  size_t available = reader->fr_end - reader->fr_start;
+  if (available < sizeof(frame_header))
+    return 0;
+  memcpy(header, reader->fr_buffer + reader->fr_start, sizeof(frame_header));
+  if (header->version != FRAME_VERSION || header->length > FRAME_MAX_PAYLOAD)
+    return -1;
+  if (available < sizeof(frame_header) + header->length)
+    return 0;
+  *payload = reader->fr_buffer + reader->fr_start + sizeof(frame_header);
+  reader->fr_start += sizeof(frame_header) + header->length;
+  return 1;
+}
+
+int frame_read(frame_reader *reader, frame_header *header, void *payload,
+               size_t size) {
+  char const *data;
+  int found;
+  while ((found = frame_next(reader, header, &data)) == 0) {
+    ssize_t n = frame_reader_fill(reader);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return (int)n;
+  }
+  if (found == -1)
+    return -1;
+  memcpy(payload, data, header->length < size ? header->length : size);
+  return 1;
+}
+
+size_t frame_pack(void *buffer, uint8_t code, void const *payload,
+                  size_t length) {
+  frame_header header;
+  header.version = FRAME_VERSION;
+  header.code = code;
+  header.length = (uint16_t)length;
+  memcpy(buffer, &header, sizeof(header));
+  memcpy((char *)buffer + sizeof(header), payload, length);
+  return sizeof(header) + length;
+}
+
+int frame_write(int fd, uint8_t code, void const *payload, size_t length) {
+  char frame[FRAME_MAX_SIZE];
+  if (length > FRAME_MAX_PAYLOAD)
+    return -1;
+  size_t size = frame_pack(frame, code, payload, length);
+  if (write(fd, frame, size) != (ssize_t)size)
+    return -1;
+  return 0;
+}
+
+// copies a string (of at most size - 1 characters) to *payload, followed by
+// '\0', and moves *payload past it
+static void pack_string(char **payload, char const *field, size_t size) {
+  size_t length = strnlen(field, size - 1);
+  memcpy(*payload, field, length);
+  (*payload)[length] = '\0';
+  *payload += length + 1;
+}
+
+int frame_write_register(int fd, protocol const *request) {
+  char payload[PIPE_NAME_SIZE + 3 * BOX_NAME_SIZE + sizeof(uint32_t) +
+               sizeof(uint8_t) + 4 * sizeof(uint64_t)];
+  char *end = payload;
+  pack_string(&end, request->pipename, PIPE_NAME_SIZE);
+  pack_string(&end, request->boxname, BOX_NAME_SIZE);
+  // only listings, subscribers and box creations have more fields, which are
+  // otherwise taken as zero
+  int retention = request->max_bytes != 0 || request->max_messages != 0 ||
+                  request->max_age != 0;
+  int subscription =
+      request->group[0] != '\0' || request->start != 0 || retention;
+  if (request->cursor[0] != '\0' || request->limit != 0 || subscription) {
+    pack_string(&end, request->cursor, BOX_NAME_SIZE);
+    memcpy(end, &request->limit, sizeof(uint32_t));
+    end += sizeof(uint32_t);
+  }
+  if (subscription) {
+    pack_string(&end, request->group, BOX_NAME_SIZE);
+    memcpy(end, &request->start, sizeof(uint8_t));
+    memcpy(end + sizeof(uint8_t), &request->offset, sizeof(uint64_t));
+    end += sizeof(uint8_t) + sizeof(uint64_t);
+  }
+  if (retention) {
+    uint64_t limits[3] = {request->max_bytes, request->max_messages,
+                          request->max_age};
+    memcpy(end, limits, sizeof(limits));
+    end += sizeof(limits);
+  }
+  return frame_write(fd, request->code, payload, (size_t)(end - payload));
+}
+
+// copies the '\0' terminated string at *payload (of at most size - 1
+// characters) to field, and moves *payload past it. Missing fields are empty
+static int parse_string(char const **payload, char const *end, char *field,
+                        size_t size) {
+  memset(field, '\0', size);
+  if (*payload >= end)
+    return 0;
+  size_t length = strnlen(*payload, (size_t)(end - *payload));
+  if (length >= size || *payload + length == end)
+    return -1;
+  memcpy(field, *payload, length);
+  *payload += length + 1;
+  return 0;
+}
+
+int frame_parse_register(frame_header const *header, char const *payload,
+                         protocol *request) {
+  char const *end = payload + header->length;
+  request->code = header->code;
+  if (parse_string(&payload, end, request->pipename, PIPE_NAME_SIZE) == -1 ||
+      parse_string(&payload, end, request->boxname, BOX_NAME_SIZE) == -1 ||
+      parse_string(&payload, end, request->cursor, BOX_NAME_SIZE) == -1)
+    return -1;
+  request->limit = 0;
+  request->start = 0;
+  request->offset = 0;
+  if (end - payload >= (ptrdiff_t)sizeof(uint32_t)) {
+    memcpy(&request->limit, payload, sizeof(uint32_t));
+    payload += sizeof(uint32_t);
+  }
+  if (parse_string(&payload, end, request->group, BOX_NAME_SIZE) == -1)
+    return -1;
+  if (end - payload >= (ptrdiff_t)(sizeof(uint8_t) + sizeof(uint64_t))) {
+    memcpy(&request->start, payload, sizeof(uint8_t));
+    memcpy(&request->offset, payload + sizeof(uint8_t), sizeof(uint64_t));
+    payload += sizeof(uint8_t) + sizeof(uint64_t);
+  }
+  uint64_t limits[3] = {0, 0, 0};
+  if (end - payload >= (ptrdiff_t)sizeof(limits))
+    memcpy(limits, payload, sizeof(limits));
+  request->max_bytes = limits[0];
+  request->max_messages = limits[1];
+  request->max_age = limits[2];
+  return 0;
+}
+
+size_t box_list_pack(void *buffer, mail_box const *box) {
+  char *entry = (char *)buffer;
+  uint8_t name_length = (uint8_t)strnlen(box->box_name, BOX_NAME_SIZE - 1);
+  memcpy(entry, &box->box_size, sizeof(uint64_t));
+  memcpy(entry + sizeof(uint64_t), &box->n_pubs, sizeof(uint64_t));
+  memcpy(entry + 2 * sizeof(uint64_t), &box->n_subs, sizeof(uint64_t));
+  entry[3 * sizeof(uint64_t)] = (char)name_length;
+  memcpy(entry + BOX_LIST_ENTRY_SIZE(0), box->box_name, name_length);
+  return BOX_LIST_ENTRY_SIZE(name_length);
+}
+
+size_t box_list_unpack(void const *entry, size_t size, mail_box *box) {
+  char const *data = (char const *)entry;
+  if (size < BOX_LIST_ENTRY_SIZE(0))
+    return 0;
+  uint8_t name_length = (uint8_t)data[3 * sizeof(uint64_t)];
+  if (name_length >= BOX_NAME_SIZE || size < BOX_LIST_ENTRY_SIZE(name_length))
+    return 0;
+  memcpy(&box->box_size, data, sizeof(uint64_t));
+  memcpy(&box->n_pubs, data + sizeof(uint64_t), sizeof(uint64_t));
+  memcpy(&box->n_subs, data + 2 * sizeof(uint64_t), sizeof(uint64_t));
+  memcpy(box->box_name, data + BOX_LIST_ENTRY_SIZE(0), name_length);
+  box->box_name[name_length] = '\0';
+  return BOX_LIST_ENTRY_SIZE(name_length);
+}
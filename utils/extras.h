@@ -7,6 +7,7 @@
  */
 
 #include <fcntl.h>
+#include <limits.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdint.h>
@@ -24,14 +25,34 @@
 #define PIPE_NAME_SIZE 256
 #define PROTOCOL_SIZE 289
 #define BOX_LISTING 257
-#define MAX_MAILBOXES 23 // BLOCK_SIZE / sizeof(dir_entry_t)
 #define BLOCK_SIZE 1024
-#define MAX_BOX_SIZE 1024
+
+// where a subscriber starts reading its box
+typedef enum {
+  SUB_START_DEFAULT, // where its subscription left off, or the first message
+  SUB_START_EARLIEST,
+  SUB_START_LATEST, // the next message published
+  SUB_START_OFFSET, // the message at protocol.offset
+} sub_start;
 
 typedef struct {
   uint8_t code;
   char pipename[PIPE_NAME_SIZE];
-  char boxname[BOX_NAME_SIZE];
+  char boxname[BOX_NAME_SIZE]; // for listings, the prefix of the boxes listed
+  // listings only: the name of the box after which the listing starts, and
+  // the maximum number of boxes listed (0 for no limit)
+  char cursor[BOX_NAME_SIZE];
+  uint32_t limit;
+  // subscribers only: the name of their subscription (empty for none), and
+  // where they start (a sub_start), at offset if so asked
+  char group[BOX_NAME_SIZE];
+  uint8_t start;
+  uint64_t offset;
+  // box creations only: how much of the box is kept (0 for no limit), in
+  // bytes, messages and seconds since the messages were published
+  uint64_t max_bytes;
+  uint64_t max_messages;
+  uint64_t max_age;
 } protocol;
 
 typedef struct {
@@ -41,21 +62,129 @@ typedef struct {
   uint64_t n_subs;
 } mail_box;
 
+// Every message exchanged between clients and mbroker is a frame: a
+// frame_header followed by length bytes of payload. Frames are never larger
+// than PIPE_BUF, so writing one (or several packed together) to a pipe is
+// atomic. The payload of each code is:
+//
+// - 1, 2, 3, 5, 7, 11, 13, 14 (register requests): the client's pipe name and
+//   the box name, each followed by '\0', then the cursor (also followed by
+//   '\0') and the limit of listings, then the subscription (also followed by
+//   '\0'), start (uint8_t) and offset (uint64_t) of subscribers, then the
+//   retention limits (uint64_t) of box creations. Fields added in later
+//   versions go after these, and are taken as zero when absent
+// - 4, 6 (box creation/destruction answers): a box_response, whose error
+//   message ends at the end of the frame
+// - 8 (box listing): a box_list_header followed by its entries, each one the
+//   box's size, publishers and subscribers (uint64_t) and the length of its
+//   name (uint8_t), followed by the name itself. A listing takes as many
+//   frames as needed, in order of name, the last one flagged as such
+// - 9, 10 (messages from publishers/to subscribers): the message itself, with
+//   no terminator
+// - 12 (shared memory ring to read from): its name and starting position
+// - 13 (register request of a durable publisher): as 1, but the broker only
+//   reads the publisher's next messages once the previous ones are synced
+// - 14 (stats request): as 7, with the box name as the prefix of the boxes
+//   whose stats are sent
+// - 15 (stats): lines of text, each a name followed by pairs of counter names
+//   and values. The stats take as many frames as needed, the last one empty
+#define FRAME_VERSION 1
+#define FRAME_MAX_SIZE PIPE_BUF
+#define FRAME_MAX_PAYLOAD (FRAME_MAX_SIZE - sizeof(frame_header))
+// size of a frame_reader's buffer, which holds at least one whole frame
+#define FRAME_BUFFER_SIZE (2 * FRAME_MAX_SIZE)
+
 typedef struct {
+  uint8_t version;
   uint8_t code;
-  char message[MESSAGE_SIZE];
-} p_msg;
+  uint16_t length; // of the payload
+} frame_header;
 
 typedef struct {
-  uint8_t code;
   int32_t return_code;
   char error_message[ERROR_MESSAGE_SIZE];
 } box_response;
 
 typedef struct {
-  uint8_t code;
-  uint8_t last;
-  mail_box box;
-} box_list_response;
+  uint8_t last; // whether this is the listing's last frame
+  // (last frame only) whether the listing stopped at its limit, and more
+  // boxes follow the last one listed
+  uint8_t more;
+  uint16_t count; // number of entries in the frame
+} box_list_header;
+
+// size of a box listing entry with the given name length
+#define BOX_LIST_ENTRY_SIZE(name_length)                                      \
+  (3 * sizeof(uint64_t) + 1 + (name_length))
+
+// buffered reader of frames from a file descriptor, which may return them in
+// pieces (or several at once)
+typedef struct {
+  int fr_fd;
+  size_t fr_start; // position of the first byte not yet consumed
+  size_t fr_end;   // position past the last byte read
+  char fr_buffer[FRAME_BUFFER_SIZE];
+} frame_reader;
+
+// frame_reader_init: initializes a reader of frames from fd
+void frame_reader_init(frame_reader *reader, int fd);
+
+// frame_reader_fill: reads from the file descriptor into the reader's buffer
+// once, after moving the unconsumed bytes to its beginning
+//
+// Returns the number of bytes read, 0 at end of file, or -1 in case of error
+// (including EAGAIN for non-blocking descriptors)
+ssize_t frame_reader_fill(frame_reader *reader);
+
+// frame_next: takes the next frame from the reader's buffer, without reading
+// from the file descriptor. The payload points into the buffer, and is valid
+// until the next call on the reader
+//
+// Returns 1 if a frame was taken, 0 if the buffer has no complete frame, or
+// -1 if the data read is not a valid frame
+int frame_next(frame_reader *reader, frame_header *header,
+               char const **payload);
+
+// frame_read: reads the next frame, blocking until it is complete, and copies
+// (at most size bytes of) its payload to payload
+//
+// Returns 1 if a frame was read, 0 at end of file, or -1 in case of error
+int frame_read(frame_reader *reader, frame_header *header, void *payload,
+               size_t size);
+
+// frame_pack: writes a frame to buffer, which must have room for
+// sizeof(frame_header) + length bytes
+//
+// Returns the size of the frame
+size_t frame_pack(void *buffer, uint8_t code, void const *payload,
+                  size_t length);
+
+// frame_write: writes a frame to fd, with a single write
+//
+// Returns 0 if successful, -1 otherwise
+int frame_write(int fd, uint8_t code, void const *payload, size_t length);
+
+// frame_write_register: writes a register request frame to fd
+//
+// Returns 0 if successful, -1 otherwise
+int frame_write_register(int fd, protocol const *request);
+
+// frame_parse_register: fills request with the register request in a frame
+//
+// Returns 0 if successful, -1 if the frame is not a valid register request
+int frame_parse_register(frame_header const *header, char const *payload,
+                         protocol *request);
+
+// box_list_pack: writes a box's listing entry to buffer, which must have
+// room for BOX_LIST_ENTRY_SIZE of its name's length
+//
+// Returns the size of the entry
+size_t box_list_pack(void *buffer, mail_box const *box);
+
+// box_list_unpack: reads the listing entry at entry (with at most size bytes)
+// into box
+//
+// Returns the size of the entry, or 0 if it is not valid
+size_t box_list_unpack(void const *entry, size_t size, mail_box *box);
 
 #endif // __UTILS_EXTRAS_H__
\ No newline at end of file
@@ -0,0 +1,213 @@
+#include "hashmap.h"
+#include "epoch.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// initial number of buckets of each shard
+#define SHARD_INITIAL_CAPACITY (16)
+
+// FNV-1a
+static size_t hash_key(char const *key) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (; *key != '\0'; key++) {
+    hash ^= (unsigned char)*key;
+    hash *= 1099511628211ULL;
+  }
+  return (size_t)hash;
+}
+
+// the low bits of the hash pick the bucket, so the shard is picked from the
+// high ones
+static hashmap_shard *shard_of(hashmap *map, size_t hash) {
+  return &map->hm_shards[(hash >> 48) % HASHMAP_SHARDS];
+}
+
+static hashmap_table *table_alloc(size_t capacity) {
+  hashmap_table *table = (hashmap_table *)calloc(
+      1, sizeof(hashmap_table) + capacity * sizeof(hashmap_node *));
+  if (table == NULL)
+    return NULL;
+  table->ht_capacity = capacity;
+  return table;
+}
+
+// frees a table along with all of its nodes
+static void table_free(void *arg) {
+  hashmap_table *table = (hashmap_table *)arg;
+  for (size_t b = 0; b < table->ht_capacity; b++) {
+    hashmap_node *node = atomic_load(&table->ht_buckets[b]);
+    while (node != NULL) {
+      hashmap_node *next = atomic_load(&node->hn_next);
+      free(node);
+      node = next;
+    }
+  }
+  free(table);
+}
+
+int hashmap_init(hashmap *map) {
+  for (size_t i = 0; i < HASHMAP_SHARDS; i++) {
+    hashmap_shard *shard = &map->hm_shards[i];
+    hashmap_table *table = table_alloc(SHARD_INITIAL_CAPACITY);
+    if (table == NULL)
+      return -1;
+    atomic_init(&shard->hs_table, table);
+    shard->hs_size = 0;
+    pthread_mutex_init(&shard->hs_lock, NULL);
+  }
+  return 0;
+}
+
+void hashmap_destroy(hashmap *map) {
+  for (size_t i = 0; i < HASHMAP_SHARDS; i++) {
+    hashmap_shard *shard = &map->hm_shards[i];
+    table_free(atomic_load(&shard->hs_table));
+    pthread_mutex_destroy(&shard->hs_lock);
+  }
+}
+
+// returns the link pointing to the node with the key (or the NULL link at the
+// end of its bucket); must be called with the shard locked, or in a read-side
+// section (where the link must only be read)
+static _Atomic(hashmap_node *) *find_link(hashmap_table *table,
+                                          char const *key, size_t hash) {
+  _Atomic(hashmap_node *) *link =
+      &table->ht_buckets[hash & (table->ht_capacity - 1)];
+  hashmap_node *node;
+  while ((node = atomic_load_explicit(link, memory_order_acquire)) != NULL &&
+         (node->hn_hash != hash || strcmp(node->hn_key, key) != 0)) {
+    link = &node->hn_next;
+  }
+  return link;
+}
+
+static hashmap_node *node_alloc(char const *key, size_t hash, void *value) {
+  size_t key_size = strlen(key) + 1;
+  hashmap_node *node = (hashmap_node *)malloc(sizeof(hashmap_node) + key_size);
+  if (node == NULL)
+    return NULL;
+  atomic_init(&node->hn_next, NULL);
+  node->hn_hash = hash;
+  node->hn_value = value;
+  memcpy(node->hn_key, key, key_size);
+  return node;
+}
+
+// replaces a shard's table with one twice as large, if possible. Readers may
+// still be traversing the old one, so its nodes are copied rather than moved,
+// and it is retired whole. Must be called with the shard locked
+static void grow(hashmap_shard *shard) {
+  hashmap_table *old = atomic_load(&shard->hs_table);
+  hashmap_table *table = table_alloc(old->ht_capacity * 2);
+  if (table == NULL)
+    return; // the shard still works, only with longer chains
+
+  for (size_t b = 0; b < old->ht_capacity; b++) {
+    for (hashmap_node *node = atomic_load(&old->ht_buckets[b]); node != NULL;
+         node = atomic_load(&node->hn_next)) {
+      hashmap_node *copy = node_alloc(node->hn_key, node->hn_hash,
+                                      node->hn_value);
+      if (copy == NULL) {
+        table_free(table);
+        return;
+      }
+      _Atomic(hashmap_node *) *bucket =
+          &table->ht_buckets[copy->hn_hash & (table->ht_capacity - 1)];
+      atomic_init(&copy->hn_next, atomic_load(bucket));
+      atomic_init(bucket, copy);
+    }
+  }
+  atomic_store_explicit(&shard->hs_table, table, memory_order_release);
+  epoch_retire(old, table_free);
+}
+
+void *hashmap_get(hashmap *map, char const *key, hashmap_hold_fn hold) {
+  size_t hash = hash_key(key);
+  hashmap_shard *shard = shard_of(map, hash);
+
+  epoch_enter();
+  hashmap_table *table =
+      atomic_load_explicit(&shard->hs_table, memory_order_acquire);
+  hashmap_node *node =
+      atomic_load_explicit(find_link(table, key, hash), memory_order_acquire);
+  void *value = node != NULL ? node->hn_value : NULL;
+  if (value != NULL && hold != NULL && !hold(value))
+    value = NULL;
+  epoch_exit();
+  return value;
+}
+
+int hashmap_put(hashmap *map, char const *key, void *value) {
+  size_t hash = hash_key(key);
+  hashmap_shard *shard = shard_of(map, hash);
+
+  pthread_mutex_lock(&shard->hs_lock);
+  hashmap_table *table = atomic_load(&shard->hs_table);
+  _Atomic(hashmap_node *) *link = find_link(table, key, hash);
+  hashmap_node *node;
+  if (atomic_load(link) != NULL ||
+      (node = node_alloc(key, hash, value)) == NULL) {
+    pthread_mutex_unlock(&shard->hs_lock);
+    return -1;
+  }
+  // publishes the node at the end of its bucket, fully built
+  atomic_store_explicit(link, node, memory_order_release);
+
+  // keeps the average chain length at most 1
+  if (++shard->hs_size > table->ht_capacity)
+    grow(shard);
+  pthread_mutex_unlock(&shard->hs_lock);
+  return 0;
+}
+
+void *hashmap_remove(hashmap *map, char const *key) {
+  size_t hash = hash_key(key);
+  hashmap_shard *shard = shard_of(map, hash);
+
+  pthread_mutex_lock(&shard->hs_lock);
+  hashmap_table *table = atomic_load(&shard->hs_table);
+  _Atomic(hashmap_node *) *link = find_link(table, key, hash);
+  hashmap_node *node = atomic_load(link);
+  void *value = NULL;
+  if (node != NULL) {
+    // readers at the node keep following its next pointer, which is left as
+    // it was
+    atomic_store_explicit(link, atomic_load(&node->hn_next),
+                          memory_order_release);
+    shard->hs_size--;
+    value = node->hn_value;
+    epoch_retire(node, free);
+  }
+  pthread_mutex_unlock(&shard->hs_lock);
+  return value;
+}
+
+void hashmap_foreach(hashmap *map, hashmap_visit_fn visit, void *arg) {
+  epoch_enter();
+  for (size_t i = 0; i < HASHMAP_SHARDS; i++) {
+    hashmap_table *table = atomic_load_explicit(&map->hm_shards[i].hs_table,
+                                                memory_order_acquire);
+    for (size_t b = 0; b < table->ht_capacity; b++) {
+      for (hashmap_node *node = atomic_load_explicit(&table->ht_buckets[b],
+                                                     memory_order_acquire);
+           node != NULL; node = atomic_load_explicit(&node->hn_next,
+                                                     memory_order_acquire)) {
+        visit(node->hn_key, node->hn_value, arg);
+      }
+    }
+  }
+  epoch_exit();
+}
+
+size_t hashmap_size(hashmap *map) {
+  size_t size = 0;
+  for (size_t i = 0; i < HASHMAP_SHARDS; i++) {
+    hashmap_shard *shard = &map->hm_shards[i];
+    pthread_mutex_lock(&shard->hs_lock);
+    size += shard->hs_size;
+    pthread_mutex_unlock(&shard->hs_lock);
+  }
+  return size;
+}
@@ -0,0 +1,86 @@
+#ifndef __UTILS_HASHMAP_H__
+#define __UTILS_HASHMAP_H__
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+// Concurrent hash map from strings to (non NULL) pointers, used both by the
+// broker's registry of boxes and by tfs' directories.
+//
+// The map is split into HASHMAP_SHARDS independent shards (picked by the hash
+// of the key), each one a chained hash table which grows on its own when it
+// gets too full. Writers to a shard are serialized by its lock, while readers
+// take no lock at all: writers only ever publish fully built nodes and tables
+// with a single atomic store, and retire whatever they unlink (see epoch.h),
+// so that it is freed once no reader can be traversing it.
+
+#define HASHMAP_SHARDS (64)
+
+// nodes are immutable but for their next pointer
+typedef struct hashmap_node {
+  _Atomic(struct hashmap_node *) hn_next;
+  size_t hn_hash;
+  void *hn_value;
+  char hn_key[]; // copied into the node
+} hashmap_node;
+
+// growing a shard replaces its table (and copies its nodes) as a whole
+typedef struct {
+  size_t ht_capacity; // number of buckets, always a power of two
+  _Atomic(hashmap_node *) ht_buckets[];
+} hashmap_table;
+
+typedef struct {
+  pthread_mutex_t hs_lock; // serializes writers
+  _Atomic(hashmap_table *) hs_table;
+  size_t hs_size; // number of entries, only touched by writers
+} hashmap_shard;
+
+typedef struct {
+  hashmap_shard hm_shards[HASHMAP_SHARDS];
+} hashmap;
+
+// called on a value found, before it can be freed (but possibly after it was
+// removed): lets callers take a reference to it, unless it is already being
+// freed, in which case it returns 0 and the value is treated as not found
+typedef int (*hashmap_hold_fn)(void *value);
+
+// called on every entry by hashmap_foreach
+typedef void (*hashmap_visit_fn)(char const *key, void *value, void *arg);
+
+// hashmap_init: initializes an empty map
+//
+// Returns 0 if successful, -1 otherwise
+int hashmap_init(hashmap *map);
+
+// hashmap_destroy: releases the map's memory (but not its values). Nobody may
+// be using the map anymore
+void hashmap_destroy(hashmap *map);
+
+// hashmap_get: looks a key up, calling hold (if not NULL) on its value before
+// returning it
+//
+// Returns the value, or NULL if the key is not in the map
+void *hashmap_get(hashmap *map, char const *key, hashmap_hold_fn hold);
+
+// hashmap_put: inserts a key, unless it is already in the map
+//
+// Returns 0 if the key was inserted, or -1 if it already existed (or memory
+// ran out)
+int hashmap_put(hashmap *map, char const *key, void *value);
+
+// hashmap_remove: removes a key from the map
+//
+// Returns the value it had, or NULL if it was not in the map
+void *hashmap_remove(hashmap *map, char const *key);
+
+// hashmap_foreach: calls visit on every entry, one shard at a time, without
+// blocking writers (so it doesn't see the map at a single point in time, and
+// entries inserted or removed meanwhile may or may not be visited)
+void hashmap_foreach(hashmap *map, hashmap_visit_fn visit, void *arg);
+
+// hashmap_size: number of entries in the map (taking every shard's lock)
+size_t hashmap_size(hashmap *map);
+
+#endif // __UTILS_HASHMAP_H__
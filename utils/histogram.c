@@ -0,0 +1,74 @@
+#include "histogram.h"
+
+#include <stddef.h>
+
+// the bucket of a value: below HISTOGRAM_SUB_BUCKETS, the value itself, and
+// above, the power of two it is in and the HISTOGRAM_SUB_BITS bits after its
+// most significant one
+static size_t bucket_of(uint64_t value) {
+  if (value < HISTOGRAM_SUB_BUCKETS)
+    return (size_t)value;
+  unsigned msb = 63 - (unsigned)__builtin_clzll(value);
+  size_t sub = (size_t)(value >> (msb - HISTOGRAM_SUB_BITS)) &
+               (HISTOGRAM_SUB_BUCKETS - 1);
+  return (msb - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS + sub;
+}
+
+// the highest value counted in a bucket
+static uint64_t bucket_highest(size_t bucket) {
+  if (bucket < HISTOGRAM_SUB_BUCKETS)
+    return bucket;
+  unsigned shift = (unsigned)(bucket / HISTOGRAM_SUB_BUCKETS) - 1;
+  uint64_t sub = bucket % HISTOGRAM_SUB_BUCKETS;
+  uint64_t lowest = (HISTOGRAM_SUB_BUCKETS + sub) << shift;
+  return lowest + ((1ULL << shift) - 1);
+}
+
+void histogram_init(histogram *h) {
+  for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    atomic_init(&h->h_counts[i], 0);
+  }
+  atomic_init(&h->h_max, 0);
+}
+
+void histogram_record(histogram *h, uint64_t value) {
+  atomic_fetch_add_explicit(&h->h_counts[bucket_of(value)], 1,
+                            memory_order_relaxed);
+  uint64_t max = atomic_load_explicit(&h->h_max, memory_order_relaxed);
+  while (value > max &&
+         !atomic_compare_exchange_weak_explicit(&h->h_max, &max, value,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed)) {
+  }
+}
+
+void histogram_snapshot_take(histogram *h, histogram_snapshot *snapshot) {
+  snapshot->hs_total = 0;
+  for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    snapshot->hs_counts[i] =
+        atomic_load_explicit(&h->h_counts[i], memory_order_relaxed);
+    snapshot->hs_total += snapshot->hs_counts[i];
+  }
+  snapshot->hs_max = atomic_load_explicit(&h->h_max, memory_order_relaxed);
+}
+
+uint64_t histogram_percentile(histogram_snapshot const *snapshot,
+                              double percentile) {
+  if (snapshot->hs_total == 0)
+    return 0;
+  uint64_t rank = (uint64_t)(percentile / 100.0 * (double)snapshot->hs_total);
+  if (rank == 0)
+    rank = 1;
+  uint64_t seen = 0;
+  for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    seen += snapshot->hs_counts[i];
+    if (seen >= rank) {
+      uint64_t value = bucket_highest(i);
+      // the maximum may have been recorded after the buckets were copied
+      return value < snapshot->hs_max || snapshot->hs_max == 0
+                 ? value
+                 : snapshot->hs_max;
+    }
+  }
+  return snapshot->hs_max;
+}
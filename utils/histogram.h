@@ -0,0 +1,51 @@
+#ifndef __UTILS_HISTOGRAM_H__
+#define __UTILS_HISTOGRAM_H__
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+// Histogram of (latency) values, in the style of HdrHistogram: values below
+// HISTOGRAM_SUB_BUCKETS get a bucket each, and every power of two above is
+// split into HISTOGRAM_SUB_BUCKETS buckets, so any 64-bit value is counted in
+// a bucket at most 1/HISTOGRAM_SUB_BUCKETS (about 3%) wider than itself.
+//
+// Recording a value is a single relaxed atomic increment of its bucket (plus
+// a load of the maximum, which is only written when it grows), so threads can
+// record into the same histogram without any lock. Readers copy the buckets
+// into a histogram_snapshot, which is only approximately a single point in
+// time, and compute percentiles from it.
+
+#define HISTOGRAM_SUB_BITS (5)
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS                                                      \
+  ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+typedef struct {
+  _Atomic uint64_t h_counts[HISTOGRAM_BUCKETS];
+  _Atomic uint64_t h_max;
+} histogram;
+
+typedef struct {
+  uint64_t hs_counts[HISTOGRAM_BUCKETS];
+  uint64_t hs_total;
+  uint64_t hs_max;
+} histogram_snapshot;
+
+// histogram_init: empties a histogram
+void histogram_init(histogram *h);
+
+// histogram_record: counts a value
+void histogram_record(histogram *h, uint64_t value);
+
+// histogram_snapshot_take: copies the counts of a histogram into snapshot
+void histogram_snapshot_take(histogram *h, histogram_snapshot *snapshot);
+
+// histogram_percentile: the value below which percentile% of the values in a
+// snapshot are (the highest value of their bucket, so it is never lower than
+// the actual one)
+//
+// Returns the value, or 0 if the snapshot is empty
+uint64_t histogram_percentile(histogram_snapshot const *snapshot,
+                              double percentile);
+
+#endif // __UTILS_HISTOGRAM_H__
@@ -0,0 +1,254 @@
+// syscall() and the futex constants are only exposed with _GNU_SOURCE
+#define _GNU_SOURCE
+#include "shm_ring.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// records start after the header, on its own cache line
+#define SHM_RING_DATA_OFFSET (64)
+
+_Static_assert(sizeof(shm_ring_header) <= SHM_RING_DATA_OFFSET,
+               "ring header must fit before the data area");
+_Static_assert(sizeof(shm_ring_record) == sizeof(uint64_t) &&
+                   SHM_RING_ALIGN == sizeof(uint64_t),
+               "records must be made of whole words");
+
+static uint64_t record_size(uint32_t length) {
+  return (sizeof(shm_ring_record) + length + SHM_RING_ALIGN - 1) &
+         ~(uint64_t)(SHM_RING_ALIGN - 1);
+}
+
+// the ring is shared between processes, so these are not FUTEX_*_PRIVATE
+static void futex_wait(_Atomic uint32_t const *futex, uint32_t seen) {
+  syscall(SYS_futex, (uint32_t const *)futex, FUTEX_WAIT, seen, NULL, NULL, 0);
+}
+
+static void futex_wake(_Atomic uint32_t *futex) {
+  syscall(SYS_futex, (uint32_t *)futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static uint64_t record_word(shm_ring_record record) {
+  uint64_t word;
+  memcpy(&word, &record, sizeof(word));
+  return word;
+}
+
+static shm_ring_record word_record(uint64_t word) {
+  shm_ring_record record;
+  memcpy(&record, &word, sizeof(record));
+  return record;
+}
+
+// copies length bytes into the words at to, zero-padding the last one
+static void store_words(_Atomic uint64_t *to, void const *from,
+                        size_t length) {
+  char const *bytes = (char const *)from;
+  for (size_t i = 0; i < length; i += sizeof(uint64_t)) {
+    uint64_t word = 0;
+    size_t n = length - i < sizeof(word) ? length - i : sizeof(word);
+    memcpy(&word, bytes + i, n);
+    atomic_store_explicit(to++, word, memory_order_relaxed);
+  }
+}
+
+// copies length bytes out of the words at from
+static void load_words(void *to, _Atomic uint64_t const *from,
+                       size_t length) {
+  char *bytes = (char *)to;
+  for (size_t i = 0; i < length; i += sizeof(uint64_t)) {
+    uint64_t word = atomic_load_explicit(from++, memory_order_relaxed);
+    size_t n = length - i < sizeof(word) ? length - i : sizeof(word);
+    memcpy(bytes + i, &word, n);
+  }
+}
+
+// word at byte offset in the data area
+static size_t word_at(uint64_t offset) {
+  return (size_t)(offset / sizeof(uint64_t));
+}
+
+int shm_ring_create(shm_ring *ring, char const *name, size_t capacity) {
+  capacity = (capacity + SHM_RING_ALIGN - 1) & ~(size_t)(SHM_RING_ALIGN - 1);
+  size_t map_size = SHM_RING_DATA_OFFSET + capacity;
+
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+  if (fd == -1)
+    return -1;
+  if (ftruncate(fd, (off_t)map_size) == -1) {
+    close(fd);
+    shm_unlink(name);
+    return -1;
+  }
+  void *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    shm_unlink(name);
+    return -1;
+  }
+
+  ring->sr_header = (shm_ring_header *)map;
+  ring->sr_data = (_Atomic uint64_t *)((char *)map + SHM_RING_DATA_OFFSET);
+  ring->sr_map_size = map_size;
+  strncpy(ring->sr_name, name, sizeof(ring->sr_name) - 1);
+  ring->sr_name[sizeof(ring->sr_name) - 1] = '\0';
+  atomic_init(&ring->sr_header->sr_head, 0);
+  atomic_init(&ring->sr_header->sr_tail, 0);
+  atomic_init(&ring->sr_header->sr_futex, 0);
+  atomic_init(&ring->sr_header->sr_closed, 0);
+  ring->sr_header->sr_capacity = capacity;
+  return 0;
+}
+
+void shm_ring_destroy(shm_ring *ring) {
+  atomic_store_explicit(&ring->sr_header->sr_closed, 1, memory_order_release);
+  shm_ring_notify(ring);
+  shm_unlink(ring->sr_name);
+  munmap(ring->sr_header, ring->sr_map_size);
+}
+
+int shm_ring_append(shm_ring *ring, void const *message, uint32_t length) {
+  shm_ring_header *header = ring->sr_header;
+  uint64_t capacity = header->sr_capacity;
+  uint64_t size = record_size(length);
+  if (length == SHM_RING_PADDING || size > capacity / 2)
+    return -1;
+
+  uint64_t tail = atomic_load_explicit(&header->sr_tail, memory_order_relaxed);
+  uint64_t start = tail;
+  // skips to the beginning of the data area if the record doesn't fit before
+  // its end
+  if (capacity - tail % capacity < size)
+    start = tail + (capacity - tail % capacity);
+
+  // drops the oldest records until the new one fits, before overwriting them
+  uint64_t head = atomic_load_explicit(&header->sr_head, memory_order_relaxed);
+  uint64_t old_head = head;
+  while (start + size - head > capacity) {
+    shm_ring_record record = word_record(atomic_load_explicit(
+        &ring->sr_data[word_at(head % capacity)], memory_order_relaxed));
+    if (record.rr_length == SHM_RING_PADDING)
+      head += capacity - head % capacity;
+    else
+      head += record_size(record.rr_length);
+  }
+  if (head != old_head) {
+    atomic_store_explicit(&header->sr_head, head, memory_order_relaxed);
+    // a reader that reads any of the words written below sees the new head
+    // when it validates what it read
+    atomic_thread_fence(memory_order_release);
+  }
+
+  if (start != tail) {
+    shm_ring_record padding = {SHM_RING_PADDING, 0};
+    atomic_store_explicit(&ring->sr_data[word_at(tail % capacity)],
+                          record_word(padding), memory_order_relaxed);
+  }
+  size_t word = word_at(start % capacity);
+  shm_ring_record record = {length, 0};
+  atomic_store_explicit(&ring->sr_data[word], record_word(record),
+                        memory_order_relaxed);
+  store_words(&ring->sr_data[word + 1], message, length);
+
+  atomic_store_explicit(&header->sr_tail, start + size, memory_order_release);
+  return 0;
+}
+
+void shm_ring_notify(shm_ring *ring) {
+  atomic_fetch_add_explicit(&ring->sr_header->sr_futex, 1,
+                            memory_order_release);
+  futex_wake(&ring->sr_header->sr_futex);
+}
+
+uint64_t shm_ring_tail(shm_ring *ring) {
+  return atomic_load_explicit(&ring->sr_header->sr_tail, memory_order_relaxed);
+}
+
+int shm_ring_attach(shm_ring_reader *reader, char const *name,
+                    uint64_t position) {
+  int fd = shm_open(name, O_RDONLY, 0);
+  if (fd == -1)
+    return -1;
+  struct stat st;
+  if (fstat(fd, &st) == -1 || st.st_size < SHM_RING_DATA_OFFSET) {
+    close(fd);
+    return -1;
+  }
+  void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return -1;
+
+  reader->rd_header = (shm_ring_header const *)map;
+  reader->rd_data =
+      (_Atomic uint64_t const *)((char const *)map + SHM_RING_DATA_OFFSET);
+  reader->rd_map_size = (size_t)st.st_size;
+  reader->rd_position = position;
+  reader->rd_overruns = 0;
+  return 0;
+}
+
+void shm_ring_detach(shm_ring_reader *reader) {
+  munmap((void *)reader->rd_header, reader->rd_map_size);
+}
+
+// checks that what was read at the reader's position wasn't overwritten
+// meanwhile, skipping to the oldest record in the ring otherwise
+static int validate(shm_ring_reader *reader) {
+  atomic_thread_fence(memory_order_acquire);
+  uint64_t head =
+      atomic_load_explicit(&reader->rd_header->sr_head, memory_order_relaxed);
+  if (reader->rd_position >= head)
+    return 1;
+  reader->rd_position = head;
+  reader->rd_overruns++;
+  return 0;
+}
+
+ssize_t shm_ring_read(shm_ring_reader *reader, void *buffer, size_t size) {
+  shm_ring_header const *header = reader->rd_header;
+  uint64_t capacity = header->sr_capacity;
+
+  while (1) {
+    uint32_t seen =
+        atomic_load_explicit(&header->sr_futex, memory_order_acquire);
+    uint64_t tail =
+        atomic_load_explicit(&header->sr_tail, memory_order_acquire);
+    if (reader->rd_position >= tail) {
+      if (atomic_load_explicit(&header->sr_closed, memory_order_acquire))
+        return 0;
+      futex_wait(&header->sr_futex, seen);
+      continue;
+    }
+    if (!validate(reader))
+      continue;
+
+    uint64_t offset = reader->rd_position % capacity;
+    shm_ring_record record = word_record(atomic_load_explicit(
+        &reader->rd_data[word_at(offset)], memory_order_relaxed));
+    if (record.rr_length == SHM_RING_PADDING) {
+      if (validate(reader))
+        reader->rd_position += capacity - offset;
+      continue;
+    }
+    // a torn header may have any length, which must not be trusted before
+    // validating it
+    if (record.rr_length > size ||
+        record_size(record.rr_length) > capacity - offset) {
+      if (validate(reader))
+        return -1;
+      continue;
+    }
+    load_words(buffer, &reader->rd_data[word_at(offset) + 1],
+               record.rr_length);
+    if (!validate(reader))
+      continue;
+    reader->rd_position += record_size(record.rr_length);
+    return (ssize_t)record.rr_length;
+  }
+}
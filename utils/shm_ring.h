@@ -0,0 +1,102 @@
+#ifndef __UTILS_SHM_RING_H__
+#define __UTILS_SHM_RING_H__
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Ring of messages in a POSIX shared memory object, written by the broker and
+// mapped read-only by any number of subscribers, which read the messages in
+// place. Fanning a message out to N subscribers costs a single copy into the
+// ring, instead of one pipe write (and two copies) per subscriber.
+//
+// Records are a shm_ring_record followed by the message, padded to
+// SHM_RING_ALIGN bytes. Positions are byte counts since the ring was created
+// and never wrap; the record at position p is at p % capacity in the data
+// area. When a record doesn't fit before the end of the data area, a padding
+// record fills the rest and the record starts back at the beginning.
+//
+// The writer never waits for readers: to make room, it moves sr_head past the
+// oldest records before overwriting them. A reader validates each record it
+// copies by checking, afterwards, that its position is still past sr_head
+// (like a seqlock). A reader that falls that far behind skips to sr_head and
+// counts an overrun. Records are written and copied a word at a time with
+// relaxed atomic accesses, after a release fence and before an acquire fence
+// respectively: a reader copying a record while it is overwritten gets some
+// mix of the two, but is then sure to see the head moved past it.
+
+#define SHM_RING_ALIGN (8)
+#define SHM_RING_PADDING UINT32_MAX
+
+typedef struct {
+  _Atomic uint64_t sr_head;  // position of the oldest record in the ring
+  _Atomic uint64_t sr_tail;  // position past the newest record
+  _Atomic uint32_t sr_futex; // incremented whenever readers must wake up
+  _Atomic uint32_t sr_closed;
+  uint64_t sr_capacity; // size of the data area
+} shm_ring_header;
+
+typedef struct {
+  uint32_t rr_length; // length of the message, or SHM_RING_PADDING
+  uint32_t rr_reserved;
+} shm_ring_record;
+
+// writer side, private to the broker
+typedef struct {
+  shm_ring_header *sr_header;
+  _Atomic uint64_t *sr_data;
+  size_t sr_map_size;
+  char sr_name[64];
+} shm_ring;
+
+// reader side
+typedef struct {
+  shm_ring_header const *rd_header;
+  _Atomic uint64_t const *rd_data;
+  size_t rd_map_size;
+  uint64_t rd_position; // position of the next record to read
+  uint64_t rd_overruns; // number of times the reader fell behind the writer
+} shm_ring_reader;
+
+// shm_ring_create: creates (and maps) the shared memory object name, which
+// must not exist yet, with room for capacity bytes of records (rounded up to
+// SHM_RING_ALIGN)
+//
+// Returns 0 if successful, -1 otherwise (with errno EEXIST if name exists)
+int shm_ring_create(shm_ring *ring, char const *name, size_t capacity);
+
+// shm_ring_destroy: closes the ring, waking up its readers so that they see
+// it closed, and unlinks and unmaps the shared memory object
+void shm_ring_destroy(shm_ring *ring);
+
+// shm_ring_append: appends a message to the ring, without waking up readers
+// (see shm_ring_notify). Must not be called concurrently on the same ring
+//
+// Returns 0 if successful, or -1 if the message doesn't fit in the ring
+int shm_ring_append(shm_ring *ring, void const *message, uint32_t length);
+
+// shm_ring_notify: wakes up the readers waiting for new records
+void shm_ring_notify(shm_ring *ring);
+
+// shm_ring_tail: position the next record appended will have
+uint64_t shm_ring_tail(shm_ring *ring);
+
+// shm_ring_attach: maps the ring with the given name read-only, to read it
+// starting at the record at position
+//
+// Returns 0 if successful, -1 otherwise
+int shm_ring_attach(shm_ring_reader *reader, char const *name,
+                    uint64_t position);
+
+// shm_ring_detach: unmaps the ring
+void shm_ring_detach(shm_ring_reader *reader);
+
+// shm_ring_read: copies the next message into buffer, sleeping while there
+// is none
+//
+// Returns the length of the message, 0 if the ring was closed, or -1 if the
+// message is larger than size
+ssize_t shm_ring_read(shm_ring_reader *reader, void *buffer, size_t size);
+
+#endif // __UTILS_SHM_RING_H__
@@ -0,0 +1,69 @@
+#include "slab.h"
+
+#include <stdlib.h>
+
+#define SLAB_ALIGN (_Alignof(max_align_t))
+
+static uint64_t pack(uint64_t tag, uint32_t slot) { return tag << 32 | slot; }
+
+static uint32_t slot_of(uint64_t head) { return (uint32_t)head; }
+
+int slab_pool_init(slab_pool *pool, size_t object_size, uint32_t capacity) {
+  if (capacity == 0 || capacity == SLAB_NONE) {
+    return -1;
+  }
+  pool->sp_object_size =
+      (object_size + SLAB_ALIGN - 1) / SLAB_ALIGN * SLAB_ALIGN;
+  pool->sp_capacity = capacity;
+  pool->sp_objects = (char *)malloc(pool->sp_object_size * capacity);
+  pool->sp_next = (_Atomic uint32_t *)malloc(sizeof(uint32_t) * capacity);
+  if (pool->sp_objects == NULL || pool->sp_next == NULL) {
+    free(pool->sp_objects);
+    free((void *)pool->sp_next);
+    return -1;
+  }
+  // every object starts free, in order
+  for (uint32_t i = 0; i < capacity; i++) {
+    atomic_init(&pool->sp_next[i], i + 1 < capacity ? i + 1 : SLAB_NONE);
+  }
+  atomic_init(&pool->sp_head, pack(0, 0));
+  return 0;
+}
+
+void slab_pool_destroy(slab_pool *pool) {
+  free(pool->sp_objects);
+  free((void *)pool->sp_next);
+  pool->sp_objects = NULL;
+  pool->sp_next = NULL;
+}
+
+void *slab_pool_alloc(slab_pool *pool) {
+  uint64_t head = atomic_load_explicit(&pool->sp_head, memory_order_acquire);
+  uint64_t next;
+  do {
+    if (slot_of(head) == SLAB_NONE) {
+      return NULL;
+    }
+    // the slot may be taken (and its next changed) by another thread right
+    // after this load, but then the tag has changed and the swap fails
+    uint32_t after = atomic_load_explicit(&pool->sp_next[slot_of(head)],
+                                          memory_order_relaxed);
+    next = pack((head >> 32) + 1, after);
+  } while (!atomic_compare_exchange_weak_explicit(&pool->sp_head, &head, next,
+                                                  memory_order_acquire,
+                                                  memory_order_acquire));
+  return pool->sp_objects + (size_t)slot_of(head) * pool->sp_object_size;
+}
+
+void slab_pool_free(slab_pool *pool, void *object) {
+  uint32_t slot =
+      (uint32_t)((size_t)((char *)object - pool->sp_objects) /
+                 pool->sp_object_size);
+  uint64_t head = atomic_load_explicit(&pool->sp_head, memory_order_relaxed);
+  do {
+    atomic_store_explicit(&pool->sp_next[slot], slot_of(head),
+                          memory_order_relaxed);
+  } while (!atomic_compare_exchange_weak_explicit(
+      &pool->sp_head, &head, pack((head >> 32) + 1, slot),
+      memory_order_release, memory_order_relaxed));
+}
@@ -0,0 +1,48 @@
+#ifndef __UTILS_SLAB_H__
+#define __UTILS_SLAB_H__
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Fixed-capacity pool of equally sized objects, carved out of a single
+// allocation made when the pool is created, so that taking and returning
+// objects never calls malloc or free and the memory used is bounded.
+//
+// Free objects are kept in a lock-free stack (a Treiber stack) of slot
+// numbers, so any thread may take or return objects. The top of the stack is
+// packed with a tag, bumped by every change, into a single word: a thread
+// that read the top before other threads took it and put it back fails its
+// compare-and-swap instead of linking a stale next slot (the ABA problem).
+
+typedef struct {
+  char *sp_objects;
+  size_t sp_object_size; // rounded up to keep every object aligned
+  uint32_t sp_capacity;
+  // next free slot after each free one, or SLAB_NONE
+  _Atomic uint32_t *sp_next;
+  // tag << 32 | the first free slot (SLAB_NONE when there is none), on its
+  // own cache line since every thread using the pool writes it
+  _Alignas(64) _Atomic uint64_t sp_head;
+} slab_pool;
+
+#define SLAB_NONE (UINT32_MAX)
+
+// slab_pool_init: creates a pool of capacity objects of object_size bytes
+//
+// Returns 0 if successful, -1 otherwise
+int slab_pool_init(slab_pool *pool, size_t object_size, uint32_t capacity);
+
+// slab_pool_destroy: frees the memory of a pool, whose objects must all have
+// been returned
+void slab_pool_destroy(slab_pool *pool);
+
+// slab_pool_alloc: takes a free object from the pool
+//
+// Returns the object, or NULL if every object is in use
+void *slab_pool_alloc(slab_pool *pool);
+
+// slab_pool_free: returns an object taken from the pool
+void slab_pool_free(slab_pool *pool, void *object);
+
+#endif // __UTILS_SLAB_H__